@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2020, Irvin Pang <halo.irvin@gmail.com>
+ * All rights reserved.
+ *
+ * see LICENSE file for details
+ */
+
+/*
+ * the resident agent, loaded into tracee along with the library injected.
+ * it maps a command ring on a memfd and serves it from a thread of its own,
+ * so that later operations on the process need no ptrace stop at all.
+ * no libc++ in here, it's meant to be tiny
+ */
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <linux/memfd.h>
+
+#include "agent_protocol.h"
+
+static AgentRing* sRing = nullptr;
+
+static long futex(uint32_t* word, int op, uint32_t value) {
+    return ::syscall(__NR_futex, word, op, value, nullptr, nullptr, 0);
+}
+
+// copy the error out of dlerror into the slot
+static void takeDlerror(AgentSlot* slot) {
+    const char* error = ::dlerror();
+    ::strncpy(slot->data, error ? error : "unknown error", AGENT_DATA_SIZE - 1);
+    slot->data[AGENT_DATA_SIZE - 1] = '\0';
+    slot->size = (uint32_t)::strlen(slot->data);
+    slot->error = EINVAL;
+}
+
+// access of memory through the kernel, so a bad address fails with EFAULT
+// rather than crashing the process
+static void copyMemory(AgentSlot* slot, bool write) {
+    size_t size = write ? slot->size : (size_t)slot->args[1];
+    if (size > AGENT_DATA_SIZE) {
+        size = AGENT_DATA_SIZE;
+    }
+    struct iovec local = { slot->data, size };
+    struct iovec remote = { (void*)(uintptr_t)slot->args[0], size };
+    long nr = write ? __NR_process_vm_writev : __NR_process_vm_readv;
+    slot->result = ::syscall(nr, ::getpid(), &local, 1, &remote, 1, 0);
+    if (slot->result < 0) {
+        slot->error = errno;
+    } else if (!write) {
+        slot->size = (uint32_t)slot->result;
+    }
+}
+
+static void run(AgentSlot* slot) {
+    typedef intptr_t (*Function)(intptr_t, intptr_t, intptr_t, intptr_t, intptr_t, intptr_t);
+    const uint64_t* args = slot->args;
+    slot->error = 0;
+    slot->result = 0;
+    // strings come in data, make sure they end
+    if (slot->op == AGENT_OP_DLOPEN || slot->op == AGENT_OP_DLSYM || slot->op == AGENT_OP_MEMFD) {
+        slot->data[slot->size < AGENT_DATA_SIZE ? slot->size : AGENT_DATA_SIZE - 1] = '\0';
+    }
+
+    switch (slot->op) {
+        case AGENT_OP_CALL:
+            slot->result = ((Function)(uintptr_t)args[0])(args[1], args[2], args[3], args[4], args[5], args[6]);
+            break;
+        case AGENT_OP_READ:
+            copyMemory(slot, false);
+            break;
+        case AGENT_OP_WRITE:
+            copyMemory(slot, true);
+            break;
+        case AGENT_OP_DLOPEN:
+            slot->result = (intptr_t)::dlopen(slot->data, (int)args[0]);
+            if (!slot->result) {
+                takeDlerror(slot);
+            }
+            break;
+        case AGENT_OP_DLCLOSE:
+            slot->result = ::dlclose((void*)(uintptr_t)args[0]);
+            if (slot->result) {
+                takeDlerror(slot);
+            }
+            break;
+        case AGENT_OP_DLSYM:
+            slot->result = (intptr_t)::dlsym((void*)(uintptr_t)args[0], slot->data);
+            if (!slot->result) {
+                takeDlerror(slot);
+            }
+            break;
+        case AGENT_OP_MEMFD:
+            slot->result = ::syscall(__NR_memfd_create, slot->data, MFD_CLOEXEC);
+            if (slot->result < 0) {
+                slot->error = errno;
+            }
+            break;
+        case AGENT_OP_CLOSE:
+            slot->result = ::close((int)args[0]);
+            if (slot->result < 0) {
+                slot->error = errno;
+            }
+            break;
+        default:
+            slot->result = -1;
+            slot->error = ENOSYS;
+            break;
+    }
+}
+
+static void* serve(void*) {
+    ::prctl(PR_SET_NAME, "adrill-agent");
+    for (;;) {
+        // taken before the scan, so a submission during it won't be slept through
+        uint32_t doorbell = __atomic_load_n(&sRing->doorbell, __ATOMIC_ACQUIRE);
+        bool served = false;
+        for (AgentSlot& slot : sRing->slots) {
+            // the client may withdraw it on timeout, whoever comes first takes it
+            uint32_t state = AGENT_SLOT_READY;
+            if (!__atomic_compare_exchange_n(&slot.state, &state, AGENT_SLOT_RUNNING, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) continue;
+            run(&slot);
+            state = AGENT_SLOT_RUNNING;
+            if (!__atomic_compare_exchange_n(&slot.state, &state, AGENT_SLOT_DONE, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+                // nobody's waiting for it any more
+                __atomic_store_n(&slot.state, AGENT_SLOT_FREE, __ATOMIC_RELEASE);
+            }
+            futex(&slot.state, FUTEX_WAKE, INT_MAX);
+            served = true;
+        }
+        if (!served) {
+            futex(&sRing->doorbell, FUTEX_WAIT, doorbell);
+        }
+    }
+    return nullptr;
+}
+
+__attribute__((constructor)) static void start() {
+    // shared with adrill through /proc/<pid>/fd, not to be inherited by exec
+    int fd = (int)::syscall(__NR_memfd_create, AGENT_MEMFD_NAME, MFD_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    void* ring = MAP_FAILED;
+    if (::ftruncate(fd, sizeof(AgentRing)) == 0) {
+        ring = ::mmap(nullptr, sizeof(AgentRing), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (ring == MAP_FAILED) {
+        ::close(fd);
+        return;
+    }
+    sRing = (AgentRing*)ring;
+    sRing->version = AGENT_VERSION;
+    sRing->pid = ::getpid();
+
+    // signals of the app are none of the agent's business
+    sigset_t all, old;
+    ::sigfillset(&all);
+    ::pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_t thread;
+    pthread_attr_t attr;
+    ::pthread_attr_init(&attr);
+    ::pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    bool started = ::pthread_create(&thread, &attr, serve, nullptr) == 0;
+    ::pthread_attr_destroy(&attr);
+    ::pthread_sigmask(SIG_SETMASK, &old, nullptr);
+
+    if (!started) {
+        ::munmap(ring, sizeof(AgentRing));
+        ::close(fd);
+        sRing = nullptr;
+        return;
+    }
+    // the fd is kept open for adrill to find, the ring is valid only once
+    // the magic is there
+    __atomic_store_n(&sRing->magic, AGENT_MAGIC, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,302 @@
+/*
+ * Copyright (c) 2020, Irvin Pang <halo.irvin@gmail.com>
+ * All rights reserved.
+ *
+ * see LICENSE file for details
+ */
+
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <dirent.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sendfile.h>
+#include <linux/futex.h>
+#include <algorithm>
+
+#include "macros.h"
+#include "clock.h"
+#include "agent_client.h"
+
+AgentClient::AgentClient()
+: _pid(0)
+, _ring(nullptr)
+, _timeoutMs(AGENT_DEFAULT_TIMEOUT_MS)
+, _abandoned(false) {
+}
+
+AgentClient::~AgentClient() {
+    this->disconnect();
+}
+
+bool AgentClient::connected() const {
+    return this->_ring != nullptr;
+}
+
+void AgentClient::setTimeout(int timeoutMs) {
+    this->_timeoutMs = timeoutMs;
+}
+
+bool AgentClient::abandoned() const {
+    return this->_abandoned;
+}
+
+void AgentClient::disconnect() {
+    if (this->_ring) {
+        ::munmap(this->_ring, sizeof(AgentRing));
+        this->_ring = nullptr;
+    }
+    this->_pid = 0;
+}
+
+bool AgentClient::connect(pid_t pid) {
+    this->disconnect();
+
+    char path[64];
+    ::snprintf(path, sizeof(path), "/proc/%d/fd", pid);
+    DIR* dp = ::opendir(path);
+    if (!dp) {
+        return false;
+    }
+    // the memfd shows up as '/memfd:<name> (deleted)'
+    const char prefix[] = "/memfd:" AGENT_MEMFD_NAME;
+    struct dirent* entry;
+    while (!this->_ring && (entry = ::readdir(dp)) != nullptr) {
+        char link[PATH_MAX];
+        ssize_t size = ::readlinkat(::dirfd(dp), entry->d_name, link, sizeof(link) - 1);
+        if (size < (ssize_t)sizeof(prefix) - 1 || ::memcmp(link, prefix, sizeof(prefix) - 1) != 0) continue;
+
+        // the very memfd, through procfs
+        ::snprintf(path, sizeof(path), "/proc/%d/fd/%s", pid, entry->d_name);
+        int fd = ::open(path, O_RDWR | O_CLOEXEC);
+        if (fd < 0) continue;
+        struct stat st;
+        void* ring = MAP_FAILED;
+        if (::fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(AgentRing)) {
+            ring = ::mmap(nullptr, sizeof(AgentRing), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        ::close(fd);
+        if (ring == MAP_FAILED) continue;
+
+        // a ring inherited through fork has no agent thread behind it
+        AgentRing* candidate = (AgentRing*)ring;
+        if (__atomic_load_n(&candidate->magic, __ATOMIC_ACQUIRE) == AGENT_MAGIC &&
+            candidate->version == AGENT_VERSION && candidate->pid == pid) {
+            this->_ring = candidate;
+            this->_pid = pid;
+        } else {
+            ::munmap(ring, sizeof(AgentRing));
+        }
+    }
+    ::closedir(dp);
+    return this->_ring != nullptr;
+}
+
+AgentSlot* AgentClient::_claim() {
+    for (AgentSlot& slot : this->_ring->slots) {
+        uint32_t state = AGENT_SLOT_FREE;
+        if (__atomic_compare_exchange_n(&slot.state, &state, AGENT_SLOT_CLAIMED, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return &slot;
+        }
+    }
+    LOGGER_LOGE("AgentClient::_claim all %d slots of agent in process %d are busy\n", AGENT_SLOTS, this->_pid);
+    return nullptr;
+}
+
+void AgentClient::_release(AgentSlot* slot) {
+    __atomic_store_n(&slot->state, AGENT_SLOT_FREE, __ATOMIC_RELEASE);
+}
+
+bool AgentClient::_submit(AgentSlot* slot) {
+    this->_abandoned = false;
+    __atomic_store_n(&slot->state, AGENT_SLOT_READY, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&this->_ring->doorbell, 1, __ATOMIC_RELEASE);
+    ::syscall(__NR_futex, &this->_ring->doorbell, FUTEX_WAKE, 1, nullptr, nullptr, 0);
+
+    int64_t deadline = monotonicNs() + (int64_t)this->_timeoutMs * 1000000;
+    for (;;) {
+        uint32_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+        if (state == AGENT_SLOT_DONE) {
+            return true;
+        }
+        int64_t remaining = deadline - monotonicNs();
+        if (remaining <= 0) {
+            // withdraw it if it's not taken yet, or leave it to the agent to free
+            uint32_t expected = AGENT_SLOT_READY;
+            if (__atomic_compare_exchange_n(&slot->state, &expected, AGENT_SLOT_FREE, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                LOGGER_LOGE("AgentClient::_submit agent in process %d is not responding\n", this->_pid);
+                return false;
+            }
+            expected = AGENT_SLOT_RUNNING;
+            if (__atomic_compare_exchange_n(&slot->state, &expected, AGENT_SLOT_ABANDONED, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                LOGGER_LOGE("AgentClient::_submit op %u timed out in process %d\n", slot->op, this->_pid);
+                this->_abandoned = true;
+                return false;
+            }
+            // done right in between
+            continue;
+        }
+        struct timespec timeout = { (time_t)(remaining / 1000000000), (long)(remaining % 1000000000) };
+        ::syscall(__NR_futex, &slot->state, FUTEX_WAIT, state, &timeout, nullptr, 0);
+    }
+}
+
+bool AgentClient::_run(uint32_t op, std::initializer_list<uint64_t> args, const void* data, size_t size, AgentSlot** outSlot) {
+    if (!this->_ring || size > AGENT_DATA_SIZE || args.size() > AGENT_MAX_ARGS + 1) {
+        return false;
+    }
+    AgentSlot* slot = this->_claim();
+    if (!slot) {
+        return false;
+    }
+    slot->op = op;
+    ::memset(slot->args, 0, sizeof(slot->args));
+    std::copy(args.begin(), args.end(), slot->args);
+    slot->size = (uint32_t)size;
+    if (size) {
+        ::memcpy(slot->data, data, size);
+    }
+    if (!this->_submit(slot)) {
+        return false;
+    }
+    *outSlot = slot;
+    return true;
+}
+
+bool AgentClient::call(uintptr_t func, std::initializer_list<intptr_t> args, intptr_t* outResult) {
+    if (args.size() > AGENT_MAX_ARGS) {
+        return false;
+    }
+    uint64_t argv[AGENT_MAX_ARGS + 1] = { func };
+    std::copy(args.begin(), args.end(), argv + 1);
+    AgentSlot* slot;
+    if (!this->_run(AGENT_OP_CALL, { argv[0], argv[1], argv[2], argv[3], argv[4], argv[5], argv[6] }, nullptr, 0, &slot)) {
+        return false;
+    }
+    *outResult = (intptr_t)slot->result;
+    this->_release(slot);
+    return true;
+}
+
+size_t AgentClient::readMemory(void* dst, uintptr_t src, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        size_t chunk = std::min(size - done, (size_t)AGENT_DATA_SIZE);
+        AgentSlot* slot;
+        if (!this->_run(AGENT_OP_READ, { src + done, chunk }, nullptr, 0, &slot)) {
+            break;
+        }
+        size_t got = slot->result > 0 ? std::min((size_t)slot->size, chunk) : 0;
+        ::memcpy((uint8_t*)dst + done, slot->data, got);
+        this->_release(slot);
+        done += got;
+        if (got < chunk) {
+            break;
+        }
+    }
+    return done;
+}
+
+size_t AgentClient::writeMemory(uintptr_t dst, const void* src, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        size_t chunk = std::min(size - done, (size_t)AGENT_DATA_SIZE);
+        AgentSlot* slot;
+        if (!this->_run(AGENT_OP_WRITE, { dst + done }, (const uint8_t*)src + done, chunk, &slot)) {
+            break;
+        }
+        size_t put = slot->result > 0 ? std::min((size_t)slot->result, chunk) : 0;
+        this->_release(slot);
+        done += put;
+        if (put < chunk) {
+            break;
+        }
+    }
+    return done;
+}
+
+bool AgentClient::dlopen(const std::string& path, int flags, uintptr_t* outHandle, std::string* outError) {
+    AgentSlot* slot;
+    if (!this->_run(AGENT_OP_DLOPEN, { (uint64_t)flags }, path.c_str(), path.length() + 1, &slot)) {
+        return false;
+    }
+    *outHandle = (uintptr_t)slot->result;
+    if (!slot->result && outError) {
+        outError->assign(slot->data, std::min((size_t)slot->size, (size_t)AGENT_DATA_SIZE));
+    }
+    this->_release(slot);
+    return true;
+}
+
+bool AgentClient::dlclose(uintptr_t handle, bool* outClosed, std::string* outError) {
+    AgentSlot* slot;
+    if (!this->_run(AGENT_OP_DLCLOSE, { handle }, nullptr, 0, &slot)) {
+        return false;
+    }
+    *outClosed = slot->result == 0;
+    if (!*outClosed && outError) {
+        outError->assign(slot->data, std::min((size_t)slot->size, (size_t)AGENT_DATA_SIZE));
+    }
+    this->_release(slot);
+    return true;
+}
+
+bool AgentClient::dlsym(uintptr_t handle, const std::string& symbol, uintptr_t* outAddr) {
+    AgentSlot* slot;
+    if (!this->_run(AGENT_OP_DLSYM, { handle }, symbol.c_str(), symbol.length() + 1, &slot)) {
+        return false;
+    }
+    *outAddr = (uintptr_t)slot->result;
+    this->_release(slot);
+    return true;
+}
+
+bool AgentClient::deliver(int fd, size_t size, int* outRemoteFd) {
+    AgentSlot* slot;
+    if (!this->_run(AGENT_OP_MEMFD, {}, "adrill", sizeof("adrill"), &slot)) {
+        return false;
+    }
+    int remoteFd = (int)slot->result;
+    this->_release(slot);
+    *outRemoteFd = -1;
+    if (remoteFd < 0) {
+        LOGGER_LOGE("AgentClient::deliver memfd_create failed in process %d\n", this->_pid);
+        return true;
+    }
+
+    // filled right from here through procfs, as the ptrace delivery does
+    char path[64];
+    ::snprintf(path, sizeof(path), "/proc/%d/fd/%d", this->_pid, remoteFd);
+    int localFd = ::open(path, O_WRONLY | O_CLOEXEC);
+    bool ok = localFd != -1;
+    off_t offset = 0;
+    while (ok && (size_t)offset < size) {
+        ssize_t sent = ::sendfile(localFd, fd, &offset, size - offset);
+        ok &= sent > 0 || (sent < 0 && errno == EINTR);
+    }
+    if (localFd != -1) {
+        ::close(localFd);
+    }
+    if (!ok) {
+        LOGGER_LOGE("AgentClient::deliver failed to copy library into %s: %s\n", path, ::strerror(errno));
+        this->closeRemote(remoteFd);
+        return true;
+    }
+    *outRemoteFd = remoteFd;
+    return true;
+}
+
+bool AgentClient::closeRemote(int remoteFd) {
+    AgentSlot* slot;
+    if (!this->_run(AGENT_OP_CLOSE, { (uint64_t)remoteFd }, nullptr, 0, &slot)) {
+        return false;
+    }
+    this->_release(slot);
+    return true;
+}
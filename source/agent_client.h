@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2020, Irvin Pang <halo.irvin@gmail.com>
+ * All rights reserved.
+ *
+ * see LICENSE file for details
+ */
+
+#ifndef __ADRILL_AGENT_CLIENT_H__
+#define __ADRILL_AGENT_CLIENT_H__
+
+#include <string>
+#include <initializer_list>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "agent_protocol.h"
+
+// deadline of a single op by default
+#define AGENT_DEFAULT_TIMEOUT_MS 3000
+
+/*
+ * talks to the resident agent in a process through its command ring, with
+ * no ptrace involved. ops run on the agent's own thread in tracee, and each
+ * one takes a futex round trip, i.e., microseconds. every method but
+ * connect() returns false if the agent doesn't answer in time, while what
+ * the op itself got is in its out params
+ */
+class AgentClient {
+public:
+    AgentClient();
+    ~AgentClient();
+
+    /*
+     * find and map the ring of the agent in <pid>, false if there's none
+     */
+    bool connect(pid_t pid);
+    void disconnect();
+    bool connected() const;
+    void setTimeout(int timeoutMs);
+
+    /*
+     * whether the last op timed out after the agent took it, so it may still
+     * take effect, rather than being withdrawn before it ever ran
+     */
+    bool abandoned() const;
+
+    /*
+     * integer arguments & result only, on the agent's thread
+     */
+    bool call(uintptr_t func, std::initializer_list<intptr_t> args, intptr_t* outResult);
+
+    /*
+     * through process_vm_* of the agent, so a bad address just makes it
+     * short rather than crashing tracee. returns bytes done
+     */
+    size_t readMemory(void* dst, uintptr_t src, size_t size);
+    size_t writeMemory(uintptr_t dst, const void* src, size_t size);
+
+    bool dlopen(const std::string& path, int flags, uintptr_t* outHandle, std::string* outError);
+    bool dlclose(uintptr_t handle, bool* outClosed, std::string* outError);
+    bool dlsym(uintptr_t handle, const std::string& symbol, uintptr_t* outAddr);
+
+    /*
+     * a memfd created by the agent and filled with <size> bytes of <fd>,
+     * to dlopen as /proc/self/fd/<outRemoteFd>. closed by closeRemote()
+     */
+    bool deliver(int fd, size_t size, int* outRemoteFd);
+    bool closeRemote(int remoteFd);
+
+protected:
+    AgentSlot* _claim();
+    // ring the doorbell and wait until the agent is done with <slot>
+    bool _submit(AgentSlot* slot);
+    void _release(AgentSlot* slot);
+    // a single op taking <data> of <size> bytes in, false on timeout
+    bool _run(uint32_t op, std::initializer_list<uint64_t> args, const void* data, size_t size, AgentSlot** outSlot);
+
+protected:
+    pid_t      _pid;
+    AgentRing* _ring;
+    int        _timeoutMs;
+    bool       _abandoned;
+
+};
+
+#endif // __ADRILL_AGENT_CLIENT_H__
@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2020, Irvin Pang <halo.irvin@gmail.com>
+ * All rights reserved.
+ *
+ * see LICENSE file for details
+ */
+
+#ifndef __ADRILL_AGENT_PROTOCOL_H__
+#define __ADRILL_AGENT_PROTOCOL_H__
+
+#include <stdint.h>
+
+/*
+ * command ring shared between adrill and the resident agent in tracee. the
+ * agent creates it as a memfd named AGENT_MEMFD_NAME when loaded, adrill
+ * finds it in /proc/<pid>/fd and maps it as well. it's included by both
+ * sides, so keep it plain C layout with fixed-size fields only
+ */
+
+#define AGENT_MAGIC     0x41475241  // 'ARGA'
+#define AGENT_VERSION   1
+#define AGENT_MEMFD_NAME "adrill-agent"
+#define AGENT_SLOTS     16
+// room of a slot for paths, symbol names and memory read or written
+#define AGENT_DATA_SIZE 4096
+#define AGENT_MAX_ARGS  6
+
+enum AgentOp {
+    AGENT_OP_NONE,
+    AGENT_OP_CALL,     // args[0](args[1..]), integer args & result only
+    AGENT_OP_READ,     // args[1] bytes at args[0] into data
+    AGENT_OP_WRITE,    // size bytes of data to args[0]
+    AGENT_OP_DLOPEN,   // dlopen(data, args[0]), dlerror into data on failure
+    AGENT_OP_DLCLOSE,  // dlclose(args[0])
+    AGENT_OP_DLSYM,    // dlsym(args[0], data)
+    AGENT_OP_MEMFD,    // memfd_create(data, MFD_CLOEXEC), to deliver a library through
+    AGENT_OP_CLOSE,    // close(args[0])
+};
+
+// slot states, each one a futex word as well
+enum AgentSlotState {
+    AGENT_SLOT_FREE,
+    AGENT_SLOT_CLAIMED,  // taken by a client, being filled
+    AGENT_SLOT_READY,    // submitted, to be run by the agent, or withdrawn by the client
+    AGENT_SLOT_RUNNING,  // taken by the agent
+    AGENT_SLOT_DONE,     // result filled, to be taken by the client
+    AGENT_SLOT_ABANDONED,// given up by the client while running, freed by the agent once done
+};
+
+struct AgentSlot {
+    uint32_t state;
+    uint32_t op;
+    uint64_t args[AGENT_MAX_ARGS + 1];
+    int64_t  result;
+    // errno of the op, 0 on success
+    int32_t  error;
+    uint32_t size;
+    char     data[AGENT_DATA_SIZE];
+};
+
+struct AgentRing {
+    uint32_t magic;
+    uint32_t version;
+    // of the process the agent runs in, as the memfd survives fork
+    int32_t  pid;
+    // futex bumped on every submission, which the agent sleeps on
+    uint32_t doorbell;
+    AgentSlot slots[AGENT_SLOTS];
+};
+
+#endif // __ADRILL_AGENT_PROTOCOL_H__
@@ -6,6 +6,7 @@
  */
 
 #include "arch.h"
+#include "stub_writer.h"
 #include "call_procedure.h"
 
 #if $is($arch_arm)
@@ -17,21 +18,45 @@
 // reference: https://en.wikipedia.org/wiki/ARM_architecture#Registers
 #define MASK_CPSR_THUMB_STATE (1u << 5)
 
-bool CallProcedure::_setupCall(uintptr_t remoteAddr, const std::vector<intptr_t>& args) {
-    // push up to MAX_ARG_REGS arguments into registers
-    int pushn = 0;
-    int argn = args.size();
-    int maxArgNum = std::min(argn, MAX_ARG_REGS);
-    for (; pushn < maxArgNum ; ++ pushn) {
-        // copy param to corresponding register
-        this->_curRegs.uregs[pushn] = args[pushn];
+bool CallProcedure::_setupCall(uintptr_t remoteAddr, uintptr_t resultAddr, const RemoteArg* args, size_t argn) {
+    // Android takes the base standard of AAPCS(softfp), so float and double
+    // are passed in core registers as integers do. 64-bit values take an
+    // even-numbered register pair, or 8-byte aligned stack slots
+    size_t ncrn = 0;
+    size_t stackn = 0;
+    uint32_t stackArgs[MAX_CALL_ARGS * 2 + 1];
+    // memory for the returned struct is passed as the implicit first argument
+    if (resultAddr) {
+        this->_curRegs.uregs[ncrn ++] = resultAddr;
+    }
+    for (size_t i = 0; i < argn; ++ i) {
+        const RemoteArg& arg = args[i];
+        if (arg.kind == RemoteArg::DWORD || arg.kind == RemoteArg::DOUBLE) {
+            ncrn = (ncrn + 1) & ~0x1;
+            if (ncrn + 2 <= MAX_ARG_REGS) {
+                this->_curRegs.uregs[ncrn ++] = (uint32_t)arg.bits;
+                this->_curRegs.uregs[ncrn ++] = (uint32_t)(arg.bits >> 32);
+                continue;
+            }
+            // once an argument goes to the stack, all the following do
+            ncrn = MAX_ARG_REGS;
+            stackn = (stackn + 1) & ~0x1;
+            stackArgs[stackn ++] = (uint32_t)arg.bits;
+            stackArgs[stackn ++] = (uint32_t)(arg.bits >> 32);
+        } else if (ncrn < MAX_ARG_REGS) {
+            this->_curRegs.uregs[ncrn ++] = (uint32_t)arg.bits;
+        } else {
+            stackArgs[stackn ++] = (uint32_t)arg.bits;
+        }
     }
 
-    // push the remaining arguments onto stack
-    if (pushn < argn) {
-        const intptr_t* argHead = args.data();
-        this->_curRegs.ARM_sp -= (argn - pushn) * PT_SIZE;
-        this->_ptraceWrapper->writeText((void*)this->_curRegs.ARM_sp, (const void*)(argHead + pushn), (argn - pushn) * PT_SIZE);
+    // push the remaining arguments onto stack, which is kept aligned by 8
+    this->_curRegs.ARM_sp = (this->_curRegs.ARM_sp - stackn * PT_SIZE) & ~0x7;
+    if (stackn > 0) {
+        size_t stackSize = stackn * PT_SIZE;
+        if (this->_ptraceWrapper->writeMemory((void*)this->_curRegs.ARM_sp, stackArgs, stackSize) != stackSize) {
+            return false;
+        }
     }
 
     // setup target func address depends on instruction state
@@ -48,20 +73,178 @@ bool CallProcedure::_setupCall(uintptr_t remoteAddr, const std::vector<intptr_t>
         this->_curRegs.ARM_cpsr &= ~MASK_CPSR_THUMB_STATE;
         this->_curRegs.ARM_pc = remoteAddr;
     }
-    // return address set to null to raise SIGSEGV
+    // return address set to the trap(ARM state), or null to raise SIGSEGV
     // so we could take it over through waitpid after function call
-    this->_curRegs.ARM_lr = 0;
+    this->_curRegs.ARM_lr = this->_returnAddr;
     
     return true;
 }
 
-intptr_t CallProcedure::returnValue() {
-    return this->_curRegs.ARM_r0;
+uint64_t CallProcedure::_returnBits(RemoteArg::Kind kind) {
+    // 64-bit values are returned in r0:r1, even double with softfp
+    uint64_t bits = (uint32_t)this->_curRegs.ARM_r0;
+    if (kind == RemoteArg::DWORD || kind == RemoteArg::DOUBLE) {
+        bits |= (uint64_t)(uint32_t)this->_curRegs.ARM_r1 << 32;
+    }
+    return bits;
 }
 
-bool CallProcedure::_checkCall() {
-    // return address has been set to null
-    return this->_curRegs.ARM_pc == 0;
+uintptr_t CallProcedure::_emitTrap(StubWriter& writer, uintptr_t trapAddr) {
+    // the undefined instruction linux reserves for ptrace breakpoints,
+    // raises SIGTRAP and leaves pc on itself. BKPT would need hardware
+    // debug support to be reported as SIGTRAP
+    writer.value<uint32_t>(0xe7f001f0u);
+    return trapAddr;
+}
+
+uintptr_t CallProcedure::_programCounter() {
+    return this->_curRegs.ARM_pc;
+}
+
+uintptr_t CallProcedure::_stackPointer() {
+    return this->_curRegs.ARM_sp;
+}
+
+void CallProcedure::_setStackPointer(uintptr_t sp) {
+    this->_curRegs.ARM_sp = sp;
+}
+
+bool CallProcedure::_setupStub(uintptr_t stubAddr, size_t reserve, uintptr_t* outReserved) {
+    this->_curRegs.ARM_sp = (this->_curRegs.ARM_sp - STACK_RED_ZONE - reserve) & ~(uintptr_t)0xf;
+    *outReserved = this->_curRegs.ARM_sp;
+    // stub is made of ARM instructions
+    this->_curRegs.ARM_cpsr &= ~MASK_CPSR_THUMB_STATE;
+    this->_curRegs.ARM_pc = stubAddr;
+    return true;
+}
+
+// intra-procedure scratch register, free to use between calls
+#define REG_R7 7
+#define REG_IP 12
+#define REG_LR 14
+
+// loads <value> into r<reg> from a literal embedded right after
+static void emitMovImm(StubWriter& writer, int reg, uint32_t value) {
+    // ldr rd, [pc, #0]; pc reads as the address of current instruction + 8
+    writer.value<uint32_t>(0xe59f0000u | (reg << 12));
+    // b . + 8, skipping the literal
+    writer.value<uint32_t>(0xea000000u);
+    writer.value<uint32_t>(value);
+}
+
+// loads <arg> into r<reg>
+static void emitLoadArg(StubWriter& writer, int reg, const CallChain::Arg& arg, uintptr_t resultsAddr) {
+    if (arg.fromCall >= 0) {
+        emitMovImm(writer, REG_IP, resultsAddr + arg.fromCall * PT_SIZE);
+        // ldr rd, [ip]
+        writer.value<uint32_t>(0xe59c0000u | (reg << 12));
+    } else {
+        emitMovImm(writer, reg, arg.value);
+    }
+}
+
+uintptr_t CallProcedure::_scanSyscallInsn(const uint8_t* code, size_t size, uintptr_t remoteAddr) {
+    for (size_t i = 0; i + 2 <= size; i += 2) {
+        // svc #0 in ARM state
+        if ((i & 0x3) == 0 && i + 4 <= size && *(const uint32_t*)(code + i) == 0xef000000u) {
+            return remoteAddr + i;
+        }
+        // svc #0 in Thumb state, marked by the LSB
+        if (*(const uint16_t*)(code + i) == 0xdf00u) {
+            return (remoteAddr + i) | 0x1;
+        }
+    }
+    return 0;
+}
+
+bool CallProcedure::_setupSyscall(uintptr_t insnAddr, long nr, const intptr_t* args, size_t argn) {
+    for (size_t i = 0; i < argn; ++ i) {
+        this->_curRegs.uregs[i] = args[i];
+    }
+    // syscall number goes in r7 with EABI
+    this->_curRegs.ARM_r7 = nr;
+    if (insnAddr & 0x1) {
+        this->_curRegs.ARM_cpsr |= MASK_CPSR_THUMB_STATE;
+        this->_curRegs.ARM_pc = insnAddr & (~0x1u);
+    } else {
+        this->_curRegs.ARM_cpsr &= ~MASK_CPSR_THUMB_STATE;
+        this->_curRegs.ARM_pc = insnAddr;
+    }
+    return true;
+}
+
+size_t CallProcedure::_emitChain(const CallChain& chain, uintptr_t stubAddr, uintptr_t resultsAddr, uintptr_t stackTop,
+    uint8_t* code, size_t capacity, uintptr_t* outTrapAddr, uintptr_t* outTailAddr) {
+    StubWriter writer(code, capacity);
+    if (stackTop) {
+        emitMovImm(writer, REG_IP, stackTop);
+        // mov sp, ip
+        writer.value<uint32_t>(0xe1a0d00cu);
+    }
+    for (size_t i = 0; i < chain.size(); ++ i) {
+        const CallChain::Call& call = chain.call(i);
+        bool tail = chain.hasTail() && i == chain.size() - 1;
+        if (call.syscall) {
+            for (size_t k = 0; k < call.argn; ++ k) {
+                emitLoadArg(writer, (int)k, call.args[k], resultsAddr);
+            }
+            emitMovImm(writer, REG_R7, call.remoteAddr);
+            // svc #0
+            writer.value<uint32_t>(0xef000000u);
+            if (tail) {
+                // fetching the next instruction faults if the stub is gone
+                *outTailAddr = stubAddr + writer.size();
+                continue;
+            }
+            emitMovImm(writer, REG_IP, resultsAddr + i * PT_SIZE);
+            // str r0, [ip]
+            writer.value<uint32_t>(0xe58c0000u);
+            continue;
+        }
+        size_t stackn = call.argn > MAX_ARG_REGS ? call.argn - MAX_ARG_REGS : 0;
+        // AAPCS requires sp aligned by 8 at public interfaces
+        uint32_t stackSize = (stackn * PT_SIZE + 0x7) & ~0x7;
+        if (stackSize) {
+            // sub sp, sp, #imm8
+            writer.value<uint32_t>(0xe24dd000u | stackSize);
+        }
+        for (size_t k = 0; k < stackn; ++ k) {
+            emitLoadArg(writer, REG_IP, call.args[MAX_ARG_REGS + k], resultsAddr);
+            // str ip, [sp, #(k * 4)]
+            writer.value<uint32_t>(0xe58dc000u | (uint32_t)(k * PT_SIZE));
+        }
+        for (size_t k = 0; k < std::min(call.argn, (size_t)MAX_ARG_REGS); ++ k) {
+            emitLoadArg(writer, (int)k, call.args[k], resultsAddr);
+        }
+        // blx/bx switch to Thumb state by the LSB of target address
+        emitMovImm(writer, REG_IP, call.remoteAddr);
+        if (tail && chain.tailReturn()) {
+            // bx ip, returning to where lr points
+            emitMovImm(writer, REG_LR, chain.tailReturn());
+            writer.value<uint32_t>(0xe12fff1cu);
+            *outTailAddr = 0;
+            continue;
+        }
+        if (tail) {
+            // mov lr, #0; bx ip
+            writer.value<uint32_t>(0xe3a0e000u);
+            writer.value<uint32_t>(0xe12fff1cu);
+            *outTailAddr = 0;
+            continue;
+        }
+        // blx ip
+        writer.value<uint32_t>(0xe12fff3cu);
+        emitMovImm(writer, REG_IP, resultsAddr + i * PT_SIZE);
+        // str r0, [ip]
+        writer.value<uint32_t>(0xe58c0000u);
+        if (stackSize) {
+            // add sp, sp, #imm8
+            writer.value<uint32_t>(0xe28dd000u | stackSize);
+        }
+    }
+    // a tail call never comes back here
+    *outTrapAddr = this->_emitTrap(writer, stubAddr + writer.size());
+    return writer.overflowed() ? 0 : writer.size();
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -6,32 +6,60 @@
  */
 
 #include "arch.h"
+#include "stub_writer.h"
 #include "call_procedure.h"
 
 #if $is($arch_arm64)
 
 #define MAX_ARG_REGS 8
+#define MAX_VEC_ARG_REGS 8
 
 // bit 5 in pstate(processor state register)
 // indicates the T32 instruction state on AArch32 mode
 // reference: https://en.wikipedia.org/wiki/ARM_architecture#Registers
 #define MASK_PSTATE_THUMB_STATE (1u << 5)
 
-bool CallProcedure::_setupCall(uintptr_t remoteAddr, const std::vector<intptr_t>& args) {
-    // push up to MAX_ARG_REGS arguments into registers
-    int pushn = 0;
-    int argn = args.size();
-    int maxArgNum = std::min(argn, MAX_ARG_REGS);
-    for (; pushn < maxArgNum; ++ pushn) {
-        // copy param to corresponding register
-        this->_curRegs.regs[pushn] = args[pushn];
+bool CallProcedure::_setupCall(uintptr_t remoteAddr, uintptr_t resultAddr, const RemoteArg* args, size_t argn) {
+    // integers go into x0-x7, float and double into v0-v7,
+    // and the rest are passed on the stack by 8 bytes each
+    size_t gpn = 0;
+    size_t vecn = 0;
+    size_t stackn = 0;
+    uint64_t stackArgs[MAX_CALL_ARGS];
+    PtraceFpRegs fpRegs;
+    for (size_t i = 0; i < argn; ++ i) {
+        const RemoteArg& arg = args[i];
+        if (arg.kind == RemoteArg::FLOAT || arg.kind == RemoteArg::DOUBLE) {
+            if (vecn < MAX_VEC_ARG_REGS) {
+                // fp registers are touched only if there's any fp argument
+                if (vecn == 0 && !this->_ptraceWrapper->getFpRegisters(&fpRegs)) {
+                    return false;
+                }
+                // s<n>/d<n> are the low bits of v<n>, upper ones cleared
+                fpRegs.vregs[vecn ++] = arg.kind == RemoteArg::FLOAT ? (uint32_t)arg.bits : arg.bits;
+                continue;
+            }
+        } else if (gpn < MAX_ARG_REGS) {
+            this->_curRegs.regs[gpn ++] = arg.bits;
+            continue;
+        }
+        stackArgs[stackn ++] = arg.bits;
+    }
+    if (vecn > 0 && !this->_ptraceWrapper->setFpRegisters(fpRegs)) {
+        return false;
+    }
+    // memory for the returned struct is passed by x8, not as an argument
+    if (resultAddr) {
+        this->_curRegs.regs[8] = resultAddr;
     }
 
-    // push the remaining arguments onto stack
-    if (pushn < argn) {
-        const intptr_t* argHead = args.data();
-        this->_curRegs.sp -= (argn - pushn) * PT_SIZE;
-        this->_ptraceWrapper->writeText((void*)this->_curRegs.sp, (const void*)(argHead + pushn), (argn - pushn) * PT_SIZE);
+    // push the remaining arguments onto stack, which is kept aligned by 16
+    this->_curRegs.sp = (this->_curRegs.sp - stackn * PT_SIZE) & ~(uintptr_t)0xf;
+    if (stackn > 0) {
+        size_t stackSize = stackn * PT_SIZE;
+        if (this->_ptraceWrapper->writeMemory((void*)this->_curRegs.sp, stackArgs, stackSize) != stackSize) {
+            return false;
+        }
     }
 
     // setup target func address depends on instruction state
@@ -48,20 +76,175 @@ bool CallProcedure::_setupCall(uintptr_t remoteAddr, const std::vector<intptr_t>
         this->_curRegs.pstate &= ~MASK_PSTATE_THUMB_STATE;
         this->_curRegs.pc = remoteAddr;
     }
-    // return address set to null to raise SIGSEGV
+    // return address set to the trap, or null to raise SIGSEGV
     // so we could take it over through waitpid after function call
-    this->_curRegs.regs[30] = 0;
+    this->_curRegs.regs[30] = this->_returnAddr;
 
     return true;
 }
 
-intptr_t CallProcedure::returnValue() {
+uint64_t CallProcedure::_returnBits(RemoteArg::Kind kind) {
+    if (kind == RemoteArg::FLOAT || kind == RemoteArg::DOUBLE) {
+        // returned in s0/d0
+        PtraceFpRegs fpRegs;
+        if (!this->_ptraceWrapper->getFpRegisters(&fpRegs)) {
+            return 0;
+        }
+        uint64_t bits = (uint64_t)fpRegs.vregs[0];
+        return kind == RemoteArg::FLOAT ? (uint32_t)bits : bits;
+    }
     return this->_curRegs.regs[0];
 }
 
-bool CallProcedure::_checkCall() {
-    // return address has been set to null
-    return this->_curRegs.pc == 0;
+uintptr_t CallProcedure::_emitTrap(StubWriter& writer, uintptr_t trapAddr) {
+    // brk #0, which leaves pc on itself
+    writer.value<uint32_t>(0xd4200000u);
+    return trapAddr;
+}
+
+uintptr_t CallProcedure::_programCounter() {
+    return this->_curRegs.pc;
+}
+
+uintptr_t CallProcedure::_stackPointer() {
+    return this->_curRegs.sp;
+}
+
+void CallProcedure::_setStackPointer(uintptr_t sp) {
+    this->_curRegs.sp = sp;
+}
+
+bool CallProcedure::_setupStub(uintptr_t stubAddr, size_t reserve, uintptr_t* outReserved) {
+    this->_curRegs.sp = (this->_curRegs.sp - STACK_RED_ZONE - reserve) & ~(uintptr_t)0xf;
+    *outReserved = this->_curRegs.sp;
+    // stub is made of A64 instructions
+    this->_curRegs.pstate &= ~MASK_PSTATE_THUMB_STATE;
+    this->_curRegs.pc = stubAddr;
+    return true;
+}
+
+// scratch registers IP0/IP1, free to use between calls
+#define REG_X8  8
+#define REG_X16 16
+#define REG_X17 17
+#define REG_X30 30
+
+// movz/movk sequence loading <value> into x<reg>
+static void emitMovImm(StubWriter& writer, int reg, uint64_t value) {
+    // movz xd, #imm16
+    writer.value<uint32_t>(0xd2800000u | ((uint32_t)(value & 0xffff) << 5) | reg);
+    for (uint32_t hw = 1; hw < 4; ++ hw) {
+        uint32_t imm16 = (value >> (hw * 16)) & 0xffff;
+        if (imm16) {
+            // movk xd, #imm16, lsl #(hw * 16)
+            writer.value<uint32_t>(0xf2800000u | (hw << 21) | (imm16 << 5) | reg);
+        }
+    }
+}
+
+// loads <arg> into x<reg>
+static void emitLoadArg(StubWriter& writer, int reg, const CallChain::Arg& arg, uintptr_t resultsAddr) {
+    if (arg.fromCall >= 0) {
+        emitMovImm(writer, REG_X17, resultsAddr + arg.fromCall * PT_SIZE);
+        // ldr xd, [x17]
+        writer.value<uint32_t>(0xf9400000u | (REG_X17 << 5) | reg);
+    } else {
+        emitMovImm(writer, reg, arg.value);
+    }
+}
+
+uintptr_t CallProcedure::_scanSyscallInsn(const uint8_t* code, size_t size, uintptr_t remoteAddr) {
+    // svc #0
+    for (size_t i = 0; i + 4 <= size; i += 4) {
+        if (*(const uint32_t*)(code + i) == 0xd4000001u) {
+            return remoteAddr + i;
+        }
+    }
+    return 0;
+}
+
+bool CallProcedure::_setupSyscall(uintptr_t insnAddr, long nr, const intptr_t* args, size_t argn) {
+    for (size_t i = 0; i < argn; ++ i) {
+        this->_curRegs.regs[i] = args[i];
+    }
+    // syscall number goes in x8
+    this->_curRegs.regs[8] = nr;
+    this->_curRegs.pstate &= ~MASK_PSTATE_THUMB_STATE;
+    this->_curRegs.pc = insnAddr;
+    return true;
+}
+
+size_t CallProcedure::_emitChain(const CallChain& chain, uintptr_t stubAddr, uintptr_t resultsAddr, uintptr_t stackTop,
+    uint8_t* code, size_t capacity, uintptr_t* outTrapAddr, uintptr_t* outTailAddr) {
+    StubWriter writer(code, capacity);
+    if (stackTop) {
+        emitMovImm(writer, REG_X16, stackTop);
+        // mov sp, x16
+        writer.value<uint32_t>(0x9100001fu | (REG_X16 << 5));
+    }
+    for (size_t i = 0; i < chain.size(); ++ i) {
+        const CallChain::Call& call = chain.call(i);
+        bool tail = chain.hasTail() && i == chain.size() - 1;
+        if (call.syscall) {
+            for (size_t k = 0; k < call.argn; ++ k) {
+                emitLoadArg(writer, (int)k, call.args[k], resultsAddr);
+            }
+            emitMovImm(writer, REG_X8, call.remoteAddr);
+            // svc #0
+            writer.value<uint32_t>(0xd4000001u);
+            if (tail) {
+                // fetching the next instruction faults if the stub is gone
+                *outTailAddr = stubAddr + writer.size();
+                continue;
+            }
+            emitMovImm(writer, REG_X17, resultsAddr + i * PT_SIZE);
+            // str x0, [x17]
+            writer.value<uint32_t>(0xf9000000u | (REG_X17 << 5));
+            continue;
+        }
+        size_t stackn = call.argn > MAX_ARG_REGS ? call.argn - MAX_ARG_REGS : 0;
+        // sp must be aligned by 16 whenever it is used to access memory
+        uint32_t stackSize = (stackn * PT_SIZE + 0xf) & ~0xf;
+        if (stackSize) {
+            // sub sp, sp, #imm12
+            writer.value<uint32_t>(0xd10003ffu | (stackSize << 10));
+        }
+        for (size_t k = 0; k < stackn; ++ k) {
+            emitLoadArg(writer, REG_X16, call.args[MAX_ARG_REGS + k], resultsAddr);
+            // str x16, [sp, #(k * 8)]
+            writer.value<uint32_t>(0xf90003e0u | ((uint32_t)k << 10) | REG_X16);
+        }
+        for (size_t k = 0; k < std::min(call.argn, (size_t)MAX_ARG_REGS); ++ k) {
+            emitLoadArg(writer, (int)k, call.args[k], resultsAddr);
+        }
+        emitMovImm(writer, REG_X16, call.remoteAddr);
+        if (tail && chain.tailReturn()) {
+            // br x16, returning to where x30 points
+            emitMovImm(writer, REG_X30, chain.tailReturn());
+            writer.value<uint32_t>(0xd61f0000u | (REG_X16 << 5));
+            *outTailAddr = 0;
+            continue;
+        }
+        if (tail) {
+            // mov x30, xzr; br x16
+            writer.value<uint32_t>(0xaa1f03feu);
+            writer.value<uint32_t>(0xd61f0000u | (REG_X16 << 5));
+            *outTailAddr = 0;
+            continue;
+        }
+        // blr x16
+        writer.value<uint32_t>(0xd63f0000u | (REG_X16 << 5));
+        emitMovImm(writer, REG_X17, resultsAddr + i * PT_SIZE);
+        // str x0, [x17]
+        writer.value<uint32_t>(0xf9000000u | (REG_X17 << 5));
+        if (stackSize) {
+            // add sp, sp, #imm12
+            writer.value<uint32_t>(0x910003ffu | (stackSize << 10));
+        }
+    }
+    // a tail call never comes back here
+    *outTrapAddr = this->_emitTrap(writer, stubAddr + writer.size());
+    return writer.overflowed() ? 0 : writer.size();
 }
 
-#endif
\ No newline at end of file
+#endif
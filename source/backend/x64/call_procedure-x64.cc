@@ -11,59 +11,286 @@
 //
 
 #include "arch.h"
+#include "stub_writer.h"
 #include "call_procedure.h"
 
 #if $is($arch_x64)
 
 #define MAX_ARG_REGS 6
+#define MAX_VEC_ARG_REGS 8
 
 // referenced from: https://wiki.osdev.org/Calling_Conventions#Cheat_Sheets
 
-bool CallProcedure::_setupCall(uintptr_t remoteAddr, const std::vector<intptr_t>& args) {
-    // push up to MAX_ARG_REGS arguments into the following registers respectively
+bool CallProcedure::_setupCall(uintptr_t remoteAddr, uintptr_t resultAddr, const RemoteArg* args, size_t argn) {
+    // integers go into the following registers respectively, float and
+    // double into xmm0-7, and the rest are passed on the stack in order
     const int ARG_REGS_OFFSET[] = { RDI, RSI, RDX, RCX, R8, R9 };
-    int pushn = 0;
-    int argn = args.size();
-    int maxArgNum = std::min(argn, MAX_ARG_REGS);
-    for (; pushn < maxArgNum ; ++ pushn) {
-        // copy param to corresponding register
-        *((uintptr_t*)&this->_curRegs + ARG_REGS_OFFSET[pushn] / PT_SIZE) = args[pushn];
+    size_t gpn = 0;
+    size_t vecn = 0;
+    size_t stackn = 0;
+    uint64_t stackArgs[MAX_CALL_ARGS];
+    PtraceFpRegs fpRegs;
+
+    // memory for the returned struct is passed as the implicit first argument
+    if (resultAddr) {
+        *((uintptr_t*)&this->_curRegs + ARG_REGS_OFFSET[gpn ++] / PT_SIZE) = resultAddr;
+    }
+    for (size_t i = 0; i < argn; ++ i) {
+        const RemoteArg& arg = args[i];
+        if (arg.kind == RemoteArg::FLOAT || arg.kind == RemoteArg::DOUBLE) {
+            if (vecn < MAX_VEC_ARG_REGS) {
+                // fp registers are touched only if there's any fp argument
+                if (vecn == 0 && !this->_ptraceWrapper->getFpRegisters(&fpRegs)) {
+                    return false;
+                }
+                // 4 dwords per xmm register, upper ones cleared
+                uint32_t* xmm = (uint32_t*)fpRegs.xmm_space + vecn * 4;
+                ::memset(xmm, 0, 16);
+                ::memcpy(xmm, &arg.bits, arg.kind == RemoteArg::FLOAT ? 4 : 8);
+                vecn ++;
+                continue;
+            }
+        } else if (gpn < MAX_ARG_REGS) {
+            *((uintptr_t*)&this->_curRegs + ARG_REGS_OFFSET[gpn ++] / PT_SIZE) = arg.bits;
+            continue;
+        }
+        // every argument takes an eightbyte on the stack
+        stackArgs[stackn ++] = arg.bits;
+    }
+    if (vecn > 0 && !this->_ptraceWrapper->setFpRegisters(fpRegs)) {
+        return false;
     }
 
     // stack pointer must be aligned by 16 before any CALL instruction,
     // so that the value of RSP is 8 modulo 16 at the entry of a function
     uintptr_t extraStackSize = PT_SIZE; // return address
-    extraStackSize += argn > MAX_ARG_REGS ? PT_SIZE * (argn - MAX_ARG_REGS) : 0; // extra params
+    extraStackSize += stackn * PT_SIZE; // extra params
     // calculate the closest aligned stack
     while (((this->_curRegs.rsp - extraStackSize - PT_SIZE) & 0xf) != 0) this->_curRegs.rsp --;
 
     // further params are transferred on the stack with the first params
     // at the lowest address and aligned by 8
-    if (argn > MAX_ARG_REGS) {
-        const intptr_t* argHead = args.data();
-        this->_curRegs.rsp -= PT_SIZE * (argn - MAX_ARG_REGS);
-        this->_ptraceWrapper->writeText((void*)this->_curRegs.rsp, (const void*)(argHead + pushn), (argn - pushn) * PT_SIZE);
+    RemoteIoVec stackVecs[2];
+    size_t stackSize = 0;
+    if (stackn > 0) {
+        this->_curRegs.rsp -= PT_SIZE * stackn;
+        stackVecs[1] = { (void*)this->_curRegs.rsp, (void*)stackArgs, stackn * PT_SIZE };
+        stackSize += stackVecs[1].count;
     }
 
-    // set return address to null
-    uintptr_t nullAddr = 0;
+    // set return address to the trap, or null to raise SIGSEGV
+    uintptr_t returnAddr = this->_returnAddr;
     this->_curRegs.rsp -= PT_SIZE;
-    this->_ptraceWrapper->writeText((void*)this->_curRegs.rsp, (void*)&nullAddr, PT_SIZE);
+    stackVecs[0] = { (void*)this->_curRegs.rsp, (void*)&returnAddr, PT_SIZE };
+    stackSize += PT_SIZE;
+
+    // return address and params are adjacent, so they go in one write
+    if (this->_ptraceWrapper->writev(stackVecs, stackn > 0 ? 2 : 1) != stackSize) {
+        return false;
+    }
     
     // modify pc
     this->_curRegs.rip = remoteAddr;
 
-    this->_curRegs.rax = this->_curRegs.orig_rax = 0;
+    // al tells a variadic callee how many vector registers are used
+    this->_curRegs.orig_rax = 0;
+    this->_curRegs.rax = vecn;
     return true;
 }
 
-intptr_t CallProcedure::returnValue() {
+uint64_t CallProcedure::_returnBits(RemoteArg::Kind kind) {
+    if (kind == RemoteArg::FLOAT || kind == RemoteArg::DOUBLE) {
+        // returned in xmm0
+        PtraceFpRegs fpRegs;
+        uint64_t bits = 0;
+        if (this->_ptraceWrapper->getFpRegisters(&fpRegs)) {
+            ::memcpy(&bits, fpRegs.xmm_space, kind == RemoteArg::FLOAT ? 4 : 8);
+        }
+        return bits;
+    }
     return this->_curRegs.rax;
 }
 
-bool CallProcedure::_checkCall() {
-    // return address has been set to null
-    return this->_curRegs.rip == 0;
+uintptr_t CallProcedure::_emitTrap(StubWriter& writer, uintptr_t trapAddr) {
+    // int3, which leaves rip right after it
+    writer.bytes({ 0xcc });
+    return trapAddr + 1;
+}
+
+uintptr_t CallProcedure::_programCounter() {
+    return this->_curRegs.rip;
+}
+
+uintptr_t CallProcedure::_stackPointer() {
+    return this->_curRegs.rsp;
+}
+
+void CallProcedure::_setStackPointer(uintptr_t sp) {
+    this->_curRegs.rsp = sp;
+}
+
+bool CallProcedure::_setupStub(uintptr_t stubAddr, size_t reserve, uintptr_t* outReserved) {
+    // keep off the red zone of the interrupted function
+    this->_curRegs.rsp = (this->_curRegs.rsp - STACK_RED_ZONE - reserve) & ~(uintptr_t)0xf;
+    *outReserved = this->_curRegs.rsp;
+    this->_curRegs.rip = stubAddr;
+    this->_curRegs.rax = this->_curRegs.orig_rax = 0;
+    return true;
+}
+
+// loads <arg> into rax
+static void emitLoadRax(StubWriter& writer, const CallChain::Arg& arg, uintptr_t resultsAddr) {
+    if (arg.fromCall >= 0) {
+        // mov rax, [moffs64]
+        writer.bytes({ 0x48, 0xa1 });
+        writer.value<uint64_t>(resultsAddr + arg.fromCall * PT_SIZE);
+    } else {
+        // mov rax, imm64
+        writer.bytes({ 0x48, 0xb8 });
+        writer.value<uint64_t>(arg.value);
+    }
+}
+
+uintptr_t CallProcedure::_scanSyscallInsn(const uint8_t* code, size_t size, uintptr_t remoteAddr) {
+    // syscall: 0f 05
+    for (size_t i = 0; i + 1 < size; ++ i) {
+        if (code[i] == 0x0f && code[i + 1] == 0x05) {
+            return remoteAddr + i;
+        }
+    }
+    return 0;
+}
+
+bool CallProcedure::_setupSyscall(uintptr_t insnAddr, long nr, const intptr_t* args, size_t argn) {
+    // the kernel takes the 4th argument from r10, as rcx is clobbered by SYSCALL
+    const int ARG_REGS_OFFSET[] = { RDI, RSI, RDX, R10, R8, R9 };
+    for (size_t i = 0; i < argn; ++ i) {
+        *((uintptr_t*)&this->_curRegs + ARG_REGS_OFFSET[i] / PT_SIZE) = args[i];
+    }
+    this->_curRegs.rax = nr;
+    // not in a syscall, so nothing would be restarted on resume
+    this->_curRegs.orig_rax = -1;
+    this->_curRegs.rip = insnAddr;
+    return true;
+}
+
+size_t CallProcedure::_emitChain(const CallChain& chain, uintptr_t stubAddr, uintptr_t resultsAddr, uintptr_t stackTop,
+    uint8_t* code, size_t capacity, uintptr_t* outTrapAddr, uintptr_t* outTailAddr) {
+    // 'mov reg, imm64' and 'mov reg, rax' for rdi, rsi, rdx, rcx, r8, r9
+    static const uint8_t MOV_IMM[MAX_ARG_REGS][2] = {
+        { 0x48, 0xbf }, { 0x48, 0xbe }, { 0x48, 0xba }, { 0x48, 0xb9 }, { 0x49, 0xb8 }, { 0x49, 0xb9 },
+    };
+    static const uint8_t MOV_RAX[MAX_ARG_REGS][3] = {
+        { 0x48, 0x89, 0xc7 }, { 0x48, 0x89, 0xc6 }, { 0x48, 0x89, 0xc2 },
+        { 0x48, 0x89, 0xc1 }, { 0x49, 0x89, 0xc0 }, { 0x49, 0x89, 0xc1 },
+    };
+    // same for syscalls, where r10 takes the place of rcx
+    static const uint8_t SYS_MOV_IMM[MAX_SYSCALL_ARGS][2] = {
+        { 0x48, 0xbf }, { 0x48, 0xbe }, { 0x48, 0xba }, { 0x49, 0xba }, { 0x49, 0xb8 }, { 0x49, 0xb9 },
+    };
+    static const uint8_t SYS_MOV_RAX[MAX_SYSCALL_ARGS][3] = {
+        { 0x48, 0x89, 0xc7 }, { 0x48, 0x89, 0xc6 }, { 0x48, 0x89, 0xc2 },
+        { 0x49, 0x89, 0xc2 }, { 0x49, 0x89, 0xc0 }, { 0x49, 0x89, 0xc1 },
+    };
+
+    StubWriter writer(code, capacity);
+    if (stackTop) {
+        // mov rsp, imm64
+        writer.bytes({ 0x48, 0xbc });
+        writer.value<uint64_t>(stackTop);
+    }
+    // and rsp, -16
+    writer.bytes({ 0x48, 0x83, 0xe4, 0xf0 });
+    for (size_t i = 0; i < chain.size(); ++ i) {
+        const CallChain::Call& call = chain.call(i);
+        bool tail = chain.hasTail() && i == chain.size() - 1;
+        if (call.syscall) {
+            for (size_t k = 0; k < call.argn; ++ k) {
+                const CallChain::Arg& arg = call.args[k];
+                if (arg.fromCall >= 0) {
+                    emitLoadRax(writer, arg, resultsAddr);
+                    writer.bytes({ SYS_MOV_RAX[k][0], SYS_MOV_RAX[k][1], SYS_MOV_RAX[k][2] });
+                } else {
+                    writer.bytes({ SYS_MOV_IMM[k][0], SYS_MOV_IMM[k][1] });
+                    writer.value<uint64_t>(arg.value);
+                }
+            }
+            // mov eax, imm32; syscall
+            writer.bytes({ 0xb8 });
+            writer.value<uint32_t>(call.remoteAddr);
+            writer.bytes({ 0x0f, 0x05 });
+            if (tail) {
+                // fetching the next instruction faults if the stub is gone
+                *outTailAddr = stubAddr + writer.size();
+                continue;
+            }
+            // mov [moffs64], rax
+            writer.bytes({ 0x48, 0xa3 });
+            writer.value<uint64_t>(resultsAddr + i * PT_SIZE);
+            continue;
+        }
+        size_t stackn = call.argn > MAX_ARG_REGS ? call.argn - MAX_ARG_REGS : 0;
+        // rsp stays aligned by 16 right before the CALL (or the null
+        // return address pushed for tail call), pad for odd stack args.
+        // a tail call returning somewhere is a word off instead, so the
+        // one returned to is aligned, with null above it if there's room
+        bool returns = tail && chain.tailReturn();
+        size_t stackSize = (stackn * PT_SIZE + 0xf) & ~0xf;
+        if (returns && !(stackn & 1)) {
+            // push 0
+            writer.bytes({ 0x6a, 0x00 });
+        } else if (!returns && (stackn & 1)) {
+            // sub rsp, 8
+            writer.bytes({ 0x48, 0x83, 0xec, 0x08 });
+        }
+        for (size_t k = call.argn; k-- > MAX_ARG_REGS;) {
+            emitLoadRax(writer, call.args[k], resultsAddr);
+            // push rax
+            writer.bytes({ 0x50 });
+        }
+        for (size_t k = 0; k < std::min(call.argn, (size_t)MAX_ARG_REGS); ++ k) {
+            const CallChain::Arg& arg = call.args[k];
+            if (arg.fromCall >= 0) {
+                emitLoadRax(writer, arg, resultsAddr);
+                writer.bytes({ MOV_RAX[k][0], MOV_RAX[k][1], MOV_RAX[k][2] });
+            } else {
+                writer.bytes({ MOV_IMM[k][0], MOV_IMM[k][1] });
+                writer.value<uint64_t>(arg.value);
+            }
+        }
+        // mov r11, imm64
+        writer.bytes({ 0x49, 0xbb });
+        writer.value<uint64_t>(call.remoteAddr);
+        // xor eax, eax: no vector registers used, in case of variadic callee
+        writer.bytes({ 0x31, 0xc0 });
+        if (returns) {
+            // mov r10, imm64; push r10; jmp r11
+            writer.bytes({ 0x49, 0xba });
+            writer.value<uint64_t>(chain.tailReturn());
+            writer.bytes({ 0x41, 0x52, 0x41, 0xff, 0xe3 });
+            *outTailAddr = 0;
+            continue;
+        }
+        if (tail) {
+            // push 0; jmp r11
+            writer.bytes({ 0x6a, 0x00, 0x41, 0xff, 0xe3 });
+            *outTailAddr = 0;
+            continue;
+        }
+        // call r11
+        writer.bytes({ 0x41, 0xff, 0xd3 });
+        // mov [moffs64], rax
+        writer.bytes({ 0x48, 0xa3 });
+        writer.value<uint64_t>(resultsAddr + i * PT_SIZE);
+        if (stackSize) {
+            // add rsp, imm32
+            writer.bytes({ 0x48, 0x81, 0xc4 });
+            writer.value<uint32_t>(stackSize);
+        }
+    }
+    // a tail call never comes back here
+    *outTrapAddr = this->_emitTrap(writer, stubAddr + writer.size());
+    return writer.overflowed() ? 0 : writer.size();
 }
 
-#endif
\ No newline at end of file
+#endif
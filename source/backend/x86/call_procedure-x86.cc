@@ -5,38 +5,247 @@
  * see LICENSE file for details
  */
 
+#include <math.h>
+
 #include "arch.h"
+#include "stub_writer.h"
 #include "call_procedure.h"
 
 #if $is($arch_x86)
 
 // referenced from: https://wiki.osdev.org/Calling_Conventions#Cheat_Sheets
 
-bool CallProcedure::_setupCall(uintptr_t remoteAddr, const std::vector<intptr_t>& args) {
-    // pushing all arguments onto stack
-    size_t argn = args.size();
-    this->_curRegs.esp -= argn * PT_SIZE;
-    if (argn > 0) {
-        this->_ptraceWrapper->writeText((void*)this->_curRegs.esp, (const void*)args.data(), argn * PT_SIZE);
+bool CallProcedure::_setupCall(uintptr_t remoteAddr, uintptr_t resultAddr, const RemoteArg* args, size_t argn) {
+    // pushing all arguments onto stack, where 64-bit integers and double
+    // take two slots with the low half at the lower address
+    uint32_t stackArgs[MAX_CALL_ARGS * 2 + 1];
+    size_t stackn = 0;
+    // memory for the returned struct is passed as the implicit first argument
+    if (resultAddr) {
+        stackArgs[stackn ++] = resultAddr;
+    }
+    for (size_t i = 0; i < argn; ++ i) {
+        stackArgs[stackn ++] = (uint32_t)args[i].bits;
+        if (args[i].kind == RemoteArg::DWORD || args[i].kind == RemoteArg::DOUBLE) {
+            stackArgs[stackn ++] = (uint32_t)(args[i].bits >> 32);
+        }
+    }
+
+    // stack pointer must be aligned by 16 right before the call,
+    // i.e., where the arguments begin
+    RemoteIoVec stackVecs[2];
+    size_t stackSize = 0;
+    this->_curRegs.esp = (this->_curRegs.esp - stackn * PT_SIZE) & ~0xf;
+    if (stackn > 0) {
+        stackVecs[1] = { (void*)this->_curRegs.esp, (void*)stackArgs, stackn * PT_SIZE };
+        stackSize += stackVecs[1].count;
     }
     
-    // set return address to null
-    uintptr_t nullAddr = 0;
+    // set return address to the trap, or null to raise SIGSEGV
+    uintptr_t returnAddr = this->_returnAddr;
     this->_curRegs.esp -= PT_SIZE;
-    this->_ptraceWrapper->writeText((void*)this->_curRegs.esp, (void*)&nullAddr, PT_SIZE);
+    stackVecs[0] = { (void*)this->_curRegs.esp, (void*)&returnAddr, PT_SIZE };
+    stackSize += PT_SIZE;
+
+    // return address and arguments are adjacent, so they go in one write
+    if (this->_ptraceWrapper->writev(stackVecs, stackn > 0 ? 2 : 1) != stackSize) {
+        return false;
+    }
     
     // modify pc
     this->_curRegs.eip = remoteAddr;
     return true;
 }
 
-intptr_t CallProcedure::returnValue() {
-    return this->_curRegs.eax;
+// st0 in the 80-bit extended precision format, as saved by FSAVE
+static double extendedToDouble(const uint8_t* st) {
+    uint64_t mantissa;
+    uint16_t signExp;
+    ::memcpy(&mantissa, st, sizeof(mantissa));
+    ::memcpy(&signExp, st + 8, sizeof(signExp));
+    int exp = signExp & 0x7fff;
+    double value;
+    if (exp == 0x7fff) {
+        value = (mantissa << 1) ? NAN : INFINITY;
+    } else {
+        // the integer bit is explicit, so it's mantissa * 2^(exp - bias - 63)
+        value = ::ldexp((double)mantissa, exp - 16383 - 63);
+    }
+    return (signExp & 0x8000) ? -value : value;
+}
+
+uint64_t CallProcedure::_returnBits(RemoteArg::Kind kind) {
+    if (kind == RemoteArg::FLOAT || kind == RemoteArg::DOUBLE) {
+        // returned in st0 of the x87 register stack
+        PtraceFpRegs fpRegs;
+        uint64_t bits = 0;
+        if (this->_ptraceWrapper->getFpRegisters(&fpRegs)) {
+            double value = extendedToDouble((const uint8_t*)fpRegs.st_space);
+            if (kind == RemoteArg::FLOAT) {
+                float single = (float)value;
+                ::memcpy(&bits, &single, sizeof(single));
+            } else {
+                ::memcpy(&bits, &value, sizeof(value));
+            }
+        }
+        return bits;
+    }
+    // 64-bit integers are returned in edx:eax
+    uint64_t bits = (uint32_t)this->_curRegs.eax;
+    if (kind == RemoteArg::DWORD) {
+        bits |= (uint64_t)(uint32_t)this->_curRegs.edx << 32;
+    }
+    return bits;
+}
+
+uintptr_t CallProcedure::_emitTrap(StubWriter& writer, uintptr_t trapAddr) {
+    // int3, which leaves eip right after it
+    writer.bytes({ 0xcc });
+    return trapAddr + 1;
+}
+
+uintptr_t CallProcedure::_programCounter() {
+    return this->_curRegs.eip;
+}
+
+uintptr_t CallProcedure::_stackPointer() {
+    return this->_curRegs.esp;
+}
+
+void CallProcedure::_setStackPointer(uintptr_t sp) {
+    this->_curRegs.esp = sp;
+}
+
+bool CallProcedure::_setupStub(uintptr_t stubAddr, size_t reserve, uintptr_t* outReserved) {
+    this->_curRegs.esp = (this->_curRegs.esp - STACK_RED_ZONE - reserve) & ~(uintptr_t)0xf;
+    *outReserved = this->_curRegs.esp;
+    this->_curRegs.eip = stubAddr;
+    return true;
+}
+
+uintptr_t CallProcedure::_scanSyscallInsn(const uint8_t* code, size_t size, uintptr_t remoteAddr) {
+    // int 0x80: cd 80, which __kernel_vsyscall also falls back to
+    for (size_t i = 0; i + 1 < size; ++ i) {
+        if (code[i] == 0xcd && code[i + 1] == 0x80) {
+            return remoteAddr + i;
+        }
+    }
+    return 0;
+}
+
+bool CallProcedure::_setupSyscall(uintptr_t insnAddr, long nr, const intptr_t* args, size_t argn) {
+    long* ARG_REGS[] = { &this->_curRegs.ebx, &this->_curRegs.ecx, &this->_curRegs.edx,
+                         &this->_curRegs.esi, &this->_curRegs.edi, &this->_curRegs.ebp };
+    for (size_t i = 0; i < argn; ++ i) {
+        *ARG_REGS[i] = args[i];
+    }
+    this->_curRegs.eax = nr;
+    // not in a syscall, so nothing would be restarted on resume
+    this->_curRegs.orig_eax = -1;
+    this->_curRegs.eip = insnAddr;
+    return true;
 }
 
-bool CallProcedure::_checkCall() {
-    // return address has been set to null
-    return this->_curRegs.eip == 0;
+size_t CallProcedure::_emitChain(const CallChain& chain, uintptr_t stubAddr, uintptr_t resultsAddr, uintptr_t stackTop,
+    uint8_t* code, size_t capacity, uintptr_t* outTrapAddr, uintptr_t* outTailAddr) {
+    // opcodes of 'mov reg, imm32' and modrm of 'mov reg, [disp32]'
+    // for ebx, ecx, edx, esi, edi, ebp, the syscall arguments
+    static const uint8_t SYS_MOV_IMM[MAX_SYSCALL_ARGS] = { 0xbb, 0xb9, 0xba, 0xbe, 0xbf, 0xbd };
+    static const uint8_t SYS_MOV_MEM[MAX_SYSCALL_ARGS] = { 0x1d, 0x0d, 0x15, 0x35, 0x3d, 0x2d };
+
+    StubWriter writer(code, capacity);
+    if (stackTop) {
+        // mov esp, imm32
+        writer.bytes({ 0xbc });
+        writer.value<uint32_t>(stackTop);
+    }
+    // and esp, -16
+    writer.bytes({ 0x83, 0xe4, 0xf0 });
+    for (size_t i = 0; i < chain.size(); ++ i) {
+        const CallChain::Call& call = chain.call(i);
+        bool tail = chain.hasTail() && i == chain.size() - 1;
+        if (call.syscall) {
+            for (size_t k = 0; k < call.argn; ++ k) {
+                const CallChain::Arg& arg = call.args[k];
+                if (arg.fromCall >= 0) {
+                    // mov reg, [addr]
+                    writer.bytes({ 0x8b, SYS_MOV_MEM[k] });
+                    writer.value<uint32_t>(resultsAddr + arg.fromCall * PT_SIZE);
+                } else {
+                    // mov reg, imm32
+                    writer.bytes({ SYS_MOV_IMM[k] });
+                    writer.value<uint32_t>(arg.value);
+                }
+            }
+            // mov eax, imm32; int 0x80
+            writer.bytes({ 0xb8 });
+            writer.value<uint32_t>(call.remoteAddr);
+            writer.bytes({ 0xcd, 0x80 });
+            if (tail) {
+                // fetching the next instruction faults if the stub is gone
+                *outTailAddr = stubAddr + writer.size();
+                continue;
+            }
+            // mov [addr], eax
+            writer.bytes({ 0xa3 });
+            writer.value<uint32_t>(resultsAddr + i * PT_SIZE);
+            continue;
+        }
+        // esp stays aligned by 16 right before the CALL (or the null
+        // return address pushed for tail call), pad before pushing args.
+        // a tail call returning somewhere is a word off instead, so the
+        // one returned to is aligned
+        bool returns = tail && chain.tailReturn();
+        size_t argSize = call.argn * PT_SIZE;
+        size_t skew = returns ? 0xc : 0;
+        size_t stackSize = ((argSize + skew + 0xf) & ~0xf) - skew;
+        if (stackSize != argSize) {
+            // sub esp, imm8
+            writer.bytes({ 0x83, 0xec, (uint8_t)(stackSize - argSize) });
+        }
+        for (size_t k = call.argn; k-- > 0;) {
+            const CallChain::Arg& arg = call.args[k];
+            if (arg.fromCall >= 0) {
+                // push dword [addr]
+                writer.bytes({ 0xff, 0x35 });
+                writer.value<uint32_t>(resultsAddr + arg.fromCall * PT_SIZE);
+            } else {
+                // push imm32
+                writer.bytes({ 0x68 });
+                writer.value<uint32_t>(arg.value);
+            }
+        }
+        // mov eax, imm32
+        writer.bytes({ 0xb8 });
+        writer.value<uint32_t>(call.remoteAddr);
+        if (returns) {
+            // push imm32; jmp eax
+            writer.bytes({ 0x68 });
+            writer.value<uint32_t>(chain.tailReturn());
+            writer.bytes({ 0xff, 0xe0 });
+            *outTailAddr = 0;
+            continue;
+        }
+        if (tail) {
+            // push 0; jmp eax
+            writer.bytes({ 0x6a, 0x00, 0xff, 0xe0 });
+            *outTailAddr = 0;
+            continue;
+        }
+        // call eax
+        writer.bytes({ 0xff, 0xd0 });
+        // mov [addr], eax
+        writer.bytes({ 0xa3 });
+        writer.value<uint32_t>(resultsAddr + i * PT_SIZE);
+        if (stackSize) {
+            // add esp, imm32
+            writer.bytes({ 0x81, 0xc4 });
+            writer.value<uint32_t>(stackSize);
+        }
+    }
+    // a tail call never comes back here
+    *outTrapAddr = this->_emitTrap(writer, stubAddr + writer.size());
+    return writer.overflowed() ? 0 : writer.size();
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,629 @@
+/*
+ * Copyright (c) 2020, Irvin Pang <halo.irvin@gmail.com>
+ * All rights reserved.
+ *
+ * see LICENSE file for details
+ */
+
+/*
+ * benchmarks of the core on host Linux, against adrill-bench-tracee:
+ *
+ *   attach   attach & detach, legacy and seize
+ *   call     remote call, syscall and chain round trips
+ *   memory   remote read & write by backend and transfer size
+ *   symbol   maps parsing, ELF symbol lookup, dlopen & dlerror resolved
+ *   inject   end to end, the ways Injector does it
+ *
+ * each figure is sampled --iterations times and reported as a line of
+ * min/p50/p90/max, to be compared before and after a change. --soak
+ * injects into one tracee over and over instead, and tells whatever it
+ * is left with, e.g., mappings, descriptors or threads
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <dirent.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <set>
+#include <tuple>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <functional>
+
+#include "macros.h"
+#include "clock.h"
+#include "ptrace_wrapper.h"
+#include "call_procedure.h"
+#include "remote_arena.h"
+#include "maps_snapshot.h"
+#include "symbol_cache.h"
+#include "elf_dlfcn.h"
+#include "injector.h"
+#include "inject_stats.h"
+#include "bench.h"
+
+// bytes moved for each (backend, size) of the memory benchmark, at most
+#define BENCH_MEMORY_BUDGET (16 * 1024 * 1024)
+// calls in the chain of the call benchmark
+#define BENCH_CHAIN_CALLS   4
+
+static bool sVerbose = false;
+
+/*
+ * the log of adrill goes to stdout as well, it's dropped while measuring
+ * unless --verbose, so that the report stays readable
+ */
+class QuietLog {
+public:
+    QuietLog() : _saved(-1) {
+        if (!sVerbose) {
+            ::fflush(stdout);
+            this->_saved = ::dup(STDOUT_FILENO);
+            int null = ::open("/dev/null", O_WRONLY | O_CLOEXEC);
+            ::dup2(null, STDOUT_FILENO);
+            ::close(null);
+        }
+    }
+    ~QuietLog() {
+        if (this->_saved != -1) {
+            ::fflush(stdout);
+            ::dup2(this->_saved, STDOUT_FILENO);
+            ::close(this->_saved);
+        }
+    }
+
+protected:
+    int _saved;
+
+};
+
+// nearest rank, <values> sorted
+static int64_t percentile(const std::vector<int64_t>& values, int p) {
+    size_t rank = (values.size() * p + 99) / 100;
+    return values[rank ? rank - 1 : 0];
+}
+
+static void report(const char* name, std::vector<int64_t> ns, size_t failed = 0) {
+    if (ns.empty()) {
+        ::printf("%-34s %6s  failed %zu\n", name, "-", failed);
+        return;
+    }
+    std::sort(ns.begin(), ns.end());
+    ::printf("%-34s %6zu  min %9.1f  p50 %9.1f  p90 %9.1f  max %9.1f us", name, ns.size(),
+        ns.front() / 1e3, percentile(ns, 50) / 1e3, percentile(ns, 90) / 1e3, ns.back() / 1e3);
+    if (failed) {
+        ::printf("  failed %zu", failed);
+    }
+    ::printf("\n");
+}
+
+static void reportBandwidth(const char* name, size_t size, std::vector<int64_t> ns, size_t failed) {
+    if (ns.empty()) {
+        ::printf("%-34s %6s  failed %zu\n", name, "-", failed);
+        return;
+    }
+    std::sort(ns.begin(), ns.end());
+    int64_t median = std::max<int64_t>(percentile(ns, 50), 1);
+    ::printf("%-34s %6zu  p50 %9.1f us  %9.1f MB/s", name, ns.size(), median / 1e3, size * 1e3 / median);
+    if (failed) {
+        ::printf("  failed %zu", failed);
+    }
+    ::printf("\n");
+}
+
+/*
+ * adrill-bench-tracee, a child of ours, so it's traceable whatever
+ * yama says
+ */
+struct Tracee {
+    pid_t     pid;
+    uintptr_t buffer;
+};
+
+static bool spawnTracee(const std::string& path, Tracee* outTracee) {
+    int fds[2];
+    if (::pipe2(fds, O_CLOEXEC) == -1) {
+        return false;
+    }
+    ::fflush(stdout);
+    pid_t pid = ::fork();
+    if (pid == 0) {
+        ::dup2(fds[1], STDOUT_FILENO);
+        ::execl(path.c_str(), path.c_str(), nullptr);
+        ::_exit(127);
+    }
+    ::close(fds[1]);
+
+    // the first line is the address of its buffer
+    char line[64] = {0};
+    size_t size = 0;
+    while (size < sizeof(line) - 1 && !::memchr(line, '\n', size)) {
+        ssize_t n = ::read(fds[0], line + size, sizeof(line) - 1 - size);
+        if (n <= 0) {
+            break;
+        }
+        size += n;
+    }
+    ::close(fds[0]);
+
+    void* buffer = nullptr;
+    if (pid == -1 || ::sscanf(line, "%p", &buffer) != 1) {
+        LOGGER_LOGE("[!] failed to start %s\n", path.c_str());
+        if (pid > 0) {
+            ::kill(pid, SIGKILL);
+            ::waitpid(pid, nullptr, 0);
+        }
+        return false;
+    }
+    outTracee->pid = pid;
+    outTracee->buffer = (uintptr_t)buffer;
+    return true;
+}
+
+static void killTracee(const Tracee& tracee) {
+    ::kill(tracee.pid, SIGKILL);
+    ::waitpid(tracee.pid, nullptr, 0);
+}
+
+/*
+ * <local> of ours in tracee, i.e., the same offset in the same module
+ */
+static uintptr_t remoteAddressOf(pid_t pid, const void* local) {
+    MapsSnapshot localMaps;
+    MapsSnapshot remoteMaps;
+    MapsSnapshot::Region region;
+    MapsSnapshot::Module localModule { nullptr, 0, 0 };
+    MapsSnapshot::Module remoteModule { nullptr, 0, 0 };
+    if (!localMaps.load(0) || !localMaps.findAddress((uintptr_t)local, &region, &localModule) || !localModule.path) {
+        return 0;
+    }
+    if (!remoteMaps.load(pid) || !remoteMaps.findModule(localModule.path, &remoteModule)) {
+        return 0;
+    }
+    return (uintptr_t)local - localModule.start + remoteModule.start;
+}
+
+static std::string moduleOf(const void* local) {
+    MapsSnapshot maps;
+    MapsSnapshot::Region region;
+    MapsSnapshot::Module module { nullptr, 0, 0 };
+    if (!maps.load(0) || !maps.findAddress((uintptr_t)local, &region, &module) || !module.path) {
+        return "";
+    }
+    return module.path;
+}
+
+/*
+ * samples <body> <n> times, false from it counts as a failure
+ */
+static void measure(const char* name, int n, const std::function<bool()>& body) {
+    std::vector<int64_t> ns;
+    size_t failed = 0;
+    {
+        QuietLog quiet;
+        for (int i = 0; i < n; ++ i) {
+            int64_t startNs = monotonicNs();
+            if (body()) {
+                ns.push_back(monotonicNs() - startNs);
+            } else {
+                ++ failed;
+            }
+        }
+    }
+    report(name, ns, failed);
+}
+
+static void benchAttach(const Tracee& tracee, int n) {
+    const struct {
+        const char* name;
+        PtraceWrapper::AttachMode mode;
+    } modes[] = {
+        { "legacy", PtraceWrapper::ATTACH_LEGACY },
+        { "seize",  PtraceWrapper::ATTACH_SEIZE },
+    };
+    for (const auto& mode : modes) {
+        std::vector<int64_t> attachNs;
+        std::vector<int64_t> detachNs;
+        size_t failed = 0;
+        {
+            QuietLog quiet;
+            for (int i = 0; i < n; ++ i) {
+                PtraceWrapper ptrace;
+                int64_t startNs = monotonicNs();
+                if (!ptrace.attach(tracee.pid, mode.mode)) {
+                    ++ failed;
+                    continue;
+                }
+                int64_t attachedNs = monotonicNs();
+                ptrace.detach();
+                attachNs.push_back(attachedNs - startNs);
+                detachNs.push_back(monotonicNs() - attachedNs);
+            }
+        }
+        std::string name = std::string("attach ") + mode.name;
+        report(name.c_str(), attachNs, failed);
+        name = std::string("detach ") + mode.name;
+        report(name.c_str(), detachNs, failed);
+    }
+}
+
+static void benchCall(const Tracee& tracee, int n) {
+    PtraceWrapper ptrace;
+    CallProcedure caller(&ptrace);
+    RemoteArena arena(&caller, &ptrace);
+    PtraceRegs regs;
+    uintptr_t remoteGetpid = remoteAddressOf(tracee.pid, (const void*)::getpid);
+    bool ok = true;
+    do {
+        QuietLog quiet;
+        ok &= remoteGetpid != 0;
+        BREAK_IF_WITH_LOGE(!ok, "[!] getpid not found in process %d\n", tracee.pid);
+        ok &= ptrace.attach(tracee.pid, PtraceWrapper::ATTACH_SEIZE);
+        BREAK_IF_WITH_LOGE(!ok, "[!] failed to attach to process %d\n", tracee.pid);
+        ok &= ptrace.getRegisters(&regs) && arena.create();
+    } while (false);
+    if (!ok) {
+        ::printf("%-34s %6s  failed\n", "call", "-");
+        ptrace.detach();
+        return;
+    }
+
+    measure("remote call", n, [&]() {
+        return caller.remoteCall(remoteGetpid) && caller.returnValue() == tracee.pid;
+    });
+    measure("remote syscall", n, [&]() {
+        return caller.remoteSyscall(__NR_getpid) && caller.returnValue() == tracee.pid;
+    });
+    CallChain chain;
+    for (int i = 0; i < BENCH_CHAIN_CALLS; ++ i) {
+        chain.add(remoteGetpid, {});
+    }
+    char name[64];
+    ::snprintf(name, sizeof(name), "remote chain of %d calls", BENCH_CHAIN_CALLS);
+    measure(name, n, [&]() {
+        return caller.remoteCallChain(chain, arena.stubAddr(), arena.stubCapacity())
+            && caller.chainResult(BENCH_CHAIN_CALLS - 1) == tracee.pid;
+    });
+
+    QuietLog quiet;
+    arena.release();
+    ptrace.setRegisters(regs);
+    ptrace.detach();
+}
+
+static void benchMemory(const Tracee& tracee, int n) {
+    PtraceWrapper ptrace;
+    bool attached = false;
+    {
+        QuietLog quiet;
+        attached = ptrace.attach(tracee.pid, PtraceWrapper::ATTACH_SEIZE);
+    }
+    if (!attached) {
+        ::printf("%-34s %6s  failed\n", "memory", "-");
+        return;
+    }
+
+    const struct {
+        const char* name;
+        int backends;
+    } backends[] = {
+        { "ptrace",  PtraceWrapper::MEM_PTRACE },
+        { "vm",      PtraceWrapper::MEM_VM },
+        { "procmem", PtraceWrapper::MEM_PROC },
+    };
+    const size_t sizes[] = { 8, 64, 512, 4096, 64 * 1024, 1024 * 1024 };
+    std::vector<char> local(BENCH_BUFFER_SIZE, 0x3c);
+    const void* remote = (const void*)tracee.buffer;
+    for (const auto& backend : backends) {
+        ptrace.setMemoryBackends(backend.backends);
+        for (size_t size : sizes) {
+            int reps = (int)std::max<size_t>(3, std::min<size_t>(n, BENCH_MEMORY_BUDGET / size));
+            for (bool write : { false, true }) {
+                std::vector<int64_t> ns;
+                size_t failed = 0;
+                {
+                    QuietLog quiet;
+                    for (int i = 0; i < reps; ++ i) {
+                        int64_t startNs = monotonicNs();
+                        size_t done = write ? ptrace.writeMemory(remote, local.data(), size) : ptrace.readMemory(local.data(), remote, size);
+                        if (done == size) {
+                            ns.push_back(monotonicNs() - startNs);
+                        } else {
+                            ++ failed;
+                        }
+                    }
+                }
+                char name[64];
+                ::snprintf(name, sizeof(name), "%s %-7s %7zu bytes", write ? "write" : "read ", backend.name, size);
+                reportBandwidth(name, size, ns, failed);
+            }
+        }
+    }
+
+    QuietLog quiet;
+    ptrace.detach();
+}
+
+static void benchSymbol(const Tracee& tracee, int n) {
+    measure("maps of tracee parsed", n, [&]() {
+        MapsSnapshot maps;
+        return maps.load(tracee.pid);
+    });
+
+    std::string libc = moduleOf((const void*)::dlopen);
+    measure("ELF parsed for dlopen", n, [&]() {
+        void* handle = elf_dlopen(libc.c_str(), RTLD_PARSE_ELF);
+        bool found = handle && elf_dlsym(handle, "dlopen");
+        if (handle) {
+            elf_dlclose(handle);
+        }
+        return found;
+    });
+
+    uintptr_t remoteDlopen = 0;
+    uintptr_t remoteDlerror = 0;
+    measure("dlfcn resolved, cache cold", n, [&]() {
+        SymbolCache cache;
+        return resolveRemoteDlfcn(tracee.pid, &cache, &remoteDlopen, &remoteDlerror);
+    });
+    SymbolCache cache;
+    measure("dlfcn resolved, cache warm", n, [&]() {
+        return resolveRemoteDlfcn(tracee.pid, &cache, &remoteDlopen, &remoteDlerror);
+    });
+}
+
+/*
+ * <n> injections through Injector with <options>, false if any failed
+ */
+static bool inject(const Tracee& tracee, const std::string& payload, const InjectOptions& options, int n,
+    SymbolCache* cache, StatsAggregator* aggregator) {
+    bool ok = true;
+    QuietLog quiet;
+    for (int i = 0; i < n; ++ i) {
+        Injector injector(payload, options);
+        injector.setSymbolCache(cache);
+        injector.add(tracee.pid);
+        ok &= injector.run();
+        aggregator->add(injector.results().front());
+    }
+    return ok;
+}
+
+static void reportInjections(const char* name, const StatsAggregator& aggregator) {
+    std::vector<int64_t> elapsedNs;
+    std::vector<int64_t> heldNs;
+    size_t failed = 0;
+    for (const Injector::Result& result : aggregator.results()) {
+        if (!result.ok) {
+            ++ failed;
+            continue;
+        }
+        elapsedNs.push_back(result.elapsedNs);
+        if (result.stats.ptrace.heldNs) {
+            heldNs.push_back(result.stats.ptrace.heldNs);
+        }
+    }
+    report(name, elapsedNs, failed);
+    if (!heldNs.empty()) {
+        std::string held = std::string(name) + ", held";
+        report(held.c_str(), heldNs);
+    }
+}
+
+static void benchInject(const std::string& tracee, const std::string& payload, const std::string& agent, int n) {
+    InjectOptions seize;
+    seize.attachMode = PtraceWrapper::ATTACH_SEIZE;
+    InjectOptions memfd = seize;
+    memfd.memfdDelivery = true;
+    InjectOptions thread = seize;
+    thread.spawnThread = true;
+    InjectOptions resident = seize;
+    resident.agentPath = agent;
+
+    const struct {
+        const char*   name;
+        InjectOptions options;
+    } variants[] = {
+        { "inject legacy", InjectOptions() },
+        { "inject seize",  seize },
+        { "inject memfd",  memfd },
+        { "inject thread", thread },
+        // the first one loads the agent, the rest go through it
+        { "inject agent",  resident },
+    };
+    for (const auto& variant : variants) {
+        if (!variant.options.agentPath.empty() && ::access(agent.c_str(), R_OK) != 0) {
+            continue;
+        }
+        // a tracee of each, the agent stays once it's in
+        Tracee target;
+        if (!spawnTracee(tracee, &target)) {
+            return;
+        }
+        SymbolCache cache;
+        StatsAggregator warmup;
+        StatsAggregator aggregator;
+        inject(target, payload, variant.options, 1, &cache, &warmup);
+        inject(target, payload, variant.options, n, &cache, &aggregator);
+        reportInjections(variant.name, aggregator);
+        killTracee(target);
+    }
+}
+
+/*
+ * what the tracee is made of, to tell what it's left with afterwards
+ */
+struct Footprint {
+    // (start, end, prot) of each mapping
+    std::set<std::tuple<uintptr_t, uintptr_t, int>> regions;
+    size_t fds;
+    size_t threads;
+};
+
+static size_t countEntries(const std::string& dir) {
+    size_t count = 0;
+    DIR* dp = ::opendir(dir.c_str());
+    if (dp) {
+        while (struct dirent* entry = ::readdir(dp)) {
+            count += entry->d_name[0] != '.';
+        }
+        ::closedir(dp);
+    }
+    return count;
+}
+
+static bool takeFootprint(pid_t pid, Footprint* outFootprint, MapsSnapshot* outMaps) {
+    if (!outMaps->load(pid)) {
+        return false;
+    }
+    outFootprint->regions.clear();
+    for (const MapsSnapshot::Region& region : outMaps->regions()) {
+        outFootprint->regions.emplace(region.start, region.end, region.prot);
+    }
+    std::string proc = "/proc/" + std::to_string(pid);
+    outFootprint->fds = countEntries(proc + "/fd");
+    outFootprint->threads = countEntries(proc + "/task");
+    return true;
+}
+
+static int soak(const std::string& tracee, const std::string& payload, const InjectOptions& options, int n) {
+    Tracee target;
+    if (!spawnTracee(tracee, &target)) {
+        return 1;
+    }
+    SymbolCache cache;
+    StatsAggregator aggregator;
+    // the payload loaded for good by the first one
+    inject(target, payload, options, 1, &cache, &aggregator);
+
+    Footprint before;
+    Footprint after;
+    MapsSnapshot beforeMaps;
+    MapsSnapshot afterMaps;
+    bool ok = takeFootprint(target.pid, &before, &beforeMaps);
+    int step = std::max(n / 10, 1);
+    for (int i = 0; ok && i < n; i += step) {
+        inject(target, payload, options, std::min(step, n - i), &cache, &aggregator);
+        ok &= takeFootprint(target.pid, &after, &afterMaps);
+        LOGGER_LOGI("[-] %d/%d injected, %zu mappings, %zu fds, %zu threads\n", std::min(i + step, n), n,
+            after.regions.size(), after.fds, after.threads);
+    }
+    killTracee(target);
+    if (!ok) {
+        LOGGER_LOGE("[!] tracee is gone\n");
+        return 1;
+    }
+
+    reportInjections("soak", aggregator);
+    size_t leaked = 0;
+    for (const MapsSnapshot::Region& region : afterMaps.regions()) {
+        if (!before.regions.count(std::make_tuple(region.start, region.end, region.prot))) {
+            const char* path = region.path != MapsSnapshot::NO_PATH ? afterMaps.pathOf(region) : "";
+            LOGGER_LOGE("[!] new mapping 0x%zx-0x%zx prot %d %s\n", region.start, region.end, region.prot, path);
+            ++ leaked;
+        }
+    }
+    LOGGER_LOGI("[>] %zu mappings new, fds %zu => %zu, threads %zu => %zu\n", leaked,
+        before.fds, after.fds, before.threads, after.threads);
+    return leaked || after.fds != before.fds || after.threads != before.threads ? 2 : 0;
+}
+
+static void help() {
+    LOGGER_LOGI("usage: adrill-bench [options] [attach|call|memory|symbol|inject ...]\n");
+    LOGGER_LOGI("\n");
+    LOGGER_LOGI("   all of the benchmarks unless some are named.\n");
+    LOGGER_LOGI("\n");
+    LOGGER_LOGI("   options:\n");
+    LOGGER_LOGI("      --iterations  samples of each figure, 200 by default.\n");
+    LOGGER_LOGI("      --soak        inject <n> times into one tracee instead, then check it for\n");
+    LOGGER_LOGI("                    mappings, fds or threads left behind. exits with 2 if any.\n");
+    LOGGER_LOGI("      --seize       soak with PTRACE_SEIZE rather than PTRACE_ATTACH.\n");
+    LOGGER_LOGI("      --memfd       soak with the library delivered through a memfd.\n");
+    LOGGER_LOGI("      --thread      soak with dlopen on a thread spawned in tracee.\n");
+    LOGGER_LOGI("      --tracee      the tracee, '" BENCH_TRACEE_NAME "' next to adrill-bench by default.\n");
+    LOGGER_LOGI("      --payload     the library injected, '" BENCH_PAYLOAD_NAME "' by default.\n");
+    LOGGER_LOGI("      --agent       the agent, '" BENCH_AGENT_NAME "' by default, skipped if missing.\n");
+    LOGGER_LOGI("      --verbose     keep the log of adrill.\n");
+}
+
+int main(int argc, char* argv[]) {
+    // next to ourselves
+    char self[PATH_MAX] = {0};
+    ssize_t len = ::readlink("/proc/self/exe", self, sizeof(self) - 1);
+    std::string dir = len > 0 ? std::string(self, len) : std::string(argv[0]);
+    dir = dir.substr(0, dir.find_last_of('/') + 1);
+    std::string tracee = dir + BENCH_TRACEE_NAME;
+    std::string payload = dir + BENCH_PAYLOAD_NAME;
+    std::string agent = dir + BENCH_AGENT_NAME;
+
+    int iterations = 200;
+    int soakCount = 0;
+    InjectOptions soakOptions;
+    std::vector<std::string> suites;
+    for (int i = 1; i < argc; ++ i) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--iterations" && hasValue) {
+            iterations = std::max(::atoi(argv[++ i]), 1);
+        } else if (arg == "--soak" && hasValue) {
+            soakCount = std::max(::atoi(argv[++ i]), 1);
+        } else if (arg == "--seize") {
+            soakOptions.attachMode = PtraceWrapper::ATTACH_SEIZE;
+        } else if (arg == "--memfd") {
+            soakOptions.memfdDelivery = true;
+        } else if (arg == "--thread") {
+            soakOptions.spawnThread = true;
+        } else if (arg == "--tracee" && hasValue) {
+            tracee = argv[++ i];
+        } else if (arg == "--payload" && hasValue) {
+            payload = argv[++ i];
+        } else if (arg == "--agent" && hasValue) {
+            agent = argv[++ i];
+        } else if (arg == "--verbose") {
+            sVerbose = true;
+        } else if (arg == "attach" || arg == "call" || arg == "memory" || arg == "symbol" || arg == "inject") {
+            suites.push_back(arg);
+        } else {
+            help();
+            return 1;
+        }
+    }
+    // nothing to be kept across runs on host
+    soakOptions.symbolCachePath.clear();
+
+    if (soakCount) {
+        return soak(tracee, payload, soakOptions, soakCount);
+    }
+
+    auto selected = [&suites](const char* suite) {
+        return suites.empty() || std::find(suites.begin(), suites.end(), suite) != suites.end();
+    };
+    Tracee target;
+    if (!spawnTracee(tracee, &target)) {
+        return 1;
+    }
+    if (selected("attach")) {
+        benchAttach(target, iterations);
+    }
+    if (selected("call")) {
+        benchCall(target, iterations);
+    }
+    if (selected("memory")) {
+        benchMemory(target, iterations);
+    }
+    if (selected("symbol")) {
+        benchSymbol(target, iterations);
+    }
+    killTracee(target);
+    if (selected("inject")) {
+        benchInject(tracee, payload, agent, iterations);
+    }
+    return 0;
+}
@@ -0,0 +1,21 @@
+/*
+ * Copyright (c) 2020, Irvin Pang <halo.irvin@gmail.com>
+ * All rights reserved.
+ *
+ * see LICENSE file for details
+ */
+
+#ifndef __ADRILL_BENCH_H__
+#define __ADRILL_BENCH_H__
+
+// what adrill-bench looks for next to itself
+#define BENCH_TRACEE_NAME  "adrill-bench-tracee"
+#define BENCH_PAYLOAD_NAME "libadrill-bench-payload.so"
+#define BENCH_AGENT_NAME   "libadrill-agent.so"
+
+// buffer of the tracee, the largest transfer measured fits in
+#define BENCH_BUFFER_SIZE  (4 * 1024 * 1024)
+// the main thread of the tracee sleeps this long between ticks
+#define BENCH_TICK_US      1000
+
+#endif // __ADRILL_BENCH_H__
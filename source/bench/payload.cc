@@ -0,0 +1,15 @@
+/*
+ * Copyright (c) 2020, Irvin Pang <halo.irvin@gmail.com>
+ * All rights reserved.
+ *
+ * see LICENSE file for details
+ */
+
+/*
+ * the library adrill-bench injects, as small as one gets, so what's
+ * measured is adrill rather than the loading of it
+ */
+
+extern "C" int adrill_bench_payload() {
+    return 0;
+}
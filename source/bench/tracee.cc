@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2020, Irvin Pang <halo.irvin@gmail.com>
+ * All rights reserved.
+ *
+ * see LICENSE file for details
+ */
+
+/*
+ * the dummy tracee of adrill-bench. it tells the address of a buffer to
+ * read & write on its first line of stdout, then its main thread ticks in
+ * short sleeps, the way an app waiting for events does, until killed or
+ * its parent is gone
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+
+#include "bench.h"
+
+int main() {
+    ::prctl(PR_SET_PDEATHSIG, SIGKILL);
+    void* buffer = ::mmap(nullptr, BENCH_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer == MAP_FAILED) {
+        return 1;
+    }
+    // pages present already, faults are not what's measured
+    ::memset(buffer, 0x5a, BENCH_BUFFER_SIZE);
+    ::printf("%p\n", buffer);
+    ::fflush(stdout);
+
+    while (true) {
+        ::usleep(BENCH_TICK_US);
+    }
+    return 0;
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2020, Irvin Pang <halo.irvin@gmail.com>
+ * All rights reserved.
+ *
+ * see LICENSE file for details
+ */
+
+#ifndef __ADRILL_CALL_PROCEDURE_INL_H__
+#define __ADRILL_CALL_PROCEDURE_INL_H__
+
+#include <string.h>
+#include <type_traits>
+
+#include "call_procedure.h"
+
+template<typename T>
+inline RemoteArg makeRemoteArg(T value) {
+    if constexpr (std::is_same<T, float>::value) {
+        uint32_t bits;
+        ::memcpy(&bits, &value, sizeof(bits));
+        return { RemoteArg::FLOAT, bits };
+    } else if constexpr (std::is_floating_point<T>::value) {
+        static_assert(sizeof(T) == sizeof(double), "long double is not supported in remote calls");
+        uint64_t bits;
+        ::memcpy(&bits, &value, sizeof(bits));
+        return { RemoteArg::DOUBLE, bits };
+    } else if constexpr (std::is_null_pointer<T>::value) {
+        return { RemoteArg::WORD, 0 };
+    } else if constexpr (std::is_pointer<T>::value) {
+        return { RemoteArg::WORD, (uint64_t)(uintptr_t)value };
+    } else {
+        static_assert(std::is_integral<T>::value || std::is_enum<T>::value, "remote call arguments must be scalars");
+        // extended the way it would be seen in a full register
+        return { sizeof(T) > PT_SIZE ? RemoteArg::DWORD : RemoteArg::WORD, (uint64_t)(int64_t)value };
+    }
+}
+
+template<typename... Args>
+bool CallProcedure::remoteCall(uintptr_t remoteAddr, Args... args) {
+    static_assert(sizeof...(Args) <= MAX_CALL_ARGS, "too many arguments for a remote call");
+    // one more slot, so that an empty list still makes an array
+    const RemoteArg argv[sizeof...(Args) + 1] = { makeRemoteArg(args)... };
+    return this->_remoteCall(remoteAddr, 0, argv, sizeof...(Args));
+}
+
+template<typename... Args>
+bool CallProcedure::remoteCallStruct(uintptr_t remoteAddr, uintptr_t resultAddr, Args... args) {
+    static_assert(sizeof...(Args) < MAX_CALL_ARGS, "too many arguments for a remote call");
+    const RemoteArg argv[sizeof...(Args) + 1] = { makeRemoteArg(args)... };
+    return this->_remoteCall(remoteAddr, resultAddr, argv, sizeof...(Args));
+}
+
+template<typename R>
+R CallProcedure::returnValue() {
+    if constexpr (std::is_same<R, float>::value) {
+        uint32_t bits = (uint32_t)this->_fpReturnBits(RemoteArg::FLOAT);
+        float value;
+        ::memcpy(&value, &bits, sizeof(value));
+        return value;
+    } else if constexpr (std::is_floating_point<R>::value) {
+        static_assert(sizeof(R) == sizeof(double), "long double is not supported in remote calls");
+        uint64_t bits = this->_fpReturnBits(RemoteArg::DOUBLE);
+        double value;
+        ::memcpy(&value, &bits, sizeof(value));
+        return value;
+    } else if constexpr (std::is_pointer<R>::value) {
+        return (R)(uintptr_t)this->_returnBits(RemoteArg::WORD);
+    } else {
+        static_assert(std::is_integral<R>::value || std::is_enum<R>::value, "remote call results must be scalars");
+        return (R)this->_returnBits(sizeof(R) > PT_SIZE ? RemoteArg::DWORD : RemoteArg::WORD);
+    }
+}
+
+#endif // __ADRILL_CALL_PROCEDURE_INL_H__
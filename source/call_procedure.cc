@@ -5,35 +5,176 @@
  * see LICENSE file for details
  */
 
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/auxv.h>
+#include <sys/wait.h>
+#include <algorithm>
+
 #include "macros.h"
+#include "clock.h"
+#include "stub_writer.h"
 #include "call_procedure.h"
 
-// magic
-intptr_t CallProcedure::ARG_END = (intptr_t)0xca1111ca;
+CallChain::CallChain()
+: _count(0)
+, _tail(false)
+, _tailReturn(0) {
+}
+
+CallChain::Arg CallChain::resultOf(int index) {
+    Arg arg;
+    arg.fromCall = index;
+    return arg;
+}
+
+int CallChain::add(uintptr_t remoteAddr, std::initializer_list<Arg> args) {
+    return this->_append(remoteAddr, false, false, args);
+}
+
+int CallChain::addTail(uintptr_t remoteAddr, std::initializer_list<Arg> args, uintptr_t returnAddr) {
+    int index = this->_append(remoteAddr, false, true, args);
+    if (index >= 0) {
+        this->_tailReturn = returnAddr;
+    }
+    return index;
+}
+
+int CallChain::addSyscall(long nr, std::initializer_list<Arg> args) {
+    return this->_append((uintptr_t)nr, true, false, args);
+}
+
+int CallChain::addTailSyscall(long nr, std::initializer_list<Arg> args) {
+    return this->_append((uintptr_t)nr, true, true, args);
+}
+
+int CallChain::_append(uintptr_t remoteAddr, bool syscall, bool tail, std::initializer_list<Arg> args) {
+    // nothing could be appended after the tail step
+    size_t maxArgs = syscall ? MAX_SYSCALL_ARGS : MAX_CHAIN_ARGS;
+    if (this->_tail || this->_count >= MAX_CHAIN_CALLS || args.size() > maxArgs) {
+        return -1;
+    }
+    // results could only be forwarded from former calls
+    for (const Arg& arg : args) {
+        if (arg.fromCall >= (int)this->_count) {
+            return -1;
+        }
+    }
+    Call& call = this->_calls[this->_count];
+    call.remoteAddr = remoteAddr;
+    call.syscall = syscall;
+    call.argn = 0;
+    for (const Arg& arg : args) {
+        call.args[call.argn ++] = arg;
+    }
+    this->_tail = tail;
+    return (int)this->_count ++;
+}
+
+size_t CallChain::size() const {
+    return this->_count;
+}
+
+bool CallChain::hasTail() const {
+    return this->_tail;
+}
+
+uintptr_t CallChain::tailReturn() const {
+    return this->_tailReturn;
+}
+
+const CallChain::Call& CallChain::call(size_t index) const {
+    return this->_calls[index];
+}
 
 CallProcedure::CallProcedure(PtraceWrapper* ptraceWrapper)
-: _ptraceWrapper(ptraceWrapper) {
+: _ptraceWrapper(ptraceWrapper)
+, _syscallInsn(0)
+, _returnAddr(0)
+, _returnPc(0)
+, _callStack(0)
+, _leftSp(0)
+, _liveSp(0)
+, _syscallNr(0)
+, _syscallEntered(false)
+, _chainSize(0)
+, _chainTail(false)
+, _chainResultsAddr(0)
+, _chainTrapAddr(0)
+, _chainTailAddr(0)
+, _stats()
+, _beginNs(0)
+, _fpSaved(false)
+, _fpResults() {
+}
+
+bool CallProcedure::setReturnTrap(uintptr_t trapAddr) {
+    if (!trapAddr) {
+        this->_returnAddr = 0;
+        this->_returnPc = 0;
+        return true;
+    }
+    uint8_t code[0x10];
+    StubWriter writer(code, sizeof(code));
+    uintptr_t trapPc = this->_emitTrap(writer, trapAddr);
+    bool ok = this->_ptraceWrapper->writeText((void*)trapAddr, code, writer.size());
+    if (ok) {
+        this->_returnAddr = trapAddr;
+        this->_returnPc = trapPc;
+    } else {
+        LOGGER_LOGE("CallProcedure::setReturnTrap failed to write trap to 0x%zx\n", trapAddr);
+    }
+    return ok;
+}
+
+uintptr_t CallProcedure::returnTrap() const {
+    return this->_returnAddr;
+}
+
+void CallProcedure::setCallStack(uintptr_t stackTop) {
+    this->_callStack = stackTop;
+}
+
+uintptr_t CallProcedure::callStack() const {
+    return this->_callStack;
 }
 
-bool CallProcedure::remoteCall(uintptr_t remoteAddr, ...) {
-    // fill the arguments list
-    ::va_list args;
-    ::va_start(args, remoteAddr);
-    std::vector<intptr_t> vargs;
-    for (intptr_t p = CallProcedure::ARG_END; (p = va_arg(args, intptr_t)) != CallProcedure::ARG_END;) {
-        vargs.push_back(p);
+bool CallProcedure::_remoteCall(uintptr_t remoteAddr, uintptr_t resultAddr, const RemoteArg* args, size_t argn) {
+    int64_t beginNs = monotonicNs();
+    // fp arguments go into the fp registers of tracee, and a float result
+    // is pushed onto the x87 stack on x86. either way the fp state is saved
+    // to be put back after the call, nothing else touches it
+#if $is($arch_x86)
+    bool saveFp = true;
+#else
+    bool saveFp = false;
+#endif
+    for (size_t i = 0; i < argn; ++ i) {
+        saveFp |= args[i].kind == RemoteArg::FLOAT || args[i].kind == RemoteArg::DOUBLE;
     }
-    ::va_end(args);
-    
+    this->_fpSaved = false;
+    bool stopped = true;
     bool ok = true;
     do {
         // first of all. backup the registers from tracee
         ok &= this->_ptraceWrapper->getRegisters(&this->_curRegs);
         BREAK_IF_WITH_LOGE(!ok, "CallProcedure::remoteCall failed to save registers through ptrace\n");
+
+        if (saveFp) {
+            ok &= this->_ptraceWrapper->getFpState(&this->_fpState);
+            BREAK_IF_WITH_LOGE(!ok, "CallProcedure::remoteCall failed to save fp registers through ptrace\n");
+            this->_fpSaved = true;
+        }
+
+        // leave the live stack of tracee alone if there's a dedicated one
+        uintptr_t liveSp = this->_liveStackPointer();
+        this->_setStackPointer(this->_callStack ? this->_callStack : liveSp);
         
         // setup call procedure according to different archs.
         // registers would be modified here
-        ok &= this->_setupCall(remoteAddr, vargs);
+        ok &= this->_setupCall(remoteAddr, resultAddr, args, argn);
         BREAK_IF_WITH_LOGE(!ok, "CallProcedure::remoteCall failed to setup call procedure\n");
         
         // set modified registers to tracee
@@ -43,19 +184,274 @@ bool CallProcedure::remoteCall(uintptr_t remoteAddr, ...) {
         // continue running
         ok &= this->_ptraceWrapper->kontinue();
         BREAK_IF_WITH_LOGE(!ok, "CallProcedure::remoteCall failed to continue ptracee\n");
+        stopped = false;
         
-        // tracee should be stopped with signal SIGSEGV by now
-        // just as what we excepted in _setupCall
-        ok &= this->_ptraceWrapper->waitForSignal(SIGSEGV);
-        BREAK_IF_WITH_LOGE(!ok, "CallProcedure::remoteCall failed to wait for SIGSEGV\n");
+        // tracee should be stopped with SIGTRAP or SIGSEGV by now, just as
+        // what we excepted in _setupCall. faults are waited as well, for
+        // a crashed callee would crash again and again if resumed
+        ok &= this->_ptraceWrapper->waitForSignals({ SIGTRAP, SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT });
+        BREAK_IF_WITH_LOGE(!ok, "CallProcedure::remoteCall failed to wait for the call to return\n");
+        stopped = true;
         
         // now we could get the function call return value from registers
         ok &= this->_ptraceWrapper->getRegisters(&this->_curRegs);
         BREAK_IF_WITH_LOGE(!ok, "CallProcedure::remoteCall failed to get registers through ptrace\n");
+        this->_leftSp = this->_stackPointer();
         
         // check call procedure
         ok &= this->_checkCall();
         BREAK_IF_WITH_LOGE(!ok, "CallProcedure::remoteCall failed to check call status\n");
     } while (false);
+    if (this->_fpSaved && stopped) {
+        // the result first, then the fp state as it was before the call
+        this->_fpResults[0] = this->_returnBits(RemoteArg::FLOAT);
+        this->_fpResults[1] = this->_returnBits(RemoteArg::DOUBLE);
+        ok &= this->_ptraceWrapper->setFpState(this->_fpState);
+    }
+    ++ this->_stats.calls;
+    this->_stats.ns += monotonicNs() - beginNs;
+    return ok;
+}
+
+bool CallProcedure::remoteCallChain(const CallChain& chain, uintptr_t stubAddr, size_t stubCapacity) {
+    return this->_ptraceWrapper->complete(this->beginRemoteCallChain(chain, stubAddr, stubCapacity), [this]() {
+        return this->continueRemoteCallChain();
+    });
+}
+
+bool CallProcedure::beginRemoteCallChain(const CallChain& chain, uintptr_t stubAddr, size_t stubCapacity) {
+    ::memset(this->_chainResults, 0, sizeof(this->_chainResults));
+    this->_fpSaved = false;
+    this->_beginNs = monotonicNs();
+    bool ok = true;
+    do {
+        ok &= chain.size() > 0;
+        BREAK_IF_WITH_LOGE(!ok, "CallProcedure::remoteCallChain empty chain\n");
+
+        ok &= this->_ptraceWrapper->getRegisters(&this->_curRegs);
+        BREAK_IF_WITH_LOGE(!ok, "CallProcedure::remoteCallChain failed to save registers through ptrace\n");
+
+        // results are kept on the stack of tracee rather than in the scratch
+        // or on the call stack, so they're still there after a tail step
+        // releases them. the stub switches to the call stack by itself
+        size_t resultsSize = chain.size() * PT_SIZE;
+        uintptr_t resultsAddr = 0;
+        this->_setStackPointer(this->_liveStackPointer());
+        ok &= this->_setupStub(stubAddr, resultsSize, &resultsAddr);
+        BREAK_IF_WITH_LOGE(!ok, "CallProcedure::remoteCallChain failed to setup stub\n");
+
+        uint8_t code[MAX_CHAIN_STUB_SIZE];
+        uintptr_t trapAddr = 0;
+        uintptr_t tailAddr = 0;
+        size_t codeSize = this->_emitChain(chain, stubAddr, resultsAddr, this->_callStack, code, std::min(sizeof(code), stubCapacity), &trapAddr, &tailAddr);
+        ok &= codeSize > 0;
+        BREAK_IF_WITH_LOGE(!ok, "CallProcedure::remoteCallChain stub of %zu calls doesn't fit in %zu bytes\n", chain.size(), stubCapacity);
+
+        // clear the results, a call crashed halfway leaves the rest as zero
+        ok &= this->_ptraceWrapper->writeMemory((void*)resultsAddr, this->_chainResults, resultsSize) == resultsSize;
+        BREAK_IF_WITH_LOGE(!ok, "CallProcedure::remoteCallChain failed to clear results at 0x%zx\n", resultsAddr);
+
+        ok &= this->_ptraceWrapper->writeText((void*)stubAddr, code, codeSize);
+        BREAK_IF_WITH_LOGE(!ok, "CallProcedure::remoteCallChain failed to write stub to 0x%zx\n", stubAddr);
+
+        ok &= this->_ptraceWrapper->setRegisters(this->_curRegs);
+        BREAK_IF_WITH_LOGE(!ok, "CallProcedure::remoteCallChain failed to setup registers through ptrace\n");
+
+        ok &= this->_ptraceWrapper->kontinue();
+        BREAK_IF_WITH_LOGE(!ok, "CallProcedure::remoteCallChain failed to continue ptracee\n");
+
+        // the stub ends with a trap, or a tail step faulting on purpose.
+        // faults are waited as well, resuming a crashed call just crashes again
+        this->_ptraceWrapper->expectSignals({ SIGTRAP, SIGSEGV, SIGBUS, SIGILL });
+        this->_chainSize = chain.size();
+        this->_chainTail = chain.hasTail();
+        this->_chainResultsAddr = resultsAddr;
+        this->_chainTrapAddr = trapAddr;
+        this->_chainTailAddr = tailAddr;
+    } while (false);
     return ok;
-}
\ No newline at end of file
+}
+
+bool CallProcedure::writeThreadChain(const CallChain& chain, uintptr_t stubAddr, size_t stubCapacity, uintptr_t resultsAddr) {
+    bool ok = true;
+    do {
+        ok &= chain.hasTail() && !chain.call(chain.size() - 1).syscall;
+        BREAK_IF_WITH_LOGE(!ok, "CallProcedure::writeThreadChain chain must end with a tail function call\n");
+
+        // no call stack, the thread runs it on its own
+        uint8_t code[MAX_CHAIN_STUB_SIZE];
+        uintptr_t trapAddr = 0;
+        uintptr_t tailAddr = 0;
+        size_t codeSize = this->_emitChain(chain, stubAddr, resultsAddr, 0, code, std::min(sizeof(code), stubCapacity), &trapAddr, &tailAddr);
+        ok &= codeSize > 0;
+        BREAK_IF_WITH_LOGE(!ok, "CallProcedure::writeThreadChain stub of %zu calls doesn't fit in %zu bytes\n", chain.size(), stubCapacity);
+
+        intptr_t results[MAX_CHAIN_CALLS];
+        std::fill(results, results + chain.size(), CHAIN_RESULT_PENDING);
+        size_t resultsSize = chain.size() * PT_SIZE;
+        ok &= this->_ptraceWrapper->writeMemory((void*)resultsAddr, results, resultsSize) == resultsSize;
+        BREAK_IF_WITH_LOGE(!ok, "CallProcedure::writeThreadChain failed to clear results at 0x%zx\n", resultsAddr);
+
+        ok &= this->_ptraceWrapper->writeText((void*)stubAddr, code, codeSize);
+        BREAK_IF_WITH_LOGE(!ok, "CallProcedure::writeThreadChain failed to write stub to 0x%zx\n", stubAddr);
+    } while (false);
+    return ok;
+}
+
+PtraceWrapper::WaitResult CallProcedure::continueRemoteCallChain() {
+    size_t resultsSize = this->_chainSize * PT_SIZE;
+    bool ok = true;
+    do {
+        ok &= this->_ptraceWrapper->getRegisters(&this->_curRegs);
+        BREAK_IF_WITH_LOGE(!ok, "CallProcedure::remoteCallChain failed to get registers through ptrace\n");
+
+        this->_leftSp = this->_stackPointer();
+        int signal = WSTOPSIG(this->_ptraceWrapper->lastStatus());
+        uintptr_t pc = this->_programCounter();
+        ok &= (signal == SIGTRAP && pc == this->_chainTrapAddr) || (this->_chainTail && signal == SIGSEGV && pc == this->_chainTailAddr);
+        BREAK_IF_WITH_LOGE(!ok, "CallProcedure::remoteCallChain stub stopped by signal %d at 0x%zx\n", signal, this->_programCounter());
+
+        ok &= this->_ptraceWrapper->readMemory(this->_chainResults, (const void*)this->_chainResultsAddr, resultsSize) == resultsSize;
+        BREAK_IF_WITH_LOGE(!ok, "CallProcedure::remoteCallChain failed to read results from 0x%zx\n", this->_chainResultsAddr);
+
+        // the tail step returns to nowhere, its result is still in register
+        if (this->_chainTail) {
+            this->_chainResults[this->_chainSize - 1] = this->returnValue();
+        }
+    } while (false);
+    ++ this->_stats.chains;
+    this->_stats.ns += monotonicNs() - this->_beginNs;
+    return ok ? PtraceWrapper::WAIT_DONE : PtraceWrapper::WAIT_FAILED;
+}
+
+bool CallProcedure::_checkCall() {
+    int signal = WSTOPSIG(this->_ptraceWrapper->lastStatus());
+    uintptr_t pc = this->_programCounter();
+    // returned to the trap, or to null without any trap set
+    if (this->_returnAddr ? (signal == SIGTRAP && pc == this->_returnPc) : (signal == SIGSEGV && pc == 0)) {
+        return true;
+    }
+    siginfo_t info;
+    ::memset(&info, 0, sizeof(info));
+    this->_ptraceWrapper->getSignalInfo(&info);
+    LOGGER_LOGE("CallProcedure::remoteCall callee crashed by signal %d(code %d) at 0x%zx, fault address %p\n",
+        signal, info.si_code, pc, info.si_addr);
+    return false;
+}
+
+uintptr_t CallProcedure::_liveStackPointer() {
+    // sp of tracee stays where a former call left it, which may be on the
+    // call stack, until registers are restored
+    uintptr_t sp = this->_stackPointer();
+    if (!this->_liveSp || sp != this->_leftSp) {
+        this->_liveSp = sp;
+    }
+    return this->_liveSp;
+}
+
+uint64_t CallProcedure::_fpReturnBits(RemoteArg::Kind kind) {
+    if (this->_fpSaved) {
+        return this->_fpResults[kind == RemoteArg::FLOAT ? 0 : 1];
+    }
+    return this->_returnBits(kind);
+}
+
+const CallProcedure::Stats& CallProcedure::stats() const {
+    return this->_stats;
+}
+
+intptr_t CallProcedure::chainResult(size_t index) {
+    return index < MAX_CHAIN_CALLS ? this->_chainResults[index] : 0;
+}
+
+bool CallProcedure::_remoteSyscall(long nr, const intptr_t* args, size_t argn) {
+    return this->_ptraceWrapper->complete(this->_beginRemoteSyscall(nr, args, argn), [this]() {
+        return this->continueRemoteSyscall();
+    });
+}
+
+bool CallProcedure::_beginRemoteSyscall(long nr, const intptr_t* args, size_t argn) {
+    this->_beginNs = monotonicNs();
+    this->_fpSaved = false;
+    bool ok = true;
+    do {
+        ok &= this->_ptraceWrapper->getRegisters(&this->_curRegs);
+        BREAK_IF_WITH_LOGE(!ok, "CallProcedure::remoteSyscall failed to save registers through ptrace\n");
+
+        if (!this->_syscallInsn) {
+            this->_syscallInsn = this->_findSyscallInsn();
+        }
+        ok &= this->_syscallInsn != 0;
+        BREAK_IF_WITH_LOGE(!ok, "CallProcedure::remoteSyscall no syscall instruction found in tracee\n");
+
+        ok &= this->_setupSyscall(this->_syscallInsn, nr, args, argn);
+        BREAK_IF_WITH_LOGE(!ok, "CallProcedure::remoteSyscall failed to setup syscall %ld\n", nr);
+
+        ok &= this->_ptraceWrapper->setRegisters(this->_curRegs);
+        BREAK_IF_WITH_LOGE(!ok, "CallProcedure::remoteSyscall failed to setup registers through ptrace\n");
+
+        // stops at syscall entry, then at syscall exit right after the
+        // instruction, before anything beyond it gets executed
+        ok &= this->_ptraceWrapper->kontinueSyscall();
+        BREAK_IF_WITH_LOGE(!ok, "CallProcedure::remoteSyscall failed to resume ptracee\n");
+        this->_ptraceWrapper->expectSignals({ SIGTRAP });
+        this->_syscallNr = nr;
+        this->_syscallEntered = false;
+    } while (false);
+    return ok;
+}
+
+PtraceWrapper::WaitResult CallProcedure::continueRemoteSyscall() {
+    bool ok = true;
+    do {
+        if (!this->_syscallEntered) {
+            this->_syscallEntered = true;
+            ok &= this->_ptraceWrapper->kontinueSyscall();
+            BREAK_IF_WITH_LOGE(!ok, "CallProcedure::remoteSyscall failed to resume ptracee after syscall %ld entered\n", this->_syscallNr);
+            this->_ptraceWrapper->expectSignals({ SIGTRAP });
+            return PtraceWrapper::WAIT_PENDING;
+        }
+
+        ok &= this->_ptraceWrapper->getRegisters(&this->_curRegs);
+        BREAK_IF_WITH_LOGE(!ok, "CallProcedure::remoteSyscall failed to get registers through ptrace\n");
+    } while (false);
+    ++ this->_stats.syscalls;
+    this->_stats.ns += monotonicNs() - this->_beginNs;
+    return ok ? PtraceWrapper::WAIT_DONE : PtraceWrapper::WAIT_FAILED;
+}
+
+uintptr_t CallProcedure::_findSyscallInsn() {
+    // tracee stopped in a syscall has one right at or just before pc,
+    // depending on whether the kernel has rewound it for restarting
+    uint8_t code[0x2000];
+    uintptr_t pc = this->_programCounter() & ~(uintptr_t)0x3;
+    size_t size = this->_ptraceWrapper->readMemory(code, (const void*)(pc - 4), 8);
+    uintptr_t insnAddr = this->_scanSyscallInsn(code, size, pc - 4);
+    if (insnAddr) {
+        return insnAddr;
+    }
+
+    // otherwise the vdso always has some, for the fallback of vsyscalls
+    char path[0x40];
+    ::sprintf(path, "/proc/%d/auxv", this->_ptraceWrapper->pid());
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        LOGGER_LOGE("CallProcedure::_findSyscallInsn failed to open %s: %s\n", path, ::strerror(errno));
+        return 0;
+    }
+    uintptr_t vdso = 0;
+    uintptr_t auxv[2];
+    while (::read(fd, auxv, sizeof(auxv)) == sizeof(auxv) && auxv[0] != AT_NULL) {
+        if (auxv[0] == AT_SYSINFO_EHDR) {
+            vdso = auxv[1];
+            break;
+        }
+    }
+    ::close(fd);
+    if (vdso) {
+        // vdso takes a page or two, a short read tells where it ends
+        size = this->_ptraceWrapper->readMemory(code, (const void*)vdso, sizeof(code));
+        insnAddr = this->_scanSyscallInsn(code, size, vdso);
+    }
+    return insnAddr;
+}
@@ -10,36 +10,279 @@
 
 #include "ptrace_wrapper.h"
 
-class CallProcedure {
+class StubWriter;
+
+// limits of a call chain, it is built on the stack without any allocation
+#define MAX_CHAIN_CALLS 8
+#define MAX_CHAIN_ARGS  8
+// the largest stub a full chain could be encoded to, on any arch
+#define MAX_CHAIN_STUB_SIZE 2048
+// bytes under the stack pointer of tracee we keep untouched (x86_64 red zone)
+#define STACK_RED_ZONE 128
+// syscalls take up to 6 arguments on all supported archs
+#define MAX_SYSCALL_ARGS 6
+// arguments of a single remote call, either in registers or on the stack
+#define MAX_CALL_ARGS 16
+// results of a thread chain before it gets to them
+#define CHAIN_RESULT_PENDING ((intptr_t)-1)
+
+/*
+ * one argument of a remote call, classified for the calling convention
+ * of each arch. built from the C++ type at compile time, see makeRemoteArg
+ */
+struct RemoteArg {
+    enum Kind {
+        WORD,   // integers and pointers fitting in a general register
+        DWORD,  // 64-bit integers on 32-bit archs, taking a register pair
+        FLOAT,
+        DOUBLE,
+    };
+    Kind     kind;
+    uint64_t bits;
+};
+
+/*
+ * a sequence of remote calls, to be run by CallProcedure::remoteCallChain
+ * within a single stop of tracee
+ */
+class CallChain {
+public:
+    struct Arg {
+        Arg() : value(0), fromCall(-1) {}
+        Arg(intptr_t value) : value(value), fromCall(-1) {}
+        Arg(std::nullptr_t) : value(0), fromCall(-1) {}
+        intptr_t value;
+        // index of a former call whose return value is passed instead, or -1
+        int fromCall;
+    };
+
+    struct Call {
+        // function address, or syscall number for syscall steps
+        uintptr_t remoteAddr;
+        bool      syscall;
+        size_t    argn;
+        Arg       args[MAX_CHAIN_ARGS];
+    };
+
 public:
-    // used in performCall, indicates params' end
-    static intptr_t ARG_END;
+    CallChain();
+
+    /*
+     * argument taking the return value of call #<index>
+     */
+    static Arg resultOf(int index);
+
+    /*
+     * append a call, returns its index or -1 if the chain is full
+     */
+    int add(uintptr_t remoteAddr, std::initializer_list<Arg> args);
+
+    /*
+     * append the last call, which is jumped to with a null return address
+     * instead of returning to the stub. that's the way to call something
+     * that may release the stub itself, e.g., munmap its mapping. or it
+     * returns straight into <returnAddr>, e.g., pthread_exit of a thread
+     * whose stub is gone, which is entered the way a call enters it. the
+     * callee itself then finds the stack a word off its alignment on x86
+     * and x64, which a leaf like munmap doesn't mind
+     */
+    int addTail(uintptr_t remoteAddr, std::initializer_list<Arg> args, uintptr_t returnAddr = 0);
+
+    /*
+     * append a syscall executed by the stub itself, no libc involved.
+     * as the last step, it's allowed to unmap the stub, e.g., munmap
+     */
+    int addSyscall(long nr, std::initializer_list<Arg> args);
+    int addTailSyscall(long nr, std::initializer_list<Arg> args);
+
+    size_t size() const;
+    bool hasTail() const;
+    uintptr_t tailReturn() const;
+    const Call& call(size_t index) const;
+
+protected:
+    int _append(uintptr_t remoteAddr, bool syscall, bool tail, std::initializer_list<Arg> args);
+
+protected:
+    Call      _calls[MAX_CHAIN_CALLS];
+    size_t    _count;
+    bool      _tail;
+    uintptr_t _tailReturn;
+
+};
 
+class CallProcedure {
 public:
     /*
      * we need a attached ptrace instance
      */
     CallProcedure(PtraceWrapper* ptraceWrapper);
 
+    /*
+     * by default, remote calls return to null and end up with SIGSEGV.
+     * once a trap is set, a breakpoint instruction is written to <trapAddr>
+     * (executable, e.g., in a remote mmap'ed scratch) and calls return to it
+     * instead, which stops tracee without a page fault, and leaves no doubt
+     * between a finished call and a crashed one. 0 to return to null again
+     */
+    bool setReturnTrap(uintptr_t trapAddr);
+    uintptr_t returnTrap() const;
+
+    /*
+     * run remote calls on a dedicated stack growing down from <stackTop>
+     * rather than the live stack of tracee, which is the default(0).
+     * note that a tail function call of a chain must not release it
+     */
+    void setCallStack(uintptr_t stackTop);
+    uintptr_t callStack() const;
+
     /*
      * preform a remote function call in tracee process
-     * following with arguments
+     * following with arguments, which could be integers, pointers, enums,
+     * float or double. they're placed per calling convention of the arch.
+     * the fp state of tracee is put back once a call passing float or
+     * double returns, as well as after any call on x86, whose float result
+     * is pushed onto the x87 stack
+     */
+    template<typename... Args>
+    bool remoteCall(uintptr_t remoteAddr, Args... args);
+
+    /*
+     * call a function returning a struct in memory, for which the caller
+     * provides the room. <resultAddr> is passed the way the ABI expects
+     */
+    template<typename... Args>
+    bool remoteCallStruct(uintptr_t remoteAddr, uintptr_t resultAddr, Args... args);
+
+    /*
+     * get the return value after remote call, as the function returns
+     */
+    template<typename R = intptr_t>
+    R returnValue();
+
+    /*
+     * execute syscall <nr> in tracee, through a syscall instruction found
+     * around where tracee stopped or in its vdso, so nothing needs to be
+     * resolved from libc. returnValue() tells the raw result afterwards,
+     * -errno on failure
+     */
+    template<typename... Args>
+    bool remoteSyscall(long nr, Args... args) {
+        static_assert(sizeof...(Args) <= MAX_SYSCALL_ARGS, "too many syscall arguments");
+        const intptr_t argv[MAX_SYSCALL_ARGS] = { (intptr_t)args... };
+        return this->_remoteSyscall(nr, argv, sizeof...(Args));
+    }
+
+    /*
+     * run all calls of <chain> with one resume of tracee. a small stub is
+     * written to <stubAddr>, which must be executable and have <stubCapacity>
+     * bytes room, so it's usually a part of a remote mmap'ed scratch
+     */
+    bool remoteCallChain(const CallChain& chain, uintptr_t stubAddr, size_t stubCapacity);
+
+    /*
+     * write <chain> to <stubAddr> for a thread of tracee to run on its own
+     * stack, e.g., as the start routine of a remote pthread_create, with no
+     * ptrace stop involved. results are stored to <resultsAddr> and read
+     * CHAIN_RESULT_PENDING until then. there's no trap to end with, so the
+     * chain must end with a tail call never returning, e.g., pthread_exit
      */
-    bool remoteCall(uintptr_t remoteAddr, ...);
+    bool writeThreadChain(const CallChain& chain, uintptr_t stubAddr, size_t stubCapacity, uintptr_t resultsAddr);
 
     /*
-     * get the return value after remote call
+     * remote calls, syscalls and chains run so far, and the time they took
+     * from being set up to having the result back
      */
-    intptr_t returnValue();
+    struct Stats {
+        uint32_t calls;
+        uint32_t syscalls;
+        uint32_t chains;
+        int64_t  ns;
+    };
+    const Stats& stats() const;
+
+    /*
+     * get the return value of call #<index> after remote call chain
+     */
+    intptr_t chainResult(size_t index);
+
+    /*
+     * non-blocking halves of remoteSyscall and remoteCallChain, for a tracer
+     * driving many tracees from one loop. begin* resumes tracee towards the
+     * stop expected, then continue* takes over on every stop reported by
+     * PtraceWrapper::onStatus, until it's no longer WAIT_PENDING
+     */
+    template<typename... Args>
+    bool beginRemoteSyscall(long nr, Args... args) {
+        static_assert(sizeof...(Args) <= MAX_SYSCALL_ARGS, "too many syscall arguments");
+        const intptr_t argv[MAX_SYSCALL_ARGS] = { (intptr_t)args... };
+        return this->_beginRemoteSyscall(nr, argv, sizeof...(Args));
+    }
+    PtraceWrapper::WaitResult continueRemoteSyscall();
+    bool beginRemoteCallChain(const CallChain& chain, uintptr_t stubAddr, size_t stubCapacity);
+    PtraceWrapper::WaitResult continueRemoteCallChain();
 
 protected:
-    bool _setupCall(uintptr_t remoteAddr, const std::vector<intptr_t>& args);
+    bool _remoteCall(uintptr_t remoteAddr, uintptr_t resultAddr, const RemoteArg* args, size_t argn);
+    bool _setupCall(uintptr_t remoteAddr, uintptr_t resultAddr, const RemoteArg* args, size_t argn);
+    // tells whether the stop after a call means it has returned
     bool _checkCall();
+    // emit the breakpoint instruction at <trapAddr>, returns pc when it traps
+    uintptr_t _emitTrap(StubWriter& writer, uintptr_t trapAddr);
+    // raw bits of the return value in the register(s) of <kind>
+    uint64_t _returnBits(RemoteArg::Kind kind);
+    // float/double result of the last call, kept if the fp state is put back
+    uint64_t _fpReturnBits(RemoteArg::Kind kind);
+    // reserve <reserve> bytes on the stack of tracee and point pc to the stub
+    bool _setupStub(uintptr_t stubAddr, size_t reserve, uintptr_t* outReserved);
+    // encode <chain> to <code>, returns the code size or 0 if it doesn't fit.
+    // <outTrapAddr> is where pc would be once the stub is done, <outTailAddr>
+    // is where it faults if the tail step returned to null or unmapped the stub
+    size_t _emitChain(const CallChain& chain, uintptr_t stubAddr, uintptr_t resultsAddr, uintptr_t stackTop,
+        uint8_t* code, size_t capacity, uintptr_t* outTrapAddr, uintptr_t* outTailAddr);
+    uintptr_t _programCounter();
+    uintptr_t _stackPointer();
+    void _setStackPointer(uintptr_t sp);
+    // stack pointer of tracee itself, even if it's left on the call stack
+    uintptr_t _liveStackPointer();
+    bool _remoteSyscall(long nr, const intptr_t* args, size_t argn);
+    bool _beginRemoteSyscall(long nr, const intptr_t* args, size_t argn);
+    // address of a syscall instruction in tracee, with LSB set for Thumb
+    uintptr_t _findSyscallInsn();
+    // scan <code> copied from <remoteAddr> for a syscall instruction
+    uintptr_t _scanSyscallInsn(const uint8_t* code, size_t size, uintptr_t remoteAddr);
+    bool _setupSyscall(uintptr_t insnAddr, long nr, const intptr_t* args, size_t argn);
 
 protected:
     PtraceWrapper* _ptraceWrapper;
     PtraceRegs _curRegs;
+    intptr_t   _chainResults[MAX_CHAIN_CALLS];
+    uintptr_t  _syscallInsn;
+    // return address of remote calls, and pc once tracee traps there
+    uintptr_t  _returnAddr;
+    uintptr_t  _returnPc;
+    uintptr_t  _callStack;
+    // where the last call left sp, and the live one before it
+    uintptr_t  _leftSp;
+    uintptr_t  _liveSp;
+    // the syscall or the chain in progress, between begin* and continue*
+    long       _syscallNr;
+    bool       _syscallEntered;
+    size_t     _chainSize;
+    bool       _chainTail;
+    uintptr_t  _chainResultsAddr;
+    uintptr_t  _chainTrapAddr;
+    uintptr_t  _chainTailAddr;
+    Stats      _stats;
+    // when the remote call in progress was set up
+    int64_t    _beginNs;
+    // fp state of tracee before the last call, and its float/double result
+    PtraceFpState _fpState;
+    bool       _fpSaved;
+    uint64_t   _fpResults[2];
 
 };
 
+#include "call_procedure-inl.h"
+
 #endif // __ADRILL_CALL_PROCEDURE_H__
@@ -0,0 +1,34 @@
+/*
+ * Copyright (c) 2020, Irvin Pang <halo.irvin@gmail.com>
+ * All rights reserved.
+ *
+ * see LICENSE file for details
+ */
+
+#ifndef __ADRILL_CLOCK_H__
+#define __ADRILL_CLOCK_H__
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * reading of <clock> in nanoseconds
+ */
+inline int64_t clockNs(clockid_t clock) {
+    struct timespec ts;
+    ::clock_gettime(clock, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * CLOCK_MONOTONIC, which all the timings and deadlines go by
+ */
+inline int64_t monotonicNs() {
+    return clockNs(CLOCK_MONOTONIC);
+}
+
+inline int64_t monotonicMs() {
+    return monotonicNs() / 1000000;
+}
+
+#endif // __ADRILL_CLOCK_H__
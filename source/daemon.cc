@@ -0,0 +1,498 @@
+/*
+ * Copyright (c) 2020, Irvin Pang <halo.irvin@gmail.com>
+ * All rights reserved.
+ *
+ * see LICENSE file for details
+ */
+
+#include <poll.h>
+#include <time.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/socket.h>
+#include <sstream>
+#include <algorithm>
+#include <vector>
+
+#include "macros.h"
+#include "clock.h"
+#include "sdk_code.h"
+#include "process_scanner.h"
+#include "agent_client.h"
+#include "daemon.h"
+
+static std::string jsonEscape(const std::string& text) {
+    std::string escaped;
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+            escaped += c;
+        } else if ((unsigned char)c < 0x20) {
+            char code[8];
+            ::snprintf(code, sizeof(code), "\\u%04x", c);
+            escaped += code;
+        } else {
+            escaped += c;
+        }
+    }
+    return escaped;
+}
+
+static std::string jsonError(const std::string& error) {
+    return "{\"ok\":false,\"error\":\"" + jsonEscape(error) + "\"}";
+}
+
+Daemon::Daemon(const InjectOptions& defaults)
+: _defaults(defaults)
+, _listenFd(-1)
+, _running(false) {
+}
+
+Daemon::~Daemon() {
+    while (!this->_clients.empty()) {
+        this->_close(this->_clients.begin()->first);
+    }
+    if (this->_listenFd != -1) {
+        ::close(this->_listenFd);
+    }
+    if (!this->_socketPath.empty()) {
+        ::unlink(this->_socketPath.c_str());
+    }
+    this->_cache.save();
+}
+
+bool Daemon::start(const std::string& socketName) {
+    bool ok = true;
+    do {
+        struct sockaddr_un addr;
+        ::memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        ok &= !socketName.empty() && socketName.length() < sizeof(addr.sun_path);
+        BREAK_IF_WITH_LOGE(!ok, "Daemon::start invalid socket name '%s'\n", socketName.c_str());
+        ::memcpy(addr.sun_path, socketName.c_str(), socketName.length());
+        socklen_t addrLen = offsetof(struct sockaddr_un, sun_path) + socketName.length();
+        if (socketName[0] == '@') {
+            // abstract namespace, nothing left behind on the filesystem
+            addr.sun_path[0] = '\0';
+        } else {
+            ::unlink(socketName.c_str());
+            this->_socketPath = socketName;
+        }
+
+        this->_listenFd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        ok &= this->_listenFd >= 0;
+        BREAK_IF_WITH_LOGE(!ok, "Daemon::start failed to create socket: %s\n", ::strerror(errno));
+        ok &= ::bind(this->_listenFd, (struct sockaddr*)&addr, addrLen) == 0;
+        BREAK_IF_WITH_LOGE(!ok, "Daemon::start failed to bind '%s': %s\n", socketName.c_str(), ::strerror(errno));
+        ok &= ::listen(this->_listenFd, DAEMON_MAX_CLIENTS) == 0;
+        BREAK_IF_WITH_LOGE(!ok, "Daemon::start failed to listen on '%s': %s\n", socketName.c_str(), ::strerror(errno));
+    } while (false);
+
+    if (!ok) {
+        if (this->_listenFd != -1) {
+            ::close(this->_listenFd);
+            this->_listenFd = -1;
+        }
+        this->_socketPath.clear();
+        return false;
+    }
+
+    // warm up everything a request would otherwise pay for. resolving
+    // dlopen & dlerror of ourselves fills the cache for the same modules
+    SDKCode::get();
+    if (!this->_defaults.symbolCachePath.empty()) {
+        this->_cache.load(this->_defaults.symbolCachePath);
+    }
+    uintptr_t dlopenAddr = 0;
+    uintptr_t dlerrorAddr = 0;
+    resolveRemoteDlfcn(::getpid(), &this->_cache, &dlopenAddr, &dlerrorAddr);
+    this->_cache.save();
+
+    LOGGER_LOGI("[-] daemon listening on '%s' ...\n", socketName.c_str());
+    this->_running = true;
+    return true;
+}
+
+void Daemon::stop() {
+    this->_running = false;
+}
+
+void Daemon::serve() {
+    std::vector<struct pollfd> pfds;
+    while (this->_running) {
+        pfds.clear();
+        pfds.push_back({ this->_listenFd, POLLIN, 0 });
+        for (auto& entry : this->_clients) {
+            pfds.push_back({ entry.first, POLLIN, 0 });
+        }
+        if (::poll(pfds.data(), pfds.size(), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOGGER_LOGE("Daemon::serve failed to poll: %s\n", ::strerror(errno));
+            break;
+        }
+        for (size_t i = 1; i < pfds.size(); ++ i) {
+            if (pfds[i].revents && !this->_receive(pfds[i].fd)) {
+                this->_close(pfds[i].fd);
+            }
+        }
+        if (pfds[0].revents & POLLIN) {
+            this->_accept();
+        }
+    }
+}
+
+void Daemon::_accept() {
+    int fd = ::accept4(this->_listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    // whoever connects can have any process injected
+    struct ucred cred;
+    socklen_t credLen = sizeof(cred);
+    if (::getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credLen) != 0 ||
+        (cred.uid != 0 && cred.uid != ::getuid())) {
+        LOGGER_LOGE("[!] daemon refused a client of uid %d\n", (int)cred.uid);
+        ::close(fd);
+        return;
+    }
+    if (this->_clients.size() >= DAEMON_MAX_CLIENTS) {
+        std::string reply = jsonError("too many clients") + "\n";
+        ::send(fd, reply.c_str(), reply.length(), MSG_NOSIGNAL);
+        ::close(fd);
+        return;
+    }
+    this->_clients[fd];
+}
+
+bool Daemon::_receive(int fd) {
+    char buffer[1024];
+    alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int) * DAEMON_MAX_FDS)];
+    struct iovec iov = { buffer, sizeof(buffer) };
+    struct msghdr msg;
+    ::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t size = ::recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    if (size < 0 && (errno == EINTR || errno == EAGAIN)) {
+        return true;
+    }
+    if (size <= 0) {
+        return false;
+    }
+
+    Client& client = this->_clients[fd];
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+        size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < count; ++ i) {
+            int passed;
+            ::memcpy(&passed, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            client.fds.push_back(passed);
+        }
+    }
+    std::string& pending = client.pending;
+    pending.append(buffer, size);
+    size_t end;
+    while ((end = pending.find('\n')) != std::string::npos) {
+        std::string line = pending.substr(0, end);
+        pending.erase(0, end + 1);
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (line.empty()) {
+            continue;
+        }
+        std::string reply = this->_handle(line, &client) + "\n";
+        if (::send(fd, reply.c_str(), reply.length(), MSG_NOSIGNAL) != (ssize_t)reply.length()) {
+            return false;
+        }
+    }
+    if (pending.length() > DAEMON_MAX_REQUEST) {
+        std::string reply = jsonError("request too long") + "\n";
+        ::send(fd, reply.c_str(), reply.length(), MSG_NOSIGNAL);
+        return false;
+    }
+    return true;
+}
+
+void Daemon::_close(int fd) {
+    for (int passed : this->_clients[fd].fds) {
+        ::close(passed);
+    }
+    ::close(fd);
+    this->_clients.erase(fd);
+}
+
+bool Daemon::_parse(const std::string& line, Client* client, Request* outRequest, std::string* outError) {
+    outRequest->pid = 0;
+    outRequest->concurrency = -1;
+    outRequest->payloadFd = -1;
+    outRequest->options = this->_defaults;
+
+    std::istringstream tokens(line);
+    std::string token;
+    while (tokens >> token) {
+        size_t eq = token.find('=');
+        if (eq == std::string::npos) {
+            *outError = "malformed option '" + token + "'";
+            return false;
+        }
+        std::string key = token.substr(0, eq);
+        std::string value = token.substr(eq + 1);
+        if (key == "pid") {
+            outRequest->pid = ::atoi(value.c_str());
+        } else if (key == "pname") {
+            outRequest->pname = value;
+        } else if (key == "match") {
+            outRequest->matchBy = value;
+        } else if (key == "concurrency") {
+            outRequest->concurrency = ::atoi(value.c_str());
+        } else if (key == "libpath") {
+            // descriptors of the daemon itself are not for clients
+            if (value.compare(0, 3, "fd:") == 0) {
+                *outError = "descriptors are to be passed by SCM_RIGHTS";
+                return false;
+            }
+            outRequest->libPath = value;
+        } else if (key == "deliver") {
+            if (value == "memfd") {
+                outRequest->options.memfdDelivery = true;
+            } else if (value == "path") {
+                outRequest->options.memfdDelivery = false;
+            } else {
+                *outError = "unknown delivery '" + value + "'";
+                return false;
+            }
+        } else if (key == "loadon") {
+            if (value == "thread") {
+                outRequest->options.spawnThread = true;
+            } else if (value == "stopped") {
+                outRequest->options.spawnThread = false;
+            } else {
+                *outError = "unknown thread to load on '" + value + "'";
+                return false;
+            }
+        } else if (key == "membackend") {
+            outRequest->options.memBackends = parseMemoryBackends(value);
+            if (!outRequest->options.memBackends) {
+                *outError = "unknown memory backend '" + value + "'";
+                return false;
+            }
+        } else if (key == "attach") {
+            if (value == "seize") {
+                outRequest->options.attachMode = PtraceWrapper::ATTACH_SEIZE;
+            } else if (value == "legacy") {
+                outRequest->options.attachMode = PtraceWrapper::ATTACH_LEGACY;
+            } else {
+                *outError = "unknown attach mode '" + value + "'";
+                return false;
+            }
+        } else if (key == "timeout") {
+            outRequest->options.waitTimeoutMs = ::atoi(value.c_str());
+        } else if (key == "agent") {
+            outRequest->options.agentPath = value;
+        } else if (key == "op") {
+            outRequest->op = value;
+        } else if (key == "handle" || key == "symbol" || key == "func" || key == "args" ||
+                   key == "addr" || key == "size" || key == "hex") {
+            outRequest->params[key] = value;
+        } else {
+            *outError = "unknown option '" + key + "'";
+            return false;
+        }
+    }
+
+    if (outRequest->libPath.empty() && outRequest->op.empty()) {
+        if (client->fds.empty()) {
+            *outError = "libpath or a descriptor passed is required";
+            return false;
+        }
+        outRequest->payloadFd = client->fds.front();
+        client->fds.pop_front();
+        outRequest->libPath = "fd:" + std::to_string(outRequest->payloadFd);
+        outRequest->options.memfdDelivery = true;
+    }
+    if (outRequest->pid == 0 && outRequest->pname.empty()) {
+        *outError = "pid or pname is required";
+        return false;
+    }
+    if (outRequest->pid != 0 && !outRequest->pname.empty()) {
+        *outError = "pid and pname are exclusive";
+        return false;
+    }
+    return true;
+}
+
+std::string Daemon::_handle(const std::string& line, Client* client) {
+    LOGGER_LOGI("[>] daemon request: %s\n", line.c_str());
+    Request request;
+    std::string error;
+    std::string reply;
+    if (!this->_parse(line, client, &request, &error)) {
+        reply = jsonError(error);
+    } else if (!request.op.empty()) {
+        reply = this->_agentOp(request);
+    } else {
+        reply = this->_inject(request);
+    }
+    if (request.payloadFd != -1) {
+        ::close(request.payloadFd);
+    }
+    return reply;
+}
+
+bool Daemon::_targets(const Request& request, std::vector<pid_t>* outPids, std::string* outError) {
+    if (request.pname.empty()) {
+        outPids->push_back(request.pid);
+        return true;
+    }
+    ProcessScanner scanner;
+    ProcessScanner::MatchBy by;
+    if (!ProcessScanner::parseMatchBy(request.matchBy, &by)) {
+        *outError = "unknown match mode '" + request.matchBy + "'";
+        return false;
+    }
+    if (!scanner.setPattern(request.pname, by)) {
+        *outError = "invalid pattern '" + request.pname + "'";
+        return false;
+    }
+    *outPids = scanner.scan();
+    if (outPids->empty()) {
+        *outError = "process '" + request.pname + "' not found";
+        return false;
+    }
+    // the lowest pid, as on the command line, unless concurrency is given
+    if (request.concurrency < 0) {
+        outPids->resize(1);
+    }
+    return true;
+}
+
+std::string Daemon::_inject(const Request& request) {
+    int64_t startNs = monotonicNs();
+    std::vector<pid_t> targets;
+    std::string error;
+    if (!this->_targets(request, &targets, &error)) {
+        return jsonError(error);
+    }
+
+    Injector injector(request.libPath, request.options);
+    injector.setSymbolCache(&this->_cache);
+    injector.setConcurrency(request.concurrency);
+    for (pid_t pid : targets) {
+        injector.add(pid);
+    }
+    bool ok = injector.run();
+    this->_cache.save();
+
+    std::string reply;
+    char field[160];
+    ::snprintf(field, sizeof(field), "{\"ok\":%s,\"elapsed_us\":%lld,\"results\":[",
+        ok ? "true" : "false", (long long)((monotonicNs() - startNs) / 1000));
+    reply += field;
+    for (const Injector::Result& result : injector.results()) {
+        ::snprintf(field, sizeof(field), "{\"pid\":%d,\"ok\":%s,\"stage\":\"%s\",\"handle\":\"0x%zx\",\"via\":\"%s\",\"elapsed_us\":%lld},",
+            result.pid, result.ok ? "true" : "false", Injector::stageName(result.stage), (size_t)result.handle,
+            result.viaAgent ? "agent" : "ptrace", (long long)(result.elapsedNs / 1000));
+        reply += field;
+    }
+    if (reply.back() == ',') {
+        reply.pop_back();
+    }
+    reply += "]}";
+    return reply;
+}
+
+std::string Daemon::_agentOp(const Request& request) {
+    int64_t startNs = monotonicNs();
+    std::vector<pid_t> targets;
+    std::string error;
+    if (!this->_targets(request, &targets, &error)) {
+        return jsonError(error);
+    }
+    AgentClient agent;
+    if (!agent.connect(targets.front())) {
+        return jsonError("no agent in process " + std::to_string(targets.front()));
+    }
+    if (request.options.waitTimeoutMs) {
+        agent.setTimeout(request.options.waitTimeoutMs);
+    }
+
+    auto param = [&request](const char* key) -> std::string {
+        auto it = request.params.find(key);
+        return it == request.params.end() ? std::string() : it->second;
+    };
+    auto number = [&param](const char* key) -> uintptr_t {
+        return (uintptr_t)::strtoull(param(key).c_str(), nullptr, 0);
+    };
+
+    bool answered = false;
+    bool ok = false;
+    uintptr_t result = 0;
+    std::string hex;
+    const std::string& op = request.op;
+    if (op == "dlsym") {
+        answered = agent.dlsym(number("handle"), param("symbol"), &result);
+        ok = result != 0;
+    } else if (op == "dlclose") {
+        answered = agent.dlclose(number("handle"), &ok, &error);
+    } else if (op == "call") {
+        // integer args only, at most 6 of them
+        intptr_t argv[AGENT_MAX_ARGS] = { 0 };
+        std::istringstream args(param("args"));
+        std::string arg;
+        for (size_t argn = 0; std::getline(args, arg, ',') && argn < AGENT_MAX_ARGS; ++ argn) {
+            argv[argn] = (intptr_t)::strtoll(arg.c_str(), nullptr, 0);
+        }
+        intptr_t value = 0;
+        answered = agent.call(number("func"), { argv[0], argv[1], argv[2], argv[3], argv[4], argv[5] }, &value);
+        result = (uintptr_t)value;
+        ok = true;
+    } else if (op == "read") {
+        std::vector<uint8_t> buffer(std::min(number("size"), (uintptr_t)DAEMON_MAX_READ));
+        result = agent.readMemory(buffer.data(), number("addr"), buffer.size());
+        for (size_t i = 0; i < result; ++ i) {
+            char byte[3];
+            ::snprintf(byte, sizeof(byte), "%02x", buffer[i]);
+            hex += byte;
+        }
+        answered = true;
+        ok = result == buffer.size();
+    } else if (op == "write") {
+        std::string text = param("hex");
+        std::vector<uint8_t> buffer;
+        for (size_t i = 0; i + 1 < text.length(); i += 2) {
+            buffer.push_back((uint8_t)::strtoul(text.substr(i, 2).c_str(), nullptr, 16));
+        }
+        result = agent.writeMemory(number("addr"), buffer.data(), buffer.size());
+        answered = true;
+        ok = result == buffer.size();
+    } else {
+        return jsonError("unknown op '" + op + "'");
+    }
+    if (!answered) {
+        return jsonError("agent in process " + std::to_string(targets.front()) + " is not responding");
+    }
+
+    char field[128];
+    ::snprintf(field, sizeof(field), "{\"ok\":%s,\"elapsed_us\":%lld,\"result\":\"0x%zx\"",
+        ok ? "true" : "false", (long long)((monotonicNs() - startNs) / 1000), (size_t)result);
+    std::string reply = field;
+    if (!hex.empty()) {
+        reply += ",\"hex\":\"" + hex + "\"";
+    }
+    if (!error.empty()) {
+        reply += ",\"error\":\"" + jsonEscape(error) + "\"";
+    }
+    reply += "}";
+    return reply;
+}
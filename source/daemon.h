@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2020, Irvin Pang <halo.irvin@gmail.com>
+ * All rights reserved.
+ *
+ * see LICENSE file for details
+ */
+
+#ifndef __ADRILL_DAEMON_H__
+#define __ADRILL_DAEMON_H__
+
+#include <map>
+#include <deque>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "injector.h"
+#include "symbol_cache.h"
+
+#define DAEMON_DEFAULT_SOCKET "@adrill"
+// clients served at a time, the longest request line, descriptors taken
+// along with one message, and bytes of a single op=read
+#define DAEMON_MAX_CLIENTS    16
+#define DAEMON_MAX_REQUEST    4096
+#define DAEMON_MAX_FDS        4
+#define DAEMON_MAX_READ       4096
+
+/*
+ * keeps adrill resident and serves injections over a unix domain socket,
+ * so that selinux, the sdk level, bionic paths and symbol offsets are set
+ * up once rather than per injection. each request is a line of options:
+ *
+ *   pid=<n> | pname=<s> [match=<m>] [concurrency=<n>] libpath=<path>
+ *   [deliver=<d>] [agent=<path>] [loadon=<l>] [membackend=<b>] [attach=<a>]
+ *   [timeout=<ms>]
+ *
+ * named as the command line ones. a request without libpath takes the
+ * oldest descriptor passed along on the connection by SCM_RIGHTS, e.g.,
+ * a memfd just built, and delivers it through a memfd of tracee. each
+ * request is answered by a line of json:
+ *
+ *   {"ok":true,"elapsed_us":..,"results":[{"pid":..,"ok":..,"stage":"..","handle":"0x..","elapsed_us":..}]}
+ *   {"ok":false,"error":".."}
+ *
+ * with the resident agent loaded, a request could be an op run by it
+ * instead, with no ptrace at all:
+ *
+ *   op=dlsym handle=<h> symbol=<s>      op=dlclose handle=<h>
+ *   op=call func=<addr> [args=<a>,..]   op=read addr=<addr> size=<n>
+ *   op=write addr=<addr> hex=<bytes>
+ *
+ * answered by {"ok":..,"elapsed_us":..,"result":"0x.."}, along with
+ * "hex" of the bytes read, or "error"
+ *
+ * requests are served one by one on the thread calling serve(), which is
+ * the tracer of all the targets. only root and the daemon's own uid are
+ * allowed to connect
+ */
+class Daemon {
+public:
+    Daemon(const InjectOptions& defaults);
+    ~Daemon();
+
+    /*
+     * listen on <socketName>, in the abstract namespace if it starts with '@'
+     */
+    bool start(const std::string& socketName);
+
+    /*
+     * serve requests until stop()
+     */
+    void serve();
+    void stop();
+
+protected:
+    struct Request {
+        pid_t       pid;
+        std::string pname;
+        std::string matchBy;
+        int         concurrency;
+        std::string libPath;
+        // passed by the client, or -1
+        int         payloadFd;
+        InjectOptions options;
+        // agent op, empty to inject, and its params
+        std::string op;
+        std::map<std::string, std::string> params;
+    };
+
+    struct Client {
+        // partial request line
+        std::string    pending;
+        std::deque<int> fds;
+    };
+
+    void _accept();
+    // false once the client is gone
+    bool _receive(int fd);
+    std::string _handle(const std::string& line, Client* client);
+    bool _parse(const std::string& line, Client* client, Request* outRequest, std::string* outError);
+    // pids of the request, or an error reply
+    bool _targets(const Request& request, std::vector<pid_t>* outPids, std::string* outError);
+    std::string _inject(const Request& request);
+    std::string _agentOp(const Request& request);
+    void _close(int fd);
+
+protected:
+    InjectOptions _defaults;
+    SymbolCache   _cache;
+    int           _listenFd;
+    std::string   _socketPath;
+    bool          _running;
+    std::unordered_map<int, Client> _clients;
+
+};
+
+#endif // __ADRILL_DAEMON_H__
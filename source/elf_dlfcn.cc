@@ -8,12 +8,11 @@
 #include <fcntl.h>
 #include <sys/mman.h>
 
-#include <mem/protect.h>
-#include <elfio/elfio.hpp>
-
 #include "macros.h"
 #include "sdk_code.h"
 #include "elf_dlfcn.h"
+#include "elf_reader.h"
+#include "maps_snapshot.h"
 
 #define MOCK_INDICATOR 0xfaced1fc
 
@@ -22,9 +21,10 @@ namespace internal {
         // always equals to MOCK_INDICATOR
         // recognized by elf_dlsym & elf_dlclose
         int indicator;
-        mem::region_info* region_info;
-        ELFIO::elfio* elf_reader;
-        ELFIO::Elf64_Addr bias;
+        // lowest address the module is mapped at
+        uintptr_t start;
+        ElfReader* elf_reader;
+        uint64_t bias;
     };
 } // namespace internal
 
@@ -36,17 +36,17 @@ void* elf_dlopen(const char* libpath, int flags) {
 
     struct internal::context* ctx = nullptr;
     do {
-        auto region_info = new mem::region_info();
         // resolve modules
-        int ret = mem::get_region_info(/*self*/0, libpath, region_info);
-        if (ret == 0) {
+        MapsSnapshot maps;
+        MapsSnapshot::Module module;
+        if (!maps.load(/*self*/0) || !maps.findModule(libpath, &module)) {
             LOGGER_LOGE("module '%s' not found in /proc/self/maps\n", libpath);
-            delete region_info;
             break;
         }
 
-        auto reader = new ELFIO::elfio();
-        if (!reader->load(libpath)) {
+        // mapped rather than loaded, only the pages looked up are read in
+        auto reader = new ElfReader();
+        if (!reader->open(libpath)) {
             LOGGER_LOGE("not an ELF: '%s'\n", libpath);
             delete reader;
             break;
@@ -56,16 +56,9 @@ void* elf_dlopen(const char* libpath, int flags) {
         ctx = (struct internal::context*)::calloc(1, sizeof(struct internal::context));
         // indicating this is a elf_dlopened handle
         ctx->indicator = MOCK_INDICATOR;
-        ctx->region_info = region_info;
+        ctx->start = module.start;
         ctx->elf_reader = reader;
-        ELFIO::Elf_Half seg_num = reader->segments.size();
-        for (ELFIO::Elf_Half i = 0; i < seg_num; ++i) {
-            ELFIO::segment* seg = reader->segments[i];
-            if (seg->get_type() == ELFIO::PT_LOAD) {
-                ctx->bias = seg->get_virtual_address();
-                break;
-            }
-        }
+        ctx->bias = reader->loadBias();
     } while (false);
     return ctx;
 }
@@ -78,29 +71,9 @@ void* elf_dlsym(void* handle, const char* symname) {
         return ::dlsym(handle, symname);
     }
 
-    std::string       name;
-    ELFIO::Elf64_Addr value = 0;
-    ELFIO::Elf_Xword  size = 0;
-    uint8_t           bind = 0;
-    uint8_t           type = 0;
-    ELFIO::Elf_Half   section = 0;
-    uint8_t           other = 0;
-    // iterates all sections
-    bool found = false;
-    auto reader = ctx->elf_reader;
-    ELFIO::Elf_Half sec_num = reader->sections.size();
-    for (ELFIO::Elf_Half i = 0; i < sec_num && !found; i ++) {
-        ELFIO::section* sec = reader->sections[i];
-        if (sec->get_type() == ELFIO::SHT_SYMTAB || sec->get_type() == ELFIO::SHT_DYNSYM) {
-            ELFIO::symbol_section_accessor symbols(*reader, sec);
-            ELFIO::Elf_Xword sym_num = symbols.get_symbols_num();
-            for (ELFIO::Elf_Xword j = 0; j < sym_num && !found; j++) {
-                symbols.get_symbol(j, name, value, size, bind, type, section, other);
-                found = (::strcmp(name.c_str(), symname) == 0);
-            }
-        }
-    }
-    return found ? (void*)(ctx->region_info->start + value - ctx->bias) : nullptr;
+    uint64_t value = 0;
+    bool found = ctx->elf_reader->findSymbol(symname, &value);
+    return found ? (void*)(ctx->start + value - ctx->bias) : nullptr;
 }
 
 int elf_dlclose(void* handle) {
@@ -109,10 +82,6 @@ int elf_dlclose(void* handle) {
         return ::dlclose(handle);
     }
 
-    if (ctx->region_info) {
-        delete ctx->region_info;
-        ctx->region_info = nullptr;
-    }
     if (ctx->elf_reader) {
         delete ctx->elf_reader;
         ctx->elf_reader = nullptr;
@@ -0,0 +1,453 @@
+/*
+ * Copyright (c) 2020, Irvin Pang <halo.irvin@gmail.com>
+ * All rights reserved.
+ *
+ * see LICENSE file for details
+ */
+
+#include <algorithm>
+#include <elf.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "macros.h"
+#include "elf_reader.h"
+
+namespace {
+    struct Elf32 {
+        typedef Elf32_Ehdr Ehdr;
+        typedef Elf32_Phdr Phdr;
+        typedef Elf32_Shdr Shdr;
+        typedef Elf32_Dyn  Dyn;
+        typedef Elf32_Sym  Sym;
+    };
+
+    struct Elf64 {
+        typedef Elf64_Ehdr Ehdr;
+        typedef Elf64_Phdr Phdr;
+        typedef Elf64_Shdr Shdr;
+        typedef Elf64_Dyn  Dyn;
+        typedef Elf64_Sym  Sym;
+    };
+
+    uint32_t gnuHash(const char* name) {
+        uint32_t h = 5381;
+        for (auto c = (const uint8_t*)name; *c; ++ c) {
+            h = h * 33 + *c;
+        }
+        return h;
+    }
+
+    uint32_t sysvHash(const char* name) {
+        uint32_t h = 0;
+        for (auto c = (const uint8_t*)name; *c; ++ c) {
+            h = (h << 4) + *c;
+            h ^= (h >> 24) & 0xf0;
+        }
+        return h & 0x0fffffff;
+    }
+} // namespace
+
+ElfReader::ElfReader()
+: _base(nullptr)
+, _size(0)
+, _is64(false)
+, _loadBias(0)
+, _symSize(0)
+, _dynsym(nullptr)
+, _dynsymNum(0)
+, _dynstr(nullptr)
+, _dynstrSize(0)
+, _gnuHash(nullptr)
+, _sysvHash(nullptr)
+, _symtab(nullptr)
+, _symtabNum(0)
+, _strtab(nullptr)
+, _strtabSize(0)
+, _indexed(false) {
+}
+
+ElfReader::~ElfReader() {
+    this->close();
+}
+
+bool ElfReader::open(const char* path) {
+    this->close();
+    bool ok = true;
+    int fd = -1;
+    do {
+        fd = ::open(path, O_RDONLY | O_CLOEXEC);
+        ok &= fd >= 0;
+        BREAK_IF_WITH_LOGE(!ok, "ElfReader::open failed to open '%s': %s\n", path, ::strerror(errno));
+
+        struct stat st;
+        ok &= ::fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(Elf32_Ehdr);
+        BREAK_IF_WITH_LOGE(!ok, "ElfReader::open '%s' is too small to be an ELF\n", path);
+
+        // read-only and private, pages are faulted in only when touched
+        void* base = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ok &= base != MAP_FAILED;
+        BREAK_IF_WITH_LOGE(!ok, "ElfReader::open failed to mmap '%s': %s\n", path, ::strerror(errno));
+        this->_base = (char*)base;
+        this->_size = st.st_size;
+
+        const unsigned char* ident = (const unsigned char*)this->_base;
+        ok &= ::memcmp(ident, ELFMAG, SELFMAG) == 0;
+        BREAK_IF_WITH_LOGE(!ok, "ElfReader::open not an ELF: '%s'\n", path);
+
+        this->_is64 = ident[EI_CLASS] == ELFCLASS64;
+        ok &= this->_is64 ? this->_parse<Elf64>() : this->_parse<Elf32>();
+        BREAK_IF_WITH_LOGE(!ok, "ElfReader::open malformed ELF: '%s'\n", path);
+    } while (false);
+
+    if (fd >= 0) {
+        ::close(fd);
+    }
+    if (!ok) {
+        this->close();
+    }
+    return ok;
+}
+
+void ElfReader::close() {
+    if (this->_base) {
+        ::munmap(this->_base, this->_size);
+    }
+    this->_base = nullptr;
+    this->_size = 0;
+    this->_is64 = false;
+    this->_loadBias = 0;
+    this->_symSize = 0;
+    this->_dynsym = this->_dynstr = nullptr;
+    this->_dynsymNum = this->_dynstrSize = 0;
+    this->_gnuHash = this->_sysvHash = nullptr;
+    this->_symtab = this->_strtab = nullptr;
+    this->_symtabNum = this->_strtabSize = 0;
+    this->_indexed = false;
+    this->_index.clear();
+}
+
+bool ElfReader::is64() const {
+    return this->_is64;
+}
+
+uint64_t ElfReader::loadBias() const {
+    return this->_loadBias;
+}
+
+template<typename E>
+bool ElfReader::_parse() {
+    auto ehdr = (const typename E::Ehdr*)this->_at(0, sizeof(typename E::Ehdr));
+    if (!ehdr || (ehdr->e_phnum && ehdr->e_phentsize != sizeof(typename E::Phdr))) {
+        return false;
+    }
+    this->_symSize = sizeof(typename E::Sym);
+
+    // program headers for the load bias and the dynamic segment
+    auto phdrs = (const typename E::Phdr*)this->_at(ehdr->e_phoff, (uint64_t)ehdr->e_phnum * sizeof(typename E::Phdr));
+    if (!phdrs) {
+        return false;
+    }
+    const typename E::Phdr* dynamic = nullptr;
+    bool loadFound = false;
+    for (size_t i = 0; i < ehdr->e_phnum; ++ i) {
+        if (phdrs[i].p_type == PT_LOAD && !loadFound) {
+            this->_loadBias = phdrs[i].p_vaddr;
+            loadFound = true;
+        } else if (phdrs[i].p_type == PT_DYNAMIC) {
+            dynamic = &phdrs[i];
+        }
+    }
+
+    // d_ptr entries are virtual addresses, which have to be mapped back to file offsets
+    auto fileAt = [&](uint64_t vaddr, uint64_t size) -> const char* {
+        for (size_t i = 0; i < ehdr->e_phnum; ++ i) {
+            if (phdrs[i].p_type == PT_LOAD && vaddr >= phdrs[i].p_vaddr && vaddr < phdrs[i].p_vaddr + phdrs[i].p_filesz) {
+                return this->_at(vaddr - phdrs[i].p_vaddr + phdrs[i].p_offset, size);
+            }
+        }
+        return nullptr;
+    };
+
+    auto dyns = dynamic ? (const typename E::Dyn*)this->_at(dynamic->p_offset, dynamic->p_filesz) : nullptr;
+    for (size_t i = 0; dyns && i < dynamic->p_filesz / sizeof(typename E::Dyn) && dyns[i].d_tag != DT_NULL; ++ i) {
+        uint64_t ptr = dyns[i].d_un.d_ptr;
+        switch (dyns[i].d_tag) {
+            case DT_SYMTAB:   this->_dynsym = fileAt(ptr, this->_symSize); break;
+            case DT_STRTAB:   this->_dynstr = fileAt(ptr, 1); break;
+            case DT_STRSZ:    this->_dynstrSize = dyns[i].d_un.d_val; break;
+            case DT_GNU_HASH: this->_gnuHash = (const uint32_t*)fileAt(ptr, 4 * sizeof(uint32_t)); break;
+            case DT_HASH:     this->_sysvHash = (const uint32_t*)fileAt(ptr, 2 * sizeof(uint32_t)); break;
+            default: break;
+        }
+    }
+    if (this->_dynstr && !this->_inFile(this->_dynstr, this->_dynstrSize)) {
+        this->_dynstrSize = this->_base + this->_size - this->_dynstr;
+    }
+
+    // section headers are optional, for .symtab and the exact size of .dynsym
+    auto shdrs = (ehdr->e_shoff && ehdr->e_shentsize == sizeof(typename E::Shdr)) ?
+        (const typename E::Shdr*)this->_at(ehdr->e_shoff, (uint64_t)ehdr->e_shnum * sizeof(typename E::Shdr)) : nullptr;
+    for (size_t i = 0; shdrs && i < ehdr->e_shnum; ++ i) {
+        const typename E::Shdr& sec = shdrs[i];
+        if ((sec.sh_type != SHT_SYMTAB && sec.sh_type != SHT_DYNSYM) || sec.sh_link >= ehdr->e_shnum) {
+            continue;
+        }
+        const typename E::Shdr& str = shdrs[sec.sh_link];
+        const char* syms = this->_at(sec.sh_offset, sec.sh_size);
+        const char* strs = this->_at(str.sh_offset, str.sh_size);
+        if (!syms || !strs) {
+            continue;
+        }
+        if (sec.sh_type == SHT_SYMTAB) {
+            this->_symtab = syms;
+            this->_symtabNum = sec.sh_size / this->_symSize;
+            this->_strtab = strs;
+            this->_strtabSize = str.sh_size;
+        } else if (!this->_dynsym || this->_dynsym == syms) {
+            this->_dynsym = syms;
+            this->_dynsymNum = sec.sh_size / this->_symSize;
+            this->_dynstr = strs;
+            this->_dynstrSize = str.sh_size;
+        }
+    }
+
+    // stripped of section headers, the hash tables tell how many symbols there are
+    if (this->_dynsym && !this->_dynsymNum) {
+        if (this->_sysvHash) {
+            this->_dynsymNum = this->_sysvHash[1];
+        } else if (this->_gnuHash) {
+            this->_dynsymNum = this->_countGnuHashSymbols();
+        }
+    }
+    if (this->_dynsym && !this->_inFile(this->_dynsym, this->_dynsymNum * this->_symSize)) {
+        this->_dynsymNum = (this->_base + this->_size - this->_dynsym) / this->_symSize;
+    }
+    if (!this->_dynsym || !this->_dynstr) {
+        this->_dynsym = this->_dynstr = nullptr;
+        this->_dynsymNum = this->_dynstrSize = 0;
+        this->_gnuHash = this->_sysvHash = nullptr;
+    }
+    return true;
+}
+
+const char* ElfReader::_at(uint64_t offset, uint64_t size) const {
+    if (!this->_base || offset > this->_size || size > this->_size - offset) {
+        return nullptr;
+    }
+    return this->_base + offset;
+}
+
+bool ElfReader::_inFile(const void* ptr, size_t size) const {
+    const char* p = (const char*)ptr;
+    return p >= this->_base && p <= this->_base + this->_size && size <= (size_t)(this->_base + this->_size - p);
+}
+
+void ElfReader::_getSymbol(const char* syms, uint64_t index, uint32_t* outName, uint64_t* outValue, uint16_t* outShndx) const {
+    if (this->_is64) {
+        auto sym = (const Elf64_Sym*)syms + index;
+        *outName = sym->st_name;
+        *outValue = sym->st_value;
+        *outShndx = sym->st_shndx;
+    } else {
+        auto sym = (const Elf32_Sym*)syms + index;
+        *outName = sym->st_name;
+        *outValue = sym->st_value;
+        *outShndx = sym->st_shndx;
+    }
+}
+
+bool ElfReader::_matchDynsym(uint64_t index, const char* name, uint64_t* outValue) const {
+    uint32_t nameOffset = 0;
+    uint16_t shndx = 0;
+    if (index >= this->_dynsymNum) {
+        return false;
+    }
+    this->_getSymbol(this->_dynsym, index, &nameOffset, outValue, &shndx);
+    return shndx != SHN_UNDEF && nameOffset < this->_dynstrSize &&
+        ::strncmp(this->_dynstr + nameOffset, name, this->_dynstrSize - nameOffset) == 0;
+}
+
+// see https://flapenguin.me/elf-dt-gnu-hash
+template<typename BloomWord>
+bool ElfReader::_lookupGnuHash(const char* name, uint64_t* outValue) const {
+    const uint32_t nbuckets    = this->_gnuHash[0];
+    const uint32_t symoffset   = this->_gnuHash[1];
+    const uint32_t bloomSize   = this->_gnuHash[2];
+    const uint32_t bloomShift  = this->_gnuHash[3];
+    auto bloom   = (const BloomWord*)&this->_gnuHash[4];
+    auto buckets = (const uint32_t*)&bloom[bloomSize];
+    auto chain   = &buckets[nbuckets];
+    if (!nbuckets || !bloomSize || !this->_inFile(bloom, (char*)chain - (char*)bloom)) {
+        return false;
+    }
+
+    // the bloom filter rejects most of the missing names at once
+    const uint32_t bits = sizeof(BloomWord) * 8;
+    uint32_t h1 = gnuHash(name);
+    BloomWord word = bloom[(h1 / bits) % bloomSize];
+    BloomWord mask = ((BloomWord)1 << (h1 % bits)) | ((BloomWord)1 << ((h1 >> bloomShift) % bits));
+    if ((word & mask) != mask) {
+        return false;
+    }
+
+    uint32_t index = buckets[h1 % nbuckets];
+    if (index < symoffset) {
+        return false;
+    }
+    for (; index < this->_dynsymNum && this->_inFile(&chain[index - symoffset], sizeof(uint32_t)); ++ index) {
+        // lowest bit of chain hashes marks the end of the bucket
+        uint32_t h2 = chain[index - symoffset];
+        if ((h1 | 1) == (h2 | 1) && this->_matchDynsym(index, name, outValue)) {
+            return true;
+        }
+        if (h2 & 1) {
+            break;
+        }
+    }
+    return false;
+}
+
+bool ElfReader::_lookupSysvHash(const char* name, uint64_t* outValue) const {
+    const uint32_t nbucket = this->_sysvHash[0];
+    const uint32_t nchain  = this->_sysvHash[1];
+    auto buckets = &this->_sysvHash[2];
+    auto chain   = &buckets[nbucket];
+    if (!nbucket || !this->_inFile(buckets, ((uint64_t)nbucket + nchain) * sizeof(uint32_t))) {
+        return false;
+    }
+    // STN_UNDEF(0) ends the chain, nchain bounds a corrupted one
+    uint32_t index = buckets[sysvHash(name) % nbucket];
+    for (uint32_t n = 0; index && index < nchain && n < nchain; index = chain[index], ++ n) {
+        if (this->_matchDynsym(index, name, outValue)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+uint64_t ElfReader::_countGnuHashSymbols() const {
+    const uint32_t nbuckets  = this->_gnuHash[0];
+    const uint32_t symoffset = this->_gnuHash[1];
+    const uint32_t bloomSize = this->_gnuHash[2];
+    auto buckets = (const uint32_t*)((const char*)&this->_gnuHash[4] + (this->_is64 ? 8 : 4) * (uint64_t)bloomSize);
+    auto chain   = &buckets[nbuckets];
+    if (!this->_inFile(buckets, (uint64_t)nbuckets * sizeof(uint32_t))) {
+        return 0;
+    }
+    // symbols are sorted by bucket, so the chain of the last bucket ends them all
+    uint32_t last = 0;
+    for (uint32_t i = 0; i < nbuckets; ++ i) {
+        last = std::max(last, buckets[i]);
+    }
+    if (last < symoffset) {
+        return symoffset;
+    }
+    while (this->_inFile(&chain[last - symoffset], sizeof(uint32_t)) && !(chain[last - symoffset] & 1)) {
+        ++ last;
+    }
+    return (uint64_t)last + 1;
+}
+
+void ElfReader::_indexSymbols(const char* syms, uint64_t num, const char* strs, uint64_t strsSize) {
+    for (uint64_t i = 0; i < num; ++ i) {
+        uint32_t name = 0;
+        uint64_t value = 0;
+        uint16_t shndx = 0;
+        this->_getSymbol(syms, i, &name, &value, &shndx);
+        // the first one wins, as a linear scan would
+        if (shndx != SHN_UNDEF && name && name < strsSize) {
+            this->_index.emplace(std::string_view(strs + name, ::strnlen(strs + name, strsSize - name)), value);
+        }
+    }
+}
+
+bool ElfReader::findSymbol(const char* name, uint64_t* outValue) {
+    if (!this->_base) {
+        return false;
+    }
+    uint64_t value = 0;
+    bool found = false;
+    if (this->_gnuHash) {
+        found = this->_is64 ? this->_lookupGnuHash<uint64_t>(name, &value) : this->_lookupGnuHash<uint32_t>(name, &value);
+    } else if (this->_sysvHash) {
+        found = this->_lookupSysvHash(name, &value);
+    }
+
+    if (!found) {
+        // .dynsym is indexed as well if it has no hash table
+        if (!this->_indexed) {
+            if (!this->_gnuHash && !this->_sysvHash) {
+                this->_indexSymbols(this->_dynsym, this->_dynsymNum, this->_dynstr, this->_dynstrSize);
+            }
+            this->_indexSymbols(this->_symtab, this->_symtabNum, this->_strtab, this->_strtabSize);
+            this->_indexed = true;
+        }
+        auto it = this->_index.find(name);
+        found = it != this->_index.end();
+        value = found ? it->second : 0;
+    }
+    if (found) {
+        *outValue = value;
+    }
+    return found;
+}
+
+template<typename E>
+bool ElfReader::_readBuildId(int fd, std::string* outBuildId) {
+    typename E::Ehdr ehdr;
+    if (::pread(fd, &ehdr, sizeof(ehdr), 0) != sizeof(ehdr) || ehdr.e_phentsize != sizeof(typename E::Phdr)) {
+        return false;
+    }
+    for (size_t i = 0; i < ehdr.e_phnum; ++ i) {
+        typename E::Phdr phdr;
+        if (::pread(fd, &phdr, sizeof(phdr), ehdr.e_phoff + i * sizeof(phdr)) != sizeof(phdr)) {
+            return false;
+        }
+        if (phdr.p_type != PT_NOTE || phdr.p_filesz > 0x1000) {
+            continue;
+        }
+        char notes[0x1000];
+        if (::pread(fd, notes, phdr.p_filesz, phdr.p_offset) != (ssize_t)phdr.p_filesz) {
+            continue;
+        }
+        // name and desc are both padded to 4 bytes
+        for (size_t offset = 0; offset + sizeof(Elf32_Nhdr) <= phdr.p_filesz; ) {
+            auto nhdr = (const Elf32_Nhdr*)&notes[offset];
+            size_t name = offset + sizeof(Elf32_Nhdr);
+            size_t desc = name + ((nhdr->n_namesz + 3) & ~3u);
+            offset = desc + ((nhdr->n_descsz + 3) & ~3u);
+            if (offset > phdr.p_filesz) {
+                break;
+            }
+            if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4 && ::memcmp(&notes[name], "GNU", 4) == 0) {
+                static const char digits[] = "0123456789abcdef";
+                outBuildId->clear();
+                for (size_t j = 0; j < nhdr->n_descsz; ++ j) {
+                    uint8_t byte = notes[desc + j];
+                    outBuildId->push_back(digits[byte >> 4]);
+                    outBuildId->push_back(digits[byte & 0xf]);
+                }
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+bool ElfReader::readBuildId(const char* path, std::string* outBuildId) {
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    unsigned char ident[EI_NIDENT];
+    bool ok = ::pread(fd, ident, sizeof(ident), 0) == sizeof(ident) && ::memcmp(ident, ELFMAG, SELFMAG) == 0;
+    if (ok) {
+        ok = ident[EI_CLASS] == ELFCLASS64 ? _readBuildId<Elf64>(fd, outBuildId) : _readBuildId<Elf32>(fd, outBuildId);
+    }
+    ::close(fd);
+    return ok;
+}
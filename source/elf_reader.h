@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2020, Irvin Pang <halo.irvin@gmail.com>
+ * All rights reserved.
+ *
+ * see LICENSE file for details
+ */
+
+#ifndef __ADRILL_ELF_READER_H__
+#define __ADRILL_ELF_READER_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+/*
+ * read-only view of an ELF32/ELF64 file, mmap-ed and parsed in place without
+ * copying anything. only the headers, the dynamic segment and the symbol
+ * tables actually looked up get faulted in
+ */
+class ElfReader {
+public:
+    ElfReader();
+    ~ElfReader();
+
+    bool open(const char* path);
+    void close();
+
+    bool is64() const;
+    // p_vaddr of the first PT_LOAD segment
+    uint64_t loadBias() const;
+
+    /*
+     * value of the defined symbol <name>. .dynsym is searched through .gnu.hash
+     * or .hash, then .symtab through a name index built on first use
+     */
+    bool findSymbol(const char* name, uint64_t* outValue);
+
+    /*
+     * hex of NT_GNU_BUILD_ID of <path>, read through its program headers only
+     * without mapping the file. false if there's none
+     */
+    static bool readBuildId(const char* path, std::string* outBuildId);
+
+protected:
+    template<typename E> bool _parse();
+    template<typename E> static bool _readBuildId(int fd, std::string* outBuildId);
+    // pointer to [offset, offset + size) of the file, nullptr if out of range
+    const char* _at(uint64_t offset, uint64_t size) const;
+    bool _inFile(const void* ptr, size_t size) const;
+    void _getSymbol(const char* syms, uint64_t index, uint32_t* outName, uint64_t* outValue, uint16_t* outShndx) const;
+    bool _matchDynsym(uint64_t index, const char* name, uint64_t* outValue) const;
+    template<typename BloomWord> bool _lookupGnuHash(const char* name, uint64_t* outValue) const;
+    bool _lookupSysvHash(const char* name, uint64_t* outValue) const;
+    uint64_t _countGnuHashSymbols() const;
+    void _indexSymbols(const char* syms, uint64_t num, const char* strs, uint64_t strsSize);
+
+protected:
+    char*    _base;
+    size_t   _size;
+    bool     _is64;
+    uint64_t _loadBias;
+    size_t   _symSize;
+    // .dynsym and what's needed to look it up
+    const char*     _dynsym;
+    uint64_t        _dynsymNum;
+    const char*     _dynstr;
+    uint64_t        _dynstrSize;
+    const uint32_t* _gnuHash;
+    const uint32_t* _sysvHash;
+    // .symtab, which is only there if not stripped
+    const char*     _symtab;
+    uint64_t        _symtabNum;
+    const char*     _strtab;
+    uint64_t        _strtabSize;
+    // name => value, keys point into the mapped string tables
+    bool _indexed;
+    std::unordered_map<std::string_view, uint64_t> _index;
+
+};
+
+#endif // __ADRILL_ELF_READER_H__
@@ -5,6 +5,8 @@
  * see LICENSE file for details
  */
 
+#include <errno.h>
+#include <string.h>
 #include <dirent.h>
 #include <unistd.h>
 
@@ -0,0 +1,324 @@
+/*
+ * Copyright (c) 2020, Irvin Pang <halo.irvin@gmail.com>
+ * All rights reserved.
+ *
+ * see LICENSE file for details
+ */
+
+#include <poll.h>
+#include <time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <sys/signalfd.h>
+#include <vector>
+#include <algorithm>
+
+#include "macros.h"
+#include "clock.h"
+#include "injector.h"
+#include "process_scanner.h"
+#include "fork_follower.h"
+
+// stops are announced by SIGCHLD, which could be consumed by another
+// signalfd(e.g., of a blocking PtraceWrapper wait), so sleep in slices
+#define FOLLOW_POLL_SLICE_MS 10
+
+ForkFollower::ForkFollower(ProcessScanner* scanner, Injector* injector)
+: _scanner(scanner)
+, _injector(injector)
+, _parentPid(0)
+, _following(false)
+, _handedOver(0)
+, _sigFd(-1) {
+}
+
+ForkFollower::~ForkFollower() {
+    this->stop();
+    closeChildSignalFd(this->_sigFd);
+}
+
+int ForkFollower::handedOver() const {
+    return this->_handedOver;
+}
+
+bool ForkFollower::start(pid_t parent) {
+    bool ok = true;
+    do {
+        // seized, so children are seized as well and zygote needs no workaround
+        ok &= this->_parent.attach(parent, PtraceWrapper::ATTACH_SEIZE);
+        BREAK_IF_WITH_LOGE(!ok, "[!] failed to attach to process %d: %s\n", parent, ::strerror(errno));
+        this->_parentPid = parent;
+
+        ok &= this->_parent.setOptions(PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK | PTRACE_O_TRACECLONE);
+        BREAK_IF_WITH_LOGE(!ok, "[!] failed to trace forks of process %d\n", parent);
+
+        if (this->_sigFd == -1) {
+            this->_sigFd = openChildSignalFd();
+        }
+
+        ok &= this->_parent.kontinue();
+        BREAK_IF_WITH_LOGE(!ok, "[!] failed to resume process %d\n", parent);
+        this->_following = true;
+    } while (false);
+
+    if (!ok) {
+        this->_parent.detach();
+        this->_parentPid = 0;
+    }
+    return ok;
+}
+
+bool ForkFollower::run(int count) {
+    while (this->_following || this->_injector->inFlight()) {
+        if (this->_following && count && this->_handedOver >= count) {
+            // enough of them, the rest are not to be slowed down any more
+            this->_unfollow();
+            continue;
+        }
+        if (this->_reap()) {
+            continue;
+        }
+
+        int64_t nearest = this->_injector->expire();
+        int timeout = FOLLOW_POLL_SLICE_MS;
+        if (nearest >= 0) {
+            timeout = (int)std::min<int64_t>((nearest - monotonicNs() + 999999) / 1000000, timeout);
+        }
+        struct pollfd pfd = { this->_sigFd, POLLIN, 0 };
+        if (::poll(&pfd, this->_sigFd != -1 ? 1 : 0, std::max(timeout, 0)) > 0) {
+            struct signalfd_siginfo sigInfo;
+            while (::read(this->_sigFd, &sigInfo, sizeof(sigInfo)) == sizeof(sigInfo));
+        }
+    }
+    this->stop();
+
+    bool ok = this->_handedOver > 0;
+    for (const Injector::Result& result : this->_injector->results()) {
+        ok &= result.ok;
+    }
+    return ok;
+}
+
+void ForkFollower::stop() {
+    this->_unfollow();
+}
+
+void ForkFollower::_unfollow() {
+    if (this->_parentPid) {
+        this->_parent.detach();
+        this->_parentPid = 0;
+    }
+    for (auto& entry : this->_children) {
+        Child& child = entry.second;
+        if (!child.born) {
+            // forked but not stopped yet, it can't be detached till then
+            child.ptrace->expectSignals({ 0 });
+            child.ptrace->waitExpected();
+        }
+        child.ptrace->detach();
+    }
+    this->_children.clear();
+    this->_following = false;
+}
+
+bool ForkFollower::_reap() {
+    // the children handed over are the injector's to reap. the rest are
+    // waited for one by one as well, so nothing else of the process is taken
+    bool reaped = this->_injector->reap();
+    while (this->_parentPid) {
+        int status = 0;
+        PtraceWrapper::WaitResult result = this->_parent.pollStatus(&status);
+        if (result == PtraceWrapper::WAIT_PENDING) {
+            break;
+        }
+        reaped = true;
+        if (result == PtraceWrapper::WAIT_FAILED) {
+            LOGGER_LOGE("[!] process %d is no longer traced\n", this->_parentPid);
+            this->_parentPid = 0;
+            this->_unfollow();
+            break;
+        }
+        this->_onParent(status);
+    }
+
+    std::vector<pid_t> pids;
+    for (auto& entry : this->_children) {
+        pids.push_back(entry.first);
+    }
+    for (pid_t pid : pids) {
+        // until it's handed over, dropped or gone
+        while (this->_children.count(pid)) {
+            Child& child = this->_children[pid];
+            int status = 0;
+            PtraceWrapper::WaitResult result = child.ptrace->pollStatus(&status);
+            if (result == PtraceWrapper::WAIT_PENDING) {
+                break;
+            }
+            reaped = true;
+            if (result == PtraceWrapper::WAIT_FAILED) {
+                this->_children.erase(pid);
+                break;
+            }
+            if (child.born) {
+                this->_onChild(pid, status);
+            } else {
+                this->_newChild(pid, status);
+            }
+        }
+    }
+    return reaped;
+}
+
+void ForkFollower::_onParent(int status) {
+    if (WIFEXITED(status) || WIFSIGNALED(status)) {
+        LOGGER_LOGE("[!] process %d has exited\n", this->_parentPid);
+        this->_parentPid = 0;
+        this->_unfollow();
+        return;
+    }
+    // tell the wrapper it's stopped, then let it go on. fork events,
+    // group-stops and interrupts carry no signal to deliver
+    this->_parent.expectSignals({ 0 });
+    this->_parent.onStatus(status);
+    int event = status >> 16;
+    if (event == PTRACE_EVENT_FORK || event == PTRACE_EVENT_VFORK || event == PTRACE_EVENT_CLONE) {
+        this->_onFork();
+    }
+    this->_parent.kontinue(event == 0 ? WSTOPSIG(status) : 0);
+}
+
+void ForkFollower::_onFork() {
+    // the child is traced from then on, stopped or about to be
+    unsigned long msg = 0;
+    if (::ptrace(PTRACE_GETEVENTMSG, this->_parentPid, nullptr, &msg) == -1) {
+        LOGGER_LOGE("[!] failed to get the child forked by process %d: %s\n", this->_parentPid, ::strerror(errno));
+        return;
+    }
+    pid_t pid = (pid_t)msg;
+    Child& child = this->_children[pid];
+    child.ptrace.reset(new PtraceWrapper());
+    child.ptrace->adopt(pid, true);
+    child.born = false;
+}
+
+void ForkFollower::_newChild(pid_t pid, int status) {
+    Child& child = this->_children[pid];
+    if (WIFEXITED(status) || WIFSIGNALED(status)) {
+        this->_children.erase(pid);
+        return;
+    }
+    // threads of the parent, through PTRACE_O_TRACECLONE, are none of our business
+    char path[64];
+    ::snprintf(path, sizeof(path), "/proc/%d/task/%d", this->_parentPid, pid);
+    if (::access(path, F_OK) == 0) {
+        ::ptrace(PTRACE_DETACH, pid, nullptr, 0);
+        this->_children.erase(pid);
+        return;
+    }
+
+    child.ptrace->expectSignals({ 0 });
+    child.ptrace->onStatus(status);
+    child.born = true;
+    child.bornNs = monotonicNs();
+    child.recheck = 0;
+    child.inSyscall = false;
+    child.matched = false;
+    // its own children are no concern, but an exec tells it's settled. syscall
+    // stops are told from SIGTRAP, so entries and exits pair up
+    child.ptrace->setOptions(PTRACE_O_TRACEEXEC | PTRACE_O_TRACESYSGOOD);
+
+    // the name of the parent may match already, e.g., for a non-zygote parent
+    if (this->_scanner->matches(pid)) {
+        this->_handOver(pid, &child);
+    } else {
+        child.ptrace->kontinueSyscall();
+    }
+}
+
+void ForkFollower::_onChild(pid_t pid, int status) {
+    Child& child = this->_children[pid];
+    if (WIFEXITED(status) || WIFSIGNALED(status)) {
+        this->_children.erase(pid);
+        return;
+    }
+    child.ptrace->expectSignals({ 0 });
+    child.ptrace->onStatus(status);
+
+    int event = status >> 16;
+    int signal = WSTOPSIG(status);
+    if (event == PTRACE_EVENT_EXEC) {
+        // whatever it is now, it won't rename any more
+        if (this->_scanner->matches(pid)) {
+            this->_handOver(pid, &child);
+        } else {
+            this->_drop(pid, &child);
+        }
+        return;
+    }
+
+    if (event == 0 && signal == (SIGTRAP | 0x80)) {
+        // a syscall entry or exit, they alternate from the first stop on
+        child.inSyscall = !child.inSyscall;
+        if (child.matched) {
+            this->_handOver(pid, &child);
+            return;
+        }
+        // x0/r0 holds the result by the exit on arm, so look at the entry only
+        long nr = -1;
+        intptr_t arg0 = 0;
+        if (child.inSyscall && child.ptrace->getSyscall(&nr, &arg0) && nr == __NR_prctl && arg0 == PR_SET_NAME) {
+            child.recheck = FOLLOW_RECHECK_SYSCALLS;
+        }
+        if (child.recheck > 0) {
+            if (this->_scanner->matches(pid)) {
+                // the injector can't run anything from an entry stop, the
+                // syscall is about to be made. let it be, and take the exit
+                if (child.inSyscall) {
+                    child.matched = true;
+                    child.ptrace->kontinueSyscall();
+                    return;
+                }
+                this->_handOver(pid, &child);
+                return;
+            }
+            if (-- child.recheck == 0) {
+                // renamed as something else
+                this->_drop(pid, &child);
+                return;
+            }
+        }
+        signal = 0;
+    } else if (event != 0) {
+        signal = 0;
+    }
+
+    // a matched one is due at its next exit anyway
+    if (!child.matched && monotonicNs() - child.bornNs > (int64_t)FOLLOW_CHILD_TIMEOUT_MS * 1000000) {
+        this->_drop(pid, &child);
+        return;
+    }
+    child.ptrace->kontinueSyscall(signal);
+}
+
+void ForkFollower::_handOver(pid_t pid, Child* child) {
+    LOGGER_LOGI("[>] child %d of process %d matched %.1fms after fork\n", pid, this->_parentPid,
+        (monotonicNs() - child->bornNs) / 1e6);
+    // it's stopped and traced by us already, so there's no attach at all.
+    // the wrapper is dropped without detaching, the injector takes over
+    child->ptrace->setOptions(0);
+    this->_children.erase(pid);
+    ++ this->_handedOver;
+    this->_injector->adopt(pid, true);
+}
+
+void ForkFollower::_drop(pid_t pid, Child* child) {
+    child->ptrace->detach();
+    this->_children.erase(pid);
+}
@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2020, Irvin Pang <halo.irvin@gmail.com>
+ * All rights reserved.
+ *
+ * see LICENSE file for details
+ */
+
+#ifndef __ADRILL_FORK_FOLLOWER_H__
+#define __ADRILL_FORK_FOLLOWER_H__
+
+#include <memory>
+#include <unordered_map>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "ptrace_wrapper.h"
+
+class Injector;
+class ProcessScanner;
+
+// how long a child is followed for its name, and how many syscalls the name is
+// rechecked for after a prctl(PR_SET_NAME), as argv[0] is rewritten right after
+#define FOLLOW_CHILD_TIMEOUT_MS 5000
+#define FOLLOW_RECHECK_SYSCALLS 64
+
+/*
+ * stays attached to a parent, e.g., zygote, with PTRACE_O_TRACEFORK & co.,
+ * so its children are traced from their very first instruction. each one is
+ * run syscall by syscall until it specializes, i.e., renames itself, then
+ * handed over to the Injector at that syscall exit stop if its name matches,
+ * before any app code runs. the rest are let go
+ */
+class ForkFollower {
+public:
+    ForkFollower(ProcessScanner* scanner, Injector* injector);
+    ~ForkFollower();
+
+    /*
+     * seize <parent> and trace its forks from then on
+     */
+    bool start(pid_t parent);
+
+    /*
+     * follow until <count> children are handed over(0 for no limit) and
+     * their injections are done, or the parent is gone. true if all the
+     * injections succeeded
+     */
+    bool run(int count);
+
+    /*
+     * detach from the parent and the children not handed over
+     */
+    void stop();
+
+    int handedOver() const;
+
+protected:
+    struct Child {
+        std::unique_ptr<PtraceWrapper> ptrace;
+        // its first stop taken, learned of by a fork event of the parent before
+        bool    born;
+        int64_t bornNs;
+        // syscalls left to recheck the name for
+        int     recheck;
+        // between the entry & exit stops of a syscall
+        bool    inSyscall;
+        // matched at an entry stop, to be handed over at the exit
+        bool    matched;
+    };
+
+    bool _reap();
+    void _onParent(int status);
+    void _onChild(pid_t pid, int status);
+    // of a fork event of the parent
+    void _onFork();
+    void _newChild(pid_t pid, int status);
+    void _handOver(pid_t pid, Child* child);
+    void _drop(pid_t pid, Child* child);
+    void _unfollow();
+
+protected:
+    ProcessScanner* _scanner;
+    Injector*       _injector;
+    PtraceWrapper   _parent;
+    pid_t           _parentPid;
+    bool            _following;
+    int             _handedOver;
+    // signalfd of SIGCHLD to sleep on between stops
+    int             _sigFd;
+    std::unordered_map<pid_t, Child> _children;
+
+};
+
+#endif // __ADRILL_FORK_FOLLOWER_H__
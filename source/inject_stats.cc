@@ -0,0 +1,248 @@
+/*
+ * Copyright (c) 2020, Irvin Pang <halo.irvin@gmail.com>
+ * All rights reserved.
+ *
+ * see LICENSE file for details
+ */
+
+#include <stdio.h>
+#include <algorithm>
+
+#include "macros.h"
+#include "inject_stats.h"
+
+// held times up to 2^(n-2)ms, then the rest
+#define HELD_HISTOGRAM_BUCKETS 13
+#define HELD_HISTOGRAM_WIDTH   40
+
+typedef int64_t (*Figure)(const Injector::Result& result);
+
+// phases of an injection, mostly the stages of Injector, in the order they go
+static const struct {
+    const char* name;
+    Figure      ns;
+} kPhases[] = {
+    { "resolve", [](const Injector::Result& r) { return r.stats.stageNs[Injector::STAGE_QUEUED]; } },
+    { "attach",  [](const Injector::Result& r) { return r.stats.stageNs[Injector::STAGE_ATTACH]; } },
+    { "stage",   [](const Injector::Result& r) { return r.stats.stageNs[Injector::STAGE_STAGE]; } },
+    { "deliver", [](const Injector::Result& r) { return r.stats.stageNs[Injector::STAGE_DELIVER]; } },
+    { "call",    [](const Injector::Result& r) { return r.stats.stageNs[Injector::STAGE_CALL]; } },
+    { "verify",  [](const Injector::Result& r) { return r.stats.stageNs[Injector::STAGE_VERIFY]; } },
+    { "restore", [](const Injector::Result& r) { return r.stats.restoreNs; } },
+    { "detach",  [](const Injector::Result& r) { return r.stats.stageNs[Injector::STAGE_DETACH] - r.stats.restoreNs; } },
+    { "load",    [](const Injector::Result& r) { return r.stats.stageNs[Injector::STAGE_LOAD]; } },
+};
+
+static std::string jsonFigures(const std::initializer_list<std::pair<const char*, long long>>& figures) {
+    std::string json = "{";
+    char field[64];
+    for (const auto& figure : figures) {
+        ::snprintf(field, sizeof(field), "\"%s\":%lld,", figure.first, figure.second);
+        json += field;
+    }
+    json.back() = '}';
+    return json;
+}
+
+// tracee held in all, and the part of it not running remote calls
+static int64_t heldNs(const Injector::Result& result) {
+    return result.stats.ptrace.heldNs;
+}
+
+static int64_t stoppedNs(const Injector::Result& result) {
+    const PtraceWrapper::Stats& stats = result.stats.ptrace;
+    int64_t ns = stats.heldNs;
+    for (uint32_t i = 0; i < std::min(stats.heldRuns, (uint32_t)MAX_HELD_RUNS); ++ i) {
+        ns -= stats.heldRunNs[i];
+    }
+    return ns;
+}
+
+static std::string heldToJson(const PtraceWrapper::Stats& stats, int64_t stopped) {
+    std::string json;
+    char field[64];
+    ::snprintf(field, sizeof(field), "{\"us\":%lld,\"stopped_us\":%lld,\"calls_us\":[",
+        (long long)(stats.heldNs / 1000), (long long)(stopped / 1000));
+    json += field;
+    for (uint32_t i = 0; i < std::min(stats.heldRuns, (uint32_t)MAX_HELD_RUNS); ++ i) {
+        ::snprintf(field, sizeof(field), "%s%lld", i ? "," : "", (long long)(stats.heldRunNs[i] / 1000));
+        json += field;
+    }
+    json += "]}";
+    return json;
+}
+
+static std::string taskToJson(const PtraceWrapper::Stats& stats) {
+    if (!stats.taskCounted) {
+        return "null";
+    }
+    const TaskCounters& before = stats.taskBefore;
+    const TaskCounters& after = stats.taskAfter;
+    return jsonFigures({
+        { "minflt", (long long)(after.minorFaults - before.minorFaults) },
+        { "majflt", (long long)(after.majorFaults - before.majorFaults) },
+        { "vcsw", (long long)(after.voluntarySwitches - before.voluntarySwitches) },
+        { "nivcsw", (long long)(after.involuntarySwitches - before.involuntarySwitches) },
+        { "cpu_us", (long long)(after.cpuNs - before.cpuNs) / 1000 },
+        { "delay_us", (long long)(after.runDelayNs - before.runDelayNs) / 1000 },
+    });
+}
+
+std::string statsToJson(const Injector::Result& result) {
+    const Injector::Stats& stats = result.stats;
+    std::string json;
+    char field[160];
+    ::snprintf(field, sizeof(field), "{\"pid\":%d,\"ok\":%s,\"stage\":\"%s\",\"via\":\"%s\",\"elapsed_us\":%lld,\"phases_us\":{",
+        result.pid, result.ok ? "true" : "false", Injector::stageName(result.stage),
+        result.viaAgent ? "agent" : "ptrace", (long long)(result.elapsedNs / 1000));
+    json += field;
+    for (const auto& phase : kPhases) {
+        ::snprintf(field, sizeof(field), "\"%s\":%lld,", phase.name, (long long)(phase.ns(result) / 1000));
+        json += field;
+    }
+    json.back() = '}';
+    json += ",\"ptrace\":" + jsonFigures({
+        { "requests", stats.ptrace.ptraceCalls },
+        { "stops", stats.ptrace.stops },
+        { "bytes_read", (long long)stats.ptrace.bytesRead },
+        { "bytes_written", (long long)stats.ptrace.bytesWritten },
+        { "run_us", stats.ptrace.runNs / 1000 },
+    });
+    json += ",\"remote\":" + jsonFigures({
+        { "calls", stats.remote.calls },
+        { "syscalls", stats.remote.syscalls },
+        { "chains", stats.remote.chains },
+        { "us", stats.remote.ns / 1000 },
+    });
+    json += ",\"held\":" + heldToJson(stats.ptrace, stoppedNs(result));
+    json += ",\"task\":" + taskToJson(stats.ptrace);
+    json += "}";
+    return json;
+}
+
+void StatsAggregator::add(const Injector::Result& result) {
+    this->_results.push_back(result);
+}
+
+size_t StatsAggregator::count() const {
+    return this->_results.size();
+}
+
+const std::vector<Injector::Result>& StatsAggregator::results() const {
+    return this->_results;
+}
+
+// summary of one figure over all the results, microseconds for times
+static std::string summarize(const std::vector<Injector::Result>& results, Figure figure, int64_t unit) {
+    std::vector<int64_t> values;
+    values.reserve(results.size());
+    for (const Injector::Result& result : results) {
+        values.push_back(figure(result) / unit);
+    }
+    if (values.empty()) {
+        return "{}";
+    }
+    std::sort(values.begin(), values.end());
+    long long sum = 0;
+    for (int64_t value : values) {
+        sum += value;
+    }
+    // nearest rank
+    auto percentile = [&values](int p) {
+        size_t rank = (values.size() * p + 99) / 100;
+        return (long long)values[rank ? rank - 1 : 0];
+    };
+    return jsonFigures({
+        { "min", values.front() },
+        { "p50", percentile(50) },
+        { "p90", percentile(90) },
+        { "max", values.back() },
+        { "mean", sum / (long long)values.size() },
+    });
+}
+
+std::string StatsAggregator::toJson() const {
+    size_t ok = std::count_if(this->_results.begin(), this->_results.end(), [](const Injector::Result& result) {
+        return result.ok;
+    });
+    std::string json;
+    char field[64];
+    ::snprintf(field, sizeof(field), "{\"runs\":%zu,\"ok\":%zu", this->_results.size(), ok);
+    json += field;
+    json += ",\"elapsed_us\":" + summarize(this->_results, [](const Injector::Result& r) { return r.elapsedNs; }, 1000);
+    json += ",\"phases_us\":{";
+    for (const auto& phase : kPhases) {
+        json += std::string("\"") + phase.name + "\":" + summarize(this->_results, phase.ns, 1000) + ",";
+    }
+    json.back() = '}';
+    json += ",\"ptrace_requests\":" + summarize(this->_results, [](const Injector::Result& r) {
+        return (int64_t)r.stats.ptrace.ptraceCalls;
+    }, 1);
+    json += ",\"bytes\":" + summarize(this->_results, [](const Injector::Result& r) {
+        return (int64_t)(r.stats.ptrace.bytesRead + r.stats.ptrace.bytesWritten);
+    }, 1);
+    json += ",\"run_us\":" + summarize(this->_results, [](const Injector::Result& r) { return r.stats.ptrace.runNs; }, 1000);
+    json += ",\"held_us\":" + summarize(this->_results, heldNs, 1000);
+    json += ",\"stopped_us\":" + summarize(this->_results, stoppedNs, 1000);
+    json += ",\"nivcsw\":" + summarize(this->_results, [](const Injector::Result& r) {
+        const PtraceWrapper::Stats& stats = r.stats.ptrace;
+        return stats.taskCounted ? (int64_t)(stats.taskAfter.involuntarySwitches - stats.taskBefore.involuntarySwitches) : 0;
+    }, 1);
+    json += ",\"held_ms_hist\":{";
+    std::vector<size_t> counts = this->_heldHistogram();
+    for (size_t i = 0; i < counts.size(); ++ i) {
+        char field[64];
+        if (i + 1 < counts.size()) {
+            ::snprintf(field, sizeof(field), "\"le_%d\":%zu,", 1 << i, counts[i]);
+        } else {
+            ::snprintf(field, sizeof(field), "\"gt_%d\":%zu}", 1 << (i - 1), counts[i]);
+        }
+        json += field;
+    }
+    json += "}";
+    return json;
+}
+
+std::vector<size_t> StatsAggregator::_heldHistogram() const {
+    // <=1ms, <=2ms, ... <=2^(n-2)ms, and the rest
+    std::vector<size_t> counts(HELD_HISTOGRAM_BUCKETS, 0);
+    for (const Injector::Result& result : this->_results) {
+        if (!heldNs(result)) {
+            continue;
+        }
+        size_t bucket = 0;
+        while (bucket + 1 < counts.size() && heldNs(result) > ((int64_t)1000000 << bucket)) {
+            ++ bucket;
+        }
+        ++ counts[bucket];
+    }
+    return counts;
+}
+
+void StatsAggregator::printHistogram() const {
+    std::vector<size_t> counts = this->_heldHistogram();
+    size_t first = 0, last = 0, most = 0, held = 0;
+    for (size_t i = 0; i < counts.size(); ++ i) {
+        held += counts[i];
+        if (counts[i]) {
+            first = most ? first : i;
+            last = i;
+            most = std::max(most, counts[i]);
+        }
+    }
+    if (!most) {
+        LOGGER_LOGI("[>] no tracee held in %zu runs\n", this->_results.size());
+        return;
+    }
+    LOGGER_LOGI("[>] tracee held in %zu of %zu runs:\n", held, this->_results.size());
+    for (size_t i = first; i <= last; ++ i) {
+        char bound[16];
+        if (i + 1 < counts.size()) {
+            ::snprintf(bound, sizeof(bound), "<= %d", 1 << i);
+        } else {
+            ::snprintf(bound, sizeof(bound), " > %d", 1 << (i - 1));
+        }
+        std::string bar((counts[i] * HELD_HISTOGRAM_WIDTH + most - 1) / most, '#');
+        LOGGER_LOGI("    %8s ms %6zu %s\n", bound, counts[i], bar.c_str());
+    }
+}
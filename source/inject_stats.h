@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2020, Irvin Pang <halo.irvin@gmail.com>
+ * All rights reserved.
+ *
+ * see LICENSE file for details
+ */
+
+#ifndef __ADRILL_INJECT_STATS_H__
+#define __ADRILL_INJECT_STATS_H__
+
+#include <string>
+#include <vector>
+
+#include "injector.h"
+
+/*
+ * a result of Injector as one line of json, to track injection latency
+ * across devices and OS versions:
+ *
+ *   {"pid":..,"ok":..,"stage":"..","via":"ptrace","elapsed_us":..,
+ *    "phases_us":{"resolve":..,"attach":..,"stage":..,"deliver":..,"call":..,
+ *                 "verify":..,"restore":..,"detach":..,"load":..},
+ *    "ptrace":{"requests":..,"stops":..,"bytes_read":..,"bytes_written":..,"run_us":..},
+ *    "remote":{"calls":..,"syscalls":..,"chains":..,"us":..},
+ *    "held":{"us":..,"stopped_us":..,"calls_us":[..]},
+ *    "task":{"minflt":..,"majflt":..,"vcsw":..,"nivcsw":..,"cpu_us":..,"delay_us":..}}
+ *
+ * where "call" is the dlopen chain including the tail munmap of the arena,
+ * which runs within one stop of tracee and is not told apart. "held" is how
+ * long the thread traced runs none of its own code, split into the remote
+ * calls and the rest of time it stays stopped. "task" is the counters of
+ * that thread gone up from before attaching to right after detached, null
+ * if /proc didn't tell
+ */
+std::string statsToJson(const Injector::Result& result);
+
+/*
+ * min, p50, p90, max and mean of each figure above over repeated runs
+ */
+class StatsAggregator {
+public:
+    void add(const Injector::Result& result);
+    size_t count() const;
+    const std::vector<Injector::Result>& results() const;
+
+    /*
+     * {"runs":..,"ok":..,"elapsed_us":{"min":..,"p50":..,"p90":..,"max":..,"mean":..},
+     *  "phases_us":{"resolve":{..},..},"ptrace_requests":{..},"bytes":{..},"run_us":{..},
+     *  "held_us":{..},"stopped_us":{..},"nivcsw":{..},
+     *  "held_ms_hist":{"le_1":..,"le_2":..,..,"le_2048":..,"gt_2048":..}}
+     */
+    std::string toJson() const;
+
+    /*
+     * histogram of "held" above in the log, buckets of powers of 2 in ms
+     */
+    void printHistogram() const;
+
+protected:
+    // runs by bucket of held time, the ones never held(e.g., via agent) left out
+    std::vector<size_t> _heldHistogram() const;
+
+protected:
+    std::vector<Injector::Result> _results;
+
+};
+
+#endif // __ADRILL_INJECT_STATS_H__
@@ -0,0 +1,1133 @@
+/*
+ * Copyright (c) 2020, Irvin Pang <halo.irvin@gmail.com>
+ * All rights reserved.
+ *
+ * see LICENSE file for details
+ */
+
+#include <poll.h>
+#include <time.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <sys/ptrace.h>
+#include <sys/auxv.h>
+#include <sys/syscall.h>
+#include <sys/sendfile.h>
+#include <sys/signalfd.h>
+#include <linux/memfd.h>
+
+#include "macros.h"
+#include "clock.h"
+#include "sdk_code.h"
+#include "elf_dlfcn.h"
+#include "file_utils.h"
+#include "call_procedure.h"
+#include "remote_arena.h"
+#include "maps_snapshot.h"
+#include "agent_client.h"
+#include "injector.h"
+
+// stops are announced by SIGCHLD, which could be consumed by another
+// signalfd(e.g., of a blocking PtraceWrapper wait), so sleep in slices
+#define INJECT_POLL_SLICE_MS 10
+// how often the thread spawned for dlopen is checked on, and the room
+// for its dlerror copied
+#define INJECT_LOAD_POLL_NS  1000000
+#define INJECT_ERROR_SIZE    512
+
+// the thread's results and its copy of the error share a page
+static_assert(MAX_CHAIN_CALLS * PT_SIZE + INJECT_ERROR_SIZE <= 4096, "no room for the error in the shared page");
+
+uintptr_t resolveRemoteFunction(const char* name, uintptr_t localAddr, const MapsSnapshot::Module& localModule, const MapsSnapshot::Module& remoteModule) {
+    // overcome address space layout randomization(ASLR)
+    uintptr_t remoteAddr = 0;
+    do {
+        BREAK_IF_WITH_LOGE(!localAddr,
+            "[!] func '%s' is nullptr: %s\n", name, ::dlerror());
+        BREAK_IF_WITH_LOGE(::strcmp(localModule.path, remoteModule.path) != 0,
+            "[!] local module(%s) and remote module(%s) should refer to the same path\n", localModule.path, remoteModule.path);
+        BREAK_IF_WITH_LOGE(!localModule.start || !remoteModule.start,
+            "[!] local/remote module '%s' not found\n", localModule.path);
+        BREAK_IF_WITH_LOGE(localAddr < localModule.start || localAddr > localModule.end,
+            "[!] func '%s'(0x%zx) is not within module '%s'(0x%zx-0x%zx)\n", name, localAddr, localModule.path, localModule.start, localModule.end);
+        // same module shares the same offset
+        remoteAddr = localAddr - localModule.start + remoteModule.start;
+    } while (false);
+    return remoteAddr;
+}
+
+uintptr_t resolveLocalFunction(const std::vector<std::string>& symbols) {
+    uintptr_t localAddr = 0;
+    for (const auto& symbol : symbols) {
+        localAddr = (uintptr_t)dlsym(RTLD_DEFAULT, symbol.c_str());
+        if (localAddr > 0) break;
+    }
+    return localAddr;
+}
+
+#if defined(__ANDROID__)
+
+std::string getBionicLib(const std::string& libname) {
+    FileSearcher searcher;
+    // Android version < 10.x
+    searcher.addSearchPath("/system/lib" $arch_64("64") "/");
+    // Android version >= 10.x makes runtime binaries
+    // independently OTA updatable through APEX bundles
+    if (SDKCode::get() >= SDKCode::Q) {
+        /* and makes it search first */
+        std::string runtimeRoot("/apex/com.android.runtime");
+        searcher.addSearchPath(runtimeRoot.append("/lib" $arch_64("64") "/bionic/"), true);
+    }
+
+    std::string location = searcher.resolveFullPath(libname);
+    if (location.empty()) {
+        LOGGER_LOGE("file %s not found!\n", libname.c_str());
+    }
+    return location;
+}
+
+std::string getLinkerBin() {
+    FileSearcher searcher;
+    // Android version < 10.x
+    searcher.addSearchPath("/system/bin/");
+    // Android version >= 10.x makes runtime binaries
+    // independently OTA updatable through APEX bundles
+    if (SDKCode::get() >= SDKCode::Q) {
+        /* and makes it search first */
+        searcher.addSearchPath("/apex/com.android.runtime/bin/", true);
+    }
+
+    std::string location = searcher.resolveFullPath("linker" $arch_64("64"));
+    if (location.empty()) {
+        LOGGER_LOGE("linker%s not found!\n", "" $arch_64("64"));
+    }
+    return location;
+}
+
+#else
+
+/*
+ * host build against glibc, where dlopen & pthread_* are in libc or in
+ * libdl/libpthread depending on its version. so the modules are wherever
+ * our own copies of them are, which tracee shares
+ */
+static std::string moduleOf(const void* addr) {
+    Dl_info info;
+    if (!::dladdr(addr, &info) || !info.dli_fname) {
+        LOGGER_LOGE("module of 0x%zx not found!\n", (uintptr_t)addr);
+        return "";
+    }
+    // maps of tracee show the real path
+    return FileSearcher().resolveCanonicalPath(info.dli_fname);
+}
+
+std::string getBionicLib(const std::string& libname) {
+    return moduleOf(libname == "libdl.so" ? (const void*)::dlopen : (const void*)::pthread_create);
+}
+
+std::string getLinkerBin() {
+    return moduleOf((const void*)::getauxval(AT_BASE));
+}
+
+#endif
+
+int parseMemoryBackends(const std::string& name) {
+    if (name.empty() || name == "auto") return PtraceWrapper::MEM_AUTO;
+    if (name == "ptrace")               return PtraceWrapper::MEM_PTRACE;
+    if (name == "vm")                   return PtraceWrapper::MEM_VM | PtraceWrapper::MEM_PTRACE;
+    if (name == "procmem")              return PtraceWrapper::MEM_PROC | PtraceWrapper::MEM_PTRACE;
+    return 0;
+}
+
+std::string memoryBackendsName(int backends) {
+    std::string name;
+    if (backends & PtraceWrapper::MEM_VM)     name += "vm|";
+    if (backends & PtraceWrapper::MEM_PROC)   name += "procmem|";
+    if (backends & PtraceWrapper::MEM_PTRACE) name += "ptrace|";
+    if (!name.empty()) name.pop_back();
+    return name.empty() ? "none" : name;
+}
+
+bool resolveRemoteDlfcn(pid_t pid, SymbolCache* cache, uintptr_t* outDlopen, uintptr_t* outDlerror) {
+    // necessary local & remote modules. mmap/munmap are raw syscalls
+    // in tracee, so libc doesn't need to be resolved. they're searched
+    // once per process, which counts for the daemon
+    static const std::string libdlPath = getBionicLib("libdl.so");
+    static const std::string linkerPath = getLinkerBin();
+    if (libdlPath.empty() || linkerPath.empty()) {
+        return false;
+    }
+
+    // maps of tracee are parsed once for all the modules
+    MapsSnapshot remoteMaps;
+    MapsSnapshot::Module remoteLibdl  { libdlPath.c_str(), 0, 0 };
+    MapsSnapshot::Module remoteLinker { linkerPath.c_str(), 0, 0 };
+    remoteMaps.load(pid);
+    remoteMaps.findModule(libdlPath.c_str(), &remoteLibdl);
+    remoteMaps.findModule(linkerPath.c_str(), &remoteLinker);
+
+    // check target process accessable
+    if (!remoteLinker.end) {
+        LOGGER_LOGE("[!] process %d not found!\n", pid);
+        return false;
+    }
+
+    // the very same files resolved before, no ELF parsing or dlsym at all
+    uintptr_t dlopenOffset = 0;
+    uintptr_t dlerrorOffset = 0;
+    if (remoteLibdl.end &&
+        cache->lookup(libdlPath, "dlopen", &dlopenOffset) &&
+        cache->lookup(libdlPath, "dlerror", &dlerrorOffset)) {
+        *outDlopen = remoteLibdl.start + dlopenOffset;
+        *outDlerror = remoteLibdl.start + dlerrorOffset;
+        return true;
+    }
+    if (cache->lookup(linkerPath, "__dl_dlopen", &dlopenOffset) &&
+        cache->lookup(linkerPath, "__dl_dlerror", &dlerrorOffset)) {
+        *outDlopen = remoteLinker.start + dlopenOffset;
+        *outDlerror = remoteLinker.start + dlerrorOffset;
+        return true;
+    }
+
+    MapsSnapshot localMaps;
+    MapsSnapshot::Module localLibdl  { libdlPath.c_str(), 0, 0 };
+    MapsSnapshot::Module localLinker { linkerPath.c_str(), 0, 0 };
+    localMaps.load(0);
+    localMaps.findModule(libdlPath.c_str(), &localLibdl);
+    localMaps.findModule(linkerPath.c_str(), &localLinker);
+
+    // that's the minimum functions to make it work
+    uintptr_t remoteFuncDlopen  = 0;
+    uintptr_t remoteFuncDlerror = 0;
+    if (localLibdl.end == 0) {
+        ::dlerror();
+        void* handle = elf_dlopen(linkerPath.c_str(), RTLD_PARSE_ELF);
+        if (handle) {
+            remoteFuncDlopen = resolveRemoteFunction("__dl_dlopen", (uintptr_t)elf_dlsym(handle, "__dl_dlopen"), localLinker, remoteLinker);
+            remoteFuncDlerror = resolveRemoteFunction("__dl_dlerror", (uintptr_t)elf_dlsym(handle, "__dl_dlerror"), localLinker, remoteLinker);
+            elf_dlclose(handle);
+        }
+        if (remoteFuncDlopen && remoteFuncDlerror) {
+            cache->store(linkerPath, "__dl_dlopen", remoteFuncDlopen - remoteLinker.start);
+            cache->store(linkerPath, "__dl_dlerror", remoteFuncDlerror - remoteLinker.start);
+        }
+    } else {
+        remoteFuncDlopen = resolveRemoteFunction("dlopen", (uintptr_t)::dlopen, localLibdl, remoteLibdl);
+        remoteFuncDlerror = resolveRemoteFunction("dlerror", (uintptr_t)::dlerror, localLibdl, remoteLibdl);
+        if (remoteFuncDlopen && remoteFuncDlerror) {
+            cache->store(libdlPath, "dlopen", remoteFuncDlopen - remoteLibdl.start);
+            cache->store(libdlPath, "dlerror", remoteFuncDlerror - remoteLibdl.start);
+        }
+    }
+
+    *outDlopen = remoteFuncDlopen;
+    *outDlerror = remoteFuncDlerror;
+    return remoteFuncDlopen && remoteFuncDlerror;
+}
+
+bool resolveRemoteThreadFuncs(pid_t pid, SymbolCache* cache, RemoteThreadFuncs* outFuncs) {
+    static const std::string libcPath = getBionicLib("libc.so");
+    if (libcPath.empty()) {
+        return false;
+    }
+    MapsSnapshot remoteMaps;
+    MapsSnapshot::Module remoteLibc { libcPath.c_str(), 0, 0 };
+    remoteMaps.load(pid);
+    remoteMaps.findModule(libcPath.c_str(), &remoteLibc);
+    if (!remoteLibc.end) {
+        LOGGER_LOGE("[!] %s not found in process %d\n", libcPath.c_str(), pid);
+        return false;
+    }
+
+    const struct {
+        const char* name;
+        uintptr_t   localAddr;
+        uintptr_t*  outAddr;
+    } funcs[] = {
+        { "pthread_create", (uintptr_t)::pthread_create, &outFuncs->create },
+        { "pthread_self",   (uintptr_t)::pthread_self,   &outFuncs->self },
+        { "pthread_detach", (uintptr_t)::pthread_detach, &outFuncs->detach },
+        { "pthread_exit",   (uintptr_t)::pthread_exit,   &outFuncs->exit },
+        { "snprintf",       (uintptr_t)::snprintf,       &outFuncs->format },
+        { "munmap",         (uintptr_t)::munmap,         &outFuncs->unmap },
+    };
+    MapsSnapshot localMaps;
+    MapsSnapshot::Module localLibc { libcPath.c_str(), 0, 0 };
+    for (const auto& func : funcs) {
+        uintptr_t offset = 0;
+        if (!cache->lookup(libcPath, func.name, &offset)) {
+            // local maps are parsed only once something is not cached
+            if (!localLibc.end) {
+                localMaps.load(0);
+                localMaps.findModule(libcPath.c_str(), &localLibc);
+            }
+            uintptr_t remoteAddr = resolveRemoteFunction(func.name, func.localAddr, localLibc, remoteLibc);
+            if (!remoteAddr) {
+                return false;
+            }
+            offset = remoteAddr - remoteLibc.start;
+            cache->store(libcPath, func.name, offset);
+        }
+        *func.outAddr = remoteLibc.start + offset;
+    }
+    return true;
+}
+
+bool doInject(pid_t pid, const std::string& libPath, const InjectOptions& options) {
+    Injector injector(libPath, options);
+    injector.add(pid);
+    return injector.run();
+}
+
+struct Injector::Target {
+    Target() : caller(&ptrace), arena(&caller, &ptrace) {}
+
+    size_t        index;
+    pid_t         pid;
+    Stage         stage;
+    PtraceWrapper ptrace;
+    CallProcedure caller;
+    RemoteArena   arena;
+    PtraceRegs    oriRegs;
+    PtraceFpState oriFpState;
+    bool          regsSaved;
+    uintptr_t     remoteFuncDlopen;
+    uintptr_t     remoteFuncDlerror;
+    RemoteThreadFuncs threadFuncs;
+    // memfd of tracee the library is delivered through, or -1
+    int           remoteFd;
+    int           dlopenCall;
+    int           dlerrorCall;
+    int           agentCall;
+    // pthread_create of the main chain, and the chain the thread it
+    // creates runs, whose results are read back once it's through
+    int           createCall;
+    int           copyCall;
+    uintptr_t     loadResultsAddr;
+    uintptr_t     loadErrorAddr;
+    intptr_t      loadResults[MAX_CHAIN_CALLS];
+    // the page of the memfd the thread writes to, mapped here as well, so
+    // it's still readable once the thread has unmapped its side of it
+    intptr_t*     loadShared;
+    int           shareCall;
+    bool          detached;
+    int64_t       startNs;
+    // when the current stage was entered
+    int64_t       stageNs;
+    // CLOCK_MONOTONIC by when the stop waited for should have come
+    int64_t       deadlineNs;
+};
+
+Injector::Injector(const std::string& libPath, const InjectOptions& options)
+: _libPath(libPath)
+, _payloadFd(-1)
+, _payloadSize(0)
+, _options(options)
+, _concurrency(0)
+, _cache(&this->_ownCache)
+, _ready(false)
+, _sigFd(-1) {
+}
+
+Injector::~Injector() {
+    if (this->_cache == &this->_ownCache) {
+        this->_cache->save();
+    }
+    closeChildSignalFd(this->_sigFd);
+    if (this->_payloadFd != -1) {
+        ::close(this->_payloadFd);
+    }
+}
+
+void Injector::setSymbolCache(SymbolCache* cache) {
+    this->_cache = cache ? cache : &this->_ownCache;
+}
+
+void Injector::setConcurrency(int limit) {
+    this->_concurrency = std::max(limit, 0);
+}
+
+void Injector::add(pid_t pid) {
+    this->_add(pid);
+}
+
+Injector::Target* Injector::_add(pid_t pid) {
+    std::unique_ptr<Target> target(new Target());
+    target->index = this->_targets.size();
+    target->pid = pid;
+    target->stage = STAGE_QUEUED;
+    target->regsSaved = false;
+    target->remoteFuncDlopen = target->remoteFuncDlerror = 0;
+    target->dlopenCall = target->dlerrorCall = target->agentCall = target->createCall = target->copyCall = -1;
+    target->shareCall = -1;
+    target->loadResultsAddr = target->loadErrorAddr = 0;
+    target->loadShared = nullptr;
+    target->detached = false;
+    target->remoteFd = -1;
+    target->startNs = target->stageNs = target->deadlineNs = 0;
+    this->_targets.push_back(std::move(target));
+    this->_results.push_back({ pid, false, STAGE_QUEUED, 0, 0, false });
+    return this->_targets.back().get();
+}
+
+const std::vector<Injector::Result>& Injector::results() const {
+    return this->_results;
+}
+
+const char* Injector::stageName(Stage stage) {
+    switch (stage) {
+        case STAGE_QUEUED: return "queued";
+        case STAGE_ATTACH: return "attach";
+        case STAGE_STAGE:  return "stage";
+        case STAGE_DELIVER: return "deliver";
+        case STAGE_CALL:   return "call";
+        case STAGE_VERIFY: return "verify";
+        case STAGE_DETACH: return "detach";
+        case STAGE_LOAD:   return "load";
+        case STAGE_DONE:   return "done";
+    }
+    return "unknown";
+}
+
+bool Injector::_setup() {
+    if (this->_ready) {
+        return true;
+    }
+    errno = 0;
+    if (this->_options.memfdDelivery) {
+        // opened once, then copied to every tracee from the page cache
+        if (this->_libPath.compare(0, 3, "fd:") == 0) {
+            this->_payloadFd = ::fcntl(::atoi(this->_libPath.c_str() + 3), F_DUPFD_CLOEXEC, 0);
+        } else {
+            this->_payloadFd = ::open(this->_libPath.c_str(), O_RDONLY | O_CLOEXEC);
+        }
+        struct stat st;
+        if (this->_payloadFd == -1 || ::fstat(this->_payloadFd, &st) != 0) {
+            LOGGER_LOGE("[!] file '%s' unavailable: %s\n", this->_libPath.c_str(), ::strerror(errno));
+            return false;
+        }
+        this->_payloadSize = (size_t)st.st_size;
+    } else if (::access(this->_libPath.c_str(), R_OK) != 0) {
+        LOGGER_LOGE("[!] file '%s' unavailable: %s\n", this->_libPath.c_str(), ::strerror(errno));
+        return false;
+    }
+    if (this->_cache == &this->_ownCache && !this->_options.symbolCachePath.empty()) {
+        this->_cache->load(this->_options.symbolCachePath);
+    }
+
+    // SIGCHLD is kept pending for signalfd, the same way PtraceWrapper does
+    if (this->_sigFd == -1) {
+        this->_sigFd = openChildSignalFd();
+    }
+    this->_ready = true;
+    return true;
+}
+
+bool Injector::run() {
+    if (!this->_setup()) {
+        return false;
+    }
+
+    size_t next = 0;
+    for (;;) {
+        while (next < this->_targets.size() &&
+            (this->_concurrency == 0 || this->_active.size() < (size_t)this->_concurrency)) {
+            this->_start(this->_targets[next ++].get());
+        }
+        if (this->_active.empty()) {
+            break;
+        }
+        if (this->reap()) {
+            continue;
+        }
+
+        // nothing stopped yet, check for the ones overdue
+        int64_t nearest = this->expire();
+        if (nearest < 0) {
+            continue;
+        }
+
+        int timeout = (int)std::min<int64_t>((nearest - monotonicNs() + 999999) / 1000000, INJECT_POLL_SLICE_MS);
+        struct pollfd pfd = { this->_sigFd, POLLIN, 0 };
+        if (::poll(&pfd, this->_sigFd != -1 ? 1 : 0, timeout) > 0) {
+            struct signalfd_siginfo sigInfo;
+            while (::read(this->_sigFd, &sigInfo, sizeof(sigInfo)) == sizeof(sigInfo));
+        }
+    }
+
+    if (this->_cache == &this->_ownCache) {
+        this->_cache->save();
+    }
+    bool ok = true;
+    for (const Result& result : this->_results) {
+        ok &= result.ok;
+    }
+    return ok;
+}
+
+bool Injector::adopt(pid_t pid, bool seized) {
+    Target* target = this->_add(pid);
+    bool ok = true;
+    do {
+        ok &= this->_setup();
+        BREAK_IF(!ok);
+
+        target->startNs = target->stageNs = monotonicNs();
+        ok &= resolveRemoteDlfcn(target->pid, this->_cache, &target->remoteFuncDlopen, &target->remoteFuncDlerror);
+        BREAK_IF(!ok);
+        ok &= !this->_options.spawnThread || resolveRemoteThreadFuncs(target->pid, this->_cache, &target->threadFuncs);
+        BREAK_IF(!ok);
+
+        target->ptrace.setMemoryBackends(this->_options.memBackends);
+        if (this->_options.waitTimeoutMs) {
+            target->ptrace.setWaitTimeout(this->_options.waitTimeoutMs);
+        }
+        this->_enter(target, STAGE_ATTACH);
+        ok &= target->ptrace.adopt(target->pid, seized);
+        BREAK_IF_WITH_LOGE(!ok, "[!] failed to adopt process %d\n", target->pid);
+
+        this->_active[target->pid] = target;
+        ok &= this->_stage(target);
+        target->deadlineNs = monotonicNs() + (int64_t)target->ptrace.waitTimeout() * 1000000;
+    } while (false);
+
+    if (!ok) {
+        this->_finish(target, false);
+    }
+    return ok;
+}
+
+bool Injector::handleStatus(pid_t pid, int status) {
+    auto it = this->_active.find(pid);
+    if (it != this->_active.end()) {
+        this->_onStatus(it->second, status);
+        return true;
+    }
+    it = this->_strays.find(pid);
+    if (it != this->_strays.end()) {
+        this->_onStray(it->second, it->second->ptrace.onStatus(status));
+        return true;
+    }
+    return false;
+}
+
+int64_t Injector::expire() {
+    int64_t now = monotonicNs();
+    int64_t nearest = -1;
+    std::vector<Target*> overdue;
+    std::vector<Target*> loaded;
+    for (auto& entry : this->_active) {
+        Target* target = entry.second;
+        // nothing to reap from a detached tracee, just check on its thread
+        int64_t deadlineNs = target->deadlineNs;
+        if (target->stage == STAGE_LOAD) {
+            if (this->_loaded(target)) {
+                loaded.push_back(target);
+                continue;
+            }
+            deadlineNs = std::min(deadlineNs, now + INJECT_LOAD_POLL_NS);
+        }
+        if (target->deadlineNs <= now) {
+            overdue.push_back(target);
+        } else if (nearest < 0 || deadlineNs < nearest) {
+            nearest = deadlineNs;
+        }
+    }
+    for (Target* target : loaded) {
+        this->_enter(target, STAGE_VERIFY);
+        this->_finish(target, this->_verify(target));
+    }
+    for (Target* target : overdue) {
+        LOGGER_LOGE("[!] process %d timed out at stage %s\n", target->pid, stageName(target->stage));
+        this->_finish(target, false);
+    }
+    return overdue.empty() && loaded.empty() ? nearest : -1;
+}
+
+size_t Injector::inFlight() const {
+    return this->_active.size();
+}
+
+bool Injector::reap() {
+    // only the tracees of ours are waited for, one by one, so neither other
+    // children of the process nor stops of someone else's tracees are taken.
+    // the ones detached already are checked on by expire()
+    std::vector<Target*> targets;
+    for (auto& entry : this->_active) {
+        if (!entry.second->detached) {
+            targets.push_back(entry.second);
+        }
+    }
+    bool reaped = false;
+    for (Target* target : targets) {
+        // until it's finished, which drops it from the ones in flight
+        while (this->_active.count(target->pid) && !target->detached) {
+            int status = 0;
+            PtraceWrapper::WaitResult result = target->ptrace.pollStatus(&status);
+            if (result == PtraceWrapper::WAIT_PENDING) {
+                break;
+            }
+            reaped = true;
+            if (result == PtraceWrapper::WAIT_FAILED) {
+                LOGGER_LOGE("[!] process %d is no longer traced\n", target->pid);
+                this->_finish(target, false);
+                break;
+            }
+            this->_onStatus(target, status);
+        }
+    }
+
+    // the ones failed to stop in time to be detached, released once they do
+    std::vector<Target*> strays;
+    for (auto& entry : this->_strays) {
+        strays.push_back(entry.second);
+    }
+    for (Target* target : strays) {
+        int status = 0;
+        PtraceWrapper::WaitResult result = target->ptrace.pollStatus(&status);
+        if (result != PtraceWrapper::WAIT_PENDING) {
+            reaped = true;
+            this->_onStray(target, result == PtraceWrapper::WAIT_DONE ? target->ptrace.onStatus(status) : result);
+        }
+    }
+    return reaped;
+}
+
+void Injector::_onStray(Target* target, PtraceWrapper::WaitResult result) {
+    // stopped at last, or gone
+    if (result != PtraceWrapper::WAIT_PENDING) {
+        this->_release(target);
+        this->_strays.erase(target->pid);
+    }
+}
+
+bool Injector::_injectByAgent(Target* target) {
+    AgentClient agent;
+    if (!agent.connect(target->pid)) {
+        return false;
+    }
+    if (this->_options.waitTimeoutMs) {
+        agent.setTimeout(this->_options.waitTimeoutMs);
+    }
+
+    // the same delivery as through ptrace, by the agent instead
+    std::string libPath = this->_libPath;
+    int remoteFd = -1;
+    if (this->_payloadFd != -1) {
+        if (!agent.deliver(this->_payloadFd, this->_payloadSize, &remoteFd) || remoteFd == -1) {
+            return false;
+        }
+        libPath = "/proc/self/fd/" + std::to_string(remoteFd);
+    }
+    LOGGER_LOGI("[-] loading '%s' through the agent in process %d ...\n", libPath.c_str(), target->pid);
+    uintptr_t handle = 0;
+    std::string error;
+    bool answered = agent.dlopen(libPath, RTLD_NOW | RTLD_GLOBAL, &handle, &error);
+    // given up while the agent was on it, it may still load any time later,
+    // so no second load through ptrace. its fd may still be read as well
+    bool abandoned = !answered && agent.abandoned();
+    if (remoteFd != -1 && !abandoned) {
+        agent.closeRemote(remoteFd);
+    }
+    if (!answered && !abandoned) {
+        // never taken, it's stuck somehow, ptrace still works
+        return false;
+    }
+
+    Result& result = this->_results[target->index];
+    result.ok = handle != 0;
+    result.stage = handle ? STAGE_DONE : STAGE_CALL;
+    result.handle = handle;
+    result.viaAgent = true;
+    result.elapsedNs = monotonicNs() - target->startNs;
+    if (handle) {
+        LOGGER_LOGI("[>] agent dlopen return 0x%zx in process %d\n", handle, target->pid);
+    } else if (abandoned) {
+        LOGGER_LOGE("[!] agent dlopen timed out in process %d, not retried as it may still load\n", target->pid);
+    } else {
+        LOGGER_LOGE("[!] process %d: %s\n", target->pid, error.c_str());
+    }
+    this->_enter(target, STAGE_DONE);
+    return true;
+}
+
+bool Injector::_start(Target* target) {
+    bool ok = true;
+    do {
+        target->startNs = target->stageNs = monotonicNs();
+        // no stop of tracee at all if the agent is there
+        if (this->_injectByAgent(target)) {
+            return this->_results[target->index].ok;
+        }
+        ok &= resolveRemoteDlfcn(target->pid, this->_cache, &target->remoteFuncDlopen, &target->remoteFuncDlerror);
+        BREAK_IF(!ok);
+        ok &= !this->_options.spawnThread || resolveRemoteThreadFuncs(target->pid, this->_cache, &target->threadFuncs);
+        BREAK_IF(!ok);
+
+        target->ptrace.setMemoryBackends(this->_options.memBackends);
+        if (this->_options.waitTimeoutMs) {
+            target->ptrace.setWaitTimeout(this->_options.waitTimeoutMs);
+        }
+
+        // attach to target process
+        LOGGER_LOGI("[-] attcahing to process %d ...\n", target->pid);
+        this->_enter(target, STAGE_ATTACH);
+        ok &= target->ptrace.beginAttach(target->pid, this->_options.attachMode);
+        BREAK_IF_WITH_LOGE(!ok, "[!] failed to attach to process %d: %s\n", target->pid, ::strerror(errno));
+
+        target->deadlineNs = monotonicNs() + (int64_t)target->ptrace.waitTimeout() * 1000000;
+        this->_active[target->pid] = target;
+    } while (false);
+
+    if (!ok) {
+        this->_finish(target, false);
+    }
+    return ok;
+}
+
+void Injector::_onStatus(Target* target, int status) {
+    switch (target->ptrace.onStatus(status)) {
+        case PtraceWrapper::WAIT_PENDING:
+            break;
+        case PtraceWrapper::WAIT_DONE:
+            this->_advance(target);
+            break;
+        case PtraceWrapper::WAIT_FAILED:
+            this->_finish(target, false);
+            break;
+    }
+}
+
+void Injector::_advance(Target* target) {
+    if (target->stage == STAGE_DETACH) {
+        // stopped at last, the result is in already
+        this->_release(target);
+        this->_retire(target);
+        return;
+    }
+
+    PtraceWrapper::WaitResult result = PtraceWrapper::WAIT_FAILED;
+    switch (target->stage) {
+        case STAGE_ATTACH: result = target->ptrace.continueAttach(); break;
+        case STAGE_STAGE:  result = target->arena.continueCreate(); break;
+        case STAGE_DELIVER: result = target->caller.continueRemoteSyscall(); break;
+        case STAGE_CALL:   result = target->caller.continueRemoteCallChain(); break;
+        default: break;
+    }
+
+    bool ok = result != PtraceWrapper::WAIT_FAILED;
+    if (result == PtraceWrapper::WAIT_DONE) {
+        // the stage done, on to the next one
+        switch (target->stage) {
+            case STAGE_ATTACH: ok = this->_stage(target); break;
+            // a thread shares its results through a memfd, payload or not
+            case STAGE_STAGE:  ok = this->_payloadFd != -1 || this->_options.spawnThread ? this->_deliver(target) : this->_call(target); break;
+            case STAGE_DELIVER: ok = this->_fill(target) && this->_call(target); break;
+            case STAGE_CALL:
+                target->caller.setCallStack(0);
+                if (this->_options.spawnThread) {
+                    ok = this->_spawned(target);
+                    break;
+                }
+                this->_enter(target, STAGE_VERIFY);
+                this->_finish(target, this->_verify(target));
+                return;
+            default: break;
+        }
+    }
+
+    if (!ok) {
+        this->_finish(target, false);
+    } else {
+        target->deadlineNs = monotonicNs() + (int64_t)target->ptrace.waitTimeout() * 1000000;
+    }
+}
+
+bool Injector::_stage(Target* target) {
+    bool ok = true;
+    do {
+        // save tracee's registers
+        LOGGER_LOGI("[-] saving registers of process %d ...\n", target->pid);
+        ok &= target->ptrace.getRegisters(&target->oriRegs);
+        BREAK_IF_WITH_LOGE(!ok, "[!] failed to save registers of process %d\n", target->pid);
+        // it may be stopped anywhere in user code, where vector registers
+        // are live, and dlopen runs plenty of code clobbering them
+        ok &= target->ptrace.getFpState(&target->oriFpState);
+        BREAK_IF_WITH_LOGE(!ok, "[!] failed to save fp registers of process %d\n", target->pid);
+        target->regsSaved = true;
+
+        // map the arena for params, the chain stub and a stack to run calls on
+        LOGGER_LOGI("[-] creating remote arena in process %d ...\n", target->pid);
+        this->_enter(target, STAGE_STAGE);
+        ok &= target->arena.beginCreate();
+        BREAK_IF_WITH_LOGE(!ok, "[!] failed to create remote arena in process %d\n", target->pid);
+    } while (false);
+    return ok;
+}
+
+bool Injector::_deliver(Target* target) {
+    bool ok = true;
+    do {
+        LOGGER_LOGI("[>] remote arena at 0x%zx in process %d\n", target->arena.base(), target->pid);
+
+        // a raw syscall, memfd_create is exported by bionic since Android 11 only
+        uintptr_t nameAddr = target->arena.allocString("adrill");
+        ok &= nameAddr != 0;
+        BREAK_IF_WITH_LOGE(!ok, "[!] failed to write params to arena 0x%zx\n", target->arena.base());
+        LOGGER_LOGI("[-] creating memfd in process %d ...\n", target->pid);
+        this->_enter(target, STAGE_DELIVER);
+        ok &= target->caller.beginRemoteSyscall(__NR_memfd_create, nameAddr, MFD_CLOEXEC);
+        BREAK_IF_WITH_LOGE(!ok, "[!] failed to call memfd_create\n");
+    } while (false);
+    return ok;
+}
+
+bool Injector::_fill(Target* target) {
+    bool ok = true;
+    int fd = -1;
+    do {
+        intptr_t remoteFd = target->caller.returnValue();
+        ok &= remoteFd >= 0;
+        BREAK_IF_WITH_LOGE(!ok, "[!] remote memfd_create failed in process %d: %s\n", target->pid, ::strerror((int)-remoteFd));
+        target->remoteFd = (int)remoteFd;
+
+        // the very file tracee holds, opened through procfs and written from
+        // here, so the library never goes through the memory of tracee
+        char path[64];
+        ::snprintf(path, sizeof(path), "/proc/%d/fd/%d", target->pid, target->remoteFd);
+        fd = ::open(path, (this->_options.spawnThread ? O_RDWR : O_WRONLY) | O_CLOEXEC);
+        ok &= fd != -1;
+        BREAK_IF_WITH_LOGE(!ok, "[!] failed to open file %s: %s\n", path, ::strerror(errno));
+
+        if (this->_options.spawnThread) {
+            // a page past the library for the thread's results, see _spawn
+            size_t pageSize = (size_t)::sysconf(_SC_PAGESIZE);
+            off_t shareOffset = (off_t)this->_sharedOffset();
+            void* shared = MAP_FAILED;
+            ok &= ::ftruncate(fd, shareOffset + pageSize) == 0
+                && (shared = ::mmap(nullptr, pageSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, shareOffset)) != MAP_FAILED;
+            BREAK_IF_WITH_LOGE(!ok, "[!] failed to map a page of %s: %s\n", path, ::strerror(errno));
+            target->loadShared = (intptr_t*)shared;
+            std::fill(target->loadShared, target->loadShared + MAX_CHAIN_CALLS, CHAIN_RESULT_PENDING);
+        }
+
+        off_t offset = 0;
+        while (ok && (size_t)offset < this->_payloadSize) {
+            ssize_t sent = ::sendfile(fd, this->_payloadFd, &offset, this->_payloadSize - offset);
+            ok &= sent > 0 || (sent < 0 && errno == EINTR);
+        }
+        BREAK_IF_WITH_LOGE(!ok, "[!] failed to copy library into %s: %s\n", path, ::strerror(errno));
+        if (this->_payloadFd != -1) {
+            LOGGER_LOGI("[>] %zu bytes delivered through memfd %d in process %d\n", this->_payloadSize, target->remoteFd, target->pid);
+        }
+    } while (false);
+    if (fd != -1) {
+        ::close(fd);
+    }
+    return ok;
+}
+
+bool Injector::_call(Target* target) {
+    bool ok = true;
+    do {
+        if (target->remoteFd == -1) {
+            LOGGER_LOGI("[>] remote arena at 0x%zx in process %d\n", target->arena.base(), target->pid);
+        }
+
+        // write libpath string into the arena, the memfd is opened by tracee
+        // through its own procfs, no matter what's in the mount namespace
+        char fdPath[32];
+        const char* libPath = this->_libPath.c_str();
+        if (this->_payloadFd != -1) {
+            ::snprintf(fdPath, sizeof(fdPath), "/proc/self/fd/%d", target->remoteFd);
+            libPath = fdPath;
+        }
+        uintptr_t libPathAddr = target->arena.allocString(libPath);
+        ok &= libPathAddr != 0;
+        BREAK_IF_WITH_LOGE(!ok, "[!] failed to write params to arena 0x%zx\n", target->arena.base());
+        LOGGER_LOGI("[>] params written through %s\n", memoryBackendsName(target->ptrace.lastMemoryBackends()).c_str());
+
+        // dlopen, dlerror in case it fails, then munmap the arena along with
+        // the stub itself as the tail step. all done within one stop of tracee.
+        // or that's done by a thread spawned, and the stop only creates it
+        LOGGER_LOGI("[-] calling remote dlopen '%s' in process %d ...\n", libPath, target->pid);
+        CallChain chain;
+        CallChain thread;
+        CallChain& load = this->_options.spawnThread ? thread : chain;
+        if (this->_options.spawnThread) {
+            // nobody joins it
+            int selfCall = thread.add(target->threadFuncs.self, {});
+            thread.add(target->threadFuncs.detach, { CallChain::resultOf(selfCall) });
+        }
+        target->dlopenCall = load.add(target->remoteFuncDlopen, { (intptr_t)libPathAddr, RTLD_NOW | RTLD_GLOBAL, /*possible caller since Android7.0*/nullptr });
+        target->dlerrorCall = load.add(target->remoteFuncDlerror, {});
+        if (this->_options.spawnThread) {
+            // the string is gone along with the thread, so keep a copy. a
+            // null one is printed as well, there's no branch in a chain.
+            // it's right after the results, in the page shared, see _spawn
+            size_t pageSize = (size_t)::sysconf(_SC_PAGESIZE);
+            uintptr_t formatAddr = target->arena.allocString("%s");
+            target->loadResultsAddr = target->arena.alloc(pageSize, pageSize);
+            ok &= formatAddr && target->loadResultsAddr;
+            BREAK_IF_WITH_LOGE(!ok, "[!] failed to write params to arena 0x%zx\n", target->arena.base());
+            target->loadErrorAddr = target->loadResultsAddr + MAX_CHAIN_CALLS * PT_SIZE;
+            target->copyCall = thread.add(target->threadFuncs.format,
+                { (intptr_t)target->loadErrorAddr, INJECT_ERROR_SIZE, (intptr_t)formatAddr, CallChain::resultOf(target->dlerrorCall) });
+        }
+        // the agent goes along, it's never unloaded
+        if (!this->_options.agentPath.empty()) {
+            uintptr_t agentPathAddr = target->arena.allocString(this->_options.agentPath.c_str());
+            if (agentPathAddr) {
+                target->agentCall = load.add(target->remoteFuncDlopen, { (intptr_t)agentPathAddr, RTLD_NOW, nullptr });
+            }
+        }
+        // the library stays mapped, the memfd itself is of no use any more
+        if (target->remoteFd != -1) {
+            load.addSyscall(__NR_close, { target->remoteFd });
+        }
+        size_t keep = 0;
+        uintptr_t stubAddr = target->arena.stubAddr();
+        size_t stubCapacity = target->arena.stubCapacity();
+        if (this->_options.spawnThread) {
+            ok &= this->_spawn(target, &thread, &chain, &keep, &stubAddr);
+            BREAK_IF(!ok);
+            stubCapacity = MAX_CHAIN_STUB_SIZE;
+        }
+        target->arena.appendRelease(&chain, keep);
+        this->_enter(target, STAGE_CALL);
+        ok &= target->caller.beginRemoteCallChain(chain, stubAddr, stubCapacity);
+        BREAK_IF_WITH_LOGE(!ok, "[!] failed to call dlopen\n");
+    } while (false);
+    if (!ok) {
+        target->caller.setCallStack(0);
+    }
+    return ok;
+}
+
+bool Injector::_spawn(Target* target, CallChain* load, CallChain* chain, size_t* outKeep, uintptr_t* outStubAddr) {
+    bool ok = true;
+    do {
+        // the thread runs on a stack of its own, out of the head of the
+        // arena which is left mapped for it, i.e., the params and its stub
+        size_t pageSize = (size_t)::sysconf(_SC_PAGESIZE);
+        uintptr_t base = target->arena.base();
+        uintptr_t tidAddr = target->arena.alloc(sizeof(intptr_t));
+        uintptr_t stubAddr = target->arena.alloc(MAX_CHAIN_STUB_SIZE);
+        ok &= tidAddr && stubAddr;
+        BREAK_IF_WITH_LOGE(!ok, "[!] failed to write params to arena 0x%zx\n", base);
+        size_t keep = (stubAddr + MAX_CHAIN_STUB_SIZE - base + pageSize - 1) & ~(pageSize - 1);
+
+        // then the head goes as well, the page shared along with it. munmap
+        // returns straight into pthread_exit, nothing of the stub runs after
+        ok &= load->addTail(target->threadFuncs.unmap, { (intptr_t)base, (intptr_t)keep }, target->threadFuncs.exit) >= 0;
+        BREAK_IF_WITH_LOGE(!ok, "[!] too many calls for the thread to run\n");
+
+        ok &= target->caller.writeThreadChain(*load, stubAddr, MAX_CHAIN_STUB_SIZE, target->loadResultsAddr);
+        BREAK_IF_WITH_LOGE(!ok, "[!] failed to write the stub of the thread to spawn\n");
+
+        // the main chain runs past the head, which the thread may release
+        // any time after it's created
+        uintptr_t mainStubAddr = target->arena.alloc(MAX_CHAIN_STUB_SIZE, pageSize);
+        ok &= mainStubAddr >= base + keep;
+        BREAK_IF_WITH_LOGE(!ok, "[!] failed to write params to arena 0x%zx\n", base);
+
+        // the results page of the thread is swapped for that of the memfd
+        int prot = PROT_READ | PROT_WRITE;
+        int flags = MAP_SHARED | MAP_FIXED;
+        off_t offset = (off_t)this->_sharedOffset();
+        target->shareCall = chain->addSyscall($arch_32(__NR_mmap2) $arch_64(__NR_mmap),
+            { (intptr_t)target->loadResultsAddr, (intptr_t)pageSize, prot, flags, target->remoteFd, (intptr_t)($arch_32(offset / 4096) $arch_64(offset)) });
+        target->createCall = chain->add(target->threadFuncs.create, { (intptr_t)tidAddr, nullptr, (intptr_t)stubAddr, nullptr });
+        *outKeep = keep;
+        *outStubAddr = mainStubAddr;
+    } while (false);
+    return ok;
+}
+
+size_t Injector::_sharedOffset() const {
+    size_t pageSize = (size_t)::sysconf(_SC_PAGESIZE);
+    return (this->_payloadSize + pageSize - 1) & ~(pageSize - 1);
+}
+
+bool Injector::_spawned(Target* target) {
+    uintptr_t shared = (uintptr_t)target->caller.chainResult(target->shareCall);
+    if (shared != target->loadResultsAddr) {
+        LOGGER_LOGE("[!] remote mmap of the page to share failed in process %d: %s\n", target->pid, ::strerror(-(int)shared));
+        return false;
+    }
+    intptr_t error = target->caller.chainResult(target->createCall);
+    if (error) {
+        LOGGER_LOGE("[!] remote pthread_create failed in process %d: %s\n", target->pid, ::strerror((int)error));
+        return false;
+    }
+    // the thread goes on loading while tracee runs free
+    LOGGER_LOGI("[>] thread spawned to load the library in process %d\n", target->pid);
+    this->_detach(target);
+    this->_enter(target, STAGE_LOAD);
+    return true;
+}
+
+bool Injector::_loaded(Target* target) {
+    // the thread writes them in its own time, so read all the ones of
+    // interest back until none of them is pending, whatever the order
+    int count = std::max(target->copyCall, target->agentCall) + 1;
+    for (int call = 0; call < count; ++ call) {
+        target->loadResults[call] = __atomic_load_n(&target->loadShared[call], __ATOMIC_ACQUIRE);
+    }
+    for (int call : { target->dlopenCall, target->copyCall, target->agentCall }) {
+        if (call != -1 && target->loadResults[call] == CHAIN_RESULT_PENDING) {
+            return false;
+        }
+    }
+    // what dlerror returned is gone along with the thread, read the copy
+    if (target->loadResults[target->dlerrorCall]) {
+        target->loadResults[target->dlerrorCall] = (intptr_t)target->loadErrorAddr;
+    }
+    return true;
+}
+
+intptr_t Injector::_chainResult(Target* target, int call) {
+    return target->loadResultsAddr ? target->loadResults[call] : target->caller.chainResult(call);
+}
+
+bool Injector::_verify(Target* target) {
+    // get the call return value, i.e., remote module handle
+    uintptr_t handle = (uintptr_t)this->_chainResult(target, target->dlopenCall);
+    if (target->agentCall != -1) {
+        // not fatal, later injections just take ptrace as well
+        if (this->_chainResult(target, target->agentCall)) {
+            LOGGER_LOGI("[>] agent '%s' loaded in process %d\n", this->_options.agentPath.c_str(), target->pid);
+        } else {
+            LOGGER_LOGE("[!] failed to load agent '%s' in process %d\n", this->_options.agentPath.c_str(), target->pid);
+        }
+    }
+    if (handle) {
+        LOGGER_LOGI("[>] remote dlopen return 0x%zx in process %d\n", handle, target->pid);
+        this->_results[target->index].handle = handle;
+        return true;
+    }
+
+    // dlerror return remote error string header
+    // we should retrieve it by ptrace.readText
+    // the string may end near the end of a mapping, so take
+    // whatever bytes can be read rather than all-or-nothing
+    uintptr_t errAddr = (uintptr_t)this->_chainResult(target, target->dlerrorCall);
+    const size_t errSize = PATH_MAX + 1;
+    char* errMsg = (char*)::malloc(errSize);
+    ssize_t len = 0;
+    if (errAddr && errAddr == target->loadErrorAddr) {
+        // the copy of the thread, read here as it may have unmapped its side
+        const char* copy = (const char*)target->loadShared + (errAddr - target->loadResultsAddr);
+        len = (ssize_t)::strnlen(copy, INJECT_ERROR_SIZE);
+        ::memcpy(errMsg, copy, len);
+    } else if (errAddr && !target->detached) {
+        len = (ssize_t)target->ptrace.readMemory(errMsg, (const void*)errAddr, errSize);
+    } else if (errAddr) {
+        struct iovec local = { errMsg, errSize };
+        struct iovec remote = { (void*)errAddr, errSize };
+        len = ::syscall(__NR_process_vm_readv, target->pid, &local, 1, &remote, 1, 0);
+    }
+    if (len > 0) {
+        // strip it if the error msg length exceed <size>
+        // shoule be long enough to explain the error though
+        if ((size_t)len == errSize) {
+            ::strncpy((char*)errMsg + errSize - 4, "...\0", 4);
+        } else {
+            errMsg[len] = '\0';
+        }
+        LOGGER_LOGE("[!] process %d: %s\n", target->pid, errMsg);
+    } else {
+        LOGGER_LOGE("[!] dlopen unknown error at 0x%zx in process %d\n", errAddr, target->pid);
+    }
+    ::free(errMsg);
+    // remote call itself works fine, but the result is bad
+    return false;
+}
+
+void Injector::_finish(Target* target, bool ok) {
+    if (target->stage == STAGE_DETACH) {
+        // gone or overdue on the way to the stop to detach at, the result
+        // stands. one still running is released whenever it stops
+        if (target->ptrace.running()) {
+            LOGGER_LOGE("[!] process %d not stopped to be detached, left to stop later\n", target->pid);
+            this->_strays[target->pid] = target;
+        } else {
+            target->ptrace.detach();
+            target->detached = true;
+        }
+        this->_retire(target);
+        return;
+    }
+
+    Result& result = this->_results[target->index];
+    result.ok = ok;
+    result.stage = ok ? STAGE_DONE : target->stage;
+    if (target->stage != STAGE_QUEUED && !target->detached && !this->_detach(target)) {
+        // retired once it's stopped and detached, see _advance()
+        return;
+    }
+    this->_retire(target);
+}
+
+void Injector::_retire(Target* target) {
+    Result& result = this->_results[target->index];
+    if (target->stage != STAGE_QUEUED) {
+        result.elapsedNs = monotonicNs() - target->startNs;
+    }
+    this->_enter(target, STAGE_DONE);
+    if (target->loadShared) {
+        ::munmap(target->loadShared, (size_t)::sysconf(_SC_PAGESIZE));
+        target->loadShared = nullptr;
+    }
+    result.stats.ptrace = target->ptrace.stats();
+    result.stats.remote = target->caller.stats();
+    this->_active.erase(target->pid);
+}
+
+void Injector::_enter(Target* target, Stage stage) {
+    int64_t now = monotonicNs();
+    if (target->stage < STAGE_DONE && target->stageNs) {
+        this->_results[target->index].stats.stageNs[target->stage] += now - target->stageNs;
+    }
+    target->stageNs = now;
+    target->stage = stage;
+}
+
+bool Injector::_detach(Target* target) {
+    this->_enter(target, STAGE_DETACH);
+    // a remote call might have timed out and left the tracee running. it's
+    // interrupted without waiting, the others go on meanwhile
+    if (target->ptrace.running()) {
+        if (target->ptrace.beginStop()) {
+            target->deadlineNs = monotonicNs() + (int64_t)target->ptrace.waitTimeout() * 1000000;
+            return false;
+        }
+        LOGGER_LOGE("[!] failed to stop process %d to detach: %s\n", target->pid, ::strerror(errno));
+    }
+    this->_release(target);
+    return true;
+}
+
+void Injector::_release(Target* target) {
+    // restore tracee's registers
+    if (target->regsSaved && !target->ptrace.running() && !target->ptrace.exited()) {
+        LOGGER_LOGI("[-] restoring registers of process %d ...\n", target->pid);
+        int64_t restoreNs = monotonicNs();
+        target->ptrace.setRegisters(target->oriRegs);
+        target->ptrace.setFpState(target->oriFpState);
+        this->_results[target->index].stats.restoreNs += monotonicNs() - restoreNs;
+    }
+
+    // detach safely
+    LOGGER_LOGI("[-] detaching from process %d ...\n", target->pid);
+    target->ptrace.detach();
+    target->detached = true;
+}
@@ -0,0 +1,222 @@
+/*
+ * Copyright (c) 2020, Irvin Pang <halo.irvin@gmail.com>
+ * All rights reserved.
+ *
+ * see LICENSE file for details
+ */
+
+#ifndef __ADRILL_INJECTOR_H__
+#define __ADRILL_INJECTOR_H__
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+
+#include "ptrace_wrapper.h"
+#include "call_procedure.h"
+#include "symbol_cache.h"
+
+#define DEFAULT_SYMBOL_CACHE "/data/local/tmp/adrill.symcache"
+
+struct InjectOptions {
+    // mask of PtraceWrapper::MemoryBackend
+    int memBackends = PtraceWrapper::MEM_AUTO;
+    PtraceWrapper::AttachMode attachMode = PtraceWrapper::ATTACH_LEGACY;
+    // deadline of every single wait on the tracee, 0 to use the default
+    int waitTimeoutMs = 0;
+    // offsets of dlopen & dlerror kept across runs, empty to disable
+    std::string symbolCachePath = DEFAULT_SYMBOL_CACHE;
+    // copy the library into a memfd created in tracee and dlopen it from
+    // there, rather than having tracee open libPath itself. libPath could
+    // be 'fd:<n>' then, a descriptor of ours to copy from, e.g., a memfd
+    bool memfdDelivery = false;
+    // resident agent loaded along with the library, empty for none. once
+    // it's in, later injections into the process go through it, no ptrace
+    std::string agentPath;
+    // dlopen on a thread spawned in tracee rather than the one stopped, so
+    // constructors of the library never hold up, e.g., the main thread.
+    // tracee is detached as soon as the thread is created
+    bool spawnThread = false;
+};
+
+/*
+ * auto, ptrace, vm or procmem to a mask of PtraceWrapper::MemoryBackend, 0 if unknown
+ */
+int parseMemoryBackends(const std::string& name);
+std::string memoryBackendsName(int backends);
+
+/*
+ * remote dlopen & dlerror, whose offsets in their module are cached
+ * across runs. it's up to the local process which module they come from
+ */
+bool resolveRemoteDlfcn(pid_t pid, SymbolCache* cache, uintptr_t* outDlopen, uintptr_t* outDlerror);
+
+/*
+ * remote pthread functions a spawned thread is made of, from libc and
+ * cached the same way
+ */
+struct RemoteThreadFuncs {
+    uintptr_t create;
+    uintptr_t self;
+    uintptr_t detach;
+    uintptr_t exit;
+    // snprintf, to keep a copy of what dlerror returns in thread-local storage
+    uintptr_t format;
+    // munmap, for the thread to release its own stub on its way out
+    uintptr_t unmap;
+};
+bool resolveRemoteThreadFuncs(pid_t pid, SymbolCache* cache, RemoteThreadFuncs* outFuncs);
+
+/*
+ * inject <libPath> into a single process, i.e., an Injector of one target
+ */
+bool doInject(pid_t pid, const std::string& libPath, const InjectOptions& options);
+
+/*
+ * injects one library into many processes at once. each of them goes
+ * through the stages below as a state machine, and a single tracer thread
+ * drives them all: every stage resumes its tracee towards a stop, and
+ * whichever tracee stops first, reaped by a waitid(WNOHANG) on each, is advanced
+ * first. so the whole run takes about as long as the slowest target
+ */
+class Injector {
+public:
+    enum Stage {
+        STAGE_QUEUED,
+        STAGE_ATTACH,  // attached and stopped
+        STAGE_STAGE,   // arena mapped, params written
+        STAGE_DELIVER, // library copied into a memfd of tracee
+        STAGE_CALL,    // dlopen chain run
+        STAGE_VERIFY,  // dlopen result checked
+        STAGE_DETACH,  // stopped again if running, registers restored and detached
+        STAGE_LOAD,    // detached, dlopen going on in a thread spawned
+        STAGE_DONE,
+    };
+
+    /*
+     * where the time of an injection goes
+     */
+    struct Stats {
+        // time spent in each stage, the one of STAGE_QUEUED being
+        // remote functions resolved before attaching
+        int64_t stageNs[STAGE_DONE];
+        // registers restored, a part of STAGE_DETACH
+        int64_t restoreNs;
+        PtraceWrapper::Stats ptrace;
+        CallProcedure::Stats remote;
+    };
+
+    struct Result {
+        pid_t     pid;
+        bool      ok;
+        // the stage it failed at, or STAGE_DONE
+        Stage     stage;
+        // handle returned by remote dlopen
+        uintptr_t handle;
+        // from attaching to detached, or to loaded with spawnThread
+        int64_t   elapsedNs;
+        // loaded by the resident agent, without ptrace
+        bool      viaAgent;
+        Stats     stats;
+    };
+
+public:
+    Injector(const std::string& libPath, const InjectOptions& options);
+    ~Injector();
+
+    /*
+     * a cache kept by the caller, e.g., the daemon, instead of the one loaded
+     * from & saved to options.symbolCachePath. nullptr to go back to the latter
+     */
+    void setSymbolCache(SymbolCache* cache);
+
+    /*
+     * tracees in flight at a time, 0 for no limit which is the default
+     */
+    void setConcurrency(int limit);
+    void add(pid_t pid);
+
+    /*
+     * inject into all the targets added, true if all of them succeeded
+     */
+    bool run();
+    // in the order of targets added
+    const std::vector<Result>& results() const;
+
+    /*
+     * for a tracer with a loop of its own, e.g., ForkFollower. adopt() starts
+     * at once on a tracee in a ptrace-stop of ours, skipping attach, then
+     * reap() takes all the stops & exits of the targets in flight, and of
+     * the ones left to be detached, false if there's none. a status reaped
+     * by the tracer itself is offered to handleStatus() instead, which tells
+     * whether it's one of those. expire() fails the ones overdue
+     * and finishes the ones whose spawned thread is through with loading,
+     * then returns the nearest deadline(CLOCK_MONOTONIC ns) of the rest,
+     * or -1 if some just finished or none is in flight
+     */
+    bool adopt(pid_t pid, bool seized);
+    bool reap();
+    bool handleStatus(pid_t pid, int status);
+    int64_t expire();
+    size_t inFlight() const;
+
+    static const char* stageName(Stage stage);
+
+protected:
+    struct Target;
+    bool _setup();
+    Target* _add(pid_t pid);
+    bool _start(Target* target);
+    // false if there's no agent in tracee to take it
+    bool _injectByAgent(Target* target);
+    void _onStatus(Target* target, int status);
+    void _advance(Target* target);
+    bool _stage(Target* target);
+    bool _deliver(Target* target);
+    bool _fill(Target* target);
+    // where the page shared with a thread is in the memfd, past the library
+    size_t _sharedOffset() const;
+    bool _call(Target* target);
+    // a thread of tracee to run the chain <load>, created by <chain>. the first
+    // <outKeep> bytes of the arena are the thread's to release, <chain> runs
+    // from <outStubAddr> past them
+    bool _spawn(Target* target, CallChain* load, CallChain* chain, size_t* outKeep, uintptr_t* outStubAddr);
+    bool _spawned(Target* target);
+    // true once the thread spawned is through, its results taken
+    bool _loaded(Target* target);
+    bool _verify(Target* target);
+    intptr_t _chainResult(Target* target, int call);
+    // on to <stage>, the time so far charged to the one left
+    void _enter(Target* target, Stage stage);
+    // false if tracee has to be stopped first, then _release() it once stopped
+    bool _detach(Target* target);
+    // registers restored and detached, tracee stopped or gone
+    void _release(Target* target);
+    // the result is in, off the ones in flight
+    void _finish(Target* target, bool ok);
+    void _retire(Target* target);
+    // <result> of a status of a stray, released unless it's WAIT_PENDING
+    void _onStray(Target* target, PtraceWrapper::WaitResult result);
+
+protected:
+    std::string   _libPath;
+    // library to copy from with memfdDelivery
+    int           _payloadFd;
+    size_t        _payloadSize;
+    InjectOptions _options;
+    int           _concurrency;
+    SymbolCache   _ownCache;
+    SymbolCache*  _cache;
+    bool          _ready;
+    // signalfd of SIGCHLD to sleep on between stops
+    int           _sigFd;
+    std::vector<std::unique_ptr<Target>> _targets;
+    std::unordered_map<pid_t, Target*>   _active;
+    // finished, but not stopped in time to be detached, see _finish()
+    std::unordered_map<pid_t, Target*>   _strays;
+    std::vector<Result> _results;
+
+};
+
+#endif // __ADRILL_INJECTOR_H__
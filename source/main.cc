@@ -5,8 +5,8 @@
  * see LICENSE file for details
  */
 
-#include <fstream>
-#include <dirent.h>
+#include <sys/syscall.h>
+#include <algorithm>
 
 #include <config.h>
 #include <mem/module.h>
@@ -16,256 +16,104 @@
 #include <mem/cmd_param-inl.h>
 
 #include "macros.h"
+#include "clock.h"
 #include "selinux.h"
-#include "sdk_code.h"
-#include "elf_dlfcn.h"
-#include "file_utils.h"
-#include "ptrace_wrapper.h"
-#include "call_procedure.h"
+#include "injector.h"
+#include "process_scanner.h"
+#include "spawn_watcher.h"
+#include "fork_follower.h"
+#include "daemon.h"
+#include "inject_stats.h"
 
-int moduleMatcher(mem::region_info* region, void* data) {
-    mem::region_info* result = static_cast<mem::region_info*>(data);
-    // // only interest in mmap module by system
-    // // which is offset == 0 & readable & private
-    // if (region->offset == 0 && (region->prot & PROT_READ) && (region->flags & MAP_PRIVATE)) {
-        if (::strcmp(region->path_name.c_str(), result->path_name.c_str()) == 0) {
-            result->start = std::min(result->start, region->start);
-            result->end = std::max(result->end, region->end);
-            // result->offset = region->offset;
-            // result->prot   = region->prot;
-            // result->flags  = region->flags;
-        }
-    // }
-    return 0;
-}
-
-uintptr_t resolveRemoteFunction(const char* name, uintptr_t localAddr, mem::region_info* localRegionInfo, mem::region_info* remoteRegionInfo) {
-    // overcome address space layout randomization(ASLR)
-    uintptr_t remoteAddr = 0;
-    do {
-        BREAK_IF_WITH_LOGE(!localAddr,
-            "[!] func '%s' is nullptr: %s\n", name, ::dlerror());
-        BREAK_IF_WITH_LOGE(::strcmp(localRegionInfo->path_name.c_str(), remoteRegionInfo->path_name.c_str()) != 0,
-            "[!] local module(%s) and remote module(%s) should refer to the same path\n", localRegionInfo->path_name.c_str(), remoteRegionInfo->path_name.c_str());
-        BREAK_IF_WITH_LOGE(!localRegionInfo->start || !remoteRegionInfo->start,
-            "[!] local/remote module '%s' not found\n", localRegionInfo->path_name.c_str());
-        BREAK_IF_WITH_LOGE(localAddr < localRegionInfo->start || localAddr > localRegionInfo->end,
-            "[!] func '%s'(0x%zx) is not within module '%s'(0x%zx-0x%zx)\n", name, localAddr, localRegionInfo->path_name.c_str(), localRegionInfo->start, localRegionInfo->end);
-        // same module shares the same offset
-        remoteAddr = localAddr - localRegionInfo->start + remoteRegionInfo->start;
-    } while (false);
-    return remoteAddr;
-}
-
-uintptr_t resolveLocalFunction(const std::vector<std::string>& symbols) {
-    uintptr_t localAddr = 0;
-    for (const auto& symbol : symbols) {
-        localAddr = (uintptr_t)dlsym(RTLD_DEFAULT, symbol.c_str());
-        if (localAddr > 0) break;
-    }
-    return localAddr;
-}
-
-std::string getBionicLib(const std::string& libname) {
-    FileSearcher searcher;
-    // Android version < 10.x
-    searcher.addSearchPath("/system/lib" $arch_64("64") "/");
-    // Android version >= 10.x makes runtime binaries
-    // independently OTA updatable through APEX bundles
-    if (SDKCode::get() >= SDKCode::Q) {
-        /* and makes it search first */
-        std::string runtimeRoot("/apex/com.android.runtime");
-        searcher.addSearchPath(runtimeRoot.append("/lib" $arch_64("64") "/bionic/"), true);
+int watchAndInject(ProcessScanner* scanner, int count, const std::string& libPath, const InjectOptions& options) {
+    SpawnWatcher watcher(scanner);
+    if (!watcher.start()) {
+        LOGGER_LOGE("[!] failed to watch for new processes\n");
+        return 1;
     }
+    LOGGER_LOGI("[-] watching for new processes through %s ...\n", watcher.usingNetlink() ? "proc connector" : "/proc poller");
 
-    std::string location = searcher.resolveFullPath(libname);
-    if (location.empty()) {
-        LOGGER_LOGE("file %s not found!\n", libname.c_str());
+    int ret = 0;
+    SpawnWatcher::Spawn spawn;
+    for (int hits = 0; (count == 0 || hits < count) && watcher.next(&spawn); ++ hits) {
+        LOGGER_LOGI("[>] process %d spawned\n", spawn.pid);
+        bool ok = doInject(spawn.pid, libPath, options);
+        int64_t doneNs = monotonicNs();
+        if (!ok) {
+            ret = 3;
+        }
+        // the poller only knows the start time in clock ticks, take it as a rough one
+        if (spawn.eventNs) {
+            LOGGER_LOGI("[>] process %d %s: matched %.1fus, injected %.1fus after exec\n", spawn.pid, ok ? "injected" : "failed",
+                (spawn.matchNs - spawn.eventNs) / 1000.0, (doneNs - spawn.eventNs) / 1000.0);
+        } else {
+            LOGGER_LOGI("[>] process %d %s: injected %.1fus after match\n", spawn.pid, ok ? "injected" : "failed",
+                (doneNs - spawn.matchNs) / 1000.0);
+        }
     }
-    return location;
+    return ret;
 }
 
-std::string getLinkerBin() {
-    FileSearcher searcher;
-    // Android version < 10.x
-    searcher.addSearchPath("/system/bin/");
-    // Android version >= 10.x makes runtime binaries
-    // independently OTA updatable through APEX bundles
-    if (SDKCode::get() >= SDKCode::Q) {
-        /* and makes it search first */
-        searcher.addSearchPath("/apex/com.android.runtime/bin/", true);
-    }
-
-    std::string location = searcher.resolveFullPath("linker" $arch_64("64"));
-    if (location.empty()) {
-        LOGGER_LOGE("linker%s not found!\n", "" $arch_64("64"));
+void reportResults(const Injector& injector, int64_t elapsedNs) {
+    size_t injected = 0;
+    for (const Injector::Result& result : injector.results()) {
+        if (result.ok) {
+            ++ injected;
+            if (result.viaAgent) {
+                LOGGER_LOGI("[>] process %d: injected in %.1fms through the agent, handle 0x%zx\n", result.pid,
+                    result.elapsedNs / 1e6, result.handle);
+            } else {
+                LOGGER_LOGI("[>] process %d: injected in %.1fms, held for %.1fms, handle 0x%zx\n", result.pid,
+                    result.elapsedNs / 1e6, result.stats.ptrace.heldNs / 1e6, result.handle);
+            }
+        } else {
+            LOGGER_LOGE("[!] process %d: failed at stage %s\n", result.pid, Injector::stageName(result.stage));
+        }
     }
-    return location;
+    LOGGER_LOGI("[>] %zu/%zu processes injected in %.1fms\n", injected, injector.results().size(), elapsedNs / 1e6);
 }
 
-bool doInject(pid_t pid, const std::string& libPath) {
-    errno = 0;
-    if (::access(libPath.c_str(), R_OK) != 0) {
-        LOGGER_LOGE("[!] file '%s' unavailable: %s\n", libPath.c_str(), ::strerror(errno));
-        return false;
-    }
-    
-    // necessary local & remote modules
-    std::string libcPath = getBionicLib("libc.so");
-    std::string libdlPath = getBionicLib("libdl.so");
-    std::string linkerPath = getLinkerBin();
-    if (libcPath.empty() || libdlPath.empty() || linkerPath.empty()) {
-        return false;
-    }
-
-    mem::region_info localLibcRegionInfo    { $arch_32(UINT_MAX) $arch_64(UINT64_MAX), 0, 0, 0, 0, libcPath.c_str() };
-    mem::region_info localLibdlRegionInfo   { $arch_32(UINT_MAX) $arch_64(UINT64_MAX), 0, 0, 0, 0, libdlPath.c_str() };
-    mem::region_info localLinkerRegionInfo  { $arch_32(UINT_MAX) $arch_64(UINT64_MAX), 0, 0, 0, 0, linkerPath.c_str() };
-    mem::region_info remoteLibcRegionInfo   { $arch_32(UINT_MAX) $arch_64(UINT64_MAX), 0, 0, 0, 0, libcPath.c_str() };
-    mem::region_info remoteLibdlRegionInfo  { $arch_32(UINT_MAX) $arch_64(UINT64_MAX), 0, 0, 0, 0, libdlPath.c_str() };
-    mem::region_info remoteLinkerRegionInfo { $arch_32(UINT_MAX) $arch_64(UINT64_MAX), 0, 0, 0, 0, linkerPath.c_str() };
-
-    // resolve modules
-    mem::iter_proc_maps(0,   moduleMatcher, &localLibcRegionInfo);
-    mem::iter_proc_maps(0,   moduleMatcher, &localLibdlRegionInfo);
-    mem::iter_proc_maps(0,   moduleMatcher, &localLinkerRegionInfo);
-    mem::iter_proc_maps(pid, moduleMatcher, &remoteLibcRegionInfo);
-    mem::iter_proc_maps(pid, moduleMatcher, &remoteLibdlRegionInfo);
-    mem::iter_proc_maps(pid, moduleMatcher, &remoteLinkerRegionInfo);
-
-    // check target process accessable
-    if (!remoteLibcRegionInfo.end) {
-        LOGGER_LOGE("[!] process %d not found!\n", pid);
-        return false;
-    }
-
-    // that's the minimum functions to make it work
-    uintptr_t remoteFuncMmap    = resolveRemoteFunction("mmap", (uintptr_t)::mmap, &localLibcRegionInfo, &remoteLibcRegionInfo);
-    uintptr_t remoteFuncMunmap  = resolveRemoteFunction("munmap", (uintptr_t)::munmap, &localLibcRegionInfo, &remoteLibcRegionInfo);
-    uintptr_t remoteFuncDlopen  = 0;
-    uintptr_t remoteFuncDlerror = 0;
-
-    if (localLibdlRegionInfo.end == 0) {
-        ::dlerror();
-        void* handle = elf_dlopen(linkerPath.c_str(), RTLD_PARSE_ELF);
-        remoteFuncDlopen = resolveRemoteFunction("__dl_dlopen", (uintptr_t)elf_dlsym(handle, "__dl_dlopen"), &localLinkerRegionInfo, &remoteLinkerRegionInfo);
-        remoteFuncDlerror = resolveRemoteFunction("__dl_dlerror", (uintptr_t)elf_dlsym(handle, "__dl_dlerror"), &localLinkerRegionInfo, &remoteLinkerRegionInfo);
-    } else {
-        remoteFuncDlopen = resolveRemoteFunction("dlopen", (uintptr_t)::dlopen, &localLibdlRegionInfo, &remoteLibdlRegionInfo);
-        remoteFuncDlerror = resolveRemoteFunction("dlerror", (uintptr_t)::dlerror, &localLibdlRegionInfo, &remoteLibdlRegionInfo);
-    }
-
-    if (!remoteFuncMmap || !remoteFuncMunmap || !remoteFuncDlopen || !remoteFuncDlerror) {
-        return false;
-    }
-
+int injectAll(const std::vector<pid_t>& pids, int concurrency, const std::string& libPath, const InjectOptions& options,
+    const std::string& stats, int repeat) {
+    StatsAggregator aggregator;
     bool ok = true;
-    PtraceRegs oriRegs;
-    PtraceWrapper ptrace;
-    do {
-        // attach to target process
-        LOGGER_LOGI("[-] attcahing to process %d ...\n", pid);
-        ok &= ptrace.attach(pid);
-        BREAK_IF_WITH_LOGE(!ok, "[!] failed to attach to process %d: %s\n", pid, ::strerror(errno));
-
-        // save tracee's registers
-        LOGGER_LOGI("[-] saving registers ...\n");
-        ok &= ptrace.getRegisters(&oriRegs);
-        BREAK_IF_WITH_LOGE(!ok, "[!] failed to save registers\n");
-
-        // call remote mmap, alloc the params for dlopen
-        LOGGER_LOGI("[-] calling remote mmap ...\n");
-        CallProcedure caller(&ptrace);
-        const size_t size = PATH_MAX + 1;
-        int prot = PROT_READ | PROT_WRITE | PROT_EXEC;
-        int flags = MAP_ANONYMOUS | MAP_PRIVATE;
-        ok &= caller.remoteCall(remoteFuncMmap, nullptr, size, prot, flags, 0, 0, CallProcedure::ARG_END);
-        BREAK_IF_WITH_LOGE(!ok, "[!] failed to call remote mmap\n");
-        
-        // get the call return value, i.e., the mapped address
-        uintptr_t mappedAddr = (uintptr_t)caller.returnValue();
-        LOGGER_LOGI("[>] remote mmap return 0x%zx\n", mappedAddr);
-
-        // write libpath string to mapped address
-        ok &= ptrace.writeText((void*)mappedAddr, libPath.data(), libPath.length() + 1);
-        BREAK_IF_WITH_LOGE(!ok, "[!] failed to write params to 0x%zx\n", mappedAddr);
-
-        // call remote dlopen, load library to tracee process
-        LOGGER_LOGI("[-] calling remote dlopen '%s' ...\n", libPath.c_str());
-        ok &= caller.remoteCall(remoteFuncDlopen, mappedAddr, RTLD_NOW | RTLD_GLOBAL, /*possible caller since Android7.0*/nullptr, CallProcedure::ARG_END);
-        BREAK_IF_WITH_LOGE(!ok, "[!] failed to call dlopen\n");
-        
-        // get the call return value, i.e., remote module handle
-        uintptr_t handle = (uintptr_t)caller.returnValue();
-        if (!handle) {
-            if (caller.remoteCall(remoteFuncDlerror, nullptr, CallProcedure::ARG_END)) {
-                // dlerror return remote error string header
-                // we should retrieve it by ptrace.readText
-                char* errMsg = (char*)::malloc(size);
-                if (ptrace.readText(errMsg, (const void*)caller.returnValue(), size)) {
-                    // strip it if the error msg length exceed <size>
-                    // shoule be long enough to explain the error though
-                    ::strncpy((char*)errMsg + size - 4, "...\0", 4);
-                    LOGGER_LOGE("[!] %s\n", errMsg);
-                } else {
-                    LOGGER_LOGE("[!] dlopen unknown error at 0x%zx\n", caller.returnValue());
-                }
-                ::free(errMsg);
+    for (int round = 0; round < std::max(repeat, 1); ++ round) {
+        Injector injector(libPath, options);
+        injector.setConcurrency(concurrency);
+        for (pid_t pid : pids) {
+            injector.add(pid);
+        }
+        int64_t startNs = monotonicNs();
+        ok &= injector.run();
+        reportResults(injector, monotonicNs() - startNs);
+        // to stderr, apart from the log
+        for (const Injector::Result& result : injector.results()) {
+            if (stats == "json") {
+                ::fprintf(stderr, "%s\n", statsToJson(result).c_str());
             }
-            // remote call itself works fine, but the result is bad
-            ok = false;
-        } else {
-            LOGGER_LOGI("[>] remote dlopen return 0x%zx\n", handle);
+            aggregator.add(result);
         }
-        
-        // call remote munmap to free useless params
-        LOGGER_LOGI("[-] calling remote munmap ...\n");
-        caller.remoteCall(remoteFuncMunmap, mappedAddr, size, CallProcedure::ARG_END);
-    } while(false);
-
-    // restore tracee's registers
-    LOGGER_LOGI("[-] restoring registers ...\n");
-    ptrace.setRegisters(oriRegs);
-
-    // detach safely
-    LOGGER_LOGI("[-] detaching from process %d ...\n", pid);
-    ptrace.detach();
-
-    return ok;
+    }
+    if (stats == "json" && repeat > 1) {
+        ::fprintf(stderr, "%s\n", aggregator.toJson().c_str());
+    } else if (stats == "histogram") {
+        aggregator.printHistogram();
+    }
+    return ok ? 0 : 3;
 }
 
-int getPidByName(const std::string& name) {
-    int pid = 0;
-    std::string rootDir("/proc/");
-    std::string rearName("/cmdline");
-    DIR* dp = ::opendir(rootDir.c_str());
-    if (dp) {
-        std::string content;
-        struct dirent* entry;
-        while ((entry = ::readdir(dp)) != nullptr) {
-            // only interest in numeric dir name
-            int pendingPid = ::atoi(entry->d_name);
-            if (!pendingPid) continue;
-            
-            std::string curName(entry->d_name);
-            std::string filePath = rootDir + curName + rearName;
-            std::fstream readf(filePath);
-            if (readf.is_open()) {
-                std::getline(readf, content);
-                if (::strcmp(content.c_str(), name.c_str()) == 0) {
-                    LOGGER_LOGE("[>] found pid %d for process '%s'\n", pendingPid, name.c_str());
-                    pid = pendingPid;
-                    break;
-                }
-            } else {
-                LOGGER_LOGE("[!] failed to open file '%s': %s\n", filePath.c_str(), ::strerror(errno));
-            }
-        }
-        ::closedir(dp);
-    } else {
-        LOGGER_LOGE("[!] failed to open dir '/proc': %s\n", ::strerror(errno));
+int followAndInject(pid_t parent, ProcessScanner* scanner, int count, const std::string& libPath, const InjectOptions& options) {
+    Injector injector(libPath, options);
+    ForkFollower follower(scanner, &injector);
+    if (!follower.start(parent)) {
+        return 1;
     }
-    return pid;
+    LOGGER_LOGI("[-] following forks of process %d ...\n", parent);
+
+    int64_t startNs = monotonicNs();
+    bool ok = follower.run(count);
+    reportResults(injector, monotonicNs() - startNs);
+    return ok ? 0 : 3;
 }
 
 void help() {
@@ -276,40 +124,233 @@ void help() {
     LOGGER_LOGI("   -h,--help      print this message.\n");
     LOGGER_LOGI("      --pid       target process id. e.g., grep from 'ps' command\n");
     LOGGER_LOGI("      --pname     target process name. used to match with content in /proc/<pid>/cmdline.\n");
+    LOGGER_LOGI("      --match     how --pname matches: cmdline(default), comm, exe or regex(searched in cmdline).\n");
+    LOGGER_LOGI("      --scanthreads  threads to scan /proc with, 1 by default.\n");
+    LOGGER_LOGI("      --watch     wait for new processes matching --pname and inject each right as it starts.\n");
+    LOGGER_LOGI("                  stops after <count> of them, 0 to keep watching.\n");
+    LOGGER_LOGI("      --concurrency  inject into every process matching --pname rather than the lowest pid,\n");
+    LOGGER_LOGI("                  at most <n> at a time. 0 for no limit.\n");
+    LOGGER_LOGI("      --follow    trace forks of the process given by --pid/--pname(e.g., zygote64) and inject\n");
+    LOGGER_LOGI("                  its children matching <name>(by --match) before they run any of their code.\n");
+    LOGGER_LOGI("                  stops after --watch <count> of them, 1 by default, 0 to keep following.\n");
+    LOGGER_LOGI("      --daemon    stay resident and serve injections on unix socket <name>('@' prefix for the\n");
+    LOGGER_LOGI("                  abstract namespace, e.g., %s), one line of <option>=<value> per request,\n", DAEMON_DEFAULT_SOCKET);
+    LOGGER_LOGI("                  e.g., 'pname=com.foo libpath=/data/local/tmp/libfoo.so'. replied in json.\n");
+    LOGGER_LOGI("                  a request without libpath loads a descriptor passed along by SCM_RIGHTS via memfd.\n");
+    LOGGER_LOGI("                  with the agent in, 'op=dlsym|dlclose|call|read|write' run by it, see daemon.h.\n");
+    LOGGER_LOGI("                  --membackend/--attach/--timeout/--symcache given here are the defaults.\n");
     LOGGER_LOGI("      --libpath   absolute path to inject. only supports ELF file.\n");
+    LOGGER_LOGI("      --deliver   path(default): the target opens --libpath itself, which must be readable by it.\n");
+    LOGGER_LOGI("                  memfd: copy the library into a memfd created in the target and load it from\n");
+    LOGGER_LOGI("                  there, nothing staged on disk. --libpath could be fd:<n>, an inherited descriptor.\n");
+    LOGGER_LOGI("      --agent     path of libadrill-agent.so, loaded along with --libpath and kept resident.\n");
+    LOGGER_LOGI("                  later injections into the same process go through it, with no ptrace stop.\n");
+    LOGGER_LOGI("      --loadon    stopped(default): dlopen on whichever thread of the target got stopped.\n");
+    LOGGER_LOGI("                  thread: on a thread spawned in the target, which is detached right after\n");
+    LOGGER_LOGI("                  creating it, so slow constructors of the library never hold up its threads.\n");
+    LOGGER_LOGI("      --membackend  tracee memory access: auto(default), ptrace, vm or procmem.\n");
+    LOGGER_LOGI("                  vm/procmem fall back to ptrace on the pages they fail on.\n");
+    LOGGER_LOGI("      --attach    legacy(default): PTRACE_ATTACH and wait for a syscall.\n");
+    LOGGER_LOGI("                  seize: PTRACE_SEIZE + PTRACE_INTERRUPT, stops the target right away.\n");
+    LOGGER_LOGI("      --timeout   deadline in milliseconds of each wait on the target, 10000 by default.\n");
+    LOGGER_LOGI("      --stats     json: a line of json per process injected to stderr, apart from the log, with\n");
+    LOGGER_LOGI("                  the time of each phase, ptrace requests made and bytes of memory moved, how\n");
+    LOGGER_LOGI("                  long the target was held and its faults & context switches meanwhile.\n");
+    LOGGER_LOGI("                  histogram: how long targets were held over all the runs, in the end.\n");
+    LOGGER_LOGI("      --repeat    inject <n> times in a row. with --stats json, ends with a line aggregating\n");
+    LOGGER_LOGI("                  all the runs, i.e., min/p50/p90/max/mean of each figure.\n");
+    LOGGER_LOGI("      --symcache  file caching symbol offsets across runs, '%s' by default. 'none' to disable.\n", DEFAULT_SYMBOL_CACHE);
     LOGGER_LOGI("\n");
 }
 
+int serveDaemon(const std::string& socketName, const InjectOptions& options) {
+    SELinux::init();
+    if (SELinux::getEnforce() != SELinuxStatus::PERMISSIVE &&
+        !SELinux::setEnforce(SELinuxStatus::PERMISSIVE)) {
+        LOGGER_LOGE("[!] failed to disable selinux\n");
+        return 1;
+    }
+    Daemon daemon(options);
+    if (!daemon.start(socketName)) {
+        return 1;
+    }
+    daemon.serve();
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
     int ret = 1;
     mem::cmd_param cmdPid("pid");
     mem::cmd_param cmdPname("pname");
+    mem::cmd_param cmdMatch("match");
+    mem::cmd_param cmdScanthreads("scanthreads");
+    mem::cmd_param cmdWatch("watch");
+    mem::cmd_param cmdConcurrency("concurrency");
+    mem::cmd_param cmdFollow("follow");
+    mem::cmd_param cmdDaemon("daemon");
     mem::cmd_param cmdLibpath("libpath");
+    mem::cmd_param cmdDeliver("deliver");
+    mem::cmd_param cmdAgent("agent");
+    mem::cmd_param cmdLoadon("loadon");
+    mem::cmd_param cmdMembackend("membackend");
+    mem::cmd_param cmdAttach("attach");
+    mem::cmd_param cmdTimeout("timeout");
+    mem::cmd_param cmdSymcache("symcache");
+    mem::cmd_param cmdStats("stats");
+    mem::cmd_param cmdRepeat("repeat");
     mem::cmd_param::init(argc, argv);
 
-    int pid;
+    int pid = 0;
     std::string pname;
+    std::string matchBy;
+    int scanThreads = 1;
+    int watchCount = -1;
+    int concurrency = -1;
+    std::string follow;
+    std::string daemonSocket;
     std::string libPath;
+    std::string deliver;
+    std::string loadOn;
+    std::string memBackend;
+    std::string attachMode;
+    std::string symcache;
+    std::string stats;
+    int repeat = 1;
+    InjectOptions options;
 
     cmdPid.get(pid);
     cmdPname.get(pname);
+    cmdMatch.get(matchBy);
+    cmdScanthreads.get(scanThreads);
+    cmdWatch.get(watchCount);
+    cmdConcurrency.get(concurrency);
+    cmdFollow.get(follow);
+    cmdDaemon.get(daemonSocket);
     cmdLibpath.get(libPath);
+    cmdDeliver.get(deliver);
+    cmdAgent.get(options.agentPath);
+    cmdLoadon.get(loadOn);
+    cmdMembackend.get(memBackend);
+    cmdAttach.get(attachMode);
+    cmdTimeout.get(options.waitTimeoutMs);
+    cmdSymcache.get(symcache);
+    cmdStats.get(stats);
+    cmdRepeat.get(repeat);
+
+    options.memBackends = parseMemoryBackends(memBackend);
+    if (!options.memBackends) {
+        LOGGER_LOGE("[!] unknown memory backend '%s'\n", memBackend.c_str());
+        help();
+        return ret;
+    }
+    if (attachMode == "seize") {
+        options.attachMode = PtraceWrapper::ATTACH_SEIZE;
+    } else if (!attachMode.empty() && attachMode != "legacy") {
+        LOGGER_LOGE("[!] unknown attach mode '%s'\n", attachMode.c_str());
+        help();
+        return ret;
+    }
+
+    if (deliver == "memfd") {
+        options.memfdDelivery = true;
+    } else if (!deliver.empty() && deliver != "path") {
+        LOGGER_LOGE("[!] unknown delivery '%s'\n", deliver.c_str());
+        help();
+        return ret;
+    }
+
+    if (loadOn == "thread") {
+        options.spawnThread = true;
+    } else if (!loadOn.empty() && loadOn != "stopped") {
+        LOGGER_LOGE("[!] unknown thread to load on '%s'\n", loadOn.c_str());
+        help();
+        return ret;
+    }
+
+    if (symcache == "none") {
+        options.symbolCachePath.clear();
+    } else if (!symcache.empty()) {
+        options.symbolCachePath = symcache;
+    }
 
+    if (!stats.empty() && stats != "json" && stats != "histogram") {
+        LOGGER_LOGE("[!] unknown stats format '%s'\n", stats.c_str());
+        help();
+        return ret;
+    }
+
+    if (!daemonSocket.empty()) {
+        return serveDaemon(daemonSocket, options);
+    }
+
+    ProcessScanner::MatchBy by;
+    if (!ProcessScanner::parseMatchBy(matchBy, &by)) {
+        LOGGER_LOGE("[!] unknown match mode '%s'\n", matchBy.c_str());
+        help();
+        return ret;
+    }
+
+    std::vector<pid_t> targets;
     if (!pname.empty()) {
-        pid = getPidByName(pname);
-        if (!pid) {
+        ProcessScanner scanner;
+        if (!scanner.setPattern(pname, by)) {
+            return ret;
+        }
+        scanner.setThreads(scanThreads);
+
+        // --watch counts the children to inject with --follow
+        if (watchCount >= 0 && follow.empty()) {
+            if (libPath.empty()) {
+                help();
+                return ret;
+            }
+            SELinux::init();
+            if (SELinux::getEnforce() != SELinuxStatus::PERMISSIVE &&
+                !SELinux::setEnforce(SELinuxStatus::PERMISSIVE)) {
+                LOGGER_LOGE("[!] failed to disable selinux\n");
+                return ret;
+            }
+            ret = watchAndInject(&scanner, watchCount, libPath, options);
+            LOGGER_LOGI("%s\n\n", ret == 0 ? "[>] enjoy!" : "[!] something went wrong, see errors listed above.");
+            return ret;
+        }
+
+        std::vector<pid_t> pids = scanner.scan();
+        if (pids.empty()) {
             LOGGER_LOGE("[!] process '%s' not found!\n", pname.c_str());
             ret = 2;
             return ret;
         }
+        if (concurrency >= 0 && follow.empty()) {
+            targets = pids;
+            LOGGER_LOGI("[>] found %zu processes for '%s'\n", pids.size(), pname.c_str());
+        } else {
+            pid = pids.front();
+            LOGGER_LOGI("[>] found pid %d for process '%s'\n", pid, pname.c_str());
+            if (pids.size() > 1) {
+                LOGGER_LOGI("[>] %zu processes match '%s', the lowest pid is taken\n", pids.size(), pname.c_str());
+            }
+        }
+    }
+    if (pid) {
+        targets.push_back(pid);
     }
     
-    if (pid && libPath.length()) {
+    if (!targets.empty() && libPath.length()) {
         SELinux::init();
         // already permissive or set to permissive 
         if (SELinux::getEnforce() == SELinuxStatus::PERMISSIVE ||
             SELinux::setEnforce(SELinuxStatus::PERMISSIVE)) {
-            ret = doInject(pid, libPath) ? 0 : 3;
+            if (!follow.empty()) {
+                ProcessScanner children;
+                if (children.setPattern(follow, by)) {
+                    ret = followAndInject(targets.front(), &children, watchCount >= 0 ? watchCount : 1, libPath, options);
+                }
+            } else if (targets.size() == 1 && stats.empty() && repeat <= 1) {
+                ret = doInject(targets.front(), libPath, options) ? 0 : 3;
+            } else {
+                ret = injectAll(targets, concurrency, libPath, options, stats, repeat);
+            }
         } else {
             LOGGER_LOGE("[!] failed to disable selinux\n");
         }
@@ -0,0 +1,198 @@
+/*
+ * Copyright (c) 2020, Irvin Pang <halo.irvin@gmail.com>
+ * All rights reserved.
+ *
+ * see LICENSE file for details
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <algorithm>
+#include <string_view>
+#include <unordered_map>
+
+#include "macros.h"
+#include "maps_snapshot.h"
+
+namespace {
+    uintptr_t parseHex(const char*& cur, const char* end) {
+        uintptr_t value = 0;
+        for (; cur < end; ++ cur) {
+            char c = *cur;
+            if (c >= '0' && c <= '9')      value = (value << 4) | (c - '0');
+            else if (c >= 'a' && c <= 'f') value = (value << 4) | (c - 'a' + 10);
+            else if (c >= 'A' && c <= 'F') value = (value << 4) | (c - 'A' + 10);
+            else break;
+        }
+        return value;
+    }
+
+    void skipField(const char*& cur, const char* end) {
+        while (cur < end && *cur != ' ') ++ cur;
+        while (cur < end && *cur == ' ') ++ cur;
+    }
+} // namespace
+
+MapsSnapshot::MapsSnapshot() {
+}
+
+bool MapsSnapshot::load(pid_t pid) {
+    this->_regions.clear();
+    this->_modules.clear();
+    this->_pool.clear();
+
+    char path[32];
+    if (pid) {
+        ::snprintf(path, sizeof(path), "/proc/%d/maps", pid);
+    } else {
+        ::strncpy(path, "/proc/self/maps", sizeof(path));
+    }
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOGGER_LOGE("MapsSnapshot::load failed to open '%s': %s\n", path, ::strerror(errno));
+        return false;
+    }
+
+    // the kernel generates it a few pages at a time, read it all at once then parse
+    std::string text;
+    size_t size = 0;
+    text.resize(64 * 1024);
+    for (;;) {
+        if (size == text.size()) {
+            text.resize(text.size() * 2);
+        }
+        ssize_t n = ::read(fd, &text[size], text.size() - size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        size += n;
+    }
+    ::close(fd);
+    return this->_parse(text.data(), size);
+}
+
+bool MapsSnapshot::_parse(const char* text, size_t size) {
+    // path => offset in the pool, keys refer to <text> which outlives it
+    std::unordered_map<std::string_view, uint32_t> interned;
+    const char* cur = text;
+    const char* end = text + size;
+    while (cur < end) {
+        const char* eol = (const char*)::memchr(cur, '\n', end - cur);
+        if (!eol) {
+            eol = end;
+        }
+
+        // start-end perms offset dev inode [path]
+        Region region;
+        region.start = parseHex(cur, eol);
+        ++ cur;
+        region.end = parseHex(cur, eol);
+        while (cur < eol && *cur == ' ') ++ cur;
+        region.prot = PROT_NONE;
+        if (eol - cur >= 4) {
+            if (cur[0] == 'r') region.prot |= PROT_READ;
+            if (cur[1] == 'w') region.prot |= PROT_WRITE;
+            if (cur[2] == 'x') region.prot |= PROT_EXEC;
+        }
+        skipField(cur, eol);
+        region.offset = parseHex(cur, eol);
+        skipField(cur, eol);
+        skipField(cur, eol);
+        skipField(cur, eol);
+
+        region.path = NO_PATH;
+        if (cur < eol) {
+            std::string_view name(cur, eol - cur);
+            auto it = interned.find(name);
+            if (it == interned.end()) {
+                uint32_t offset = (uint32_t)this->_pool.size();
+                this->_pool.append(name.data(), name.size()).push_back('\0');
+                it = interned.emplace(name, offset).first;
+                this->_modules.push_back({ offset, region.start, region.end });
+            }
+            region.path = it->second;
+        }
+        if (region.end > region.start) {
+            this->_regions.push_back(region);
+        }
+        cur = eol + 1;
+    }
+
+    // the kernel lists them in order already, just in case
+    auto byStart = [](const Region& a, const Region& b) { return a.start < b.start; };
+    if (!std::is_sorted(this->_regions.begin(), this->_regions.end(), byStart)) {
+        std::sort(this->_regions.begin(), this->_regions.end(), byStart);
+    }
+
+    // modules span from their lowest region to the highest. they're in
+    // order of path offsets so far, as they're appended while interning
+    for (const Region& region : this->_regions) {
+        if (region.path == NO_PATH) continue;
+        auto it = std::lower_bound(this->_modules.begin(), this->_modules.end(), region.path, [](const ModuleEntry& entry, uint32_t path) {
+            return entry.path < path;
+        });
+        it->start = std::min(it->start, region.start);
+        it->end = std::max(it->end, region.end);
+    }
+    const char* pool = this->_pool.c_str();
+    std::sort(this->_modules.begin(), this->_modules.end(), [pool](const ModuleEntry& a, const ModuleEntry& b) {
+        return ::strcmp(pool + a.path, pool + b.path) < 0;
+    });
+    return !this->_regions.empty();
+}
+
+bool MapsSnapshot::_findModule(const char* path, ModuleEntry* outEntry) const {
+    const char* pool = this->_pool.c_str();
+    auto it = std::lower_bound(this->_modules.begin(), this->_modules.end(), path, [pool](const ModuleEntry& entry, const char* path) {
+        return ::strcmp(pool + entry.path, path) < 0;
+    });
+    if (it == this->_modules.end() || ::strcmp(pool + it->path, path) != 0) {
+        return false;
+    }
+    *outEntry = *it;
+    return true;
+}
+
+bool MapsSnapshot::findModule(const char* path, Module* outModule) const {
+    ModuleEntry entry;
+    if (!this->_findModule(path, &entry)) {
+        return false;
+    }
+    outModule->path = this->_pool.c_str() + entry.path;
+    outModule->start = entry.start;
+    outModule->end = entry.end;
+    return true;
+}
+
+bool MapsSnapshot::findAddress(uintptr_t addr, Region* outRegion, Module* outModule) const {
+    // the last region starting at or below <addr>
+    auto it = std::upper_bound(this->_regions.begin(), this->_regions.end(), addr, [](uintptr_t addr, const Region& region) {
+        return addr < region.start;
+    });
+    if (it == this->_regions.begin() || addr >= (-- it)->end) {
+        return false;
+    }
+    *outRegion = *it;
+    if (outModule) {
+        outModule->path = nullptr;
+        outModule->start = outModule->end = 0;
+        if (it->path != NO_PATH) {
+            this->findModule(this->pathOf(*it), outModule);
+        }
+    }
+    return true;
+}
+
+const std::vector<MapsSnapshot::Region>& MapsSnapshot::regions() const {
+    return this->_regions;
+}
+
+const char* MapsSnapshot::pathOf(const Region& region) const {
+    return region.path == NO_PATH ? nullptr : this->_pool.c_str() + region.path;
+}
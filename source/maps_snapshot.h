@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2020, Irvin Pang <halo.irvin@gmail.com>
+ * All rights reserved.
+ *
+ * see LICENSE file for details
+ */
+
+#ifndef __ADRILL_MAPS_SNAPSHOT_H__
+#define __ADRILL_MAPS_SNAPSHOT_H__
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * /proc/<pid>/maps parsed in one pass. regions are kept sorted by address,
+ * path names are interned in a single pool, and modules (all regions of the
+ * same path) sorted by path. both lookups are binary searches
+ */
+class MapsSnapshot {
+public:
+    struct Region {
+        uintptr_t start;
+        uintptr_t end;
+        uintptr_t offset;
+        int       prot;
+        // offset of the path in the pool, NO_PATH for anonymous ones
+        uint32_t  path;
+    };
+
+    struct Module {
+        const char* path;
+        // lowest start and highest end of all its regions
+        uintptr_t   start;
+        uintptr_t   end;
+    };
+
+    static const uint32_t NO_PATH = UINT32_MAX;
+
+public:
+    MapsSnapshot();
+
+    /*
+     * parse maps of <pid>, 0 for the current process
+     */
+    bool load(pid_t pid);
+
+    /*
+     * the module mapped from <path>, false if it's not there
+     */
+    bool findModule(const char* path, Module* outModule) const;
+
+    /*
+     * the region containing <addr>, along with the module it belongs to
+     * if it's file-backed. false if <addr> isn't mapped
+     */
+    bool findAddress(uintptr_t addr, Region* outRegion, Module* outModule = nullptr) const;
+
+    const std::vector<Region>& regions() const;
+    const char* pathOf(const Region& region) const;
+
+protected:
+    struct ModuleEntry {
+        uint32_t  path;
+        uintptr_t start;
+        uintptr_t end;
+    };
+
+    bool _parse(const char* text, size_t size);
+    bool _findModule(const char* path, ModuleEntry* outEntry) const;
+
+protected:
+    std::vector<Region>      _regions;
+    std::vector<ModuleEntry> _modules;
+    std::string              _pool;
+
+};
+
+#endif // __ADRILL_MAPS_SNAPSHOT_H__
@@ -0,0 +1,189 @@
+/*
+ * Copyright (c) 2020, Irvin Pang <halo.irvin@gmail.com>
+ * All rights reserved.
+ *
+ * see LICENSE file for details
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <dirent.h>
+#include <string.h>
+#include <unistd.h>
+#include <thread>
+#include <algorithm>
+
+#include "macros.h"
+#include "process_scanner.h"
+
+ProcessScanner::ProcessScanner()
+: _procFd(-1)
+, _by(MATCH_CMDLINE)
+, _threads(1) {
+}
+
+ProcessScanner::~ProcessScanner() {
+    if (this->_procFd >= 0) {
+        ::close(this->_procFd);
+    }
+}
+
+bool ProcessScanner::setPattern(const std::string& pattern, MatchBy by) {
+    this->_pattern = pattern;
+    this->_by = by;
+    if (by == MATCH_REGEX) {
+        try {
+            this->_regex.assign(pattern, std::regex::ECMAScript | std::regex::optimize);
+        } catch (const std::regex_error& e) {
+            LOGGER_LOGE("ProcessScanner::setPattern invalid regex '%s': %s\n", pattern.c_str(), e.what());
+            return false;
+        }
+    }
+    return true;
+}
+
+void ProcessScanner::setThreads(int threads) {
+    this->_threads = std::max(threads, 1);
+}
+
+bool ProcessScanner::parseMatchBy(const std::string& name, MatchBy* outBy) {
+    if (name.empty() || name == "cmdline") *outBy = MATCH_CMDLINE;
+    else if (name == "comm")               *outBy = MATCH_COMM;
+    else if (name == "exe")                *outBy = MATCH_EXE;
+    else if (name == "regex")              *outBy = MATCH_REGEX;
+    else return false;
+    return true;
+}
+
+bool ProcessScanner::_openProc() {
+    if (this->_procFd < 0) {
+        this->_procFd = ::open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (this->_procFd < 0) {
+            LOGGER_LOGE("ProcessScanner failed to open dir '/proc': %s\n", ::strerror(errno));
+        }
+    }
+    return this->_procFd >= 0;
+}
+
+std::vector<pid_t> ProcessScanner::scan() {
+    std::vector<pid_t> matches;
+    if (!this->_openProc()) {
+        return matches;
+    }
+
+    // list pids first, the dir stream is walked on a dup so procFd stays usable
+    std::vector<pid_t> pids;
+    pids.reserve(2048);
+    int dirFd = ::dup(this->_procFd);
+    DIR* dp = dirFd >= 0 ? ::fdopendir(dirFd) : nullptr;
+    if (!dp) {
+        LOGGER_LOGE("ProcessScanner::scan failed to list '/proc': %s\n", ::strerror(errno));
+        if (dirFd >= 0) {
+            ::close(dirFd);
+        }
+        return matches;
+    }
+    ::rewinddir(dp);
+    struct dirent* entry;
+    while ((entry = ::readdir(dp)) != nullptr) {
+        // only interest in numeric dir name
+        if (entry->d_name[0] < '1' || entry->d_name[0] > '9') continue;
+        pids.push_back((pid_t)::atoi(entry->d_name));
+    }
+    ::closedir(dp);
+
+    size_t threads = std::min<size_t>(this->_threads, pids.size() / 64 + 1);
+    if (threads <= 1) {
+        this->_scanRange(pids.data(), pids.size(), &matches);
+    } else {
+        std::vector<std::vector<pid_t>> results(threads);
+        std::vector<std::thread> workers;
+        size_t chunk = (pids.size() + threads - 1) / threads;
+        for (size_t i = 0; i < threads; ++ i) {
+            size_t begin = std::min(i * chunk, pids.size());
+            size_t n = std::min(chunk, pids.size() - begin);
+            workers.emplace_back(&ProcessScanner::_scanRange, this, pids.data() + begin, n, &results[i]);
+        }
+        for (size_t i = 0; i < threads; ++ i) {
+            workers[i].join();
+            matches.insert(matches.end(), results[i].begin(), results[i].end());
+        }
+    }
+    std::sort(matches.begin(), matches.end());
+    return matches;
+}
+
+bool ProcessScanner::matches(pid_t pid) {
+    return this->_openProc() && this->_matches(pid, this->_buffer);
+}
+
+void ProcessScanner::_scanRange(const pid_t* pids, size_t n, std::vector<pid_t>* outMatches) const {
+    // one buffer per thread, reused by every process
+    char buffer[SCAN_BUFFER_SIZE];
+    for (size_t i = 0; i < n; ++ i) {
+        if (this->_matches(pids[i], buffer)) {
+            outMatches->push_back(pids[i]);
+        }
+    }
+}
+
+ssize_t ProcessScanner::_read(pid_t pid, const char* name, char* buffer) const {
+    char path[32];
+    ::snprintf(path, sizeof(path), "%d/%s", pid, name);
+    int fd = ::openat(this->_procFd, path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t size = 0;
+    while (size < SCAN_BUFFER_SIZE - 1) {
+        ssize_t n = ::read(fd, buffer + size, SCAN_BUFFER_SIZE - 1 - size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        size += n;
+    }
+    ::close(fd);
+    buffer[size] = '\0';
+    return size;
+}
+
+bool ProcessScanner::_matches(pid_t pid, char* buffer) const {
+    ssize_t size = 0;
+    switch (this->_by) {
+        case MATCH_CMDLINE:
+            // arguments are separated by '\0', so it's argv[0] being compared
+            size = this->_read(pid, "cmdline", buffer);
+            return size > 0 && ::strcmp(buffer, this->_pattern.c_str()) == 0;
+
+        case MATCH_COMM:
+            size = this->_read(pid, "comm", buffer);
+            if (size > 0 && buffer[size - 1] == '\n') {
+                buffer[-- size] = '\0';
+            }
+            return size > 0 && ::strcmp(buffer, this->_pattern.c_str()) == 0;
+
+        case MATCH_EXE: {
+            char path[32];
+            ::snprintf(path, sizeof(path), "%d/exe", pid);
+            size = ::readlinkat(this->_procFd, path, buffer, SCAN_BUFFER_SIZE - 1);
+            if (size <= 0) {
+                return false;
+            }
+            buffer[size] = '\0';
+            const char* basename = ::strrchr(buffer, '/');
+            return ::strcmp(buffer, this->_pattern.c_str()) == 0 ||
+                (basename && ::strcmp(basename + 1, this->_pattern.c_str()) == 0);
+        }
+
+        case MATCH_REGEX:
+            size = this->_read(pid, "cmdline", buffer);
+            if (size <= 0) {
+                return false;
+            }
+            // trailing '\0' dropped, the ones in between joining arguments
+            while (size > 0 && buffer[size - 1] == '\0') -- size;
+            std::replace(buffer, buffer + size, '\0', ' ');
+            // the only match allocating, see the header
+            return std::regex_search((const char*)buffer, (const char*)buffer + size, this->_regex);
+    }
+    return false;
+}
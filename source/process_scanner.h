@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2020, Irvin Pang <halo.irvin@gmail.com>
+ * All rights reserved.
+ *
+ * see LICENSE file for details
+ */
+
+#ifndef __ADRILL_PROCESS_SCANNER_H__
+#define __ADRILL_PROCESS_SCANNER_H__
+
+#include <regex>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+// bytes of /proc/<pid>/* read for matching, longer contents are cut
+#define SCAN_BUFFER_SIZE 4096
+
+/*
+ * finds processes by name through /proc. files are opened relative to a
+ * dirfd of /proc and read into a fixed buffer, so that nothing is allocated
+ * per process, except with MATCH_REGEX: std::regex_search allocates state of
+ * its executor on every call, so that's a few allocations per process there.
+ * unreadable or vanished processes are skipped quietly
+ */
+class ProcessScanner {
+public:
+    enum MatchBy {
+        MATCH_CMDLINE,  // argv[0], i.e., what 'ps' shows for apps
+        MATCH_COMM,     // /proc/<pid>/comm, at most 15 chars
+        MATCH_EXE,      // target of /proc/<pid>/exe, full path or basename
+        MATCH_REGEX,    // ECMAScript regex searched in cmdline, args joined by spaces, allocates
+    };
+
+public:
+    ProcessScanner();
+    ~ProcessScanner();
+
+    /*
+     * false if <pattern> is not a valid regex for MATCH_REGEX
+     */
+    bool setPattern(const std::string& pattern, MatchBy by = MATCH_CMDLINE);
+
+    /*
+     * spread scan() over <threads> threads, 1 by default
+     */
+    void setThreads(int threads);
+
+    /*
+     * all matching processes in ascending order of pid
+     */
+    std::vector<pid_t> scan();
+
+    /*
+     * whether <pid> matches, e.g., for a process just spawned
+     */
+    bool matches(pid_t pid);
+
+    /*
+     * cmdline(or empty), comm, exe or regex, false if unknown
+     */
+    static bool parseMatchBy(const std::string& name, MatchBy* outBy);
+
+protected:
+    bool _openProc();
+    bool _matches(pid_t pid, char* buffer) const;
+    // reads /proc/<pid>/<name> into <buffer>, returns the size or -1
+    ssize_t _read(pid_t pid, const char* name, char* buffer) const;
+    void _scanRange(const pid_t* pids, size_t n, std::vector<pid_t>* outMatches) const;
+
+protected:
+    int         _procFd;
+    MatchBy     _by;
+    std::string _pattern;
+    std::regex  _regex;
+    int         _threads;
+    char        _buffer[SCAN_BUFFER_SIZE];
+
+};
+
+#endif // __ADRILL_PROCESS_SCANNER_H__
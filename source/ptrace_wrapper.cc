@@ -6,26 +6,213 @@
  */
 
 #include <fstream>
+#include <poll.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/un.h>
 #include <sys/wait.h>
+#include <sys/signalfd.h>
+#include <sys/uio.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/ptrace.h>
+#include <sys/syscall.h>
 #include <arpa/inet.h>
 
 #include "macros.h"
+#include "clock.h"
 #include "ptrace_wrapper.h"
 
+// max remote iovecs per process_vm_readv/writev call
+#define VM_IOV_BATCH IOV_MAX
+
+// wait for 10 seconds at most by default
+#define WAIT_TIMEOUT_DEFAULT_MS 10000
+// SIGCHLD could be consumed by another tracer in the same process,
+// poll in slices so a lost wakeup costs no more than that
+#define WAIT_POLL_SLICE_MS 10
+
+// not in older headers
+#ifndef __NR_pidfd_open
+#   define __NR_pidfd_open 434
+#endif
+#define WAIT_P_PIDFD 3
+
+#include <linux/elf.h>
+#if $is($arch_arm64)
+#   ifndef NT_ARM_SYSTEM_CALL
+#       define NT_ARM_SYSTEM_CALL 0x404
+#   endif
+#elif $is($arch_arm)
+#   ifndef PTRACE_SET_SYSCALL
+#       define PTRACE_SET_SYSCALL 23
+#   endif
+#endif
+#ifndef NT_X86_XSTATE
+#   define NT_X86_XSTATE 0x202
+#endif
+#ifndef NT_ARM_VFP
+#   define NT_ARM_VFP 0x400
+#endif
+
+// kernel internal errnos(include/linux/errno.h), only tracers could see them
+#define ERESTARTSYS           512
+#define ERESTARTNOINTR        513
+#define ERESTARTNOHAND        514
+#define ERESTART_RESTARTBLOCK 516
+
 union union_intptr_t {
     intptr_t as_intptr;
     char     as_chars[PT_SIZE];
 };
 
+static uintptr_t pageSize() {
+    static uintptr_t size = (uintptr_t)::sysconf(_SC_PAGESIZE);
+    return size;
+}
+
+// reads /proc/<pid>/task/<tid>/<name> into <buffer> as a string, false if unreadable
+static bool readTaskFile(pid_t pid, pid_t tid, const char* name, char* buffer, size_t size) {
+    char path[64];
+    ::snprintf(path, sizeof(path), "/proc/%d/task/%d/%s", pid, tid, name);
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return false;
+    }
+    ssize_t n = ::read(fd, buffer, size - 1);
+    ::close(fd);
+    buffer[n > 0 ? n : 0] = 0;
+    return n > 0;
+}
+
+// thread group <tid> belongs to, <tid> itself if unknown
+static pid_t readTgid(pid_t tid) {
+    char buffer[2048];
+    const char* tgid = readTaskFile(tid, tid, "status", buffer, sizeof(buffer)) ? ::strstr(buffer, "\nTgid:") : nullptr;
+    return tgid ? (pid_t)::strtol(tgid + 6, nullptr, 10) : tid;
+}
+
+bool readTaskCounters(pid_t pid, pid_t tid, TaskCounters* outCounters) {
+    ::memset(outCounters, 0, sizeof(TaskCounters));
+    char buffer[2048];
+    // comm in stat could hold anything, fields are counted from its closing ')'
+    if (!readTaskFile(pid, tid, "stat", buffer, sizeof(buffer))) {
+        return false;
+    }
+    const char* fields = ::strrchr(buffer, ')');
+    unsigned long long minflt = 0, majflt = 0;
+    if (!fields || ::sscanf(fields + 1, " %*c %*d %*d %*d %*d %*d %*u %llu %*u %llu", &minflt, &majflt) != 2) {
+        return false;
+    }
+    outCounters->minorFaults = minflt;
+    outCounters->majorFaults = majflt;
+
+    if (!readTaskFile(pid, tid, "status", buffer, sizeof(buffer))) {
+        return false;
+    }
+    const char* voluntary = ::strstr(buffer, "\nvoluntary_ctxt_switches:");
+    const char* involuntary = ::strstr(buffer, "\nnonvoluntary_ctxt_switches:");
+    if (voluntary) {
+        outCounters->voluntarySwitches = ::strtoull(::strchr(voluntary, ':') + 1, nullptr, 10);
+    }
+    if (involuntary) {
+        outCounters->involuntarySwitches = ::strtoull(::strchr(involuntary, ':') + 1, nullptr, 10);
+    }
+
+    unsigned long long cpuNs = 0, runDelayNs = 0;
+    if (readTaskFile(pid, tid, "schedstat", buffer, sizeof(buffer))
+        && ::sscanf(buffer, "%llu %llu", &cpuNs, &runDelayNs) == 2) {
+        outCounters->cpuNs = cpuNs;
+        outCounters->runDelayNs = runDelayNs;
+    }
+    return true;
+}
+
+// signalfds of SIGCHLD open on this thread, and whether it was blocked before
+static thread_local int childSignalFds = 0;
+static thread_local bool childSignalBlocked = false;
+
+int openChildSignalFd() {
+    sigset_t mask;
+    ::sigemptyset(&mask);
+    ::sigaddset(&mask, SIGCHLD);
+    if (childSignalFds == 0) {
+        sigset_t oldMask;
+        ::pthread_sigmask(SIG_BLOCK, &mask, &oldMask);
+        childSignalBlocked = ::sigismember(&oldMask, SIGCHLD) == 1;
+    }
+    int fd = ::signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd != -1) {
+        ++ childSignalFds;
+    } else if (childSignalFds == 0 && !childSignalBlocked) {
+        ::pthread_sigmask(SIG_UNBLOCK, &mask, nullptr);
+    }
+    return fd;
+}
+
+void closeChildSignalFd(int fd) {
+    if (fd == -1) {
+        return;
+    }
+    ::close(fd);
+    if (-- childSignalFds == 0 && !childSignalBlocked) {
+        sigset_t mask;
+        ::sigemptyset(&mask);
+        ::sigaddset(&mask, SIGCHLD);
+        ::pthread_sigmask(SIG_UNBLOCK, &mask, nullptr);
+    }
+}
+
+template<typename D>
+long PtraceWrapper::_ptrace(int request, const void* addr, D data) {
+    ++ this->_stats.ptraceCalls;
+#if defined(__GLIBC__)
+    // glibc takes an enum rather than int, for the host build
+    return ::ptrace((__ptrace_request)request, this->_pid, const_cast<void*>(addr), (void*)(intptr_t)data);
+#else
+    return ::ptrace(request, this->_pid, const_cast<void*>(addr), (void*)(intptr_t)data);
+#endif
+}
+
 PtraceWrapper::PtraceWrapper()
 : _pid(0)
-, _isZygote(false) {
+, _tgid(0)
+, _isZygote(false)
+, _seized(false)
+, _exited(false)
+, _running(false)
+, _attachStep(-1)
+, _restartRegs()
+, _expectedCount(0)
+, _pidFd(-1)
+, _sigFd(-1)
+, _waitTimeoutMs(WAIT_TIMEOUT_DEFAULT_MS)
+, _lastStatus(0)
+, _resumeRequest(PTRACE_CONT)
+, _pendingCount(0)
+, _vmAvailable(true)
+, _memFd(-1)
+, _memFdAvailable(true)
+, _memBackends(MEM_AUTO)
+, _lastMemBackends(0)
+, _stats()
+, _resumeNs(0)
+, _heldSinceNs(0) {
+}
+
+PtraceWrapper::~PtraceWrapper() {
+    for (int fd : { this->_memFd, this->_pidFd }) {
+        if (fd != -1) {
+            ::close(fd);
+        }
+    }
+    closeChildSignalFd(this->_sigFd);
 }
 
 /*
@@ -46,7 +233,18 @@ PtraceWrapper::PtraceWrapper()
  *     https://elixir.bootlin.com/linux/latest/source/arch/arm64/kernel/signal.c#L851
  *     https://elixir.bootlin.com/linux/latest/source/arch/x86/kernel/signal.c#L732
  */
-bool PtraceWrapper::attach(pid_t pid) {
+bool PtraceWrapper::attach(pid_t pid, AttachMode mode) {
+    bool ok = this->complete(this->beginAttach(pid, mode), [this]() {
+        return this->continueAttach();
+    });
+    if (!ok && this->_attachStep >= 0) {
+        LOGGER_LOGE("PtraceWrapper::attach wait for SIGTRAP/SIGSTOP failed: %s\n", ::strerror(errno));
+        this->_abortAttach();
+    }
+    return ok;
+}
+
+bool PtraceWrapper::beginAttach(pid_t pid, AttachMode mode) {
     // just in case
     errno = 0;
     bool ok = true;
@@ -54,6 +252,26 @@ bool PtraceWrapper::attach(pid_t pid) {
         // check attached already
         BREAK_IF_WITH_LOGE(this->_pid, "PtraceWrapper::attach already attached to pid %d\n", this->_pid);
         this->_pid = pid;
+        this->_tgid = readTgid(pid);
+        this->_seized = (mode == ATTACH_SEIZE);
+        this->_exited = false;
+        this->_running = true;
+        this->_attachStep = 0;
+        this->_resumeRequest = PTRACE_CONT;
+        this->_pendingCount = 0;
+        this->_stats = Stats();
+        this->_stats.taskCounted = readTaskCounters(pid, pid, &this->_stats.taskBefore);
+        this->_resumeNs = monotonicNs();
+        this->_heldSinceNs = 0;
+        this->_vmAvailable = true;
+        this->_memFdAvailable = true;
+
+        // pins the process so waits never pick up a recycled pid
+        this->_pidFd = (int)::syscall(__NR_pidfd_open, pid, 0);
+        // stops are only announced by SIGCHLD, keep it pending for signalfd
+        if (this->_sigFd == -1) {
+            this->_sigFd = openChildSignalFd();
+        }
 
         // check file accessable
         char cmdline[0x100];
@@ -69,55 +287,184 @@ bool PtraceWrapper::attach(pid_t pid) {
             LOGGER_LOGE("PtraceWrapper::attach failed to open file %s: %s\n", cmdline, ::strerror(errno));
         }
 
-        // do attach
-        ok &= (::ptrace(PTRACE_ATTACH, this->_pid, nullptr, 0) != -1);
-        BREAK_IF_WITH_LOGE(!ok, "PtraceWrapper::attach attach to process %d failed: %s\n", this->_pid, ::strerror(errno));
-        ok &= this->waitForSignals({ SIGTRAP, SIGSTOP });
-        BREAK_IF_WITH_LOGE(!ok, "PtraceWrapper::attach wait for SIGTRAP/SIGSTOP failed: %s\n", ::strerror(errno));
-        
-        // wait for syscall enter
-        ok &= (::ptrace(PTRACE_SYSCALL, this->_pid, nullptr, 0) != -1);
-        BREAK_IF_WITH_LOGE(!ok, "PtraceWrapper::attach enter syscall failed: %s\n", ::strerror(errno));
-        ok &= this->waitForSignals({ SIGTRAP, SIGSTOP });
-        BREAK_IF_WITH_LOGE(!ok, "PtraceWrapper::attach wait for SIGTRAP/SIGSTOP(enter) failed: %s\n", ::strerror(errno));
-        
+        if (mode == ATTACH_SEIZE) {
+            ok &= (this->_ptrace(PTRACE_SEIZE, nullptr, 0) != -1);
+            BREAK_IF_WITH_LOGE(!ok, "PtraceWrapper::attach seize process %d failed: %s\n", this->_pid, ::strerror(errno));
+            ok &= (this->_ptrace(PTRACE_INTERRUPT, nullptr, 0) != -1);
+            BREAK_IF_WITH_LOGE(!ok, "PtraceWrapper::attach interrupt process %d failed: %s\n", this->_pid, ::strerror(errno));
+        } else {
+            ok &= (this->_ptrace(PTRACE_ATTACH, nullptr, 0) != -1);
+            BREAK_IF_WITH_LOGE(!ok, "PtraceWrapper::attach attach to process %d failed: %s\n", this->_pid, ::strerror(errno));
+        }
+        // SIGTRAP for interrupt-stop, or SIGSTOP if it has been group-stopped
+        this->expectSignals({ SIGTRAP, SIGSTOP });
+    }
+    while (false);
+
+    if (!ok && this->_attachStep == 0) {
+        // bailout
+        this->_abortAttach();
+    }
+
+    return ok;
+}
+
+/*
+ * PTRACE_INTERRUPT stops the tracee wherever it is, without a signal. if it was
+ * blocked in a syscall, the syscall is aborted with one of -ERESTART* and would
+ * be restarted by the kernel on the way back to user mode. but that happens
+ * against whatever registers we have set for remote calls by then, so the
+ * restart is done by hand here instead:
+ *
+ *     $arch_x86/$arch_x64: the kernel rewinds after the stop. so we do it now,
+ *     (E|R)IP - 2 back onto INT 0x80/SYSCALL, restore (E|R)AX from orig_(e|r)ax,
+ *     and clear orig_(e|r)ax to tell the kernel that there's nothing to restart.
+ *
+ *     $arch_arm/$arch_arm64: the kernel rewinds PC onto SVC and restores r0/x0
+ *     from orig_r0/orig_x0 before the stop, but it sets r7/x8 to restart_syscall
+ *     for -ERESTART_RESTARTBLOCK only after the stop, and only if PC is still
+ *     there. the error itself is gone by the stop. so if PC is on a SVC, we let
+ *     the kernel go on and execute it to the syscall-entry stop, which tells the
+ *     syscall it picked. then it's skipped, and tracee is interrupted again
+ *     before any user code runs, to have r7/x8 of the registers seen at first
+ *     set to that syscall.
+ *
+ * either way, restoring the saved registers before detach re-issues the syscall.
+ */
+PtraceWrapper::WaitResult PtraceWrapper::continueAttach() {
+    bool ok = true;
+    bool done = false;
+    do {
+        if (this->_seized) {
+            WaitResult result = this->_rewindSyscall(this->_attachStep ++);
+            ok &= result != WAIT_FAILED;
+            BREAK_IF_WITH_LOGE(!ok, "PtraceWrapper::attach failed to rewind interrupted syscall\n");
+            done = result == WAIT_DONE;
+            break;
+        }
+
+        // legacy: stopped by attach, then by the syscall entered, then left
+        int step = this->_attachStep ++;
+        if (step == 2) {
+            done = true;
+            break;
+        }
         // a workaround for zygote
-        if (this->_isZygote) {
+        if (step == 1 && this->_isZygote) {
             ::sleep(2);
             this->_connectToZygote();
         }
-        
-        // wait for syscall exit
-        ok &= (::ptrace(PTRACE_SYSCALL, this->_pid, nullptr, 0) != -1);
-        BREAK_IF_WITH_LOGE(!ok, "PtraceWrapper::attach exit syscall failed: %s\n", ::strerror(errno));
-        ok &= this->waitForSignals({ SIGTRAP, SIGSTOP });
-        BREAK_IF_WITH_LOGE(!ok, "PtraceWrapper::attach wait for SIGTRAP/SIGSTOP(exit) failed: %s\n", ::strerror(errno));
-    }
-    while (false);
+        ok &= this->_resume(PTRACE_SYSCALL, 0);
+        BREAK_IF_WITH_LOGE(!ok, "PtraceWrapper::attach %s syscall failed: %s\n", step == 0 ? "enter" : "exit", ::strerror(errno));
+        this->expectSignals({ SIGTRAP, SIGSTOP });
+    } while (false);
 
     if (!ok) {
-        // bailout
-        this->_pid = 0;
+        this->_abortAttach();
+        return WAIT_FAILED;
+    }
+    if (done) {
+        this->_attachStep = -1;
+        this->_heldSinceNs = monotonicNs();
+        return WAIT_DONE;
     }
+    return WAIT_PENDING;
+}
 
+bool PtraceWrapper::adopt(pid_t pid, bool seized) {
+    if (this->_pid) {
+        LOGGER_LOGE("PtraceWrapper::adopt already attached to pid %d\n", this->_pid);
+        return false;
+    }
+    this->_pid = pid;
+    this->_tgid = readTgid(pid);
+    this->_seized = seized;
+    this->_exited = false;
+    this->_running = false;
+    this->_attachStep = -1;
+    this->_expectedCount = 0;
+    this->_resumeRequest = PTRACE_CONT;
+    this->_pendingCount = 0;
+    this->_stats = Stats();
+    // stopped already, nothing ran since the stop to be told apart
+    this->_stats.taskCounted = readTaskCounters(pid, pid, &this->_stats.taskBefore);
+    this->_heldSinceNs = monotonicNs();
+    this->_vmAvailable = true;
+    this->_memFdAvailable = true;
+    this->_isZygote = false;
+    this->_pidFd = (int)::syscall(__NR_pidfd_open, pid, 0);
+    if (this->_sigFd == -1) {
+        this->_sigFd = openChildSignalFd();
+    }
+    return true;
+}
+
+bool PtraceWrapper::setOptions(int options) {
+    bool ok = this->_pid && this->_ptrace(PTRACE_SETOPTIONS, nullptr, (void*)(intptr_t)options) != -1;
+    if (!ok) {
+        LOGGER_LOGE("PtraceWrapper::setOptions failed: %s\n", ::strerror(errno));
+    }
     return ok;
 }
 
+void PtraceWrapper::_abortAttach() {
+    // it may still be traced, but can't be detached unless stopped
+    this->_attachStep = -1;
+    this->_expectedCount = 0;
+    this->_pid = 0;
+    if (this->_pidFd != -1) {
+        ::close(this->_pidFd);
+        this->_pidFd = -1;
+    }
+}
+
 bool PtraceWrapper::detach() {
     bool ok = false;
-    if (this->_pid) {
-        ok = (::ptrace(PTRACE_DETACH, this->_pid, nullptr, 0) != -1);
+    if (this->_memFd != -1) {
+        ::close(this->_memFd);
+        this->_memFd = -1;
+    }
+    if (this->_attachStep >= 0 && this->_running) {
+        // never got stopped, e.g., a wait timed out halfway
+        this->_abortAttach();
+    } else if (this->_attachStep >= 0) {
+        // stopped halfway, e.g., by beginStop(), which is just as good
+        this->_attachStep = -1;
+    }
+    if (this->_pid && !this->_exited) {
+        // a tracee has to be stopped before being detached
+        ok = this->stop() && (this->_ptrace(PTRACE_DETACH, nullptr, 0) != -1);
         if (!ok) {
             LOGGER_LOGE("PtraceWrapper::detach failed: %s\n", ::strerror(errno));
+        } else {
+            if (this->_heldSinceNs) {
+                this->_stats.heldNs = monotonicNs() - this->_heldSinceNs;
+            }
+            // PTRACE_DETACH only injects a signal from signal-delivery-stops,
+            // so the deferred ones are simply raised again, to the thread
+            // dequeued them rather than any other one of the group
+            for (int i = 0; i < this->_pendingCount; ++ i) {
+                ::syscall(__NR_tgkill, this->_tgid, this->_pid, this->_pendingSignals[i]);
+            }
         }
     }
+    // right after, its faults & switches since are mostly ours
+    this->_stats.taskCounted = this->_stats.taskCounted && ok
+        && readTaskCounters(this->_pid, this->_pid, &this->_stats.taskAfter);
+    if (this->_pidFd != -1) {
+        ::close(this->_pidFd);
+        this->_pidFd = -1;
+    }
+    this->_pendingCount = 0;
+    this->_heldSinceNs = 0;
+    this->_pid = 0;
     return ok;
 }
 
-bool PtraceWrapper::kontinue() {
+bool PtraceWrapper::kontinue(int signal) {
     bool ok = false;
     if (this->_pid) {
-        ok = (::ptrace(PTRACE_CONT, this->_pid, nullptr, 0) != -1);
+        ok = this->_resume(PTRACE_CONT, signal);
         if (!ok) {
             LOGGER_LOGE("PtraceWrapper::kontinue failed: %s\n", ::strerror(errno));
         }
@@ -125,62 +472,307 @@ bool PtraceWrapper::kontinue() {
     return ok;
 }
 
-bool PtraceWrapper::waitForSignal(int signal) {
-    return this->waitForSignals({ signal });
+bool PtraceWrapper::kontinueSyscall(int signal) {
+    bool ok = false;
+    if (this->_pid) {
+        ok = this->_resume(PTRACE_SYSCALL, signal);
+        if (!ok) {
+            LOGGER_LOGE("PtraceWrapper::kontinueSyscall failed: %s\n", ::strerror(errno));
+        }
+    }
+    return ok;
+}
+
+bool PtraceWrapper::stop() {
+    if (!this->_pid || this->_exited) {
+        return false;
+    }
+    if (!this->_running) {
+        return true;
+    }
+    bool ok = this->complete(this->beginStop(), []() {
+        return WAIT_DONE;
+    });
+    if (!ok) {
+        LOGGER_LOGE("PtraceWrapper::stop failed to stop process %d: %s\n", this->_pid, ::strerror(errno));
+    }
+    return ok;
+}
+
+bool PtraceWrapper::beginStop() {
+    // a seized tracee could be interrupted without signals, otherwise
+    // SIGSTOP is suppressed when resuming from its signal-delivery-stop.
+    // it's sent to the very thread, a process-directed one could be taken
+    // by any untraced thread and leave the whole group stopped
+    bool ok = this->_seized
+        ? this->_ptrace(PTRACE_INTERRUPT, nullptr, 0) != -1
+        : ::syscall(__NR_tgkill, this->_tgid, this->_pid, SIGSTOP) == 0;
+    if (ok) {
+        this->expectSignals({ SIGTRAP, SIGSTOP });
+    }
+    return ok;
+}
+
+bool PtraceWrapper::waitForSignal(int signal, int timeoutMs) {
+    return this->waitForSignals({ signal }, timeoutMs);
+}
+
+bool PtraceWrapper::waitForSignals(std::initializer_list<int> signals, int timeoutMs) {
+    this->expectSignals(signals);
+    return this->waitExpected(timeoutMs);
 }
 
-bool PtraceWrapper::waitForSignals(const std::vector<int>& signals) {
+bool PtraceWrapper::waitExpected(int timeoutMs) {
+    if (timeoutMs == TIMEOUT_DEFAULT) {
+        timeoutMs = this->_waitTimeoutMs;
+    }
+    int64_t deadline = timeoutMs < 0 ? -1 : monotonicMs() + timeoutMs;
+
     int status = 0;
-    bool ret = false;
-    bool kontinue = true;
-    while (this->_pid && kontinue) {
-        errno = 0;
-        if (::waitpid(this->_pid, &status, WUNTRACED) == _pid) {
-            // check exit signal
-            if (WIFEXITED(status)) {
-                LOGGER_LOGE("PtraceWrapper::waitForSignals process %d has exited\n", _pid);
-                break;
-            }
-            // check stopped signal
-            if (WIFSTOPPED(status)) {
-                for (int signal : signals) {
-                    if (signal == 0 || WSTOPSIG(status) == signal) {
-                        ret = true;
-                        kontinue = false;
-                        break;
+    WaitResult result = WAIT_PENDING;
+    while (this->_pid && !this->_exited && result == WAIT_PENDING) {
+        BREAK_IF(!this->_waitStatus(&status, deadline));
+        result = this->onStatus(status);
+    }
+    return result == WAIT_DONE;
+}
+
+void PtraceWrapper::expectSignals(std::initializer_list<int> signals) {
+    this->_expectedCount = 0;
+    for (int signal : signals) {
+        if (this->_expectedCount < MAX_EXPECTED_SIGNALS) {
+            this->_expectedSignals[this->_expectedCount ++] = signal;
+        }
+    }
+}
+
+PtraceWrapper::WaitResult PtraceWrapper::onStatus(int status) {
+    // check exit signal
+    if (WIFEXITED(status) || WIFSIGNALED(status)) {
+        LOGGER_LOGE("PtraceWrapper::waitForSignals process %d has exited\n", this->_pid);
+        this->_exited = true;
+        return WAIT_FAILED;
+    }
+    // check stopped signal
+    if (WIFSTOPPED(status)) {
+        for (int i = 0; i < this->_expectedCount; ++ i) {
+            int signal = this->_expectedSignals[i];
+            if (signal == 0 || WSTOPSIG(status) == signal) {
+                if (this->_running) {
+                    int64_t runNs = monotonicNs() - this->_resumeNs;
+                    this->_stats.runNs += runNs;
+                    if (this->_heldSinceNs) {
+                        uint32_t slot = std::min(this->_stats.heldRuns ++, (uint32_t)MAX_HELD_RUNS - 1);
+                        this->_stats.heldRunNs[slot] += runNs;
                     }
                 }
-                if (ret == false) {
-                    LOGGER_LOGE("PtraceWrapper::waitForSignals process stopped by unexcepted signal %d.\n", WSTOPSIG(status));
-                }
+                ++ this->_stats.stops;
+                this->_lastStatus = status;
+                this->_running = false;
+                this->_expectedCount = 0;
+                return WAIT_DONE;
             }
-        } else {
-            // retry syscalls that can return EINTR
-            if (errno != EINTR) {
-                LOGGER_LOGE("PtraceWrapper::waitForSignals waitpid error: %s\n", ::strerror(errno));
-                break;
+        }
+        // event stops(e.g., group-stop of a seized tracee) carry no signal to deliver
+        bool deferred = (status >> 16) == 0;
+        if (deferred) {
+            this->_queueSignal(WSTOPSIG(status));
+        }
+        LOGGER_LOGE("PtraceWrapper::waitForSignals process stopped by unexcepted signal %d%s.\n", WSTOPSIG(status), deferred ? ", deferred" : "");
+        // and let it go on towards the stop we're waiting for
+        if (this->_ptrace(this->_resumeRequest, nullptr, 0) == -1) {
+            LOGGER_LOGE("PtraceWrapper::waitForSignals failed to resume process: %s\n", ::strerror(errno));
+            return WAIT_FAILED;
+        }
+    }
+    return WAIT_PENDING;
+}
+
+int PtraceWrapper::statusOf(const siginfo_t& info) {
+    switch (info.si_code) {
+    case CLD_EXITED:  return (info.si_status & 0xff) << 8;
+    case CLD_KILLED:  return info.si_status & 0x7f;
+    case CLD_DUMPED:  return (info.si_status & 0x7f) | 0x80;
+    // si_status holds event bits of ptrace-stops as well
+    default:          return (info.si_status << 8) | 0x7f;
+    }
+}
+
+void PtraceWrapper::setWaitTimeout(int timeoutMs) {
+    this->_waitTimeoutMs = timeoutMs;
+}
+
+int PtraceWrapper::waitTimeout() const {
+    return this->_waitTimeoutMs;
+}
+
+const PtraceWrapper::Stats& PtraceWrapper::stats() const {
+    return this->_stats;
+}
+
+int PtraceWrapper::lastStatus() const {
+    return this->_lastStatus;
+}
+
+pid_t PtraceWrapper::pid() const {
+    return this->_pid;
+}
+
+bool PtraceWrapper::running() const {
+    return this->_pid && !this->_exited && this->_running;
+}
+
+bool PtraceWrapper::exited() const {
+    return this->_exited;
+}
+
+bool PtraceWrapper::getSignalInfo(siginfo_t* outInfo) {
+    bool ok = false;
+    if (this->_pid) {
+        ok = (this->_ptrace(PTRACE_GETSIGINFO, nullptr, outInfo) != -1);
+        if (!ok) {
+            LOGGER_LOGE("PtraceWrapper::getSignalInfo failed: %s\n", ::strerror(errno));
+        }
+    }
+    return ok;
+}
+
+bool PtraceWrapper::_resume(int request, int signal) {
+    this->_resumeRequest = request;
+    this->_resumeNs = monotonicNs();
+    this->_running = this->_ptrace(request, nullptr, signal) != -1;
+    return this->_running;
+}
+
+PtraceWrapper::WaitResult PtraceWrapper::pollStatus(int* outStatus) {
+    if (!this->_pid) {
+        return WAIT_FAILED;
+    }
+    while (true) {
+        // waitid through pidfd where the kernel supports it
+        siginfo_t info;
+        ::memset(&info, 0, sizeof(info));
+        int idtype = this->_pidFd != -1 ? WAIT_P_PIDFD : P_PID;
+        id_t id = this->_pidFd != -1 ? (id_t)this->_pidFd : (id_t)this->_pid;
+        errno = 0;
+        if (::waitid((idtype_t)idtype, id, &info, WEXITED | WSTOPPED | WNOHANG | __WALL) == -1) {
+            if (errno == EINTR) {
+                continue;
             }
+            if (errno == EINVAL && idtype == WAIT_P_PIDFD) {
+                // pidfd_open is there but waitid(P_PIDFD) is not(linux 5.3)
+                ::close(this->_pidFd);
+                this->_pidFd = -1;
+                continue;
+            }
+            if (errno == ECHILD) {
+                // reaped by someone else, or not traced by us any more
+                this->_exited = true;
+            }
+            LOGGER_LOGE("PtraceWrapper::pollStatus waitid error on process %d: %s\n", this->_pid, ::strerror(errno));
+            return WAIT_FAILED;
+        }
+        if (info.si_pid == 0) {
+            return WAIT_PENDING;
         }
+        *outStatus = statusOf(info);
+        return WAIT_DONE;
+    }
+}
+
+bool PtraceWrapper::_waitStatus(int* outStatus, int64_t deadline) {
+    while (true) {
+        WaitResult result = this->pollStatus(outStatus);
+        if (result != WAIT_PENDING) {
+            return result == WAIT_DONE;
+        }
+
+        int timeout = WAIT_POLL_SLICE_MS;
+        if (deadline >= 0) {
+            int64_t remaining = deadline - monotonicMs();
+            if (remaining <= 0) {
+                errno = ETIMEDOUT;
+                LOGGER_LOGE("PtraceWrapper::waitStatus timed out waiting for process %d\n", this->_pid);
+                return false;
+            }
+            timeout = (int)std::min<int64_t>(remaining, timeout);
+        }
+
+        // sleep until SIGCHLD(stops & exit) or pidfd readable(exit)
+        struct pollfd fds[2];
+        nfds_t nfds = 0;
+        for (int fd : { this->_sigFd, this->_pidFd }) {
+            if (fd != -1) {
+                fds[nfds].fd = fd;
+                fds[nfds].events = POLLIN;
+                fds[nfds ++].revents = 0;
+            }
+        }
+        if (::poll(fds, nfds, timeout) > 0 && this->_sigFd != -1) {
+            struct signalfd_siginfo sigInfo;
+            while (::read(this->_sigFd, &sigInfo, sizeof(sigInfo)) == sizeof(sigInfo));
+        }
+    }
+}
+
+void PtraceWrapper::_queueSignal(int signal) {
+    for (int i = 0; i < this->_pendingCount; ++ i) {
+        // standard signals don't queue up anyway
+        if (this->_pendingSignals[i] == signal && signal < SIGRTMIN) {
+            return;
+        }
+    }
+    if (this->_pendingCount < MAX_PENDING_SIGNALS) {
+        this->_pendingSignals[this->_pendingCount ++] = signal;
+    } else {
+        LOGGER_LOGE("PtraceWrapper::queueSignal too many pending signals, %d dropped\n", signal);
     }
-    return ret;
 }
 
 bool PtraceWrapper::readText(void* dest, const void* src, size_t count) {
-    return this->_readInternal(PTRACE_PEEKTEXT, dest, src, count);
+    return this->_readInternal(PTRACE_PEEKTEXT, dest, src, count) == count;
 }
 
 bool PtraceWrapper::readData(void* dest, const void* src, size_t count) {
-    return this->_readInternal(PTRACE_PEEKDATA, dest, src, count);
+    return this->_readInternal(PTRACE_PEEKDATA, dest, src, count) == count;
 }
 
 bool PtraceWrapper::writeText(const void* dest, const void* src, size_t count) {
-    return this->_writeInternal(PTRACE_POKETEXT, dest, src, count);
+    return this->_writeInternal(PTRACE_POKETEXT, dest, src, count) == count;
 }
 
 bool PtraceWrapper::writeData(const void* dest, const void* src, size_t count) {
+    return this->_writeInternal(PTRACE_POKEDATA, dest, src, count) == count;
+}
+
+size_t PtraceWrapper::readMemory(void* dest, const void* src, size_t count) {
+    return this->_readInternal(PTRACE_PEEKDATA, dest, src, count);
+}
+
+size_t PtraceWrapper::writeMemory(const void* dest, const void* src, size_t count) {
     return this->_writeInternal(PTRACE_POKEDATA, dest, src, count);
 }
 
+size_t PtraceWrapper::readv(const RemoteIoVec* vecs, size_t n) {
+    return this->_transferv(false, vecs, n);
+}
+
+size_t PtraceWrapper::writev(const RemoteIoVec* vecs, size_t n) {
+    return this->_transferv(true, vecs, n);
+}
+
+void PtraceWrapper::setMemoryBackends(int backends) {
+    this->_memBackends = backends & MEM_AUTO;
+}
+
+int PtraceWrapper::memoryBackends() const {
+    return this->_memBackends;
+}
+
+int PtraceWrapper::lastMemoryBackends() const {
+    return this->_lastMemBackends;
+}
+
 bool PtraceWrapper::_connectToZygote() {
     bool ret = false;
     // usually, zygote has little changes to encounter a system call.
@@ -213,13 +805,305 @@ bool PtraceWrapper::_connectToZygote() {
     return ret;
 }
 
-bool PtraceWrapper::_readInternal(int peakAction, void* dest, const void* src, size_t count) {
+size_t PtraceWrapper::_readInternal(int peakAction, void* dest, const void* src, size_t count) {
+    this->_lastMemBackends = 0;
     if (!this->_pid) {
-        return false;
+        return 0;
+    }
+
+    size_t done = 0;
+    uint8_t* destBytes = static_cast<uint8_t*>(dest);
+    const uint8_t* srcBytes = static_cast<const uint8_t*>(src);
+    while (done < count) {
+        size_t last = done;
+        // bulk transfers first, both stop right before the first page they fail on
+        if (this->_memBackends & MEM_VM) {
+            size_t n = this->_vmTransfer(false, destBytes + done, srcBytes + done, count - done);
+            this->_lastMemBackends |= n ? MEM_VM : 0;
+            done += n;
+            BREAK_IF(done == count);
+        }
+        if (this->_memBackends & MEM_PROC) {
+            size_t n = this->_procMemTransfer(false, destBytes + done, srcBytes + done, count - done);
+            this->_lastMemBackends |= n ? MEM_PROC : 0;
+            done += n;
+            BREAK_IF(done == count);
+        }
+        // peek the rest of the failing page word by word, and give
+        // the bulk backends another chance from the next page on
+        if (this->_memBackends & MEM_PTRACE) {
+            uintptr_t addr = uintptr_t(srcBytes + done);
+            size_t chunk = std::min(count - done, size_t(((addr + pageSize()) & ~(pageSize() - 1)) - addr));
+            size_t peeked = this->_peekInternal(peakAction, destBytes + done, srcBytes + done, chunk);
+            this->_lastMemBackends |= peeked ? MEM_PTRACE : 0;
+            done += peeked;
+            BREAK_IF(peeked != chunk);
+        }
+        // no backend makes any progress
+        BREAK_IF(done == last);
+    }
+    this->_stats.bytesRead += done;
+    return done;
+}
+
+size_t PtraceWrapper::_writeInternal(int pokeAction, const void* dest, const void* src, size_t count) {
+    this->_lastMemBackends = 0;
+    if (!this->_pid) {
+        return 0;
+    }
+
+    int backends = this->_memBackends;
+#if $is($arch_arm) || $is($arch_arm64)
+    // process_vm_writev copies through the kernel mapping of the page without
+    // any cache maintenance, so the code written might never be fetched.
+    // /proc/<pid>/mem and pokes flush the icache for executable pages
+    if (pokeAction == PTRACE_POKETEXT) {
+        backends &= ~MEM_VM;
+    }
+#endif
+
+    size_t done = 0;
+    const uint8_t* srcBytes = static_cast<const uint8_t*>(src);
+    const uint8_t* destBytes = static_cast<const uint8_t*>(dest);
+    while (done < count) {
+        size_t last = done;
+        // process_vm_writev refuses to write non-writable pages (e.g., text),
+        // while /proc/<pid>/mem and ptrace pokes are allowed to do so
+        if (backends & MEM_VM) {
+            size_t n = this->_vmTransfer(true, const_cast<uint8_t*>(srcBytes + done), destBytes + done, count - done);
+            this->_lastMemBackends |= n ? MEM_VM : 0;
+            done += n;
+            BREAK_IF(done == count);
+        }
+        if (backends & MEM_PROC) {
+            size_t n = this->_procMemTransfer(true, const_cast<uint8_t*>(srcBytes + done), destBytes + done, count - done);
+            this->_lastMemBackends |= n ? MEM_PROC : 0;
+            done += n;
+            BREAK_IF(done == count);
+        }
+        if (backends & MEM_PTRACE) {
+            uintptr_t addr = uintptr_t(destBytes + done);
+            size_t chunk = std::min(count - done, size_t(((addr + pageSize()) & ~(pageSize() - 1)) - addr));
+            size_t poked = this->_pokeInternal(pokeAction, destBytes + done, srcBytes + done, chunk);
+            this->_lastMemBackends |= poked ? MEM_PTRACE : 0;
+            done += poked;
+            BREAK_IF(poked != chunk);
+        }
+        BREAK_IF(done == last);
+    }
+    this->_stats.bytesWritten += done;
+    return done;
+}
+
+size_t PtraceWrapper::_vmTransfer(bool write, void* local, const void* remote, size_t count) {
+    size_t done = 0;
+    while (this->_vmAvailable && done < count) {
+        // one local iovec against page-aligned remote iovecs, as partial transfers
+        // apply at the granularity of iovec elements. so that the returned bytes
+        // always end at the exact page we failed on
+        struct iovec localIov;
+        struct iovec remoteIov[VM_IOV_BATCH];
+        size_t batch = 0;
+        size_t batchSize = 0;
+        uintptr_t addr = uintptr_t(remote) + done;
+        while (batch < VM_IOV_BATCH && done + batchSize < count) {
+            size_t len = std::min(count - done - batchSize, size_t(((addr + pageSize()) & ~(pageSize() - 1)) - addr));
+            remoteIov[batch].iov_base = (void*)addr;
+            remoteIov[batch].iov_len = len;
+            addr += len;
+            batchSize += len;
+            batch ++;
+        }
+        localIov.iov_base = static_cast<uint8_t*>(local) + done;
+        localIov.iov_len = batchSize;
+
+        errno = 0;
+        long nr = write ? __NR_process_vm_writev : __NR_process_vm_readv;
+        ssize_t n = ::syscall(nr, this->_pid, &localIov, 1, remoteIov, batch, 0);
+        if (n < 0) {
+            if (errno == ENOSYS || errno == EPERM) {
+                // kernel(< 3.2) or security policy says no, stop trying for this tracee
+                LOGGER_LOGE("PtraceWrapper::vmTransfer process_vm_%sv unavailable: %s, falls back to ptrace\n", write ? "write" : "read", ::strerror(errno));
+                this->_vmAvailable = false;
+            }
+            break;
+        }
+        done += n;
+        BREAK_IF(size_t(n) != batchSize);
+    }
+    return done;
+}
+
+bool PtraceWrapper::_openProcMem() {
+    if (this->_memFd == -1 && this->_memFdAvailable) {
+        char path[0x40];
+        ::sprintf(path, "/proc/%d/mem", this->_pid);
+        this->_memFd = ::open(path, O_RDWR | O_CLOEXEC);
+        if (this->_memFd == -1) {
+            LOGGER_LOGE("PtraceWrapper::openProcMem failed to open %s: %s\n", path, ::strerror(errno));
+            this->_memFdAvailable = false;
+        }
+    }
+    return this->_memFd != -1;
+}
+
+size_t PtraceWrapper::_procMemTransfer(bool write, void* local, const void* remote, size_t count) {
+    size_t done = 0;
+    while (this->_openProcMem() && done < count) {
+        // addresses are file offsets here, which may exceed off_t on 32bit archs
+        errno = 0;
+        uint8_t* localBytes = static_cast<uint8_t*>(local) + done;
+        off64_t offset = (off64_t)(uintptr_t(remote) + done);
+        ssize_t n = write
+            ? ::pwrite64(this->_memFd, localBytes, count - done, offset)
+            : ::pread64(this->_memFd, localBytes, count - done, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        // short transfers end right before the first inaccessible page
+        BREAK_IF(n <= 0);
+        done += n;
+    }
+    return done;
+}
+
+size_t PtraceWrapper::_transferv(bool write, const RemoteIoVec* vecs, size_t n) {
+    this->_lastMemBackends = 0;
+    if (!this->_pid) {
+        return 0;
+    }
+
+    size_t total = 0;
+    size_t i = 0;
+    size_t skip = 0; // bytes already transferred of vecs[i]
+    while (i < n) {
+        // bulk backends service as many vectors as they can per syscall
+        size_t moved = 0;
+        if (this->_memBackends & MEM_VM) {
+            moved = this->_vmTransferv(write, vecs + i, n - i, skip);
+            this->_lastMemBackends |= moved ? MEM_VM : 0;
+        }
+        if (moved == 0 && (this->_memBackends & MEM_PROC)) {
+            moved = this->_procMemTransferv(write, vecs + i, n - i, skip);
+            this->_lastMemBackends |= moved ? MEM_PROC : 0;
+        }
+        total += moved;
+        (write ? this->_stats.bytesWritten : this->_stats.bytesRead) += moved;
+        for (moved += skip, skip = 0; i < n && moved >= vecs[i].count; ++ i) {
+            moved -= vecs[i].count;
+        }
+        skip = moved;
+        BREAK_IF(i == n);
+
+        // neither of them makes it, finish the current vector through
+        // the single range path which knows every fallback
+        int lastBackends = this->_lastMemBackends;
+        size_t rest = vecs[i].count - skip;
+        const uint8_t* remote = static_cast<const uint8_t*>(vecs[i].remote) + skip;
+        uint8_t* local = static_cast<uint8_t*>(vecs[i].local) + skip;
+        size_t done = write
+            ? this->_writeInternal(PTRACE_POKEDATA, remote, local, rest)
+            : this->_readInternal(PTRACE_PEEKDATA, local, remote, rest);
+        this->_lastMemBackends |= lastBackends;
+        total += done;
+        BREAK_IF(done != rest);
+        ++ i;
+        skip = 0;
+    }
+    return total;
+}
+
+size_t PtraceWrapper::_vmTransferv(bool write, const RemoteIoVec* vecs, size_t n, size_t skip) {
+    size_t done = 0;
+    size_t i = 0;
+    while (this->_vmAvailable && i < n) {
+        // coalesce the remote ranges which are adjacent to each other,
+        // and local buffers as well, kernel streams bytes across them
+        struct iovec localIov[VM_IOV_BATCH];
+        struct iovec remoteIov[VM_IOV_BATCH];
+        size_t localn = 0;
+        size_t remoten = 0;
+        size_t batchSize = 0;
+        for (; i < n; ++ i, skip = 0) {
+            uint8_t* local = static_cast<uint8_t*>(vecs[i].local) + skip;
+            uint8_t* remote = (uint8_t*)vecs[i].remote + skip;
+            size_t count = vecs[i].count - skip;
+            if (count == 0) continue;
+            bool localJoined = localn > 0 && (uint8_t*)localIov[localn - 1].iov_base + localIov[localn - 1].iov_len == local;
+            bool remoteJoined = remoten > 0 && (uint8_t*)remoteIov[remoten - 1].iov_base + remoteIov[remoten - 1].iov_len == remote;
+            BREAK_IF((!localJoined && localn == VM_IOV_BATCH) || (!remoteJoined && remoten == VM_IOV_BATCH));
+            if (localJoined) {
+                localIov[localn - 1].iov_len += count;
+            } else {
+                localIov[localn].iov_base = local;
+                localIov[localn ++].iov_len = count;
+            }
+            if (remoteJoined) {
+                remoteIov[remoten - 1].iov_len += count;
+            } else {
+                remoteIov[remoten].iov_base = remote;
+                remoteIov[remoten ++].iov_len = count;
+            }
+            batchSize += count;
+        }
+        BREAK_IF(batchSize == 0);
+
+        errno = 0;
+        long nr = write ? __NR_process_vm_writev : __NR_process_vm_readv;
+        ssize_t ret = ::syscall(nr, this->_pid, localIov, localn, remoteIov, remoten, 0);
+        if (ret < 0) {
+            if (errno == ENOSYS || errno == EPERM) {
+                LOGGER_LOGE("PtraceWrapper::vmTransferv process_vm_%sv unavailable: %s, falls back to ptrace\n", write ? "write" : "read", ::strerror(errno));
+                this->_vmAvailable = false;
+            }
+            break;
+        }
+        done += ret;
+        BREAK_IF(size_t(ret) != batchSize);
+    }
+    return done;
+}
+
+size_t PtraceWrapper::_procMemTransferv(bool write, const RemoteIoVec* vecs, size_t n, size_t skip) {
+    size_t done = 0;
+    size_t i = 0;
+    while (i < n && this->_openProcMem()) {
+        // each run of adjacent remote ranges takes one preadv/pwritev
+        struct iovec localIov[VM_IOV_BATCH];
+        size_t localn = 0;
+        size_t runSize = 0;
+        size_t runFirst = i;
+        size_t runSkip = skip;
+        uintptr_t runStart = uintptr_t(vecs[i].remote) + skip;
+        for (; i < n && localn < VM_IOV_BATCH; ++ i, skip = 0) {
+            BREAK_IF(uintptr_t(vecs[i].remote) + skip != runStart + runSize);
+            localIov[localn].iov_base = static_cast<uint8_t*>(vecs[i].local) + skip;
+            localIov[localn ++].iov_len = vecs[i].count - skip;
+            runSize += vecs[i].count - skip;
+        }
+        BREAK_IF(runSize == 0);
+
+        // raw syscalls as preadv/pwritev are not in bionic until android N.
+        // the offset is always passed in a low/high pair of longs
+        errno = 0;
+        uint64_t offset = runStart;
+        long nr = write ? __NR_pwritev : __NR_preadv;
+        ssize_t ret = ::syscall(nr, this->_memFd, localIov, localn, (unsigned long)offset, (unsigned long)(offset >> 32));
+        if (ret < 0 && errno == EINTR) {
+            // start over the same run
+            i = runFirst;
+            skip = runSkip;
+            continue;
+        }
+        BREAK_IF(ret <= 0);
+        done += ret;
+        BREAK_IF(size_t(ret) != runSize);
     }
+    return done;
+}
 
+size_t PtraceWrapper::_peekInternal(int peakAction, void* dest, const void* src, size_t count) {
     errno = 0;
-    bool succ = true;
     size_t p = 0;
     size_t c = count / PT_SIZE;
     size_t r = count % PT_SIZE;
@@ -227,32 +1111,27 @@ bool PtraceWrapper::_readInternal(int peakAction, void* dest, const void* src, s
 
     union_intptr_t un;
     for (size_t i = 0; i < c; ++ i) {
-        un.as_intptr = ::ptrace(peakAction, this->_pid, (const uint8_t*)src + i * PT_SIZE, 0);
-        if (un.as_intptr == -1) {
-            LOGGER_LOGE("PtraceWrapper::readInternal action of %d failed at 0x%zx: %s\n", peakAction, uintptr_t((const uint8_t*)src + i * PT_SIZE), ::strerror(errno));
-            succ = false;
-            break;
+        un.as_intptr = this->_ptrace(peakAction, (const uint8_t*)src + i * PT_SIZE, 0);
+        if (un.as_intptr == -1 && errno) {
+            LOGGER_LOGE("PtraceWrapper::peekInternal action of %d failed at 0x%zx: %s\n", peakAction, uintptr_t((const uint8_t*)src + i * PT_SIZE), ::strerror(errno));
+            return p;
         }
         ::memcpy(destBytes + i * PT_SIZE, un.as_chars, PT_SIZE);
         p += PT_SIZE;
     }
-    if (succ && r > 0) {
-        un.as_intptr = ::ptrace(peakAction, this->_pid, (const uint8_t*)src + p, 0);
-        if (un.as_intptr == -1) {
-            succ = false;
+    if (r > 0) {
+        un.as_intptr = this->_ptrace(peakAction, (const uint8_t*)src + p, 0);
+        if (un.as_intptr == -1 && errno) {
+            return p;
         }
         ::memcpy(destBytes + p, un.as_chars, r);
+        p += r;
     }
-    return succ;
+    return p;
 }
 
-bool PtraceWrapper::_writeInternal(int pokeAction, const void* dest, const void* src, size_t count) {
-    if (!this->_pid) {
-        return false;
-    }
-
+size_t PtraceWrapper::_pokeInternal(int pokeAction, const void* dest, const void* src, size_t count) {
     errno = 0;
-    bool succ = true;
     size_t p = 0;
     size_t c = count / PT_SIZE;
     size_t r = count % PT_SIZE;
@@ -262,36 +1141,140 @@ bool PtraceWrapper::_writeInternal(int pokeAction, const void* dest, const void*
     union_intptr_t un;
     for (size_t i = 0; i < c; ++ i) {
         ::memcpy(un.as_chars, srcBytes + i * PT_SIZE, PT_SIZE);
-        if (::ptrace(pokeAction, this->_pid, destBytes + i * PT_SIZE, un.as_intptr) == -1) {
-            LOGGER_LOGE("PtraceWrapper::writeInternal action of %d failed at 0x%zx: %s\n", pokeAction, uintptr_t((const uint8_t*)srcBytes + i * PT_SIZE), ::strerror(errno));
-            succ = false;
-            break;
+        if (this->_ptrace(pokeAction, destBytes + i * PT_SIZE, un.as_intptr) == -1) {
+            LOGGER_LOGE("PtraceWrapper::pokeInternal action of %d failed at 0x%zx: %s\n", pokeAction, uintptr_t(destBytes + i * PT_SIZE), ::strerror(errno));
+            return p;
         }
         p += PT_SIZE;
     }
-    if (succ && r > 0) {
+    if (r > 0) {
         /* 
          * in case of overwriting original stack data. here we need to
          * read original PT_SIZE page and modify the remaing bytes on it
          * before writing the whole page back.
          */
         int peakAction = (pokeAction == PTRACE_POKETEXT) ? PTRACE_PEEKTEXT : PTRACE_PEEKDATA;
-        un.as_intptr = ::ptrace(peakAction, this->_pid, destBytes + p, 0);
+        un.as_intptr = this->_ptrace(peakAction, destBytes + p, 0);
         for (size_t i = 0; i < r; ++ i) un.as_chars[i] = *(srcBytes + p + i);
-        if (::ptrace(pokeAction, this->_pid, destBytes + p, un.as_intptr) == -1) {
-            succ = false;
+        if (this->_ptrace(pokeAction, destBytes + p, un.as_intptr) == -1) {
+            return p;
+        }
+        p += r;
+    }
+    return p;
+}
+
+PtraceWrapper::WaitResult PtraceWrapper::_rewindSyscall(int step) {
+#if $is($arch_x86) || $is($arch_x64)
+#   if $is($arch_x64)
+#       define REGS_RET rax
+#       define REGS_NR  orig_rax
+#       define REGS_PC  rip
+#   else
+#       define REGS_RET eax
+#       define REGS_NR  orig_eax
+#       define REGS_PC  eip
+#   endif
+    (void)step;
+    PtraceRegs regs;
+    if (!this->getRegisters(&regs)) {
+        return WAIT_FAILED;
+    }
+    // not in a syscall
+    long nr = (long)regs.REGS_NR;
+    if (nr < 0) {
+        return WAIT_DONE;
+    }
+    switch ((long)regs.REGS_RET) {
+    case -ERESTARTSYS:
+    case -ERESTARTNOINTR:
+    case -ERESTARTNOHAND:
+        regs.REGS_RET = nr;
+        break;
+    case -ERESTART_RESTARTBLOCK:
+        // syscalls like nanosleep resume with the remaining time
+        regs.REGS_RET = __NR_restart_syscall;
+        break;
+    default:
+        // completed, or interrupted and not going to be restarted
+        return WAIT_DONE;
+    }
+    // both INT 0x80 and SYSCALL are 2 bytes long
+    regs.REGS_PC -= 2;
+    regs.REGS_NR = -1;
+#   undef REGS_RET
+#   undef REGS_NR
+#   undef REGS_PC
+    return this->setRegisters(regs) ? WAIT_DONE : WAIT_FAILED;
+#else
+#   if $is($arch_arm64)
+#       define REGS_NR  regs[8]
+#       define REGS_PC  pc
+#   else
+#       define REGS_NR  ARM_r7
+#       define REGS_PC  ARM_pc
+#   endif
+    switch (step) {
+    case 0: {
+        if (!this->getRegisters(&this->_restartRegs)) {
+            return WAIT_FAILED;
+        }
+        // PC is left on the SVC of an interrupted syscall going to restart
+        uintptr_t pc = (uintptr_t)this->_restartRegs.REGS_PC;
+        uint32_t insn = 0;
+#   if $is($arch_arm64)
+        bool svc = this->readMemory(&insn, (const void*)pc, 4) == 4 && insn == 0xd4000001;
+#   else
+        bool svc = (this->_restartRegs.ARM_cpsr & PSR_T_BIT)
+            ? this->readMemory(&insn, (const void*)pc, 2) == 2 && (insn & 0xff00) == 0xdf00
+            : this->readMemory(&insn, (const void*)pc, 4) == 4 && (insn & 0x0f000000) == 0x0f000000;
+#   endif
+        if (!svc) {
+            return WAIT_DONE;
+        }
+        if (!this->_resume(PTRACE_SYSCALL, 0)) {
+            return WAIT_FAILED;
+        }
+        this->expectSignals({ SIGTRAP, SIGTRAP | 0x80 });
+        return WAIT_PENDING;
+    }
+    case 1: {
+        // syscall-entry-stop, of the syscall or restart_syscall
+        long nr = 0;
+        intptr_t arg0 = 0;
+        if (!this->getSyscall(&nr, &arg0)) {
+            return WAIT_FAILED;
+        }
+        this->_restartRegs.REGS_NR = nr;
+        // skip it, and stop once it's back to user mode
+#   if $is($arch_arm64)
+        int skip = -1;
+        struct iovec iovec = { &skip, sizeof(skip) };
+        bool ok = this->_ptrace(PTRACE_SETREGSET, reinterpret_cast<void*>(NT_ARM_SYSTEM_CALL), &iovec) != -1;
+#   else
+        bool ok = this->_ptrace(PTRACE_SET_SYSCALL, nullptr, (void*)(intptr_t)-1) != -1;
+#   endif
+        ok = ok && this->_ptrace(PTRACE_INTERRUPT, nullptr, 0) != -1 && this->_resume(PTRACE_CONT, 0);
+        if (!ok) {
+            LOGGER_LOGE("PtraceWrapper::rewindSyscall failed to skip syscall %ld: %s\n", nr, ::strerror(errno));
+            return WAIT_FAILED;
         }
+        this->expectSignals({ SIGTRAP });
+        return WAIT_PENDING;
     }
-    return succ;
+    default:
+        // nothing ran since the first stop, but r7/x8 is restart-ready now
+        return this->setRegisters(this->_restartRegs) ? WAIT_DONE : WAIT_FAILED;
+    }
+#   undef REGS_NR
+#   undef REGS_PC
+#endif
 }
 
 #if $is($arch_arm64)
 
 // special tricks on arm64
 
-#include <fcntl.h>
-#include <linux/elf.h>
-
 bool PtraceWrapper::getRegisters(PtraceRegs* outRegs) {
     bool ok = false;
     if (this->_pid) {
@@ -299,7 +1282,7 @@ bool PtraceWrapper::getRegisters(PtraceRegs* outRegs) {
         iovec.iov_base = outRegs;
         iovec.iov_len = sizeof(PtraceRegs);
         int regset = NT_PRSTATUS;
-        ok = (::ptrace(PTRACE_GETREGSET, _pid, reinterpret_cast<void*>(regset), &iovec) != -1);
+        ok = (this->_ptrace(PTRACE_GETREGSET, reinterpret_cast<void*>(regset), &iovec) != -1);
         if (!ok) {
             LOGGER_LOGE("PtraceWrapper::getRegisters failed: %s\n", ::strerror(errno));
         }
@@ -314,7 +1297,7 @@ bool PtraceWrapper::setRegisters(const PtraceRegs& regs) {
         iovec.iov_base = const_cast<PtraceRegs*>(&regs);
         iovec.iov_len = sizeof(PtraceRegs);
         int regset = NT_PRSTATUS;
-        ok = (::ptrace(PTRACE_SETREGSET, _pid, reinterpret_cast<void*>(regset), &iovec) != -1);
+        ok = (this->_ptrace(PTRACE_SETREGSET, reinterpret_cast<void*>(regset), &iovec) != -1);
         if (!ok) {
             LOGGER_LOGE("PtraceWrapper::setRegisters failed: %s\n", ::strerror(errno));
         }
@@ -322,12 +1305,42 @@ bool PtraceWrapper::setRegisters(const PtraceRegs& regs) {
     return ok;
 }
 
+bool PtraceWrapper::getFpRegisters(PtraceFpRegs* outRegs) {
+    bool ok = false;
+    if (this->_pid) {
+        struct iovec iovec;
+        iovec.iov_base = outRegs;
+        iovec.iov_len = sizeof(PtraceFpRegs);
+        int regset = NT_PRFPREG;
+        ok = (this->_ptrace(PTRACE_GETREGSET, reinterpret_cast<void*>(regset), &iovec) != -1);
+        if (!ok) {
+            LOGGER_LOGE("PtraceWrapper::getFpRegisters failed: %s\n", ::strerror(errno));
+        }
+    }
+    return ok;
+}
+
+bool PtraceWrapper::setFpRegisters(const PtraceFpRegs& regs) {
+    bool ok = false;
+    if (this->_pid) {
+        struct iovec iovec;
+        iovec.iov_base = const_cast<PtraceFpRegs*>(&regs);
+        iovec.iov_len = sizeof(PtraceFpRegs);
+        int regset = NT_PRFPREG;
+        ok = (this->_ptrace(PTRACE_SETREGSET, reinterpret_cast<void*>(regset), &iovec) != -1);
+        if (!ok) {
+            LOGGER_LOGE("PtraceWrapper::setFpRegisters failed: %s\n", ::strerror(errno));
+        }
+    }
+    return ok;
+}
+
 #else
 
 bool PtraceWrapper::getRegisters(PtraceRegs* outRegs) {
     bool ok = false;
     if (this->_pid) {
-        ok = (::ptrace(PTRACE_GETREGS, this->_pid, nullptr, outRegs) != -1);
+        ok = (this->_ptrace(PTRACE_GETREGS, nullptr, outRegs) != -1);
         if (!ok) {
             LOGGER_LOGE("PtraceWrapper::getRegisters failed: %s\n", ::strerror(errno));
         }
@@ -338,7 +1351,7 @@ bool PtraceWrapper::getRegisters(PtraceRegs* outRegs) {
 bool PtraceWrapper::setRegisters(const PtraceRegs& regs) {
     bool ok = false;
     if (this->_pid) {
-        ok = (::ptrace(PTRACE_SETREGS, this->_pid, nullptr, &regs) != -1);
+        ok = (this->_ptrace(PTRACE_SETREGS, nullptr, &regs) != -1);
         if (!ok) {
             LOGGER_LOGE("PtraceWrapper::setRegisters failed: %s\n", ::strerror(errno));
         }
@@ -346,4 +1359,98 @@ bool PtraceWrapper::setRegisters(const PtraceRegs& regs) {
     return ok;
 }
 
+// VFP registers are got by a separate request on arm
+#if $is($arch_arm)
+#   define PTRACE_GETFPREGS_REQUEST PTRACE_GETVFPREGS
+#   define PTRACE_SETFPREGS_REQUEST PTRACE_SETVFPREGS
+#else
+#   define PTRACE_GETFPREGS_REQUEST PTRACE_GETFPREGS
+#   define PTRACE_SETFPREGS_REQUEST PTRACE_SETFPREGS
 #endif
+
+bool PtraceWrapper::getFpRegisters(PtraceFpRegs* outRegs) {
+    bool ok = false;
+    if (this->_pid) {
+        ok = (this->_ptrace(PTRACE_GETFPREGS_REQUEST, nullptr, outRegs) != -1);
+        if (!ok) {
+            LOGGER_LOGE("PtraceWrapper::getFpRegisters failed: %s\n", ::strerror(errno));
+        }
+    }
+    return ok;
+}
+
+bool PtraceWrapper::setFpRegisters(const PtraceFpRegs& regs) {
+    bool ok = false;
+    if (this->_pid) {
+        ok = (this->_ptrace(PTRACE_SETFPREGS_REQUEST, nullptr, &regs) != -1);
+        if (!ok) {
+            LOGGER_LOGE("PtraceWrapper::setFpRegisters failed: %s\n", ::strerror(errno));
+        }
+    }
+    return ok;
+}
+
+#endif
+
+bool PtraceWrapper::getSyscall(long* outNr, intptr_t* outArg0) {
+    PtraceRegs regs;
+    if (!this->getRegisters(&regs)) {
+        return false;
+    }
+#if   $is($arch_x64)
+    *outNr = (long)regs.orig_rax;
+    *outArg0 = (intptr_t)regs.rdi;
+#elif $is($arch_x86)
+    *outNr = (long)regs.orig_eax;
+    *outArg0 = (intptr_t)regs.ebx;
+#elif $is($arch_arm64)
+    *outNr = (long)regs.regs[8];
+    *outArg0 = (intptr_t)regs.regs[0];
+#else
+    *outNr = (long)regs.ARM_r7;
+    *outArg0 = (intptr_t)regs.ARM_r0;
+#endif
+    return true;
+}
+
+bool PtraceWrapper::getFpState(PtraceFpState* outState) {
+    if (!this->_pid) {
+        return false;
+    }
+    // GETFPREGS misses the upper halves of ymm/zmm, so XSAVE area it is,
+    // unless the cpu has no XSAVE at all
+#if $is($arch_x86) || $is($arch_x64)
+    const int regsets[] = { NT_X86_XSTATE, NT_PRFPREG };
+#elif $is($arch_arm64)
+    const int regsets[] = { NT_PRFPREG };
+#else
+    const int regsets[] = { NT_ARM_VFP };
+#endif
+    for (int regset : regsets) {
+        struct iovec iovec;
+        iovec.iov_base = outState->data;
+        iovec.iov_len = sizeof(outState->data);
+        // iov_len is cut down to the size of the regset
+        if (this->_ptrace(PTRACE_GETREGSET, reinterpret_cast<void*>(regset), &iovec) != -1) {
+            outState->regset = regset;
+            outState->size = iovec.iov_len;
+            return true;
+        }
+    }
+    LOGGER_LOGE("PtraceWrapper::getFpState failed: %s\n", ::strerror(errno));
+    return false;
+}
+
+bool PtraceWrapper::setFpState(const PtraceFpState& state) {
+    bool ok = false;
+    if (this->_pid) {
+        struct iovec iovec;
+        iovec.iov_base = const_cast<uint8_t*>(state.data);
+        iovec.iov_len = state.size;
+        ok = (this->_ptrace(PTRACE_SETREGSET, reinterpret_cast<void*>(state.regset), &iovec) != -1);
+        if (!ok) {
+            LOGGER_LOGE("PtraceWrapper::setFpState failed: %s\n", ::strerror(errno));
+        }
+    }
+    return ok;
+}
@@ -9,36 +9,242 @@
 #define __ADRILL_PTRACE_WRAPPER_H__
 
 #include <vector>
+#include <initializer_list>
+#include <stdint.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/user.h>
 #include <asm/ptrace.h>
 
 #include "arch.h"
 
 #define PT_SIZE sizeof(intptr_t)
 
+// max unrelated signals kept while waiting, to be re-injected on detach
+#define MAX_PENDING_SIGNALS 8
+// max signals a single wait could be expecting
+#define MAX_EXPECTED_SIGNALS 8
+// max remote calls timed one by one while tracee is held
+#define MAX_HELD_RUNS 8
+// room for the whole FP/vector state, i.e., the XSAVE area up to AMX tiles
+#define MAX_FP_STATE_SIZE 0x4000
+
 #if   $is($arch_arm64)
-    typedef struct user_pt_regs     PtraceRegs;
+    typedef struct user_pt_regs       PtraceRegs;
+    typedef struct user_fpsimd_state  PtraceFpRegs;
 #elif $is($arch_x64)
-    typedef struct user_regs_struct PtraceRegs;
+    typedef struct user_regs_struct   PtraceRegs;
+    typedef struct user_fpregs_struct PtraceFpRegs;
+#elif $is($arch_x86)
+    typedef struct pt_regs            PtraceRegs;
+    typedef struct user_fpregs_struct PtraceFpRegs;
 #else
-    typedef struct pt_regs          PtraceRegs;
+    typedef struct pt_regs            PtraceRegs;
+    typedef struct user_vfp           PtraceFpRegs;
 #endif
 
+/*
+ * the whole FP/vector state of a thread as the kernel keeps it, i.e., the
+ * XSAVE area(upper halves of ymm/zmm included) on x86/x64, v0-v31 with
+ * FPSR/FPCR on arm64, or VFP on arm. opaque, only to be put back as is
+ */
+struct PtraceFpState {
+    // NT_* of the regset it's read through
+    int     regset;
+    size_t  size;
+    uint8_t data[MAX_FP_STATE_SIZE];
+};
+
+/*
+ * what the scheduler knows of a thread, from /proc/<pid>/task/<tid>/
+ */
+struct TaskCounters {
+    // stat
+    uint64_t minorFaults;
+    uint64_t majorFaults;
+    // status
+    uint64_t voluntarySwitches;
+    uint64_t involuntarySwitches;
+    // schedstat, zeros without CONFIG_SCHEDSTATS
+    uint64_t cpuNs;
+    uint64_t runDelayNs;
+};
+bool readTaskCounters(pid_t pid, pid_t tid, TaskCounters* outCounters);
+
+/*
+ * a signalfd of SIGCHLD to sleep on between stops. SIGCHLD is blocked for
+ * the calling thread, so it stays pending for the fd, until the last one
+ * opened on the thread is closed and the mask is back to where it was
+ */
+int openChildSignalFd();
+void closeChildSignalFd(int fd);
+
+/*
+ * one (remote address, local buffer) pair for scatter-gather transfers
+ */
+struct RemoteIoVec {
+    const void* remote;
+    void*       local;
+    size_t      count;
+};
+
 class PtraceWrapper {
+public:
+    /*
+     * backends to access tracee's memory, combined as a mask. the ones allowed
+     * are tried in the order of VM, PROC and PTRACE for each range of pages
+     */
+    enum MemoryBackend {
+        MEM_PTRACE = 1 << 0,  // PTRACE_PEEK*/POKE*, one word per syscall
+        MEM_VM     = 1 << 1,  // process_vm_readv/writev, refuses non-writable pages
+        MEM_PROC   = 1 << 2,  // pread/pwrite on /proc/<pid>/mem, writes text pages as well
+        MEM_AUTO   = MEM_PTRACE | MEM_VM | MEM_PROC,
+    };
+
+    /*
+     * ways to stop the tracee when attaching
+     */
+    enum AttachMode {
+        // PTRACE_ATTACH, then wait for the tracee to enter and leave a syscall
+        ATTACH_LEGACY,
+        // PTRACE_SEIZE + PTRACE_INTERRUPT, stops the tracee right away and
+        // rewinds an interrupted syscall by hand so it restarts after detach
+        ATTACH_SEIZE,
+    };
+
+    /*
+     * progress of a non-blocking step, see expectSignals()
+     */
+    enum WaitResult {
+        WAIT_PENDING,  // tracee resumed, waiting for the stop expected
+        WAIT_DONE,
+        WAIT_FAILED,
+    };
+
 public:
     PtraceWrapper();
+    ~PtraceWrapper();
     
     /*
      * flow controlling
      */
-    bool attach(pid_t pid);
+    bool attach(pid_t pid, AttachMode mode = ATTACH_LEGACY);
+    // non-blocking halves of attach, see expectSignals()
+    bool beginAttach(pid_t pid, AttachMode mode = ATTACH_LEGACY);
+    WaitResult continueAttach();
+
+    /*
+     * take over a tracee traced already and in a ptrace-stop, e.g., a child
+     * auto-attached through PTRACE_O_TRACEFORK. <seized> if its parent was
+     */
+    bool adopt(pid_t pid, bool seized);
+
+    /*
+     * PTRACE_SETOPTIONS, i.e., PTRACE_O_*
+     */
+    bool setOptions(int options);
     bool detach();
-    bool kontinue(); // alias for 'continue'. you know why
+    bool kontinue(int signal = 0); // alias for 'continue'. you know why
+    // resume until the next syscall entry or exit, reported as SIGTRAP
+    bool kontinueSyscall(int signal = 0);
+    // brings a running tracee back to a stop, e.g., after a wait timed out
+    bool stop();
+    // non-blocking half of stop() for a running tracee, see expectSignals()
+    bool beginStop();
     
     /*
-     * wait for the tracee to raise specified signal or signals(any of list)
+     * wait for the tracee to raise specified signal or signals(any of list),
+     * for at most <timeoutMs> milliseconds (negative to wait forever).
+     * the tracee keeps running through stops of other signals, which are
+     * queued and re-injected on detach rather than dropped
+     */
+    static const int TIMEOUT_DEFAULT = -2;
+    bool waitForSignal(int signal = 0, int timeoutMs = TIMEOUT_DEFAULT);
+    bool waitForSignals(std::initializer_list<int> signals, int timeoutMs = TIMEOUT_DEFAULT);
+
+    /*
+     * non-blocking flavour of the waits above, for a tracer driving many
+     * tracees from one loop. expectSignals() tells the stops to wait for,
+     * then every status reaped for tracee(e.g., by pollStatus()) is fed
+     * to onStatus() until it's no longer WAIT_PENDING. unrelated stops
+     * are deferred and resumed the same way as waitForSignals does
+     */
+    void expectSignals(std::initializer_list<int> signals);
+    WaitResult onStatus(int status);
+    // reap a status of tracee alone without waiting: WAIT_PENDING if there's
+    // none yet, WAIT_FAILED if it's no longer ours to wait for, e.g., gone
+    WaitResult pollStatus(int* outStatus);
+    // blocking wait for the signals expected
+    bool waitExpected(int timeoutMs = TIMEOUT_DEFAULT);
+
+    /*
+     * drives a non-blocking step to the end: waits for each stop it
+     * expects and hands over to <step>, until it's done or failed
+     */
+    template<typename Step>
+    bool complete(bool begun, Step step) {
+        WaitResult result = begun ? WAIT_PENDING : WAIT_FAILED;
+        while (result == WAIT_PENDING) {
+            result = this->waitExpected() ? step() : WAIT_FAILED;
+        }
+        return result == WAIT_DONE;
+    }
+
+    /*
+     * waitid(2) result back to the classic wait status, so W* macros apply
+     */
+    static int statusOf(const siginfo_t& info);
+
+    /*
+     * deadline applied to waits without explicit timeout, 10 seconds by default
+     */
+    void setWaitTimeout(int timeoutMs);
+    int  waitTimeout() const;
+
+    /*
+     * raw wait status of the last stop we waited for
+     */
+    int  lastStatus() const;
+
+    /*
+     * siginfo of the signal tracee is stopped by, e.g., the fault address
+     */
+    bool getSignalInfo(siginfo_t* outInfo);
+
+    /*
+     * pid of tracee, 0 if not attached
+     */
+    pid_t pid() const;
+    // resumed and not stopped since, e.g., by a wait given up
+    bool  running() const;
+    bool  exited() const;
+
+    /*
+     * counters since attached, to tell where the time of an injection goes
      */
-    bool waitForSignal(int signal = 0);
-    bool waitForSignals(const std::vector<int>& signals);
+    struct Stats {
+        // ptrace(2) requests made, and stops of tracee waited for
+        uint32_t ptraceCalls;
+        uint32_t stops;
+        // memory of tracee moved, by whichever backend
+        uint64_t bytesRead;
+        uint64_t bytesWritten;
+        // tracee resumed by us until it stopped again, attaching included
+        int64_t  runNs;
+        // tracee held by us, from the stop attaching ends with(or the one
+        // adopted) to PTRACE_DETACH. the thread runs none of its own code
+        // meanwhile, but remote calls of ours, each of which is a run here.
+        // the last one of heldRunNs takes the rest if there're more runs
+        int64_t  heldNs;
+        uint32_t heldRuns;
+        int64_t  heldRunNs[MAX_HELD_RUNS];
+        // counters of the thread traced, taken before attaching and right
+        // after detached, both read or neither
+        bool         taskCounted;
+        TaskCounters taskBefore;
+        TaskCounters taskAfter;
+    };
+    const Stats& stats() const;
 
     /*
      * technically, Linux does not have separate text and data address spaces,
@@ -50,21 +256,106 @@ public:
     bool writeText(const void* dest, const void* src, size_t count);
     bool writeData(const void* dest, const void* src, size_t count);
 
+    /*
+     * bulk transfer through process_vm_readv/process_vm_writev, falls back to
+     * peek/poke for the pages the kernel refuses to touch (e.g., read-only text).
+     * returns the number of bytes actually transferred, which is less than
+     * <count> if some page could not be accessed either way
+     */
+    size_t readMemory(void* dest, const void* src, size_t count);
+    size_t writeMemory(const void* dest, const void* src, size_t count);
+
+    /*
+     * scatter-gather transfer of a list of buffers. adjacent remote ranges are
+     * coalesced so the whole batch takes as few syscalls as possible.
+     * returns the number of bytes transferred, counted in list order
+     */
+    size_t readv(const RemoteIoVec* vecs, size_t n);
+    size_t writev(const RemoteIoVec* vecs, size_t n);
+
+    /*
+     * select the memory backends at runtime, MEM_AUTO by default.
+     * lastMemoryBackends tells which ones serviced the last read/write call
+     */
+    void setMemoryBackends(int backends);
+    int  memoryBackends() const;
+    int  lastMemoryBackends() const;
+
     /*
      * registers operation
      */
     bool getRegisters(PtraceRegs* outRegs);
     bool setRegisters(const PtraceRegs& regs);
+    // floating-point/SIMD registers, i.e., v0-v31, xmm0-15, st0-7 or VFP d0-d31
+    bool getFpRegisters(PtraceFpRegs* outRegs);
+    bool setFpRegisters(const PtraceFpRegs& regs);
+    // all of them, to save before running anything in tracee and restore after
+    bool getFpState(PtraceFpState* outState);
+    bool setFpState(const PtraceFpState& state);
+
+    /*
+     * number and first argument of the syscall tracee is stopped at the
+     * entry of, i.e., after kontinueSyscall()
+     */
+    bool getSyscall(long* outNr, intptr_t* outArg0);
 
 protected:
+    // ptrace(2) on tracee, counted
+    template<typename D>
+    long _ptrace(int request, const void* addr, D data);
     // here's a workaround when the speficied pid indicates a zygote process
     bool _connectToZygote();
-    bool _readInternal(int action, void* dest, const void* src, size_t count);
-    bool _writeInternal(int action, const void* dest, const void* src, size_t count);
+    void _abortAttach();
+    // one stop of rewinding a syscall interrupted by PTRACE_INTERRUPT
+    WaitResult _rewindSyscall(int step);
+    bool _resume(int request, int signal);
+    bool _waitStatus(int* outStatus, int64_t deadline);
+    void _queueSignal(int signal);
+    size_t _readInternal(int action, void* dest, const void* src, size_t count);
+    size_t _writeInternal(int action, const void* dest, const void* src, size_t count);
+    size_t _peekInternal(int action, void* dest, const void* src, size_t count);
+    size_t _pokeInternal(int action, const void* dest, const void* src, size_t count);
+    size_t _vmTransfer(bool write, void* local, const void* remote, size_t count);
+    size_t _procMemTransfer(bool write, void* local, const void* remote, size_t count);
+    size_t _transferv(bool write, const RemoteIoVec* vecs, size_t n);
+    size_t _vmTransferv(bool write, const RemoteIoVec* vecs, size_t n, size_t skip);
+    size_t _procMemTransferv(bool write, const RemoteIoVec* vecs, size_t n, size_t skip);
+    bool   _openProcMem();
 
 protected:
     pid_t _pid;
+    pid_t _tgid;
     bool  _isZygote;
+    bool  _seized;
+    bool  _exited;
+    bool  _running;
+    // stops gone through while attaching, -1 once attached
+    int   _attachStep;
+    // registers seen at the interrupt-stop, while rewinding on arm/arm64
+    PtraceRegs _restartRegs;
+    int   _expectedSignals[MAX_EXPECTED_SIGNALS];
+    int   _expectedCount;
+    // pidfd of the tracee(linux 5.3+) and a signalfd of SIGCHLD to poll on
+    int   _pidFd;
+    int   _sigFd;
+    int   _waitTimeoutMs;
+    int   _lastStatus;
+    // the way tracee was resumed last time, reused after unrelated stops
+    int   _resumeRequest;
+    int   _pendingSignals[MAX_PENDING_SIGNALS];
+    int   _pendingCount;
+    // turned off once the kernel refuses process_vm_readv/writev as a whole
+    bool  _vmAvailable;
+    // /proc/<pid>/mem, opened on first use and kept until detach
+    int   _memFd;
+    bool  _memFdAvailable;
+    int   _memBackends;
+    int   _lastMemBackends;
+    Stats _stats;
+    // when tracee was resumed last
+    int64_t _resumeNs;
+    // when tracee got held, 0 if it's not yet
+    int64_t _heldSinceNs;
 
 };
 
@@ -0,0 +1,247 @@
+/*
+ * Copyright (c) 2020, Irvin Pang <halo.irvin@gmail.com>
+ * All rights reserved.
+ *
+ * see LICENSE file for details
+ */
+
+#include <algorithm>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "macros.h"
+#include "remote_arena.h"
+
+static uintptr_t alignUp(uintptr_t value, size_t align) {
+    return (value + align - 1) & ~(uintptr_t)(align - 1);
+}
+
+RemoteArena::RemoteArena(CallProcedure* caller, PtraceWrapper* ptraceWrapper)
+: _caller(caller)
+, _ptraceWrapper(ptraceWrapper)
+, _base(0)
+, _size(0)
+, _createSize(0)
+, _createStackSize(0)
+, _heapBegin(0)
+, _heapEnd(0)
+, _heapCur(0) {
+}
+
+bool RemoteArena::create(size_t size, size_t stackSize) {
+    return this->_ptraceWrapper->complete(this->beginCreate(size, stackSize), [this]() {
+        return this->continueCreate();
+    });
+}
+
+bool RemoteArena::beginCreate(size_t size, size_t stackSize) {
+    bool ok = true;
+    do {
+        ok &= !this->_base;
+        BREAK_IF_WITH_LOGE(!ok, "RemoteArena::create arena already created at 0x%zx\n", this->_base);
+
+        size_t pageSize = (size_t)::sysconf(_SC_PAGESIZE);
+        size = alignUp(size, pageSize);
+        stackSize = alignUp(stackSize, ARENA_ALIGN);
+        ok &= size > ARENA_TRAP_SIZE + MAX_CHAIN_STUB_SIZE + stackSize;
+        BREAK_IF_WITH_LOGE(!ok, "RemoteArena::create %zu bytes leave no room for heap\n", size);
+
+        int prot = PROT_READ | PROT_WRITE | PROT_EXEC;
+        int flags = MAP_ANONYMOUS | MAP_PRIVATE;
+        ok &= this->_caller->beginRemoteSyscall($arch_32(__NR_mmap2) $arch_64(__NR_mmap), 0, size, prot, flags, -1, 0);
+        BREAK_IF_WITH_LOGE(!ok, "RemoteArena::create failed to call remote mmap\n");
+        this->_createSize = size;
+        this->_createStackSize = stackSize;
+    } while (false);
+    return ok;
+}
+
+PtraceWrapper::WaitResult RemoteArena::continueCreate() {
+    PtraceWrapper::WaitResult result = this->_caller->continueRemoteSyscall();
+    if (result != PtraceWrapper::WAIT_DONE) {
+        return result;
+    }
+
+    bool ok = true;
+    do {
+        // the mapped address, or -errno
+        uintptr_t base = (uintptr_t)this->_caller->returnValue();
+        ok &= base < (uintptr_t)-4095;
+        BREAK_IF_WITH_LOGE(!ok, "RemoteArena::create remote mmap failed: %s\n", ::strerror(-(int)base));
+
+        this->_base = base;
+        this->_size = this->_createSize;
+        this->_heapBegin = this->stubAddr() + MAX_CHAIN_STUB_SIZE;
+        this->_heapEnd = this->stackTop() - this->_createStackSize;
+        this->reset();
+
+        ok &= this->_caller->setReturnTrap(base);
+        BREAK_IF_WITH_LOGE(!ok, "RemoteArena::create failed to setup return trap\n");
+        this->_caller->setCallStack(this->stackTop());
+    } while (false);
+
+    if (!ok && this->_base) {
+        this->release();
+    }
+    return ok ? PtraceWrapper::WAIT_DONE : PtraceWrapper::WAIT_FAILED;
+}
+
+bool RemoteArena::release() {
+    bool ok = true;
+    do {
+        BREAK_IF(!this->_base);
+        // stop using it before it's gone, the munmap doesn't need a stack anyway
+        this->_caller->setReturnTrap(0);
+        this->_caller->setCallStack(0);
+
+        ok &= this->_caller->remoteSyscall(__NR_munmap, this->_base, this->_size);
+        BREAK_IF_WITH_LOGE(!ok, "RemoteArena::release failed to call remote munmap\n");
+        ok &= this->_caller->returnValue() == 0;
+        BREAK_IF_WITH_LOGE(!ok, "RemoteArena::release remote munmap failed: %s\n", ::strerror(-(int)this->_caller->returnValue()));
+    } while (false);
+    this->_detach();
+    return ok;
+}
+
+bool RemoteArena::appendRelease(CallChain* chain, size_t keep) {
+    bool ok = true;
+    do {
+        ok &= this->_base != 0;
+        BREAK_IF_WITH_LOGE(!ok, "RemoteArena::appendRelease arena not created\n");
+
+        keep = alignUp(keep, (size_t)::sysconf(_SC_PAGESIZE));
+        ok &= keep < this->_size;
+        BREAK_IF_WITH_LOGE(!ok, "RemoteArena::appendRelease nothing left to release\n");
+
+        ok &= chain->addTailSyscall(__NR_munmap, { (intptr_t)(this->_base + keep), (intptr_t)(this->_size - keep) }) >= 0;
+        BREAK_IF_WITH_LOGE(!ok, "RemoteArena::appendRelease chain is full\n");
+
+        // the stub ends with a trap of its own, and still runs its calls on
+        // the stack which is left to the caller to detach
+        this->_caller->setReturnTrap(0);
+        this->_detach();
+    } while (false);
+    return ok;
+}
+
+void RemoteArena::_detach() {
+    this->_base = 0;
+    this->_size = 0;
+    this->_heapBegin = this->_heapEnd = this->_heapCur = 0;
+    this->_used.clear();
+    this->_free.clear();
+}
+
+uintptr_t RemoteArena::alloc(size_t size, size_t align) {
+    if (!this->_base || !size) {
+        return 0;
+    }
+    align = std::max(align, (size_t)ARENA_ALIGN);
+    size = alignUp(size, ARENA_ALIGN);
+
+    // first fit among the freed blocks
+    for (auto it = this->_free.begin(); it != this->_free.end(); ++ it) {
+        uintptr_t blockBegin = it->first;
+        uintptr_t blockEnd = it->first + it->second;
+        uintptr_t addr = alignUp(blockBegin, align);
+        if (addr + size > blockEnd) {
+            continue;
+        }
+        this->_free.erase(it);
+        if (addr > blockBegin) {
+            this->_free[blockBegin] = addr - blockBegin;
+        }
+        if (addr + size < blockEnd) {
+            this->_free[addr + size] = blockEnd - addr - size;
+        }
+        this->_used[addr] = size;
+        return addr;
+    }
+
+    // then bump
+    uintptr_t addr = alignUp(this->_heapCur, align);
+    if (addr + size > this->_heapEnd) {
+        LOGGER_LOGE("RemoteArena::alloc out of memory for %zu bytes\n", size);
+        return 0;
+    }
+    if (addr > this->_heapCur) {
+        this->_free[this->_heapCur] = addr - this->_heapCur;
+    }
+    this->_heapCur = addr + size;
+    this->_used[addr] = size;
+    return addr;
+}
+
+void RemoteArena::free(uintptr_t remoteAddr) {
+    auto used = this->_used.find(remoteAddr);
+    if (used == this->_used.end()) {
+        return;
+    }
+    uintptr_t blockBegin = used->first;
+    uintptr_t blockEnd = used->first + used->second;
+    this->_used.erase(used);
+
+    // merge with the neighbours
+    auto next = this->_free.find(blockEnd);
+    if (next != this->_free.end()) {
+        blockEnd += next->second;
+        this->_free.erase(next);
+    }
+    auto prev = this->_free.lower_bound(blockBegin);
+    if (prev != this->_free.begin()) {
+        -- prev;
+        if (prev->first + prev->second == blockBegin) {
+            blockBegin = prev->first;
+            this->_free.erase(prev);
+        }
+    }
+
+    // give it back to the bump pointer if it's the last one
+    if (blockEnd == this->_heapCur) {
+        this->_heapCur = blockBegin;
+    } else {
+        this->_free[blockBegin] = blockEnd - blockBegin;
+    }
+}
+
+void RemoteArena::reset() {
+    this->_heapCur = this->_heapBegin;
+    this->_used.clear();
+    this->_free.clear();
+}
+
+uintptr_t RemoteArena::allocString(const char* str) {
+    return this->allocBuffer(str, ::strlen(str) + 1);
+}
+
+uintptr_t RemoteArena::allocBuffer(const void* data, size_t size) {
+    uintptr_t addr = this->alloc(size);
+    if (addr && this->_ptraceWrapper->writeMemory((void*)addr, data, size) != size) {
+        LOGGER_LOGE("RemoteArena::allocBuffer failed to write %zu bytes to 0x%zx\n", size, addr);
+        this->free(addr);
+        addr = 0;
+    }
+    return addr;
+}
+
+uintptr_t RemoteArena::base() const {
+    return this->_base;
+}
+
+size_t RemoteArena::size() const {
+    return this->_size;
+}
+
+uintptr_t RemoteArena::stubAddr() const {
+    return this->_base ? this->_base + ARENA_TRAP_SIZE : 0;
+}
+
+size_t RemoteArena::stubCapacity() const {
+    return this->_base ? MAX_CHAIN_STUB_SIZE : 0;
+}
+
+uintptr_t RemoteArena::stackTop() const {
+    return this->_base ? this->_base + this->_size : 0;
+}
@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2020, Irvin Pang <halo.irvin@gmail.com>
+ * All rights reserved.
+ *
+ * see LICENSE file for details
+ */
+
+#ifndef __ADRILL_REMOTE_ARENA_H__
+#define __ADRILL_REMOTE_ARENA_H__
+
+#include <map>
+
+#include "call_procedure.h"
+
+// whole mapping by default, and the part of it used as call stack
+#define ARENA_DEFAULT_SIZE (512 * 1024)
+#define ARENA_STACK_SIZE   (256 * 1024)
+// room for the return trap at the very beginning
+#define ARENA_TRAP_SIZE    16
+#define ARENA_ALIGN        16
+
+class CallChain;
+
+/*
+ * one RWX mapping in tracee for a whole session of remote calls. it's laid out as
+ *
+ *   [ trap | chain stub | heap ... | ... call stack ]
+ *
+ * the trap and the stack are handed to CallProcedure once created, strings and
+ * buffers are allocated from the heap and written straight into tracee, without
+ * any remote call. nothing is released implicitly, see reset() and release()
+ */
+class RemoteArena {
+public:
+    RemoteArena(CallProcedure* caller, PtraceWrapper* ptraceWrapper);
+
+    /*
+     * map the arena with a remote mmap syscall, <stackSize> bytes of the top
+     * are used as call stack
+     */
+    bool create(size_t size = ARENA_DEFAULT_SIZE, size_t stackSize = ARENA_STACK_SIZE);
+    // non-blocking halves of create, see CallProcedure::beginRemoteSyscall
+    bool beginCreate(size_t size = ARENA_DEFAULT_SIZE, size_t stackSize = ARENA_STACK_SIZE);
+    PtraceWrapper::WaitResult continueCreate();
+
+    /*
+     * munmap the arena, and detach the trap and the stack from CallProcedure
+     */
+    bool release();
+
+    /*
+     * append a tail munmap of the arena to <chain>, so it's released by the
+     * chain itself. the arena is considered released from then on, but the
+     * call stack is kept for the chain to run on. clear it through
+     * CallProcedure::setCallStack(0) once the chain is done. the first
+     * <keep> bytes, rounded up to pages, are left mapped, e.g., for code a
+     * thread of tracee still runs afterwards. a stub among them ends with its
+     * trap then, one past them faults right after the munmap as usual
+     */
+    bool appendRelease(CallChain* chain, size_t keep = 0);
+
+    /*
+     * heap allocation, returns the remote address or 0 if it's exhausted.
+     * <align> should be a power of 2
+     */
+    uintptr_t alloc(size_t size, size_t align = ARENA_ALIGN);
+    void free(uintptr_t remoteAddr);
+    // drops all allocations at once
+    void reset();
+
+    /*
+     * allocate and write a copy of <str>/<data>, returns 0 on failure
+     */
+    uintptr_t allocString(const char* str);
+    uintptr_t allocBuffer(const void* data, size_t size);
+
+    uintptr_t base() const;
+    size_t    size() const;
+    uintptr_t stubAddr() const;
+    size_t    stubCapacity() const;
+    uintptr_t stackTop() const;
+
+protected:
+    void _detach();
+
+protected:
+    CallProcedure* _caller;
+    PtraceWrapper* _ptraceWrapper;
+    uintptr_t      _base;
+    size_t         _size;
+    // sizes asked for by beginCreate
+    size_t         _createSize;
+    size_t         _createStackSize;
+    // heap is [_heapBegin, _heapEnd), bumped at _heapCur
+    uintptr_t      _heapBegin;
+    uintptr_t      _heapEnd;
+    uintptr_t      _heapCur;
+    // address => size, of live blocks and of freed ones under _heapCur
+    std::map<uintptr_t, size_t> _used;
+    std::map<uintptr_t, size_t> _free;
+
+};
+
+#endif // __ADRILL_REMOTE_ARENA_H__
@@ -6,8 +6,27 @@
  */
 
 #include <stdlib.h>
-#include <sys/system_properties.h>
-#include <android/api-level.h>
+#if defined(__ANDROID__)
+#   include <sys/system_properties.h>
+#   include <android/api-level.h>
+#else
+    // host build, only the ones used below
+#   define __ANDROID_API_I__       14
+#   define __ANDROID_API_J__       16
+#   define __ANDROID_API_J_MR1__   17
+#   define __ANDROID_API_J_MR2__   18
+#   define __ANDROID_API_K__       19
+#   define __ANDROID_API_L__       21
+#   define __ANDROID_API_L_MR1__   22
+#   define __ANDROID_API_M__       23
+#   define __ANDROID_API_N__       24
+#   define __ANDROID_API_N_MR1__   25
+#   define __ANDROID_API_O__       26
+#   define __ANDROID_API_O_MR1__   27
+#   define __ANDROID_API_P__       28
+#   define __ANDROID_API_Q__       29
+#   define __ANDROID_API_R__       30
+#endif
 
 #include "macros.h"
 #include "sdk_code.h"
@@ -54,6 +73,7 @@ int SDKCode::S = __ANDROID_API_R__ + 1;
 
 int SDKCode::get() {
     if (SDKCode::_code == SDK_CODE_UNKNOWN) {
+#if defined(__ANDROID__)
         int len = 0;
         char sdk[92] = {0}, *end;
         if ((len = ::__system_property_get("ro.build.version.sdk", sdk)) > 0) {
@@ -70,6 +90,10 @@ int SDKCode::get() {
             end = sdk + len;
             SDKCode::_code += (int)::strtol(sdk, &end, 10) > 0 ? 1 : 0;
         }
+#else
+        // host build, behaves as the latest one
+        SDKCode::_code = SDKCode::S;
+#endif
     }
     return SDKCode::_code;
 }
\ No newline at end of file
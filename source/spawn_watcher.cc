@@ -0,0 +1,314 @@
+/*
+ * Copyright (c) 2020, Irvin Pang <halo.irvin@gmail.com>
+ * All rights reserved.
+ *
+ * see LICENSE file for details
+ */
+
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <dirent.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/connector.h>
+#include <linux/cn_proc.h>
+#include <iterator>
+#include <algorithm>
+
+#include "macros.h"
+#include "clock.h"
+#include "process_scanner.h"
+#include "spawn_watcher.h"
+
+SpawnWatcher::SpawnWatcher(ProcessScanner* scanner)
+: _scanner(scanner)
+, _netlinkFd(-1)
+, _procFd(-1)
+, _started(false) {
+}
+
+SpawnWatcher::~SpawnWatcher() {
+    this->stop();
+}
+
+bool SpawnWatcher::start() {
+    this->stop();
+    this->_procFd = ::open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (this->_procFd < 0) {
+        LOGGER_LOGE("SpawnWatcher::start failed to open dir '/proc': %s\n", ::strerror(errno));
+        return false;
+    }
+    if (!this->_startNetlink()) {
+        LOGGER_LOGI("SpawnWatcher::start proc connector unavailable, polling /proc every %dus\n", SPAWN_POLL_INTERVAL_US);
+        this->_listPids(&this->_seen);
+    }
+    // the ones running already aren't spawns, even if they exec or rename later
+    for (pid_t pid : this->_scanner->scan()) {
+        this->_reported.insert(pid);
+    }
+    this->_started = true;
+    return true;
+}
+
+void SpawnWatcher::stop() {
+    if (this->_netlinkFd >= 0) {
+        ::close(this->_netlinkFd);
+        this->_netlinkFd = -1;
+    }
+    if (this->_procFd >= 0) {
+        ::close(this->_procFd);
+        this->_procFd = -1;
+    }
+    this->_started = false;
+    this->_reported.clear();
+    this->_seen.clear();
+    this->_pending.clear();
+}
+
+bool SpawnWatcher::usingNetlink() const {
+    return this->_netlinkFd >= 0;
+}
+
+bool SpawnWatcher::_startNetlink() {
+    bool ok = true;
+    do {
+        this->_netlinkFd = ::socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_CONNECTOR);
+        ok &= this->_netlinkFd >= 0;
+        BREAK_IF_WITH_LOGE(!ok, "SpawnWatcher failed to create netlink socket: %s\n", ::strerror(errno));
+
+        // events keep coming while an injection is going on, make room for them
+        int rcvbuf = 1 << 20;
+        ::setsockopt(this->_netlinkFd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+        struct sockaddr_nl addr;
+        ::memset(&addr, 0, sizeof(addr));
+        addr.nl_family = AF_NETLINK;
+        addr.nl_groups = CN_IDX_PROC;
+        addr.nl_pid = 0;
+        ok &= ::bind(this->_netlinkFd, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+        BREAK_IF_WITH_LOGE(!ok, "SpawnWatcher failed to bind proc connector: %s\n", ::strerror(errno));
+
+        // cn_msg ends with a flexible array, so lay out the request by hand
+        alignas(struct nlmsghdr) char request[NLMSG_SPACE(sizeof(struct cn_msg) + sizeof(enum proc_cn_mcast_op))];
+        ::memset(request, 0, sizeof(request));
+        auto header = (struct nlmsghdr*)request;
+        header->nlmsg_len = sizeof(request);
+        header->nlmsg_type = NLMSG_DONE;
+        header->nlmsg_pid = ::getpid();
+        auto msg = (struct cn_msg*)NLMSG_DATA(header);
+        msg->id.idx = CN_IDX_PROC;
+        msg->id.val = CN_VAL_PROC;
+        msg->len = sizeof(enum proc_cn_mcast_op);
+        *(enum proc_cn_mcast_op*)msg->data = PROC_CN_MCAST_LISTEN;
+        ok &= ::send(this->_netlinkFd, request, sizeof(request), 0) == (ssize_t)sizeof(request);
+        BREAK_IF_WITH_LOGE(!ok, "SpawnWatcher failed to subscribe proc events: %s\n", ::strerror(errno));
+    } while (false);
+
+    if (!ok && this->_netlinkFd >= 0) {
+        ::close(this->_netlinkFd);
+        this->_netlinkFd = -1;
+    }
+    return ok;
+}
+
+bool SpawnWatcher::next(Spawn* outSpawn, int timeoutMs) {
+    if (!this->_started) {
+        return false;
+    }
+    int64_t deadline = timeoutMs < 0 ? -1 : monotonicNs() + (int64_t)timeoutMs * 1000000;
+    return this->usingNetlink() ? this->_nextNetlink(outSpawn, deadline) : this->_nextPoll(outSpawn, deadline);
+}
+
+bool SpawnWatcher::_check(pid_t pid, int64_t eventNs, Spawn* outSpawn) {
+    if (pid <= 0 || this->_reported.count(pid) || !this->_scanner->matches(pid)) {
+        return false;
+    }
+    this->_reported.insert(pid);
+    outSpawn->pid = pid;
+    outSpawn->eventNs = eventNs;
+    outSpawn->matchNs = monotonicNs();
+    return true;
+}
+
+void SpawnWatcher::_addPending(pid_t pid, int64_t sinceNs) {
+    for (const auto& pending : this->_pending) {
+        if (pending.first == pid) {
+            return;
+        }
+    }
+    this->_pending.push_back({ pid, sinceNs });
+}
+
+bool SpawnWatcher::_checkPending(bool startTime, Spawn* outSpawn) {
+    int64_t now = monotonicNs();
+    for (auto it = this->_pending.begin(); it != this->_pending.end(); ) {
+        pid_t pid = it->first;
+        if (now - it->second > (int64_t)SPAWN_PENDING_MS * 1000000) {
+            it = this->_pending.erase(it);
+            continue;
+        }
+        if (this->_check(pid, startTime ? this->_startTimeNs(pid) : it->second, outSpawn)) {
+            this->_pending.erase(it);
+            return true;
+        }
+        ++ it;
+    }
+    return false;
+}
+
+bool SpawnWatcher::_nextNetlink(Spawn* outSpawn, int64_t deadline) {
+    alignas(struct nlmsghdr) char buffer[4096];
+    for (;;) {
+        // no more events may come for them, so they're polled meanwhile
+        if (this->_checkPending(false, outSpawn)) {
+            return true;
+        }
+        int64_t timeout = -1;
+        if (deadline >= 0) {
+            timeout = deadline - monotonicNs();
+            if (timeout <= 0) {
+                return false;
+            }
+        }
+        if (!this->_pending.empty() && (timeout < 0 || timeout > (int64_t)SPAWN_POLL_INTERVAL_US * 1000)) {
+            timeout = (int64_t)SPAWN_POLL_INTERVAL_US * 1000;
+        }
+        struct timespec ts = { (time_t)(timeout / 1000000000), (long)(timeout % 1000000000) };
+        struct pollfd pfd = { this->_netlinkFd, POLLIN, 0 };
+        int ret = ::ppoll(&pfd, 1, timeout < 0 ? nullptr : &ts, nullptr);
+        if (ret < 0 && errno != EINTR) {
+            LOGGER_LOGE("SpawnWatcher failed to poll proc connector: %s\n", ::strerror(errno));
+            return false;
+        }
+        if (ret <= 0) {
+            continue;
+        }
+
+        // ENOBUFS tells some events were dropped, nothing to do about it
+        ssize_t size = ::recv(this->_netlinkFd, buffer, sizeof(buffer), 0);
+        if (size <= 0) {
+            continue;
+        }
+        for (auto header = (struct nlmsghdr*)buffer; NLMSG_OK(header, (size_t)size); header = NLMSG_NEXT(header, size)) {
+            auto msg = (struct cn_msg*)NLMSG_DATA(header);
+            if (msg->id.idx != CN_IDX_PROC || msg->id.val != CN_VAL_PROC) continue;
+            auto event = (struct proc_event*)msg->data;
+            pid_t pid = 0;
+            switch (event->what) {
+                case proc_event::PROC_EVENT_FORK:
+                    // new processes only, threads are forks as well
+                    if (event->event_data.fork.child_pid == event->event_data.fork.child_tgid) {
+                        pid = event->event_data.fork.child_tgid;
+                    }
+                    break;
+                case proc_event::PROC_EVENT_EXEC:
+                    pid = event->event_data.exec.process_tgid;
+                    break;
+                case proc_event::PROC_EVENT_COMM:
+                    // zygote children are named this way rather than by exec
+                    if (event->event_data.comm.process_pid == event->event_data.comm.process_tgid) {
+                        pid = event->event_data.comm.process_tgid;
+                    }
+                    break;
+                case proc_event::PROC_EVENT_EXIT:
+                    if (event->event_data.exit.process_pid == event->event_data.exit.process_tgid) {
+                        pid_t tgid = event->event_data.exit.process_tgid;
+                        this->_reported.erase(tgid);
+                        this->_pending.erase(std::remove_if(this->_pending.begin(), this->_pending.end(),
+                            [tgid](const std::pair<pid_t, int64_t>& pending) { return pending.first == tgid; }), this->_pending.end());
+                    }
+                    break;
+                default:
+                    break;
+            }
+            // timestamp_ns is CLOCK_MONOTONIC as well
+            if (this->_check(pid, (int64_t)event->timestamp_ns, outSpawn)) {
+                return true;
+            }
+            if (pid > 0 && !this->_reported.count(pid)) {
+                this->_addPending(pid, (int64_t)event->timestamp_ns);
+            }
+        }
+    }
+}
+
+bool SpawnWatcher::_nextPoll(Spawn* outSpawn, int64_t deadline) {
+    std::vector<pid_t> pids;
+    std::vector<pid_t> spawned;
+    for (;;) {
+        int64_t now = monotonicNs();
+        this->_listPids(&pids);
+        spawned.clear();
+        std::set_difference(pids.begin(), pids.end(), this->_seen.begin(), this->_seen.end(), std::back_inserter(spawned));
+        for (pid_t pid : spawned) {
+            this->_pending.push_back({ pid, now });
+        }
+        // forget the ones gone, their pids may be reused
+        for (auto it = this->_reported.begin(); it != this->_reported.end(); ) {
+            it = std::binary_search(pids.begin(), pids.end(), *it) ? std::next(it) : this->_reported.erase(it);
+        }
+        this->_seen.swap(pids);
+
+        if (this->_checkPending(true, outSpawn)) {
+            return true;
+        }
+
+        if (deadline >= 0 && monotonicNs() >= deadline) {
+            return false;
+        }
+        ::usleep(SPAWN_POLL_INTERVAL_US);
+    }
+}
+
+void SpawnWatcher::_listPids(std::vector<pid_t>* outPids) {
+    outPids->clear();
+    int dirFd = ::dup(this->_procFd);
+    DIR* dp = dirFd >= 0 ? ::fdopendir(dirFd) : nullptr;
+    if (!dp) {
+        if (dirFd >= 0) {
+            ::close(dirFd);
+        }
+        return;
+    }
+    ::rewinddir(dp);
+    struct dirent* entry;
+    while ((entry = ::readdir(dp)) != nullptr) {
+        if (entry->d_name[0] < '1' || entry->d_name[0] > '9') continue;
+        outPids->push_back((pid_t)::atoi(entry->d_name));
+    }
+    ::closedir(dp);
+    std::sort(outPids->begin(), outPids->end());
+}
+
+int64_t SpawnWatcher::_startTimeNs(pid_t pid) {
+    char path[32];
+    char stat[512];
+    ::snprintf(path, sizeof(path), "%d/stat", pid);
+    int fd = ::openat(this->_procFd, path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    ssize_t size = ::read(fd, stat, sizeof(stat) - 1);
+    ::close(fd);
+    if (size <= 0) {
+        return 0;
+    }
+    stat[size] = '\0';
+
+    // starttime is field 22, counted from the state right after "(comm) "
+    const char* cur = ::strrchr(stat, ')');
+    for (int field = 2; cur && field < 22; ++ field) {
+        cur = ::strchr(cur + 1, ' ');
+    }
+    if (!cur) {
+        return 0;
+    }
+    // in clock ticks since boot, including suspended time
+    int64_t ticks = ::strtoll(cur + 1, nullptr, 10);
+    int64_t startNs = ticks * (1000000000 / ::sysconf(_SC_CLK_TCK));
+    return startNs - (clockNs(CLOCK_BOOTTIME) - clockNs(CLOCK_MONOTONIC));
+}
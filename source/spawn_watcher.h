@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2020, Irvin Pang <halo.irvin@gmail.com>
+ * All rights reserved.
+ *
+ * see LICENSE file for details
+ */
+
+#ifndef __ADRILL_SPAWN_WATCHER_H__
+#define __ADRILL_SPAWN_WATCHER_H__
+
+#include <vector>
+#include <unordered_set>
+#include <stdint.h>
+#include <sys/types.h>
+
+class ProcessScanner;
+
+// interval of the /proc poller, and how long a new process is rechecked
+// for, e.g., an app forked by zygote gets its name a bit later
+#define SPAWN_POLL_INTERVAL_US 500
+#define SPAWN_PENDING_MS       3000
+
+/*
+ * reports processes matching a ProcessScanner as soon as they start. exec,
+ * fork and comm events come from the netlink proc connector, which needs
+ * CAP_NET_ADMIN. if it's unavailable, /proc is polled instead
+ */
+class SpawnWatcher {
+public:
+    struct Spawn {
+        pid_t   pid;
+        // CLOCK_MONOTONIC of the event the process matched on, and of the match.
+        // the poller knows the start time of a process in clock ticks only
+        int64_t eventNs;
+        int64_t matchNs;
+    };
+
+public:
+    SpawnWatcher(ProcessScanner* scanner);
+    ~SpawnWatcher();
+
+    /*
+     * processes already running are taken as seen, they're never reported
+     */
+    bool start();
+    void stop();
+    bool usingNetlink() const;
+
+    /*
+     * wait for the next matching process, for at most <timeoutMs>
+     * milliseconds (negative to wait forever)
+     */
+    bool next(Spawn* outSpawn, int timeoutMs = -1);
+
+protected:
+    bool _startNetlink();
+    bool _nextNetlink(Spawn* outSpawn, int64_t deadline);
+    bool _nextPoll(Spawn* outSpawn, int64_t deadline);
+    void _listPids(std::vector<pid_t>* outPids);
+    int64_t _startTimeNs(pid_t pid);
+    bool _check(pid_t pid, int64_t eventNs, Spawn* outSpawn);
+    void _addPending(pid_t pid, int64_t sinceNs);
+    // recheck the ones pending and drop the ones overdue. the poller reports
+    // their start time, netlink the time of the event they're pending since
+    bool _checkPending(bool startTime, Spawn* outSpawn);
+
+protected:
+    ProcessScanner* _scanner;
+    int  _netlinkFd;
+    int  _procFd;
+    bool _started;
+    // reported ones, dropped once they exit, so that a process matching
+    // on both exec and comm is reported only once
+    std::unordered_set<pid_t> _reported;
+    // poller: pids seen last time
+    std::vector<pid_t> _seen;
+    // new ones not matching yet, rechecked for SPAWN_PENDING_MS, e.g.,
+    // a zygote child gets its comm before its argv[0] is rewritten
+    std::vector<std::pair<pid_t, int64_t>> _pending;
+
+};
+
+#endif // __ADRILL_SPAWN_WATCHER_H__
@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2020, Irvin Pang <halo.irvin@gmail.com>
+ * All rights reserved.
+ *
+ * see LICENSE file for details
+ */
+
+#ifndef __ADRILL_STUB_WRITER_H__
+#define __ADRILL_STUB_WRITER_H__
+
+#include <stdint.h>
+#include <string.h>
+#include <initializer_list>
+
+/*
+ * appends machine code to a fixed buffer. all supported archs are little-endian,
+ * so values are copied as they are. once the buffer overflows, nothing more is
+ * written and overflowed() tells
+ */
+class StubWriter {
+public:
+    StubWriter(uint8_t* buffer, size_t capacity)
+    : _buffer(buffer)
+    , _capacity(capacity)
+    , _size(0)
+    , _overflowed(false) {
+    }
+
+    void bytes(std::initializer_list<uint8_t> values) {
+        for (uint8_t value : values) {
+            this->value<uint8_t>(value);
+        }
+    }
+
+    template<typename T>
+    void value(T value) {
+        if (this->_size + sizeof(T) > this->_capacity) {
+            this->_overflowed = true;
+            return;
+        }
+        ::memcpy(this->_buffer + this->_size, &value, sizeof(T));
+        this->_size += sizeof(T);
+    }
+
+    size_t size() const {
+        return this->_size;
+    }
+
+    bool overflowed() const {
+        return this->_overflowed;
+    }
+
+protected:
+    uint8_t* _buffer;
+    size_t   _capacity;
+    size_t   _size;
+    bool     _overflowed;
+
+};
+
+#endif // __ADRILL_STUB_WRITER_H__
@@ -0,0 +1,193 @@
+/*
+ * Copyright (c) 2020, Irvin Pang <halo.irvin@gmail.com>
+ * All rights reserved.
+ *
+ * see LICENSE file for details
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+
+#include "macros.h"
+#include "elf_reader.h"
+#include "symbol_cache.h"
+
+// bumped whenever the format changes, older files are simply ignored
+#define SYMBOL_CACHE_MAGIC "adrill-symcache 1"
+
+/*
+ * the file is plain text, one module followed by its symbols:
+ *
+ *   module <inode> <mtime sec> <mtime nsec> <build-id or -> <path>
+ *   symbol <offset in hex> <name>
+ */
+
+SymbolCache::SymbolCache()
+: _dirty(false) {
+}
+
+void SymbolCache::load(const std::string& path) {
+    this->_path = path;
+    this->_dirty = false;
+    this->_modules.clear();
+
+    FILE* fp = ::fopen(path.c_str(), "re");
+    if (!fp) {
+        return;
+    }
+    char line[PATH_MAX + 128];
+    Module* module = nullptr;
+    bool ok = ::fgets(line, sizeof(line), fp) && ::strcmp(line, SYMBOL_CACHE_MAGIC "\n") == 0;
+    while (ok && ::fgets(line, sizeof(line), fp)) {
+        line[::strcspn(line, "\n")] = '\0';
+        char buildId[128];
+        uint64_t inode = 0;
+        int64_t mtimeSec = 0;
+        long mtimeNsec = 0;
+        uintptr_t offset = 0;
+        int consumed = 0;
+        if (::sscanf(line, "module %" SCNu64 " %" SCNd64 " %ld %127s %n", &inode, &mtimeSec, &mtimeNsec, buildId, &consumed) == 4 && consumed) {
+            module = &this->_modules[line + consumed];
+            module->inode = (ino_t)inode;
+            module->mtimeSec = mtimeSec;
+            module->mtimeNsec = mtimeNsec;
+            module->buildId = ::strcmp(buildId, "-") == 0 ? "" : buildId;
+            module->validated = false;
+            module->symbols.clear();
+        } else if (module && ::sscanf(line, "symbol %" SCNxPTR " %n", &offset, &consumed) == 1 && consumed) {
+            module->symbols[line + consumed] = offset;
+        } else {
+            LOGGER_LOGE("SymbolCache::load malformed cache '%s', ignored\n", path.c_str());
+            this->_modules.clear();
+            ok = false;
+        }
+    }
+    ::fclose(fp);
+}
+
+bool SymbolCache::save() {
+    if (!this->_dirty || this->_path.empty()) {
+        return true;
+    }
+    // written aside to a file of its own and renamed, concurrent runs
+    // never see half a file, nor write into each other's
+    std::string tmpPath = this->_path + ".XXXXXX";
+    bool ok = true;
+    FILE* fp = nullptr;
+    int fd = -1;
+    bool created = false;
+    do {
+        fd = ::mkstemp(&tmpPath[0]);
+        created = fd != -1;
+        ok &= created;
+        BREAK_IF_WITH_LOGE(!ok, "SymbolCache::save failed to create '%s': %s\n", tmpPath.c_str(), ::strerror(errno));
+        // mkstemp makes it 0600, readable as a file fopen'ed would be
+        ::fchmod(fd, 0644);
+        ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+        fp = ::fdopen(fd, "w");
+        ok &= fp != nullptr;
+        BREAK_IF_WITH_LOGE(!ok, "SymbolCache::save failed to open '%s': %s\n", tmpPath.c_str(), ::strerror(errno));
+        fd = -1;
+
+        ::fprintf(fp, "%s\n", SYMBOL_CACHE_MAGIC);
+        for (const auto& module : this->_modules) {
+            ::fprintf(fp, "module %" PRIu64 " %" PRId64 " %ld %s %s\n", (uint64_t)module.second.inode, module.second.mtimeSec,
+                module.second.mtimeNsec, module.second.buildId.empty() ? "-" : module.second.buildId.c_str(), module.first.c_str());
+            for (const auto& symbol : module.second.symbols) {
+                ::fprintf(fp, "symbol %" PRIxPTR " %s\n", symbol.second, symbol.first.c_str());
+            }
+        }
+        ok &= ::fclose(fp) == 0;
+        fp = nullptr;
+        BREAK_IF_WITH_LOGE(!ok, "SymbolCache::save failed to write '%s': %s\n", tmpPath.c_str(), ::strerror(errno));
+
+        ok &= ::rename(tmpPath.c_str(), this->_path.c_str()) == 0;
+        BREAK_IF_WITH_LOGE(!ok, "SymbolCache::save failed to rename to '%s': %s\n", this->_path.c_str(), ::strerror(errno));
+        this->_dirty = false;
+    } while (false);
+
+    if (fp) {
+        ::fclose(fp);
+    }
+    if (fd != -1) {
+        ::close(fd);
+    }
+    if (!ok && created) {
+        ::unlink(tmpPath.c_str());
+    }
+    return ok;
+}
+
+bool SymbolCache::lookup(const std::string& modulePath, const std::string& symbol, uintptr_t* outOffset) {
+    Module* module = this->_validModule(modulePath);
+    if (!module) {
+        return false;
+    }
+    auto it = module->symbols.find(symbol);
+    if (it == module->symbols.end()) {
+        return false;
+    }
+    *outOffset = it->second;
+    return true;
+}
+
+void SymbolCache::store(const std::string& modulePath, const std::string& symbol, uintptr_t offset) {
+    Module* module = this->_validModule(modulePath);
+    if (!module) {
+        // new to the cache, or just invalidated
+        Module identified;
+        if (!this->_identify(modulePath, &identified)) {
+            return;
+        }
+        module = &(this->_modules[modulePath] = identified);
+    }
+    auto it = module->symbols.find(symbol);
+    if (it == module->symbols.end() || it->second != offset) {
+        module->symbols[symbol] = offset;
+        this->_dirty = true;
+    }
+}
+
+bool SymbolCache::_identify(const std::string& modulePath, Module* outModule) {
+    struct stat st;
+    if (::stat(modulePath.c_str(), &st) != 0) {
+        return false;
+    }
+    outModule->inode = st.st_ino;
+    outModule->mtimeSec = st.st_mtim.tv_sec;
+    outModule->mtimeNsec = st.st_mtim.tv_nsec;
+    outModule->buildId.clear();
+    ElfReader::readBuildId(modulePath.c_str(), &outModule->buildId);
+    outModule->validated = true;
+    outModule->symbols.clear();
+    return true;
+}
+
+SymbolCache::Module* SymbolCache::_validModule(const std::string& modulePath) {
+    auto it = this->_modules.find(modulePath);
+    if (it == this->_modules.end()) {
+        return nullptr;
+    }
+    Module& module = it->second;
+    if (!module.validated) {
+        Module current;
+        if (!this->_identify(modulePath, &current) ||
+            current.inode != module.inode ||
+            current.mtimeSec != module.mtimeSec ||
+            current.mtimeNsec != module.mtimeNsec ||
+            current.buildId != module.buildId) {
+            // updated or gone, everything about it is stale
+            this->_modules.erase(it);
+            this->_dirty = true;
+            return nullptr;
+        }
+        module.validated = true;
+    }
+    return &module;
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2020, Irvin Pang <halo.irvin@gmail.com>
+ * All rights reserved.
+ *
+ * see LICENSE file for details
+ */
+
+#ifndef __ADRILL_SYMBOL_CACHE_H__
+#define __ADRILL_SYMBOL_CACHE_H__
+
+#include <map>
+#include <string>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * module-relative symbol offsets kept on disk across runs, so that a warm
+ * start needs neither ELF parsing nor dlsym. a module is identified by its
+ * inode, mtime and build-id, and all of its entries are dropped once any of
+ * them changes, e.g., after an OTA or APEX update
+ */
+class SymbolCache {
+public:
+    SymbolCache();
+
+    /*
+     * a missing or malformed file just makes an empty cache
+     */
+    void load(const std::string& path);
+    // written back only if anything has been stored since load
+    bool save();
+
+    bool lookup(const std::string& modulePath, const std::string& symbol, uintptr_t* outOffset);
+    void store(const std::string& modulePath, const std::string& symbol, uintptr_t offset);
+
+protected:
+    struct Module {
+        ino_t       inode;
+        int64_t     mtimeSec;
+        long        mtimeNsec;
+        std::string buildId;
+        // checked against the file once per run
+        bool        validated;
+        std::map<std::string, uintptr_t> symbols;
+    };
+
+    bool _identify(const std::string& modulePath, Module* outModule);
+    Module* _validModule(const std::string& modulePath);
+
+protected:
+    std::string _path;
+    bool _dirty;
+    std::map<std::string, Module> _modules;
+
+};
+
+#endif // __ADRILL_SYMBOL_CACHE_H__